@@ -14,7 +14,8 @@ list_of_examples = {
     "Low Energy"  : [["gap_le_advertisements"],
                      ["gatt_browser"],
                      ["le_counter"],
-                     ["le_streamer"]],
+                     ["le_streamer"],
+                     ["le_coc_streamer"]],
     "Dual Mode" : [["spp_and_le_counter"]],
 }
 
@@ -45,31 +45,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include <btstack/btstack.h>
 #include <btstack/hci_cmds.h>
 
 #define PSM_TEST 0xdead
 #define PACKET_SIZE 1000
+#define REPORT_INTERVAL_BYTES 1000000
 
 int serverMode = 1;
 bd_addr_t addr = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}; 
-uint8_t packet[PACKET_SIZE];
+uint8_t test_packet[PACKET_SIZE];
 uint32_t counter = 0;
 
+uint32_t bytes_received = 0;
+struct timeval report_start;
+
 timer_source_t timer;
 
 void update_packet(void){
-    net_store_32( packet, 0, counter++);
+    net_store_32( test_packet, 0, counter++);
 }
 
 void prepare_packet(void){
     int i;
     counter = 0;
-    net_store_32( packet, 0, 0);
+    net_store_32( test_packet, 0, 0);
     for (i=4;i<PACKET_SIZE;i++)
-        packet[i] = i-4;
+        test_packet[i] = i-4;
 }
+
+void report_data_rate(uint16_t size){
+    struct timeval now;
+    if (!bytes_received){
+        gettimeofday(&report_start, NULL);
+    }
+    bytes_received += size;
+    if (bytes_received < REPORT_INTERVAL_BYTES) return;
+    gettimeofday(&now, NULL);
+    uint32_t ms = (now.tv_sec - report_start.tv_sec) * 1000 + (now.tv_usec - report_start.tv_usec) / 1000;
+    if (!ms) ms = 1;
+    printf("%u bytes in %u ms, %u bytes/s\n", bytes_received, ms, (uint32_t) ((uint64_t) bytes_received * 1000 / ms));
+    bytes_received = 0;
+}
+
 void  timer_handler(struct timer *ts){
 	bt_send_cmd(&hci_read_bd_addr);
 	run_loop_set_timer(&timer, 3000);
@@ -84,11 +104,13 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
 	uint16_t local_cid;
 	char pin[20];
 	int i;
+	int credits;
 	
 	switch (packet_type) {
 			
 		case L2CAP_DATA_PACKET:
 			// measure data rate
+			report_data_rate(size);
 			break;
 			
 		case HCI_EVENT_PACKET:
@@ -173,10 +195,13 @@ void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint
 					
 				case L2CAP_EVENT_CREDITS:
 					if (!serverMode) {
-						// can send! (assuming single credits are handet out)
-						update_packet();
+						// can send! one packet per credit
 						local_cid = READ_BT_16(packet, 2);
-						bt_send_l2cap( local_cid, packet, PACKET_SIZE); 
+						credits   = packet[4];
+						for (i=0;i<credits;i++){
+							update_packet();
+							bt_send_l2cap( local_cid, test_packet, PACKET_SIZE); 
+						}
 					}
 				    break;
 				    	
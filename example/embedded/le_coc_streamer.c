@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+// *****************************************************************************
+/* EXAMPLE_START(le_coc_streamer): LE Peripheral - Stream data over L2CAP LE Credit Based Channel
+ *
+ * @text Compared to GATT notifications as used by le_streamer, an L2CAP LE
+ * Credit Based Flow Control Mode channel (LE CoC) avoids the ATT overhead and
+ * allows for SDUs larger than the ATT MTU, which are segmented into K-frames.
+ * This example:
+ * - registers an LE_PSM and accepts incoming channels
+ * - sends an SDU whenever the previous one has been handed to the controller
+ * - reports the throughput of sent and received data
+ */
+ // *****************************************************************************
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btstack-config.h"
+
+#include <btstack/run_loop.h>
+
+#include "debug.h"
+#include "btstack_memory.h"
+#include "hci.h"
+#include "hci_dump.h"
+
+#include "l2cap.h"
+
+#include "le_device_db.h"
+#include "gap_le.h"
+#include "sm.h"
+
+// dynamic LE_PSMs are in the range 0x0080-0x00ff
+#define LE_COC_STREAMER_PSM 0x0080
+
+// SDU size and number of K-frames the remote may send before credits are returned
+#define TEST_SDU_LEN      1000
+#define INITIAL_CREDITS   10
+
+static void  packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+static void  streamer(void);
+
+const uint8_t adv_data[] = {
+    // Flags general discoverable
+    0x02, 0x01, 0x06,
+    // Name
+    0x10, 0x09, 'L', 'E', ' ', 'C', 'o', 'C', ' ', 'S', 't', 'r', 'e', 'a', 'm', 'e', 'r',
+};
+const uint8_t adv_data_len = sizeof(adv_data);
+
+static int      counter = 'A';
+static uint8_t  test_data[TEST_SDU_LEN];
+static int      test_data_len;
+
+// incoming SDUs are reassembled here
+static uint8_t  receive_buffer[TEST_SDU_LEN];
+
+static uint16_t local_cid;
+
+/* @section Main Application Setup
+ *
+ * @text Listing MainConfiguration shows main application code.
+ * It initializes L2CAP and the Security Manager, registers the LE_PSM with a
+ * maximal SDU size of TEST_SDU_LEN and INITIAL_CREDITS for the remote device,
+ * configures the advertisements and boots the Bluetooth stack.
+ */
+
+/* LISTING_START(MainConfiguration): Init L2CAP, SM, register LE_PSM, and enable advertisements */
+
+static void le_coc_streamer_setup(void){
+    l2cap_init();
+
+    // setup le device db
+    le_device_db_init();
+
+    // setup SM: Display only
+    sm_init();
+
+    // LE CoC service, mps = 0 selects the largest K-frame size
+    l2cap_le_register_service_internal(NULL, packet_handler, LE_COC_STREAMER_PSM, TEST_SDU_LEN, 0, INITIAL_CREDITS, LEVEL_0);
+
+    // setup advertisements
+    uint16_t adv_int_min = 0x0030;
+    uint16_t adv_int_max = 0x0030;
+    uint8_t adv_type = 0;
+    bd_addr_t null_addr;
+    memset(null_addr, 0, 6);
+    gap_advertisements_set_params(adv_int_min, adv_int_max, adv_type, 0, null_addr, 0x07, 0x00);
+    gap_advertisements_set_data(adv_data_len, (uint8_t*) adv_data);
+    gap_advertisements_enable(1);
+}
+/* LISTING_END */
+
+/*
+ * @section Track throughput
+ * @text We calculate the throughput by setting a start time and measuring the amount of
+ * data sent and received. After a configurable REPORT_INTERVAL_MS, we print the throughput
+ * in kB/s and reset the counter and start time.
+ */
+
+/* LISTING_START(tracking): Tracking throughput */
+#define REPORT_INTERVAL_MS 3000
+
+typedef struct {
+    const char * direction;
+    uint32_t bytes;
+    uint32_t start;
+} throughput_t;
+
+static throughput_t test_sent     = { "sent",     0, 0 };
+static throughput_t test_received = { "received", 0, 0 };
+
+static void test_reset(throughput_t * tracker){
+    tracker->start = run_loop_get_time_ms();
+    tracker->bytes = 0;
+}
+
+static void test_track(throughput_t * tracker, int bytes){
+    tracker->bytes += bytes;
+    // evaluate
+    uint32_t now = run_loop_get_time_ms();
+    uint32_t time_passed = now - tracker->start;
+    if (time_passed < REPORT_INTERVAL_MS) return;
+    // print speed
+    int bytes_per_second = tracker->bytes * 1000 / time_passed;
+    printf("%u bytes %s -> %u.%03u kB/s\n", tracker->bytes, tracker->direction, bytes_per_second / 1000, bytes_per_second % 1000);
+
+    // restart
+    tracker->start = now;
+    tracker->bytes = 0;
+}
+/* LISTING_END(tracking): Tracking throughput */
+
+/*
+ * @section Packet Handler
+ *
+ * @text The packet handler accepts incoming LE CoC channels and provides the receive buffer.
+ * Once the channel is open, the SDU size is limited by the MTU of the remote device.
+ * L2CAP_EVENT_CREDITS signals that the previous SDU has been sent and the next one can be
+ * passed to l2cap_le_send_data. Received SDUs are delivered as L2CAP_DATA_PACKET.
+ */
+
+/* LISTING_START(packetHandler): Packet Handler */
+static void packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    uint16_t remote_mtu;
+    switch (packet_type) {
+        case L2CAP_DATA_PACKET:
+            test_track(&test_received, size);
+            break;
+        case HCI_EVENT_PACKET:
+            switch (packet[0]) {
+                case L2CAP_EVENT_INCOMING_CONNECTION:
+                    l2cap_le_accept_connection_internal(READ_BT_16(packet, 12), receive_buffer);
+                    break;
+                case L2CAP_EVENT_CHANNEL_OPENED:
+                    if (packet[2]) {
+                        printf("LE CoC channel open failed, status 0x%02x\n", packet[2]);
+                        break;
+                    }
+                    local_cid  = READ_BT_16(packet, 13);
+                    remote_mtu = READ_BT_16(packet, 19);
+                    test_data_len = remote_mtu < TEST_SDU_LEN ? remote_mtu : TEST_SDU_LEN;
+                    printf("LE CoC channel open, local cid 0x%02x, remote MTU %u\n", local_cid, remote_mtu);
+                    test_reset(&test_sent);
+                    test_reset(&test_received);
+                    break;
+                case L2CAP_EVENT_CHANNEL_CLOSED:
+                    printf("LE CoC channel closed\n");
+                    local_cid = 0;
+                    break;
+                case L2CAP_EVENT_CREDITS:
+                    streamer();
+                    break;
+            }
+            break;
+    }
+}
+/* LISTING_END */
+
+/*
+ * @section Streamer
+ *
+ * @text The streamer function sends SDUs as long as the channel is open and the next SDU can be sent now.
+ * It creates some test data - a single letter that gets increased every time - and tracks the data sent.
+ * As the SDU is sent directly from test_data, it must not be modified before the next L2CAP_EVENT_CREDITS.
+ * l2cap_le_send_data can emit L2CAP_EVENT_CREDITS before it returns, the nested call is ignored.
+ */
+
+ /* LISTING_START(streamer): Streaming code */
+static void streamer(void){
+    static int in_streamer;
+    if (in_streamer) return;
+    in_streamer = 1;
+
+    // check if we can send
+    while (local_cid && l2cap_le_can_send_now(local_cid)){
+
+        // create test data
+        counter++;
+        if (counter > 'Z') counter = 'A';
+        memset(test_data, counter, test_data_len);
+
+        // send
+        if (l2cap_le_send_data(local_cid, test_data, test_data_len)) break;
+
+        // track
+        test_track(&test_sent, test_data_len);
+    }
+
+    in_streamer = 0;
+}
+/* LISTING_END */
+
+int btstack_main(void);
+int btstack_main(void)
+{
+    le_coc_streamer_setup();
+
+    // turn on!
+	hci_power_control(HCI_POWER_ON);
+
+    return 0;
+}
+/* EXAMPLE_END */
@@ -50,36 +50,11 @@
 
 #include "btstack-config.h"
 
-#include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <ifaddrs.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-
-#include <net/if_arp.h>
-
-#ifdef __APPLE__
-#include <net/if.h>
-#include <net/if_types.h>
-
-#include <netinet/if_ether.h>
-#include <netinet/in.h>
-#endif
-
-#include <sys/ioctl.h>
-#include <sys/param.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-
-#ifdef __linux
-#include <linux/if.h>
-#include <linux/if_tun.h>
-#endif
 
 #include <btstack/hci_cmds.h>
 #include <btstack/run_loop.h>
@@ -93,6 +68,7 @@
 #include "sdp_client.h"
 #include "sdp_query_util.h"
 #include "pan.h"
+#include "pan_netif.h"
 
 static int record_id = -1;
 static uint16_t bnep_l2cap_psm      = 0;
@@ -107,24 +83,7 @@ static const unsigned int attribute_value_buffer_size = sizeof(attribute_value);
 // static bd_addr_t remote = {0xE0,0x06,0xE6,0xBB,0x95,0x79}; // Ole Thinkpad
 static bd_addr_t remote = {0x84,0x38,0x35,0x65,0xD1,0x15};  // MacBook 2013 
 
-static int  tap_fd = -1;
-static uint8_t network_buffer[BNEP_MTU_MIN];
-static size_t  network_buffer_len = 0;
-
-#ifdef __APPLE__
-// tuntaposx provides fixed set of tapX devices
-static const char * tap_dev = "/dev/tap0";
-static char tap_dev_name[16] = "tap0";
-#endif
-
-#ifdef __linux
-// Linux uses single control device to bring up tunX or tapX interface
-static const char * tap_dev = "/dev/net/tun";
-static char tap_dev_name[16] = "bnep%d";
-#endif
-
-
-static data_source_t tap_dev_ds;
+static char tap_dev_name[16];
 
 /* @section Main application configuration
  *
@@ -162,131 +121,23 @@ static void panu_setup(void){
  * On Linux, TUN/TAP is available by default. On OS X, tuntaposx from
  * http://tuntaposx.sourceforge.net needs to be installed.
  *
- * The *tap_alloc* function sets up a virtual network interface with the given Bluetooth Address.
- * It is rather low-level as it sets up and configures a network interface.
+ * The *pan_netif_tap_alloc* function sets up a virtual network interface with the given Bluetooth Address.
+ * After *pan_netif_open*, Ethernet frames are forwarded between the interface and the BNEP channel.
+ * A frame from the interface is read directly into the outgoing buffer with
+ * *bnep_get_outgoing_payload_buffer* and sent with *bnep_send_prepared*, and a received
+ * frame is written to the interface from the BNEP receive buffer. The interface is only read while
+ * *bnep_can_send_packet_now* allows it, which provides a basic flow control.
  */ 
 
-int tap_alloc(char *dev, bd_addr_t bd_addr)
-{
-    struct ifreq ifr;
-    int fd_dev;
-    int fd_socket;
-
-    if( (fd_dev = open(tap_dev, O_RDWR)) < 0 ) {
-        fprintf(stderr, "TAP: Error opening %s: %s\n", tap_dev, strerror(errno));
-        return -1;
-    }
-
-#ifdef __linux
-    memset(&ifr, 0, sizeof(ifr));
-
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI; 
-    if( *dev ) {
-        strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-    }
-
-    int err;
-    if( (err = ioctl(fd_dev, TUNSETIFF, (void *) &ifr)) < 0 ) {
-        fprintf(stderr, "TAP: Error setting device name: %s\n", strerror(errno));
-        close(fd_dev);
-        return -1;
-    }  
-    strcpy(dev, ifr.ifr_name);
-#endif
-#ifdef __APPLE__
-    dev = tap_dev_name;
-#endif    
-
-    fd_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
-	if (fd_socket < 0) {
-        close(fd_dev);
-		fprintf(stderr, "TAP: Error opening netlink socket: %s\n", strerror(errno));
-		return -1;
-	}
-
-    // Configure the MAC address of the newly created bnep(x) 
-    // device to the local bd_address
-    memset (&ifr, 0, sizeof(struct ifreq));
-    strcpy(ifr.ifr_name, dev);
-#ifdef __linux
-    ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
-    memcpy(ifr.ifr_hwaddr.sa_data, bd_addr, sizeof(bd_addr_t));
-	if (ioctl(fd_socket, SIOCSIFHWADDR, &ifr) == -1) {
-        close(fd_dev);
-        close(fd_socket);
-        fprintf(stderr, "TAP: Error setting hw addr: %s\n", strerror(errno));
-        exit(1);
-		return -1;
-	}
-#endif
-#ifdef __APPLE__
-    ifr.ifr_addr.sa_len = ETHER_ADDR_LEN;
-    ifr.ifr_addr.sa_family = AF_LINK;
-    (void)memcpy(ifr.ifr_addr.sa_data, bd_addr, ETHER_ADDR_LEN);
-    if (ioctl(fd_socket, SIOCSIFLLADDR, &ifr) == -1) {
-        close(fd_dev);
-        close(fd_socket);
-        fprintf(stderr, "TAP: Error setting hw addr: %s\n", strerror(errno));
-        exit(1);
-        return -1;
-}
-#endif    
-
-    // Bring the interface up
-	if (ioctl(fd_socket, SIOCGIFFLAGS, &ifr) == -1) {
-        close(fd_dev);
-        close(fd_socket);
-		fprintf(stderr, "TAP: Error reading interface flags: %s\n", strerror(errno));
-		return -1;
-	}
-
-	if ((ifr.ifr_flags & IFF_UP) == 0) {
-		ifr.ifr_flags |= IFF_UP;
-
-		if (ioctl(fd_socket, SIOCSIFFLAGS, &ifr) == -1) {
-            close(fd_dev);
-            close(fd_socket);
-            fprintf(stderr, "TAP: Error set IFF_UP: %s\n", strerror(errno));
-            return -1;
-		}
-	}
-
-	close(fd_socket);
-    
-    return fd_dev;
-}
-
-/*
- * @text Listing processTapData shows how a packet is received from the TAP network interface
- * and forwarded over the BNEP connection.
- * 
- * After successfully reading a network packet, the call to
- * the *bnep_can_send_packet_now* function checks, if BTstack can forward
- * a network packet now. If that's not possible, the received data stays
- * in the network buffer and the data source elements is removed from the
- * run loop. The *process_tap_dev_data* function will not be called until
- * the data source is registered again. This provides a basic flow control.
- */
-
-/* LISTING_START(processTapData): Process incoming network packets */
-int process_tap_dev_data(struct data_source *ds) 
-{
-    ssize_t len;
-    len = read(ds->fd, network_buffer, sizeof(network_buffer));
-    if (len <= 0){
-        fprintf(stderr, "TAP: Error while reading: %s\n", strerror(errno));
-        return 0;
-    }
-
-    network_buffer_len = len;
-    if (bnep_can_send_packet_now(bnep_cid)) {
-        bnep_send(bnep_cid, network_buffer, network_buffer_len);
-        network_buffer_len = 0;
-    } else {
-        // park the current network packet
-        run_loop_remove_data_source(&tap_dev_ds);
+/* LISTING_START(openTapDev): Forward network packets */
+static void tap_open(bd_addr_t local_addr){
+    int tap_fd = pan_netif_tap_alloc(tap_dev_name, local_addr);
+    if (tap_fd < 0) {
+        printf("Creating BNEP tap device failed: %s\n", strerror(errno));
+        return;
     }
-    return 0;
+    printf("BNEP device \"%s\" allocated.\n", tap_dev_name);
+    pan_netif_open(tap_fd, bnep_cid);
 }
 /* LISTING_END */
 
@@ -400,7 +251,7 @@ static void handle_sdp_client_query_result(sdp_query_event_t *event)
                                 printf("l2cap_psm 0x%04x, bnep_version 0x%04x\n", bnep_l2cap_psm, bnep_version);
 
                                 /* Create BNEP connection */
-                                bnep_connect(NULL, &remote, bnep_l2cap_psm, bnep_remote_uuid);
+                                bnep_connect(NULL, remote, bnep_l2cap_psm, SDP_PANU, bnep_remote_uuid);
                             }
                             break;
                         default:
@@ -431,7 +282,6 @@ static void handle_sdp_client_query_result(sdp_query_event_t *event)
 static void packet_handler (void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
 /* LISTING_PAUSE */
-    int       rc;
     uint8_t   event;
     bd_addr_t event_addr;
     bd_addr_t local_addr;
@@ -470,40 +320,13 @@ static void packet_handler (void * connection, uint8_t packet_type, uint16_t cha
 
                 /* LISTING_RESUME */
 
-                /* @text In server mode, BNEP_EVENT_INCOMING_CONNECTION is received after a client has connected.
-                 * The TAP network interface is then configured. A data source is set up and registered with the 
-                 * run loop to receive Ethernet packets from the TAP interface.
+                /* @text BNEP_EVENT_OPEN_CHANNEL_COMPLETE is received after a client has connected in server mode,
+                 * after the connection to the remote device has been established in client mode, or when the 
+                 * connection fails. The status field returns the error code. The TAP network interface is then
+                 * configured and connected to the BNEP channel.
                  *
                  * The event contains both the source and destination UUIDs, as well as the MTU for this connection and
                  * the BNEP Channel ID, which is used for sending Ethernet packets over BNEP.
-                 */
-                case BNEP_EVENT_INCOMING_CONNECTION:
-					// data: event(8), len(8), bnep source uuid (16), bnep destination uuid (16), remote_address (48)
-                    uuid_source = READ_BT_16(packet, 2);
-                    uuid_dest   = READ_BT_16(packet, 4);
-                    mtu         = READ_BT_16(packet, 6);
-                    bnep_cid    = channel;
-                    memcpy(&event_addr, &packet[8], sizeof(bd_addr_t));
-					printf("BNEP connection from %s source UUID 0x%04x dest UUID: 0x%04x, max frame size: %u\n", bd_addr_to_str(event_addr), uuid_source, uuid_dest, mtu);
-                    /* Create the tap interface */
-                    hci_local_bd_addr(local_addr);
-                    tap_fd = tap_alloc(tap_dev_name, local_addr);
-                    if (tap_fd < 0) {
-                        printf("Creating BNEP tap device failed: %s\n", strerror(errno));
-                    } else {
-                        printf("BNEP device \"%s\" allocated.\n", tap_dev_name);
-                        /* Create and register a new runloop data source */
-                        tap_dev_ds.fd = tap_fd;
-                        tap_dev_ds.process = process_tap_dev_data;
-                        run_loop_add_data_source(&tap_dev_ds);
-                    }
-					break;
-
-                /* LISTING_PAUSE */
-
-                /* @text In client mode, BNEP_EVENT_OPEN_CHANNEL_COMPLETE is received after a client has connected
-                 * or when the connection fails. The status field returns the error code. It is otherwise identical to 
-                 * BNEP_EVENT_INCOMING_CONNECTION before.
                  */
 				case BNEP_EVENT_OPEN_CHANNEL_COMPLETE:
                     if (packet[2]) {
@@ -516,22 +339,12 @@ static void packet_handler (void * connection, uint8_t packet_type, uint16_t cha
                         bnep_cid    = channel;
                         //bt_flip_addr(event_addr, &packet[9]); 
                         memcpy(&event_addr, &packet[9], sizeof(bd_addr_t));
-                        printf("BNEP connection open succeeded to %s source UUID 0x%04x dest UUID: 0x%04x, max frame size %u\n", bd_addr_to_str(event_addr), uuid_source, uuid_dest, mtu);
+                        printf("BNEP connection open succeeded with %s source UUID 0x%04x dest UUID: 0x%04x, max frame size %u\n", bd_addr_to_str(event_addr), uuid_source, uuid_dest, mtu);
                         /* Create the tap interface */
-                        tap_fd = tap_alloc(tap_dev_name, *hci_local_bd_addr());
-                        if (tap_fd < 0) {
-                            printf("Creating BNEP tap device failed: %s\n", strerror(errno));
-                        } else {
-                            printf("BNEP device \"%s\" allocated.\n", tap_dev_name);
-                            /* Create and register a new runloop data source */
-                            tap_dev_ds.fd = tap_fd;
-                            tap_dev_ds.process = process_tap_dev_data;
-                            run_loop_add_data_source(&tap_dev_ds);
-                        }
+                        hci_local_bd_addr(local_addr);
+                        tap_open(local_addr);
                     }
 					break;
-                
-                /* LISTING_RESUME */
 
                 /* @text If there is a timeout during the connection setup, BNEP_EVENT_CHANNEL_TIMEOUT will be received
                  * and the BNEP connection  will be closed
@@ -540,55 +353,27 @@ static void packet_handler (void * connection, uint8_t packet_type, uint16_t cha
                     printf("BNEP channel timeout! Channel will be closed\n");
                     break;
 
-                /* @text BNEP_EVENT_CHANNEL_CLOSED is received when the connection gets closed.
+                /* @text BNEP_EVENT_CHANNEL_CLOSED is received when the connection gets closed. The TAP interface is 
+                 * then closed by *pan_netif_packet_handler*.
                  */
                 case BNEP_EVENT_CHANNEL_CLOSED:
                     printf("BNEP channel closed\n");
-                    run_loop_remove_data_source(&tap_dev_ds);
-                    if (tap_fd > 0) {
-                        close(tap_fd);
-                        tap_fd = -1;
-                    }
                     break;
 
-                /* @text BNEP_EVENT_READY_TO_SEND indicates that a new packet can be send. This triggers the retry of a 
-                 * parked network packet. If this succeeds, the data source element is added to the run loop again.
-                 */
-                case BNEP_EVENT_READY_TO_SEND:
-                    // Check for parked network packets and send it out now 
-                    if (network_buffer_len > 0) {
-                        bnep_send(bnep_cid, network_buffer, network_buffer_len);
-                        network_buffer_len = 0;
-                        // Re-add the tap device data source
-                        run_loop_add_data_source(&tap_dev_ds);
-                    }
-                    
-                    break;
-                    
                 default:
                     break;
             }
             break;
 
-        /* @text Ethernet packets from the remote device are received in the packet handler with type BNEP_DATA_PACKET.
-         * It is forwarded to the TAP interface.
-         */
-        case BNEP_DATA_PACKET:
-            // Write out the ethernet frame to the tap device 
-            if (tap_fd > 0) {
-                rc = write(tap_fd, packet, size);
-                if (rc < 0) {
-                    fprintf(stderr, "TAP: Could not write to TAP device: %s\n", strerror(errno));
-                } else 
-                if (rc != size) {
-                    fprintf(stderr, "TAP: Package written only partially %d of %d bytes\n", rc, size);
-                }
-            }
-            break;            
-            
         default:
             break;
     }
+
+    /* @text BNEP_EVENT_READY_TO_SEND indicates that a new packet can be send, the TAP interface is read again.
+     * Ethernet packets from the remote device are received in the packet handler with type BNEP_DATA_PACKET
+     * and written to the TAP interface.
+     */
+    pan_netif_packet_handler(packet_type, channel, packet, size);
 }
 /* LISTING_END */
 
@@ -61,24 +61,28 @@
 #include "btstack-config.h"
 
 #define HEARTBEAT_PERIOD_MS 500
+#define MAX_FRAME_SIZE      100
+#define READ_PER_PERIOD     100
 
 static void packet_handler (void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 
 static uint8_t   rfcomm_channel_nr = 1;
 static uint16_t  rfcomm_channel_id;
-static uint8_t   rfcomm_send_credit = 0;
+static uint8_t   rx_ring[2 * MAX_FRAME_SIZE];
+static uint32_t  rx_bytes_processed;
 static uint32_t  spp_service_buffer[150/4];  // implicit alignment to 4-byte memory address
 
 /* @section SPP Service Setup   
  *
  * @text Listing explicitFlowControl shows how to
- * provide one initial credit during RFCOMM service initialization. Please note
- * that providing a single credit effectively reduces the credit-based (sliding
- * window) flow control to a stop-and-wait flow control that limits the data
- * throughput substantially.  
+ * limit the RFCOMM frame size during RFCOMM service initialization. Received
+ * data is stored in a ring buffer of two frames, see Listing phManual. 
+ * RFCOMM only provides credits to the remote side for frames that fit into
+ * free space of the ring, so the remote cannot send more data than the
+ * application is able to store.
  */ 
 
-/* LISTING_START(explicitFlowControl): Providing one initial credit during RFCOMM service initialization */
+/* LISTING_START(explicitFlowControl): Limiting the frame size during RFCOMM service initialization */
 static void spp_service_setup(void){     
     // init L2CAP
     l2cap_init();
@@ -87,8 +91,8 @@ static void spp_service_setup(void){
     // init RFCOMM
     rfcomm_init();
     rfcomm_register_packet_handler(packet_handler);
-    // reserved channel, mtu limited by l2cap, 1 credit
-    rfcomm_register_service_with_initial_credits_internal(NULL, rfcomm_channel_nr, 0xffff, 1);  
+    // reserved channel, small frames for small rx ring
+    rfcomm_register_service_internal(NULL, rfcomm_channel_nr, MAX_FRAME_SIZE);  
 
     // init SDP, create record for SPP and register with SDP
     sdp_init();
@@ -102,23 +106,30 @@ static void spp_service_setup(void){
 
 /* @section Periodic Timer Setup  
  *  
- * @text Explicit credit management is
+ * @text A stream channel is
  * recommended when received RFCOMM data cannot be processed immediately. In this
  * example, delayed processing of received data is simulated with the help of a
- * periodic timer as follows. When the packet handler receives a data packet, it
- * does not provide a new credit, it sets a flag instead, see Listing phManual. 
- * If the flag is set, a new
- * credit will be granted by the heartbeat handler, introducing a delay of up to 1
- * second. The heartbeat handler code is shown in Listing hbhManual. 
+ * periodic timer as follows. The heartbeat handler takes a limited amount of
+ * data from the ring buffer with rfcomm_stream_read, which frees space and lets
+ * RFCOMM provide new credits to the remote side. The achieved rate is printed
+ * with the data. The heartbeat handler code is shown in Listing hbhManual. 
  */ 
 
 static timer_source_t heartbeat;
 
-/* LISTING_START(hbhManual): Heartbeat handler with manual credit management */ 
+/* LISTING_START(hbhManual): Heartbeat handler reading from the stream */ 
 static void  heartbeat_handler(struct timer *ts){
-    if (rfcomm_send_credit){
-        rfcomm_grant_credits(rfcomm_channel_id, 1);
-        rfcomm_send_credit = 0;
+    uint8_t buffer[READ_PER_PERIOD];
+    int i;
+    if (rfcomm_channel_id){
+        uint16_t len = rfcomm_stream_read(rfcomm_channel_id, buffer, sizeof(buffer));
+        for (i=0;i<len;i++){
+            putchar(buffer[i]);
+        }
+        if (len){
+            rx_bytes_processed += len;
+            printf("\n%u bytes processed, %u bytes/s\n", rx_bytes_processed, len * 1000 / HEARTBEAT_PERIOD_MS);
+        }
     }
     run_loop_set_timer(ts, HEARTBEAT_PERIOD_MS);
     run_loop_add_timer(ts);
@@ -131,14 +142,13 @@ static void one_shot_timer_setup(void){
     run_loop_add_timer(&heartbeat);
 }
 
-/* LISTING_START(phManual): Packet handler with manual credit management */
+/* LISTING_START(phManual): Packet handler enabling the rx ring for incoming connections */
 // Bluetooth logic
 static void packet_handler (void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
 /* LISTING_PAUSE */
     bd_addr_t event_addr;
     uint8_t   rfcomm_channel_nr;
     uint16_t  mtu;
-    int i;
     
     switch (packet_type) {
         case HCI_EVENT_PACKET:
@@ -178,8 +188,12 @@ static void packet_handler (void * connection, uint8_t packet_type, uint16_t cha
                     rfcomm_channel_nr = packet[8];
                     rfcomm_channel_id = READ_BT_16(packet, 9);
                     printf("RFCOMM channel %u requested for %s\n\r", rfcomm_channel_nr, bd_addr_to_str(event_addr));
+/* LISTING_RESUME */
+                    // received data is stored in rx ring, initial credits fit into it
+                    rfcomm_stream_enable(rfcomm_channel_id, NULL, 0, rx_ring, sizeof(rx_ring));
                     rfcomm_accept_connection_internal(rfcomm_channel_id);
                     break;
+/* LISTING_PAUSE */
                     
                 case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
                     // data: event(8), len(8), status (8), address (48), server channel(8), rfcomm_cid(16), max frame size(16)
@@ -200,15 +214,6 @@ static void packet_handler (void * connection, uint8_t packet_type, uint16_t cha
                     break;
             }
             break;
-/* LISTING_RESUME */
-        case RFCOMM_DATA_PACKET:
-            for (i=0;i<size;i++){
-                putchar(packet[i]);
-            };
-            putchar('\n');
-            rfcomm_send_credit = 1;
-            break;
-/* LISTING_PAUSE */
         default:
             break;
     }
@@ -74,6 +74,7 @@ typedef enum {
 // configuration area {
 static bd_addr_t remote = {0x84, 0x38, 0x35, 0x65, 0xD1, 0x15};     // address of remote device
 static const char * spp_service_name_prefix = "Bluetooth-Incoming"; // default on OS X
+static const int use_stream = 0;                                    // 1: write into tx ring of stream channel instead of packets
 // configuration area }
 
 static uint8_t  test_data[NUM_ROWS * NUM_COLS];
@@ -82,6 +83,9 @@ static uint8_t  channel_nr = 0;
 static uint16_t mtu;
 static uint16_t rfcomm_cid = 0;
 static uint32_t data_to_send =  DATA_VOLUME;
+static uint32_t start_ms;
+static uint8_t  tx_ring[4 * NUM_ROWS * NUM_COLS];
+static uint16_t test_data_pos;
 static state_t state = W4_SDP_RESULT;
 
 static void create_test_data(void){
@@ -95,21 +99,54 @@ static void create_test_data(void){
     }
 }
 
-static void send_packet(void){
+static void done(void){
+    rfcomm_disconnect_internal(rfcomm_cid);
+    rfcomm_cid = 0;
+    state = DONE;
+    uint32_t duration_ms = run_loop_get_time_ms() - start_ms;
+    if (!duration_ms) duration_ms = 1;
+    printf("SPP Streamer: enough data send, closing DLC. %u bytes in %u ms, %u bytes/s\n",
+        DATA_VOLUME - data_to_send, duration_ms, (uint32_t) ((DATA_VOLUME - data_to_send) * 1000ULL / duration_ms));
+}
+
+static int send_packet(void){
     int err = rfcomm_send_internal(rfcomm_cid, (uint8_t*) test_data, test_data_len);
     if (err){
         printf("rfcomm_send_internal -> error 0X%02x", err);
-        return;
+        return err;
     }
     
     if (data_to_send < test_data_len){
-        rfcomm_disconnect_internal(rfcomm_cid);
-        rfcomm_cid = 0;
-        state = DONE;
-        printf("SPP Streamer: enough data send, closing DLC\n");
-        return;
+        done();
+        return 0;
     }
     data_to_send -= test_data_len;
+    return 0;
+}
+
+// fill tx ring, continue on RFCOMM_EVENT_STREAM_CAN_WRITE. DISC is sent after the tx ring
+static void stream_write(void){
+    while (rfcomm_cid){
+        if (data_to_send < test_data_len){
+            done();
+            return;
+        }
+        uint16_t len = test_data_len - test_data_pos;
+        uint16_t written = rfcomm_stream_write(rfcomm_cid, &test_data[test_data_pos], len);
+        data_to_send  -= written;
+        test_data_pos += written;
+        if (test_data_pos == test_data_len){
+            test_data_pos = 0;
+        }
+        if (written < len) return;
+    }
+}
+
+// RFCOMM_EVENT_CREDITS may grant several packets at once
+static void send_packets(void){
+    while (rfcomm_cid && rfcomm_can_send_packet_now(rfcomm_cid)){
+        if (send_packet()) break;
+    }
 }
 
 static void packet_handler (void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
@@ -137,13 +174,23 @@ static void packet_handler (void * connection, uint8_t packet_type, uint16_t cha
                 if ((test_data_len > mtu)) {
                     test_data_len = mtu;
                 }
-                if (rfcomm_can_send_packet_now(rfcomm_cid)) send_packet();
+                start_ms = run_loop_get_time_ms();
+                if (use_stream){
+                    rfcomm_stream_enable(rfcomm_cid, tx_ring, sizeof(tx_ring), NULL, 0);
+                    stream_write();
+                    break;
+                }
+                send_packets();
                 break;
             }
             break;
         case DAEMON_EVENT_HCI_PACKET_SENT:
         case RFCOMM_EVENT_CREDITS:
-            if (rfcomm_can_send_packet_now(rfcomm_cid)) send_packet();
+            if (use_stream) break;
+            send_packets();
+            break;
+        case RFCOMM_EVENT_STREAM_CAN_WRITE:
+            stream_write();
             break;
         default:
             break;
@@ -431,7 +431,23 @@ extern "C" {
   */
 #define RFCOMM_EVENT_PORT_CONFIGURATION                    0x88
 
-    
+// data: event (8), len(8), rfcomm_cid (16), bytes in rx ring (16)
+/**
+ * @format 22
+ * @param rfcomm_cid
+ * @param bytes_available
+ */
+#define RFCOMM_EVENT_STREAM_DATA_AVAILABLE                 0x89
+
+// data: event (8), len(8), rfcomm_cid (16), free space in tx ring (16)
+/**
+ * @format 22
+ * @param rfcomm_cid
+ * @param space_available
+ */
+#define RFCOMM_EVENT_STREAM_CAN_WRITE                      0x8A
+
+
 // data: event(8), len(8), status(8), service_record_handle(32)
  /**
   * @format 14
@@ -654,10 +670,17 @@ extern "C" {
 //
 
 // from Bluetooth Core Specification
+#define ERROR_CODE_UNKNOWN_HCI_COMMAND                     0x01
 #define ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER           0x02
+#define ERROR_CODE_PAGE_TIMEOUT                            0x04
 #define ERROR_CODE_AUTHENTICATION_FAILURE				   0x05
+#define ERROR_CODE_PIN_OR_KEY_MISSING                      0x06
 #define ERROR_CODE_MEMORY_CAPACITY_EXCEEDED	    		   0x07
+#define ERROR_CODE_CONNECTION_TIMEOUT                      0x08
+#define ERROR_CODE_ACL_CONNECTION_ALREADY_EXISTS           0x0B
 #define ERROR_CODE_COMMAND_DISALLOWED                      0x0C
+#define ERROR_CODE_REMOTE_DEVICE_TERMINATED_CONNECTION_DUE_TO_POWER_OFF 0x15
+#define ERROR_CODE_CONNECTION_TERMINATED_BY_LOCAL_HOST     0x16
 #define ERROR_CODE_PAIRING_NOT_ALLOWED                     0x18
 #define ERROR_CODE_INSUFFICIENT_SECURITY                   0x2F
  
@@ -685,12 +708,17 @@ extern "C" {
 
 #define L2CAP_SERVICE_ALREADY_REGISTERED                   0x69
 #define L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU                  0x6A
+#define L2CAP_ERTM_BUFFER_TOO_SMALL                        0x6B
+#define L2CAP_ERTM_MODE_REFUSED                            0x6C
+#define L2CAP_CHANNEL_NOT_OPEN                             0x6D
+#define L2CAP_LOCAL_CID_DOES_NOT_EXIST                     0x6E
     
 #define RFCOMM_MULTIPLEXER_STOPPED                         0x70
 #define RFCOMM_CHANNEL_ALREADY_REGISTERED                  0x71
 #define RFCOMM_NO_OUTGOING_CREDITS                         0x72
 #define RFCOMM_AGGREGATE_FLOW_OFF                          0x73
 #define RFCOMM_DATA_LEN_EXCEEDS_MTU                        0x74
+#define RFCOMM_COALESCED_DATA_PENDING                      0x75
 
 #define SDP_HANDLE_ALREADY_REGISTERED                      0x80
 #define SDP_QUERY_INCOMPLETE                               0x81
@@ -68,6 +68,7 @@ typedef struct data_source {
     linked_item_t item;
     int  fd;                                 // <-- file descriptor to watch or 0
     int  (*process)(struct data_source *ds); // <-- do processing
+    int  write_enabled;                      // <-- also process when fd is writable, see run_loop_enable_data_source_write
 } data_source_t;
 
 typedef struct timer {
@@ -121,6 +122,12 @@ void run_loop_set_data_source_handler(data_source_t *ds, int (*process)(data_sou
 void run_loop_add_data_source(data_source_t *dataSource);
 int  run_loop_remove_data_source(data_source_t *dataSource);
 
+/**
+ * @brief Enable/Disable write notifications for an added data source. If enabled, process is also called when fd is writable.
+ * @return 1 if supported by the run loop implementation, 0 otherwise
+ */
+int  run_loop_enable_data_source_write(data_source_t *dataSource, int enable);
+
 /**
  * @brief Execute configured run loop. This function does not return.
  */
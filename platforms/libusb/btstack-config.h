@@ -21,4 +21,12 @@
 #define HAVE_HCI_DUMP
 #define SDP_DES_DUMP
 
+// number of concurrent USB transfers per endpoint
+// #define USB_EVENT_IN_TRANSFERS 2
+// #define USB_ACL_IN_TRANSFERS   3
+// #define USB_ACL_OUT_TRANSFERS  3
+
+// handle libusb events on a dedicated thread instead of polling every 1 ms, requires -lpthread
+// #define HAVE_USB_EVENT_THREAD
+
 #endif
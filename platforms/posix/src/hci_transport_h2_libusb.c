@@ -56,9 +56,22 @@
 #include <string.h>
 #include <unistd.h>   /* UNIX standard function definitions */
 #include <sys/types.h>
+#include <sys/time.h>
 
 #include <libusb.h>
 
+#ifdef HAVE_USB_EVENT_THREAD
+#include <pthread.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+// libusb_interrupt_event_handler was added in libusb 1.0.21
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define USB_EVENT_THREAD_INTERRUPT
+#endif
+#endif
+
 #include "btstack-config.h"
 
 #include "debug.h"
@@ -103,15 +116,55 @@ static libusb_device        * dev;
 #endif
 static libusb_device_handle * handle;
 
-#define ASYNC_BUFFERS 2
+// number of concurrent transfers per endpoint, can be overridden in btstack-config.h
+#ifndef USB_EVENT_IN_TRANSFERS
+#define USB_EVENT_IN_TRANSFERS 2
+#endif
+#ifndef USB_ACL_IN_TRANSFERS
+#define USB_ACL_IN_TRANSFERS 3
+#endif
+#ifndef USB_ACL_OUT_TRANSFERS
+#define USB_ACL_OUT_TRANSFERS 3
+#endif
+#ifndef USB_SCO_IN_TRANSFERS
+#define USB_SCO_IN_TRANSFERS 2
+#endif
+
 #define AYSNC_POLLING_INTERVAL_MS 1
+#ifndef NUM_ISO_PACKETS
 #define NUM_ISO_PACKETS 4
+#endif
 #define SCO_PACKET_SIZE 64
 
+// transfer statistics per endpoint
+typedef struct {
+    const char * name;
+    uint32_t transfers;         // completed transfers
+    uint32_t bytes;
+    uint64_t latency_sum_us;    // submit -> completion
+    uint32_t latency_max_us;
+    uint16_t in_flight;
+    uint16_t in_flight_max;
+} usb_endpoint_statistics_t;
+
+enum {
+    USB_STATS_COMMAND_OUT = 0,
+    USB_STATS_EVENT_IN,
+    USB_STATS_ACL_IN,
+    USB_STATS_ACL_OUT,
+    USB_STATS_SCO_IN,
+    USB_STATS_SCO_OUT,
+    USB_STATS_NUM
+};
+
+static usb_endpoint_statistics_t usb_statistics[USB_STATS_NUM] = {
+    { "Command Out" }, { "Event In" }, { "ACL In" }, { "ACL Out" }, { "SCO In" }, { "SCO Out" },
+};
+
 static struct libusb_transfer *command_out_transfer;
-static struct libusb_transfer *acl_out_transfer;
-static struct libusb_transfer *event_in_transfer[ASYNC_BUFFERS];
-static struct libusb_transfer *acl_in_transfer[ASYNC_BUFFERS];
+static struct libusb_transfer *acl_out_transfer[USB_ACL_OUT_TRANSFERS];
+static struct libusb_transfer *event_in_transfer[USB_EVENT_IN_TRANSFERS];
+static struct libusb_transfer *acl_in_transfer[USB_ACL_IN_TRANSFERS];
 
 static H2_SCO_STATE sco_state;
 static uint8_t  sco_buffer[255+3 + SCO_PACKET_SIZE];
@@ -120,27 +173,60 @@ static uint16_t sco_bytes_to_read;
 
 #ifdef HAVE_SCO
 static struct  libusb_transfer *sco_out_transfer;
-static struct  libusb_transfer *sco_in_transfer[ASYNC_BUFFERS];
-static uint8_t hci_sco_in_buffer[ASYNC_BUFFERS][NUM_ISO_PACKETS * SCO_PACKET_SIZE]; 
+static struct  libusb_transfer *sco_in_transfer[USB_SCO_IN_TRANSFERS];
+static uint8_t hci_sco_in_buffer[USB_SCO_IN_TRANSFERS][NUM_ISO_PACKETS * SCO_PACKET_SIZE]; 
 #endif
 
 static uint8_t hci_cmd_buffer[3 + 256 + LIBUSB_CONTROL_SETUP_SIZE];
-static uint8_t hci_event_in_buffer[ASYNC_BUFFERS][HCI_ACL_BUFFER_SIZE]; // bigger than largest packet
-static uint8_t hci_acl_in_buffer[ASYNC_BUFFERS][HCI_INCOMING_PRE_BUFFER_SIZE + HCI_ACL_BUFFER_SIZE]; 
+static uint8_t hci_event_in_buffer[USB_EVENT_IN_TRANSFERS][HCI_ACL_BUFFER_SIZE]; // bigger than largest packet
+static uint8_t hci_acl_in_buffer[USB_ACL_IN_TRANSFERS][HCI_INCOMING_PRE_BUFFER_SIZE + HCI_ACL_BUFFER_SIZE]; 
+
+// outgoing ACL packets are copied, so HCI can prepare the next one while transfers are in flight
+static uint8_t hci_acl_out_buffer[USB_ACL_OUT_TRANSFERS][HCI_ACL_BUFFER_SIZE];
+static int     acl_out_transfer_active[USB_ACL_OUT_TRANSFERS];
+static struct timeval acl_out_transfer_submitted[USB_ACL_OUT_TRANSFERS];
+static struct timeval event_in_transfer_submitted[USB_EVENT_IN_TRANSFERS];
+static struct timeval acl_in_transfer_submitted[USB_ACL_IN_TRANSFERS];
+static struct timeval command_out_transfer_submitted;
+static struct timeval sco_out_transfer_submitted;
 
 // For (ab)use as a linked list of received packets
 static struct libusb_transfer *handle_packet;
 
+#ifdef HAVE_USB_EVENT_THREAD
+// libusb events are handled on a dedicated thread. Completed transfers are passed to the
+// run loop via a single-producer/single-consumer ring and an eventfd (or pipe) wakeup.
+// Each transfer is in the ring at most once, so the ring cannot overflow.
+#define USB_COMPLETED_RING_SIZE 64
+#if (USB_EVENT_IN_TRANSFERS + USB_ACL_IN_TRANSFERS + USB_ACL_OUT_TRANSFERS + USB_SCO_IN_TRANSFERS + 2) > USB_COMPLETED_RING_SIZE
+#error "USB_COMPLETED_RING_SIZE too small for number of USB transfers"
+#endif
+static struct libusb_transfer * usb_completed_ring[USB_COMPLETED_RING_SIZE];
+static volatile uint32_t usb_completed_ring_head;   // written by event thread
+static volatile uint32_t usb_completed_ring_tail;   // written by run loop
+static pthread_t usb_event_thread;
+static volatile int usb_event_thread_stop;
+static volatile int usb_event_thread_draining;      // set by run loop, stop once no transfer is in flight
+static int usb_event_thread_started;
+static int usb_wakeup_fds[2] = { -1, -1 };          // read, write - same fd for eventfd
+static data_source_t usb_wakeup_ds;
+#endif
+
 static int doing_pollfds;
 static int num_pollfds;
 static data_source_t * pollfd_data_sources;
 static timer_source_t usb_timer;
 static int usb_timer_active;
 
-static int usb_acl_out_active = 0;
+static int usb_acl_out_active = 0;     // number of active ACL out transfers
+static volatile int usb_transfers_in_flight;  // submitted transfers whose callback did not run yet
 static int usb_sco_out_active = 0;
 static int usb_command_active = 0;
 
+// emit DAEMON_EVENT_HCI_PACKET_SENT from run loop after ACL packet was copied
+static timer_source_t usb_packet_sent_timer;
+static int usb_packet_sent_timer_active;
+
 // endpoint addresses
 static int event_in_addr;
 static int acl_in_addr;
@@ -149,6 +235,67 @@ static int sco_in_addr;
 static int sco_out_addr;
 
 
+static void usb_statistics_submitted(int endpoint, struct timeval * submitted){
+    usb_endpoint_statistics_t * stats = &usb_statistics[endpoint];
+    gettimeofday(submitted, NULL);
+    stats->in_flight++;
+    if (stats->in_flight > stats->in_flight_max){
+        stats->in_flight_max = stats->in_flight;
+    }
+}
+
+static void usb_statistics_completed(int endpoint, struct timeval * submitted, int bytes){
+    usb_endpoint_statistics_t * stats = &usb_statistics[endpoint];
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint32_t latency_us = (now.tv_sec - submitted->tv_sec) * 1000000 + (now.tv_usec - submitted->tv_usec);
+    stats->transfers++;
+    stats->bytes += bytes;
+    stats->latency_sum_us += latency_us;
+    if (latency_us > stats->latency_max_us){
+        stats->latency_max_us = latency_us;
+    }
+    if (stats->in_flight) stats->in_flight--;
+}
+
+static int usb_transfer_index(struct libusb_transfer * transfer, struct libusb_transfer ** transfers, int num_transfers){
+    int i;
+    for (i = 0; i < num_transfers; i++){
+        if (transfers[i] == transfer) return i;
+    }
+    return -1;
+}
+
+void hci_transport_usb_dump_statistics(void){
+    int i;
+    for (i = 0; i < USB_STATS_NUM; i++){
+        usb_endpoint_statistics_t * stats = &usb_statistics[i];
+        if (!stats->transfers) continue;
+        log_info("USB %-11s: %u transfers, %u bytes, latency avg %u us, max %u us, in flight %u, max %u",
+            stats->name, stats->transfers, stats->bytes, (uint32_t) (stats->latency_sum_us / stats->transfers),
+            stats->latency_max_us, stats->in_flight, stats->in_flight_max);
+    }
+}
+
+static void usb_statistics_reset(void){
+    int i;
+    for (i = 0; i < USB_STATS_NUM; i++){
+        const char * name = usb_statistics[i].name;
+        memset(&usb_statistics[i], 0, sizeof(usb_endpoint_statistics_t));
+        usb_statistics[i].name = name;
+    }
+}
+
+// submit transfer and count it until its callback ran (also used from event thread)
+static int usb_submit_transfer(struct libusb_transfer * transfer){
+    __sync_fetch_and_add(&usb_transfers_in_flight, 1);
+    int r = libusb_submit_transfer(transfer);
+    if (r) {
+        __sync_fetch_and_sub(&usb_transfers_in_flight, 1);
+    }
+    return r;
+}
+
 static void queue_transfer(struct libusb_transfer *transfer){
 
     // log_info("queue_transfer %p, endpoint %x size %u", transfer, transfer->endpoint, transfer->actual_length);
@@ -169,28 +316,69 @@ static void queue_transfer(struct libusb_transfer *transfer){
     temp->user_data = transfer;
 }
 
+#ifdef HAVE_USB_EVENT_THREAD
+// called on event thread
+static void usb_completed_ring_push(struct libusb_transfer *transfer){
+    uint32_t head = usb_completed_ring_head;
+    usb_completed_ring[head % USB_COMPLETED_RING_SIZE] = transfer;
+    // publish entry before head
+    __sync_synchronize();
+    usb_completed_ring_head = head + 1;
+
+    // wake up run loop
+    uint64_t one = 1;
+    ssize_t res = write(usb_wakeup_fds[1], &one, sizeof(one));
+    (void) res;
+}
+
+// called on run loop, returns NULL if empty
+static struct libusb_transfer * usb_completed_ring_pop(void){
+    uint32_t tail = usb_completed_ring_tail;
+    if (tail == usb_completed_ring_head) return NULL;
+    __sync_synchronize();
+    struct libusb_transfer * transfer = usb_completed_ring[tail % USB_COMPLETED_RING_SIZE];
+    // consume entry before tail is updated
+    __sync_synchronize();
+    usb_completed_ring_tail = tail + 1;
+    return transfer;
+}
+#endif
+
 static void async_callback(struct libusb_transfer *transfer)
 {
+    // libusb does not own the transfer anymore
+    int in_flight = __sync_sub_and_fetch(&usb_transfers_in_flight, 1);
+#ifdef HAVE_USB_EVENT_THREAD
+    if (usb_event_thread_draining && in_flight == 0){
+        usb_event_thread_stop = 1;
+    }
+#else
+    (void) in_flight;
+#endif
     if (libusb_state != LIB_USB_TRANSFERS_ALLOCATED)  return;
     int r;
     // log_info("begin async_callback endpoint %x, status %x, actual length %u", transfer->endpoint, transfer->status, transfer->actual_length );
 
     if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+#ifdef HAVE_USB_EVENT_THREAD
+        usb_completed_ring_push(transfer);
+#else
         queue_transfer(transfer);
+#endif
     } else if (transfer->status == LIBUSB_TRANSFER_STALL){
         log_info("-> Transfer stalled, trying again");
         r = libusb_clear_halt(handle, transfer->endpoint);
         if (r) {
             log_error("Error rclearing halt %d", r);
         }
-        r = libusb_submit_transfer(transfer);
+        r = usb_submit_transfer(transfer);
         if (r) {
             log_error("Error re-submitting transfer %d", r);
         }
     } else {
         log_info("async_callback resubmit transfer, endpoint %x, status %x, length %u", transfer->endpoint, transfer->status, transfer->actual_length);
         // No usable data, just resubmit packet
-        r = libusb_submit_transfer(transfer);
+        r = usb_submit_transfer(transfer);
         if (r) {
             log_error("Error re-submitting transfer %d", r);
         }
@@ -238,12 +426,24 @@ static void handle_completed_transfer(struct libusb_transfer *transfer){
 
     int resubmit = 0;
     int signal_done = 0;
+    struct timeval * submitted = NULL;
+    int index;
 
     if (transfer->endpoint == event_in_addr) {
+        index = usb_transfer_index(transfer, event_in_transfer, USB_EVENT_IN_TRANSFERS);
+        if (index >= 0){
+            submitted = &event_in_transfer_submitted[index];
+            usb_statistics_completed(USB_STATS_EVENT_IN, submitted, transfer->actual_length);
+        }
         packet_handler(HCI_EVENT_PACKET, transfer-> buffer, transfer->actual_length);
         resubmit = 1;
     } else if (transfer->endpoint == acl_in_addr) {
         // log_info("-> acl");
+        index = usb_transfer_index(transfer, acl_in_transfer, USB_ACL_IN_TRANSFERS);
+        if (index >= 0){
+            submitted = &acl_in_transfer_submitted[index];
+            usb_statistics_completed(USB_STATS_ACL_IN, submitted, transfer->actual_length);
+        }
         packet_handler(HCI_ACL_DATA_PACKET, transfer-> buffer, transfer->actual_length);
         resubmit = 1;
     } else if (transfer->endpoint == sco_in_addr) {
@@ -259,15 +459,23 @@ static void handle_completed_transfer(struct libusb_transfer *transfer){
         resubmit = 1;
     } else if (transfer->endpoint == 0){
         // log_info("command done, size %u", transfer->actual_length);
+        usb_statistics_completed(USB_STATS_COMMAND_OUT, &command_out_transfer_submitted, transfer->actual_length);
         usb_command_active = 0;
         signal_done = 1;
     } else if (transfer->endpoint == acl_out_addr){
         // log_info("acl out done, size %u", transfer->actual_length);
-        usb_acl_out_active = 0;
+        index = usb_transfer_index(transfer, acl_out_transfer, USB_ACL_OUT_TRANSFERS);
+        if (index >= 0){
+            usb_statistics_completed(USB_STATS_ACL_OUT, &acl_out_transfer_submitted[index], transfer->actual_length);
+            acl_out_transfer_active[index] = 0;
+        }
+        // ACL out slot available again
+        usb_acl_out_active--;
         signal_done = 1;
     } else if (transfer->endpoint == sco_out_addr){
         log_info("sco out done, size %u/%u - status %x", transfer->actual_length, 
             transfer->iso_packet_desc[0].actual_length, transfer->iso_packet_desc[0].status);
+        usb_statistics_completed(USB_STATS_SCO_OUT, &sco_out_transfer_submitted, transfer->actual_length);
         usb_sco_out_active = 0;
         signal_done = 1;
     } else {
@@ -285,7 +493,10 @@ static void handle_completed_transfer(struct libusb_transfer *transfer){
     if (resubmit){
         // Re-submit transfer 
         transfer->user_data = NULL;
-        int r = libusb_submit_transfer(transfer);
+        if (submitted){
+            usb_statistics_submitted(transfer->endpoint == event_in_addr ? USB_STATS_EVENT_IN : USB_STATS_ACL_IN, submitted);
+        }
+        int r = usb_submit_transfer(transfer);
         if (r) {
             log_error("Error re-submitting transfer %d", r);
         }
@@ -320,6 +531,102 @@ static int usb_process_ds(struct data_source *ds) {
     return 0;
 }
 
+// pre: transfers have been cancelled. libusb owns a cancelled transfer until its callback ran
+static void usb_wait_for_cancelled_transfers(void){
+    while (usb_transfers_in_flight){
+        struct timeval tv;
+        tv.tv_sec  = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout(NULL, &tv);
+    }
+}
+
+#ifdef HAVE_USB_EVENT_THREAD
+static int usb_process_wakeup_ds(struct data_source *ds) {
+    // reset eventfd counter / drain pipe
+    uint8_t buffer[64];
+    ssize_t res = read(usb_wakeup_fds[0], buffer, sizeof(buffer));
+    (void) res;
+
+    while (libusb_state == LIB_USB_TRANSFERS_ALLOCATED){
+        struct libusb_transfer * transfer = usb_completed_ring_pop();
+        if (!transfer) break;
+        handle_completed_transfer(transfer);
+    }
+    return 0;
+}
+
+static void * usb_event_thread_main(void * context){
+    while (!usb_event_thread_stop){
+#ifdef USB_EVENT_THREAD_INTERRUPT
+        libusb_handle_events_completed(NULL, (int *) &usb_event_thread_stop);
+#else
+        // event handling cannot be interrupted, check for stop once per second
+        struct timeval tv;
+        tv.tv_sec  = 1;
+        tv.tv_usec = 0;
+        libusb_handle_events_timeout_completed(NULL, &tv, (int *) &usb_event_thread_stop);
+#endif
+    }
+    return NULL;
+}
+
+static int usb_event_thread_start(void){
+    usb_completed_ring_head = 0;
+    usb_completed_ring_tail = 0;
+#ifdef __linux__
+    usb_wakeup_fds[0] = eventfd(0, EFD_NONBLOCK);
+    usb_wakeup_fds[1] = usb_wakeup_fds[0];
+    if (usb_wakeup_fds[0] < 0) return -1;
+#else
+    if (pipe(usb_wakeup_fds)) return -1;
+    fcntl(usb_wakeup_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(usb_wakeup_fds[1], F_SETFL, O_NONBLOCK);
+#endif
+    usb_wakeup_ds.fd = usb_wakeup_fds[0];
+    usb_wakeup_ds.process = usb_process_wakeup_ds;
+    run_loop_add_data_source(&usb_wakeup_ds);
+
+    usb_event_thread_stop = 0;
+    usb_event_thread_draining = 0;
+    if (pthread_create(&usb_event_thread, NULL, &usb_event_thread_main, NULL)){
+        log_error("Cannot create USB event thread");
+        return -1;
+    }
+    usb_event_thread_started = 1;
+    return 0;
+}
+
+// pre: usb_event_thread_draining was set, then transfers have been cancelled
+static void usb_event_thread_stop_and_join(void){
+    if (usb_event_thread_started){
+        // the last cancelled transfer stops the thread from its callback. if none is left,
+        // stop it here - it might be waiting for events that will never come
+        __sync_synchronize();
+        if (usb_transfers_in_flight == 0){
+            usb_event_thread_stop = 1;
+#ifdef USB_EVENT_THREAD_INTERRUPT
+            libusb_interrupt_event_handler(NULL);
+#endif
+        }
+        pthread_join(usb_event_thread, NULL);
+        usb_event_thread_started = 0;
+    } else {
+        // transfers submitted before the thread could be started
+        usb_wait_for_cancelled_transfers();
+    }
+    if (usb_wakeup_fds[0] >= 0){
+        run_loop_remove_data_source(&usb_wakeup_ds);
+        close(usb_wakeup_fds[0]);
+        if (usb_wakeup_fds[1] != usb_wakeup_fds[0]){
+            close(usb_wakeup_fds[1]);
+        }
+        usb_wakeup_fds[0] = -1;
+        usb_wakeup_fds[1] = -1;
+    }
+}
+#endif
+
 void usb_process_ts(timer_source_t *timer) {
     // log_info("in usb_process_ts");
 
@@ -643,17 +950,33 @@ static int usb_open(void *transport_config){
     
     // allocate transfer handlers
     int c;
-    for (c = 0 ; c < ASYNC_BUFFERS ; c++) {
+    for (c = 0 ; c < USB_EVENT_IN_TRANSFERS ; c++) {
         event_in_transfer[c] = libusb_alloc_transfer(0); // 0 isochronous transfers Events
+        if ( !event_in_transfer[c]) {
+            usb_close(handle);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+    }
+    for (c = 0 ; c < USB_ACL_IN_TRANSFERS ; c++) {
         acl_in_transfer[c]  =  libusb_alloc_transfer(0); // 0 isochronous transfers ACL in
-        if ( !event_in_transfer[c] || !acl_in_transfer[c]) {
+        if ( !acl_in_transfer[c]) {
+            usb_close(handle);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+    }
+    for (c = 0 ; c < USB_ACL_OUT_TRANSFERS ; c++) {
+        acl_out_transfer[c] = libusb_alloc_transfer(0);
+        acl_out_transfer_active[c] = 0;
+        if ( !acl_out_transfer[c]) {
             usb_close(handle);
             return LIBUSB_ERROR_NO_MEM;
         }
     }
+    usb_acl_out_active = 0;
+    usb_statistics_reset();
+    usb_transfers_in_flight = 0;
 
     command_out_transfer = libusb_alloc_transfer(0);
-    acl_out_transfer     = libusb_alloc_transfer(0);
 
     // TODO check for error
 
@@ -661,7 +984,7 @@ static int usb_open(void *transport_config){
 
 #ifdef HAVE_SCO
 
-    for (c = 0 ; c < ASYNC_BUFFERS ; c++) {
+    for (c = 0 ; c < USB_SCO_IN_TRANSFERS ; c++) {
         sco_in_transfer[c] = libusb_alloc_transfer(NUM_ISO_PACKETS); // isochronous transfers SCO in
         log_info("Alloc iso transfer");
         if (!sco_in_transfer[c]) {
@@ -676,7 +999,7 @@ static int usb_open(void *transport_config){
         sco_in_transfer[c]->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
         sco_in_transfer[c]->num_iso_packets = NUM_ISO_PACKETS;
         // sco_in_transfer[c]->iso_packet_desc[0].length = 300;
-        r = libusb_submit_transfer(sco_in_transfer[c]);
+        r = usb_submit_transfer(sco_in_transfer[c]);
         log_info("Submit iso transfer res = %d", r);
         if (r) {
             log_error("Error submitting isochronous in transfer %d", r);
@@ -687,28 +1010,41 @@ static int usb_open(void *transport_config){
     sco_out_transfer = libusb_alloc_transfer(1); // 1 isochronous transfers SCO out
 #endif
 
-    for (c = 0 ; c < ASYNC_BUFFERS ; c++) {
+    for (c = 0 ; c < USB_EVENT_IN_TRANSFERS ; c++) {
         // configure event_in handlers
         libusb_fill_interrupt_transfer(event_in_transfer[c], handle, event_in_addr, 
                 hci_event_in_buffer[c], HCI_ACL_BUFFER_SIZE, async_callback, NULL, 0) ;
-        r = libusb_submit_transfer(event_in_transfer[c]);
+        usb_statistics_submitted(USB_STATS_EVENT_IN, &event_in_transfer_submitted[c]);
+        r = usb_submit_transfer(event_in_transfer[c]);
         if (r) {
             log_error("Error submitting interrupt transfer %d", r);
             usb_close(handle);
             return r;
         }
- 
+    }
+
+    for (c = 0 ; c < USB_ACL_IN_TRANSFERS ; c++) {
         // configure acl_in handlers
         libusb_fill_bulk_transfer(acl_in_transfer[c], handle, acl_in_addr, 
                 hci_acl_in_buffer[c] + HCI_INCOMING_PRE_BUFFER_SIZE, HCI_ACL_BUFFER_SIZE, async_callback, NULL, 0) ;
-        r = libusb_submit_transfer(acl_in_transfer[c]);
+        usb_statistics_submitted(USB_STATS_ACL_IN, &acl_in_transfer_submitted[c]);
+        r = usb_submit_transfer(acl_in_transfer[c]);
         if (r) {
             log_error("Error submitting bulk in transfer %d", r);
             usb_close(handle);
             return r;
         }
- 
-     }
+    }
+
+#ifdef HAVE_USB_EVENT_THREAD
+    log_info("Async using event thread");
+    doing_pollfds = 0;
+    if (usb_event_thread_start()){
+        usb_close(handle);
+        return -1;
+    }
+    return 0;
+#endif
 
     // Check for pollfds functionality
     doing_pollfds = libusb_pollfds_handle_timeouts(NULL);
@@ -763,20 +1099,48 @@ static int usb_close(void *transport_config){
                 run_loop_remove_timer(&usb_timer);
                 usb_timer_active = 0;
             }
+            if (usb_packet_sent_timer_active){
+                run_loop_remove_timer(&usb_packet_sent_timer);
+                usb_packet_sent_timer_active = 0;
+            }
+
+            hci_transport_usb_dump_statistics();
+
+#ifdef HAVE_USB_EVENT_THREAD
+            // let event thread exit after the last cancelled transfer was handled
+            usb_event_thread_draining = 1;
+#endif
 
             // Cancel any asynchronous transfers
-            for (c = 0 ; c < ASYNC_BUFFERS ; c++) {
+            for (c = 0 ; c < USB_EVENT_IN_TRANSFERS ; c++) {
                 libusb_cancel_transfer(event_in_transfer[c]);
+            }
+            for (c = 0 ; c < USB_ACL_IN_TRANSFERS ; c++) {
                 libusb_cancel_transfer(acl_in_transfer[c]);
+            }
+            for (c = 0 ; c < USB_ACL_OUT_TRANSFERS ; c++) {
+                if (acl_out_transfer_active[c]){
+                    libusb_cancel_transfer(acl_out_transfer[c]);
+                }
+            }
+            if (usb_command_active){
+                libusb_cancel_transfer(command_out_transfer);
+            }
 #ifdef HAVE_SCO
+            for (c = 0 ; c < USB_SCO_IN_TRANSFERS ; c++) {
                 libusb_cancel_transfer(sco_in_transfer[c]);
-#endif
             }
+            if (usb_sco_out_active){
+                libusb_cancel_transfer(sco_out_transfer);
+            }
+#endif
 
-            /* TODO - find a better way to ensure that all transfers have completed */
-            struct timeval tv;
-            memset(&tv, 0, sizeof(struct timeval));
-            libusb_handle_events_timeout(NULL, &tv);
+            // transfers must not be freed before libusb handed them back
+#ifdef HAVE_USB_EVENT_THREAD
+            usb_event_thread_stop_and_join();
+#else
+            usb_wait_for_cancelled_transfers();
+#endif
 
             if (doing_pollfds){
                 int r;
@@ -791,15 +1155,28 @@ static int usb_close(void *transport_config){
             }
 
         case LIB_USB_INTERFACE_CLAIMED:
-            for (c = 0 ; c < ASYNC_BUFFERS ; c++) {
+            for (c = 0 ; c < USB_EVENT_IN_TRANSFERS ; c++) {
                 if (event_in_transfer[c]) libusb_free_transfer(event_in_transfer[c]);
+                event_in_transfer[c] = NULL;
+            }
+            for (c = 0 ; c < USB_ACL_IN_TRANSFERS ; c++) {
                 if (acl_in_transfer[c])   libusb_free_transfer(acl_in_transfer[c]);
+                acl_in_transfer[c] = NULL;
+            }
+            for (c = 0 ; c < USB_ACL_OUT_TRANSFERS ; c++) {
+                if (acl_out_transfer[c])  libusb_free_transfer(acl_out_transfer[c]);
+                acl_out_transfer[c] = NULL;
+                acl_out_transfer_active[c] = 0;
+            }
+            usb_acl_out_active = 0;
 #ifdef HAVE_SCO
+            for (c = 0 ; c < USB_SCO_IN_TRANSFERS ; c++) {
                 if (sco_in_transfer[c])   libusb_free_transfer(sco_in_transfer[c]);
-#endif
+                sco_in_transfer[c] = NULL;
             }
+#endif
 
-            // TODO free control and acl out transfers
+            // TODO free control transfer
 
             libusb_release_interface(handle, 0);
 
@@ -832,12 +1209,14 @@ static int usb_send_cmd_packet(uint8_t *packet, int size){
 
     // update stata before submitting transfer
     usb_command_active = 1;
+    usb_statistics_submitted(USB_STATS_COMMAND_OUT, &command_out_transfer_submitted);
 
     // submit transfer
-    r = libusb_submit_transfer(command_out_transfer);
+    r = usb_submit_transfer(command_out_transfer);
     
     if (r < 0) {
         usb_command_active = 0;
+        usb_statistics[USB_STATS_COMMAND_OUT].in_flight--;
         log_error("Error submitting cmd transfer %d", r);
         return -1;
     }
@@ -845,29 +1224,58 @@ static int usb_send_cmd_packet(uint8_t *packet, int size){
     return 0;
 }
 
+static void usb_packet_sent_timer_handler(timer_source_t * ts){
+    usb_packet_sent_timer_active = 0;
+    // notify upper stack that packet buffer can be used again
+    uint8_t event[] = { DAEMON_EVENT_HCI_PACKET_SENT, 0};
+    packet_handler(HCI_EVENT_PACKET, &event[0], sizeof(event));
+}
+
 static int usb_send_acl_packet(uint8_t *packet, int size){
     int r;
 
     if (libusb_state != LIB_USB_TRANSFERS_ALLOCATED) return -1;
 
     // log_info("usb_send_acl_packet enter, size %u", size);
-    
-    // prepare transfer
-    int completed = 0;
-    libusb_fill_bulk_transfer(acl_out_transfer, handle, acl_out_addr, packet, size,
-        async_callback, &completed, 0);
-    acl_out_transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+
+    // get free transfer
+    int c;
+    for (c = 0; c < USB_ACL_OUT_TRANSFERS; c++){
+        if (!acl_out_transfer_active[c]) break;
+    }
+    if (c == USB_ACL_OUT_TRANSFERS || size > HCI_ACL_BUFFER_SIZE){
+        log_error("usb_send_acl_packet: no free transfer or packet too large");
+        return -1;
+    }
+
+    // copy packet and prepare transfer
+    memcpy(hci_acl_out_buffer[c], packet, size);
+    libusb_fill_bulk_transfer(acl_out_transfer[c], handle, acl_out_addr, hci_acl_out_buffer[c], size,
+        async_callback, NULL, 0);
+    acl_out_transfer[c]->type = LIBUSB_TRANSFER_TYPE_BULK;
 
     // update stata before submitting transfer
-    usb_acl_out_active = 1;
+    acl_out_transfer_active[c] = 1;
+    usb_acl_out_active++;
+    usb_statistics_submitted(USB_STATS_ACL_OUT, &acl_out_transfer_submitted[c]);
 
-    r = libusb_submit_transfer(acl_out_transfer);
+    r = usb_submit_transfer(acl_out_transfer[c]);
     if (r < 0) {
-        usb_acl_out_active = 0;
+        acl_out_transfer_active[c] = 0;
+        usb_acl_out_active--;
+        usb_statistics[USB_STATS_ACL_OUT].in_flight--;
         log_error("Error submitting acl transfer, %d", r);
         return -1;
     }
 
+    // packet buffer not needed anymore, let HCI continue from run loop
+    if (!usb_packet_sent_timer_active){
+        run_loop_set_timer_handler(&usb_packet_sent_timer, &usb_packet_sent_timer_handler);
+        run_loop_set_timer(&usb_packet_sent_timer, 0);
+        run_loop_add_timer(&usb_packet_sent_timer);
+        usb_packet_sent_timer_active = 1;
+    }
+
     return 0;
 }
 
@@ -888,10 +1296,12 @@ static int usb_send_sco_packet(uint8_t *packet, int size){
 
     // update state before submitting transfer
     usb_sco_out_active = 1;
+    usb_statistics_submitted(USB_STATS_SCO_OUT, &sco_out_transfer_submitted);
 
-    r = libusb_submit_transfer(sco_out_transfer);
+    r = usb_submit_transfer(sco_out_transfer);
     if (r < 0) {
         usb_sco_out_active = 0;
+        usb_statistics[USB_STATS_SCO_OUT].in_flight--;
         log_error("Error submitting sco transfer, %d", r);
         return -1;
     }
@@ -904,7 +1314,7 @@ static int usb_can_send_packet_now(uint8_t packet_type){
         case HCI_COMMAND_DATA_PACKET:
             return !usb_command_active;
         case HCI_ACL_DATA_PACKET:
-            return !usb_acl_out_active;
+            return usb_acl_out_active < USB_ACL_OUT_TRANSFERS;
         case HCI_SCO_DATA_PACKET:
             return !usb_sco_out_active;
         default:
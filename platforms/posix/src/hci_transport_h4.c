@@ -50,13 +50,17 @@
 #include <unistd.h>   /* UNIX standard function definitions */
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h> 
+#include <sys/uio.h>
 
 #include "debug.h"
 #include "hci.h"
 #include "hci_transport.h"
 
 static int  h4_process(struct data_source *ds);
+static void h4_tx_timer_handler(timer_source_t *ts);
+static void h4_tx_reset(void);
 static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size); 
 static      hci_uart_config_t *hci_uart_config;
 
@@ -64,15 +68,37 @@ typedef enum {
     H4_W4_PACKET_TYPE,
     H4_W4_EVENT_HEADER,
     H4_W4_ACL_HEADER,
+    H4_W4_SCO_HEADER,
     H4_W4_PAYLOAD,
 } H4_STATE;
 
+// frame currently being written to the UART, frames must not be interleaved
+typedef enum {
+    H4_TX_FRAME_NONE,
+    H4_TX_FRAME_BULK,
+    H4_TX_FRAME_SCO,
+} H4_TX_FRAME;
+
+// retry interval if run loop doesn't support write notifications
+#define H4_TX_RETRY_INTERVAL_MS 1
+
+// number of outgoing SCO packets that can be queued
+#ifndef H4_SCO_QUEUE_SIZE
+#define H4_SCO_QUEUE_SIZE 4
+#endif
+
+// packet type + sco header + max sco payload
+#define H4_SCO_PACKET_SIZE (1 + HCI_SCO_HEADER_SIZE + 255)
+
 typedef struct hci_transport_h4 {
     hci_transport_t transport;
     data_source_t *ds;
     int uart_fd;    // different from ds->fd for HCI reader thread
     /* power management support, e.g. used by iOS */
     timer_source_t sleep_timer;
+    /* used for outgoing data if run loop doesn't provide write notifications */
+    timer_source_t tx_timer;
+    int tx_timer_active;
 } hci_transport_h4_t;
 
 
@@ -89,6 +115,21 @@ static int read_pos;
 static uint8_t hci_packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE + 1 + HCI_PACKET_BUFFER_SIZE]; // packet type + max(acl header + acl payload, event header + event data)
 static uint8_t * hci_packet = &hci_packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE];
 
+// outgoing bulk queue (commands and ACL): remainder of a packet that could not be written at once
+static uint8_t h4_tx_buffer[1 + HCI_PACKET_BUFFER_SIZE]; // packet type + max(acl header + acl payload, cmd header + cmd data)
+static int     h4_tx_len;
+static int     h4_tx_pos;
+
+// outgoing SCO queue, takes precedence over bulk data
+static uint8_t h4_sco_queue[H4_SCO_QUEUE_SIZE][H4_SCO_PACKET_SIZE];
+static int     h4_sco_queue_len[H4_SCO_QUEUE_SIZE];
+static int     h4_sco_queue_head;
+static int     h4_sco_queue_count;
+static int     h4_sco_pos;
+
+static H4_TX_FRAME h4_tx_frame;
+static int     h4_tx_packet_sent_pending;  // emit DAEMON_EVENT_HCI_PACKET_SENT from run loop
+
 static int    h4_set_baudrate(uint32_t baudrate){
 
     log_info("h4_set_baudrate %u", baudrate);
@@ -185,12 +226,21 @@ static int    h4_open(void *transport_config){
     bytes_to_read = 1;
     h4_state = H4_W4_PACKET_TYPE;
     read_pos = 0;    
+
+    // init outgoing queues
+    h4_tx_reset();
+    hci_transport_h4->tx_timer_active = 0;
     return 0;
 }
 
 static int h4_close(void *transport_config){
     // first remove run loop handler
 	run_loop_remove_data_source(hci_transport_h4->ds);
+    if (hci_transport_h4->tx_timer_active){
+        run_loop_remove_timer(&hci_transport_h4->tx_timer);
+        hci_transport_h4->tx_timer_active = 0;
+    }
+    h4_tx_reset();
     
     // close device 
     close(hci_transport_h4->ds->fd);
@@ -201,25 +251,191 @@ static int h4_close(void *transport_config){
     return 0;
 }
 
+static void h4_tx_reset(void){
+    h4_tx_len = 0;
+    h4_tx_pos = 0;
+    h4_sco_queue_head  = 0;
+    h4_sco_queue_count = 0;
+    h4_sco_pos = 0;
+    h4_tx_frame = H4_TX_FRAME_NONE;
+    h4_tx_packet_sent_pending = 0;
+}
+
+static int h4_tx_pending(void){
+    return h4_tx_len || h4_sco_queue_count || h4_tx_packet_sent_pending;
+}
+
+// request h4_process/h4_tx_timer_handler to get called when the UART can accept more data
+static void h4_tx_request_callback(void){
+    if (run_loop_enable_data_source_write(hci_transport_h4->ds, 1)) return;
+    // fallback: poll with timer
+    if (hci_transport_h4->tx_timer_active) return;
+    run_loop_set_timer_handler(&hci_transport_h4->tx_timer, h4_tx_timer_handler);
+    run_loop_set_timer(&hci_transport_h4->tx_timer, H4_TX_RETRY_INTERVAL_MS);
+    run_loop_add_timer(&hci_transport_h4->tx_timer);
+    hci_transport_h4->tx_timer_active = 1;
+}
+
+// write queued frames, SCO first. @returns 0 if done, 1 if more data is pending, -1 on error
+static int h4_tx_flush(void){
+    while (1){
+        // select frame, don't interrupt partially written one
+        if (h4_tx_frame == H4_TX_FRAME_NONE){
+            if (h4_sco_queue_count){
+                h4_tx_frame = H4_TX_FRAME_SCO;
+            } else if (h4_tx_len){
+                h4_tx_frame = H4_TX_FRAME_BULK;
+            } else {
+                return 0;
+            }
+        }
+
+        uint8_t * data;
+        int       len;
+        int     * pos;
+        if (h4_tx_frame == H4_TX_FRAME_SCO){
+            data = h4_sco_queue[h4_sco_queue_head];
+            len  = h4_sco_queue_len[h4_sco_queue_head];
+            pos  = &h4_sco_pos;
+        } else {
+            data = h4_tx_buffer;
+            len  = h4_tx_len;
+            pos  = &h4_tx_pos;
+        }
+
+        ssize_t bytes_written = write(hci_transport_h4->uart_fd, &data[*pos], len - *pos);
+        if (bytes_written < 0){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_error("h4_tx_flush: write failed, errno %d", errno);
+            return -1;
+        }
+        *pos += bytes_written;
+        if (*pos < len) continue;
+
+        // frame complete
+        if (h4_tx_frame == H4_TX_FRAME_SCO){
+            h4_sco_pos = 0;
+            h4_sco_queue_head = (h4_sco_queue_head + 1) % H4_SCO_QUEUE_SIZE;
+            h4_sco_queue_count--;
+        } else {
+            h4_tx_len = 0;
+            h4_tx_pos = 0;
+        }
+        h4_tx_frame = H4_TX_FRAME_NONE;
+        h4_tx_packet_sent_pending = 1;
+    }
+}
+
+// process outgoing queues, called from run loop
+static void h4_tx_process(void){
+    if (!h4_tx_pending()) return;
+
+    if (h4_tx_flush() < 0){
+        // drop queued data
+        h4_tx_reset();
+        h4_tx_packet_sent_pending = 1;
+    }
+
+    if (!h4_tx_len && !h4_sco_queue_count){
+        // all data written: stop write notifications
+        run_loop_enable_data_source_write(hci_transport_h4->ds, 0);
+    }
+
+    if (!h4_tx_packet_sent_pending) return;
+    h4_tx_packet_sent_pending = 0;
+
+    // notify upper stack that it can send again
+    uint8_t event[] = { DAEMON_EVENT_HCI_PACKET_SENT, 0};
+    packet_handler(HCI_EVENT_PACKET, &event[0], sizeof(event));
+}
+
+static void h4_tx_timer_handler(timer_source_t *ts){
+    hci_transport_h4->tx_timer_active = 0;
+    h4_tx_process();
+    if (h4_tx_pending()){
+        h4_tx_request_callback();
+    }
+}
+
+static int h4_can_send_packet_now(uint8_t packet_type){
+    if (packet_type == HCI_SCO_DATA_PACKET){
+        return h4_sco_queue_count < H4_SCO_QUEUE_SIZE;
+    }
+    return h4_tx_len == 0;
+}
+
+static int h4_send_sco_packet(uint8_t * packet, int size){
+    if (h4_sco_queue_count >= H4_SCO_QUEUE_SIZE){
+        log_error("h4_send_packet: SCO queue full, dropping packet");
+        return -1;
+    }
+    if (size > H4_SCO_PACKET_SIZE - 1){
+        log_error("h4_send_packet: SCO packet too large (%u)", size);
+        return -1;
+    }
+    int index = (h4_sco_queue_head + h4_sco_queue_count) % H4_SCO_QUEUE_SIZE;
+    h4_sco_queue[index][0] = HCI_SCO_DATA_PACKET;
+    memcpy(&h4_sco_queue[index][1], packet, size);
+    h4_sco_queue_len[index] = 1 + size;
+    h4_sco_queue_count++;
+
+    // write now to keep latency low
+    if (h4_tx_flush() < 0) return -1;
+    h4_tx_packet_sent_pending = 1;
+    h4_tx_request_callback();
+    return 0;
+}
+
 static int h4_send_packet(uint8_t packet_type, uint8_t * packet, int size){
     if (hci_transport_h4->ds == NULL) return -1;
     if (hci_transport_h4->uart_fd == 0) return -1;
 
-    char *data = (char*) packet;
-    int bytes_written = write(hci_transport_h4->uart_fd, &packet_type, 1);
-    while (bytes_written < 1) {
-        usleep(5000);
-        bytes_written = write(hci_transport_h4->uart_fd, &packet_type, 1);
-    };
-    while (size > 0) {
-        int bytes_written = write(hci_transport_h4->uart_fd, data, size);
-        if (bytes_written < 0) {
-            usleep(5000);
-            continue;
+    if (packet_type == HCI_SCO_DATA_PACKET){
+        return h4_send_sco_packet(packet, size);
+    }
+
+    if (h4_tx_len){
+        log_error("h4_send_packet: outgoing queue busy, dropping packet type %u", packet_type);
+        return -1;
+    }
+
+    ssize_t bytes_written = 0;
+    if (h4_tx_frame == H4_TX_FRAME_NONE && h4_sco_queue_count == 0){
+        // write packet type and packet with a single syscall
+        struct iovec iov[2];
+        iov[0].iov_base = &packet_type;
+        iov[0].iov_len  = 1;
+        iov[1].iov_base = packet;
+        iov[1].iov_len  = size;
+        bytes_written = writev(hci_transport_h4->uart_fd, iov, 2);
+        if (bytes_written < 0){
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                log_error("h4_send_packet: writev failed, errno %d", errno);
+                return -1;
+            }
+            bytes_written = 0;
         }
-        data += bytes_written;
-        size -= bytes_written;
     }
+
+    // queue remainder
+    if (bytes_written < 1 + size){
+        int pos = 0;
+        if (bytes_written == 0){
+            h4_tx_buffer[pos++] = packet_type;
+            bytes_written = 1;
+        } else {
+            // partially written, has to be completed first
+            h4_tx_frame = H4_TX_FRAME_BULK;
+        }
+        memcpy(&h4_tx_buffer[pos], &packet[bytes_written - 1], 1 + size - bytes_written);
+        h4_tx_len = pos + 1 + size - bytes_written;
+        h4_tx_pos = 0;
+    }
+
+    // packet buffer is not used anymore, but HCI expects DAEMON_EVENT_HCI_PACKET_SENT outside of send_packet
+    h4_tx_packet_sent_pending = 1;
+    h4_tx_request_callback();
     return 0;
 }
 
@@ -246,6 +462,9 @@ static void h4_statemachine(void){
             } else if (hci_packet[0] == HCI_ACL_DATA_PACKET){
                 bytes_to_read = HCI_ACL_HEADER_SIZE;
                 h4_state = H4_W4_ACL_HEADER;
+            } else if (hci_packet[0] == HCI_SCO_DATA_PACKET){
+                bytes_to_read = HCI_SCO_HEADER_SIZE;
+                h4_state = H4_W4_SCO_HEADER;
             } else {
                 log_error("h4_process: invalid packet type 0x%02x", hci_packet[0]);
                 read_pos = 0;
@@ -263,6 +482,11 @@ static void h4_statemachine(void){
             h4_state = H4_W4_PAYLOAD;
             break;
             
+        case H4_W4_SCO_HEADER:
+            bytes_to_read = hci_packet[3];
+            h4_state = H4_W4_PAYLOAD;
+            break;
+            
         case H4_W4_PAYLOAD:
             h4_deliver_packet();
             break;
@@ -274,6 +498,9 @@ static void h4_statemachine(void){
 static int    h4_process(struct data_source *ds) {
     if (hci_transport_h4->uart_fd == 0) return -1;
 
+    // called for writable fd, too
+    h4_tx_process();
+
     int read_now = bytes_to_read;
     
     // read up to bytes_to_read data in
@@ -311,7 +538,7 @@ hci_transport_t * hci_transport_h4_instance() {
         hci_transport_h4->transport.register_packet_handler       = h4_register_packet_handler;
         hci_transport_h4->transport.get_transport_name            = h4_get_transport_name;
         hci_transport_h4->transport.set_baudrate                  = h4_set_baudrate;
-        hci_transport_h4->transport.can_send_packet_now           = NULL;
+        hci_transport_h4->transport.can_send_packet_now           = h4_can_send_packet_now;
     }
     return (hci_transport_t *) hci_transport_h4;
 }
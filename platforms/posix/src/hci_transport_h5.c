@@ -35,73 +35,665 @@
  *
  */
 
+
 /*
  *  hci_transport_h5.c
  *
- *  HCI Transport API implementation for basic H5 protocol
+ *  HCI Transport API implementation for the Three-Wire UART (H5) protocol
+ *
+ *  - SLIP framing
+ *  - link establishment: SYNC/SYNC RESPONSE, CONFIG/CONFIG RESPONSE
+ *  - reliable packets with sequence numbers, sliding window up to 7 packets
+ *  - delayed acknowledgements, piggybacked on outgoing packets when possible
+ *  - retransmission of unacknowledged packets (go-back-N)
+ *  - optional data integrity check (CRC-CCITT)
  *
  *  Created by Matthias Ringwald on 4/29/09.
  */
 
+#include "btstack-config.h"
+
 #include <termios.h>  /* POSIX terminal control definitions */
 #include <fcntl.h>    /* File control definitions */
 #include <unistd.h>   /* UNIX standard function definitions */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
+#include "debug.h"
 #include "hci.h"
 #include "hci_transport.h"
 
-typedef struct hci_transport_h5 {
-    hci_transport_t transport;
-    data_source_t *ds;
-} hci_transport_h5_t;
+// SLIP
+#define H5_SLIP_DELIMITER           0xc0
+#define H5_SLIP_ESCAPE              0xdb
+#define H5_SLIP_ESCAPED_DELIMITER   0xdc
+#define H5_SLIP_ESCAPED_ESCAPE      0xdd
+
+// H5 packet types in addition to HCI packet types
+#define H5_PACKET_TYPE_ACK           0
+#define H5_PACKET_TYPE_VENDOR       14
+#define H5_PACKET_TYPE_LINK_CONTROL 15
+
+#define H5_HEADER_SIZE      4
+#define H5_CRC_SIZE         2
+#define H5_SEQ_MODULO       8
+#define H5_MAX_WINDOW_SIZE  7
+
+// config field
+#define H5_CONFIG_WINDOW_MASK       0x07
+#define H5_CONFIG_DATA_INTEGRITY    0x10
+
+// link establishment: SYNC/CONFIG retransmission interval as defined by spec
+#define H5_LINK_TIMER_MS 250
+
+// acknowledgement delay to allow piggybacking on outgoing packets
+#ifndef H5_ACK_DELAY_MS
+#define H5_ACK_DELAY_MS 5
+#endif
+
+// minimal retransmission timeout, scaled up for low baud rates
+#ifndef H5_RESEND_TIMEOUT_MS
+#define H5_RESEND_TIMEOUT_MS 100
+#endif
+
+// poll interval for writing if the run loop doesn't support write notifications
+#define H5_TX_RETRY_INTERVAL_MS 1
+
+// max payload: packet buffer or sco packet
+#define H5_MAX_PAYLOAD_SIZE HCI_PACKET_BUFFER_SIZE
+#define H5_MAX_FRAME_SIZE   (H5_HEADER_SIZE + H5_MAX_PAYLOAD_SIZE + H5_CRC_SIZE)
+// worst case: all bytes escaped + 2 delimiters
+#define H5_MAX_ENCODED_FRAME_SIZE (2 * H5_MAX_FRAME_SIZE + 2)
+#define H5_OUT_BUFFER_SIZE  (2 * H5_MAX_ENCODED_FRAME_SIZE)
+
+typedef enum {
+    H5_LINK_UNINITIALIZED,
+    H5_LINK_INITIALIZED,
+    H5_LINK_ACTIVE
+} H5_LINK_STATE;
 
 // h5 slip state machine
 typedef enum {
-	unknown = 1,
-	decoding,
-	x_c0,
-	x_db
-} H5_STATE;
+    H5_SLIP_UNKNOWN = 1,
+    H5_SLIP_X_C0,
+    H5_SLIP_DECODING,
+    H5_SLIP_X_DB
+} H5_SLIP_STATE;
 
 typedef struct h5_slip {
-	state_t state;
-	uint16_t length;
-	uint8_t data[HCI_ACL_BUFFER_SIZE];
+    H5_SLIP_STATE state;
+    uint16_t length;
+    uint8_t data[H5_MAX_FRAME_SIZE];
 } h5_slip_t;
 
-// Global State
-static h5_slip_t read_sm;
-static h5_slip_t write_sm;
-static int bt_filedesc = 0;
+typedef struct h5_tx_slot {
+    uint8_t  packet_type;
+    uint16_t size;
+    uint8_t  data[H5_MAX_PAYLOAD_SIZE];
+} h5_tx_slot_t;
+
+typedef struct hci_transport_h5 {
+    hci_transport_t transport;
+    data_source_t *ds;
+    timer_source_t link_timer;
+    timer_source_t ack_timer;
+    timer_source_t resend_timer;
+    timer_source_t tx_timer;
+    int ack_timer_active;
+    int resend_timer_active;
+    int tx_timer_active;
+} hci_transport_h5_t;
+
+// link control messages
+static const uint8_t link_control_sync[]            = { 0x01, 0x7e };
+static const uint8_t link_control_sync_response[]   = { 0x02, 0x7d };
+static const uint8_t link_control_config[]          = { 0x03, 0xfc };
+static const uint8_t link_control_config_response[] = { 0x04, 0x7b };
+static const uint8_t link_control_wakeup[]          = { 0x05, 0xfa };
+static const uint8_t link_control_woken[]           = { 0x06, 0xf9 };
 
 // single instance
 static hci_transport_h5_t * hci_transport_h5 = NULL;
 
 static int  h5_process(struct data_source *ds);
-static void dummy_handler(uint8_t packet_type, uint8_t *packet, int size); 
+static void h5_link_timer_handler(timer_source_t *ts);
+static void h5_ack_timer_handler(timer_source_t *ts);
+static void h5_resend_timer_handler(timer_source_t *ts);
+static void h5_tx_timer_handler(timer_source_t *ts);
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size); 
 static      hci_uart_config_t *hci_uart_config;
 
-static  void (*packet_handler)(uint8_t packet_type, uint8_t *packet, int size) = dummy_handler;
+static  void (*packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size) = dummy_handler;
 
-// prototypes
-static int    h5_open(void *transport_config){
-    hci_uart_config = (hci_uart_config_t*) transport_config;
-    struct termios toptions;
-    int fd = open(hci_uart_config->device_name, O_RDWR | O_NOCTTY | O_NDELAY);
-    if (fd == -1)  {
-        perror("init_serialport: Unable to open port ");
-        perror(hci_uart_config->device_name);
-        return -1;
+// configuration
+static int h5_window_size_config = 4;
+static int h5_data_integrity_config = 0;
+
+// link
+static H5_LINK_STATE h5_link_state;
+static int h5_window_size;      // negotiated
+static int h5_data_integrity;   // negotiated
+static uint32_t h5_resend_timeout_ms;
+
+// receive
+static h5_slip_t read_sm;
+static uint8_t h5_rx_seq;           // next expected seq
+static int     h5_ack_pending;      // number of received reliable packets not acknowledged yet
+
+// transmit: reliable packets kept until acknowledged, slot index == seq
+static h5_tx_slot_t h5_tx_window[H5_SEQ_MODULO];
+static uint8_t h5_tx_seq;           // seq for next new reliable packet
+static int     h5_tx_unacked;       // number of packets sent but not acknowledged
+
+// encoded output
+static uint8_t h5_out_buffer[H5_OUT_BUFFER_SIZE];
+static int     h5_out_len;
+static int     h5_out_pos;
+static int     h5_packet_sent_pending;  // emit DAEMON_EVENT_HCI_PACKET_SENT from run loop
+
+// statistics
+static uint32_t h5_retransmissions;
+
+// CRC-CCITT as used by H5, computed LSB first
+static uint16_t h5_crc_update(uint16_t crc, uint8_t data){
+    int i;
+    crc ^= data;
+    for (i = 0; i < 8; i++){
+        crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
     }
-    
+    return crc;
+}
+
+static uint16_t h5_crc_bit_reverse(uint16_t crc){
+    uint16_t result = 0;
+    int i;
+    for (i = 0; i < 16; i++){
+        result = (result << 1) | (crc & 1);
+        crc >>= 1;
+    }
+    return result;
+}
+
+// CRC over header and payload
+static uint16_t h5_crc(const uint8_t * header, const uint8_t * payload, uint16_t size){
+    uint16_t crc = 0xffff;
+    int i;
+    for (i = 0; i < H5_HEADER_SIZE; i++){
+        crc = h5_crc_update(crc, header[i]);
+    }
+    for (i = 0; i < size; i++){
+        crc = h5_crc_update(crc, payload[i]);
+    }
+    return h5_crc_bit_reverse(crc);
+}
+
+static int h5_reliable_packet_type(uint8_t packet_type){
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+        case HCI_ACL_DATA_PACKET:
+        case HCI_EVENT_PACKET:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void h5_set_timer(timer_source_t * ts, void (*handler)(timer_source_t *ts), uint32_t timeout_ms){
+    run_loop_remove_timer(ts);
+    run_loop_set_timer_handler(ts, handler);
+    run_loop_set_timer(ts, timeout_ms);
+    run_loop_add_timer(ts);
+}
+
+static void h5_stop_ack_timer(void){
+    if (!hci_transport_h5->ack_timer_active) return;
+    run_loop_remove_timer(&hci_transport_h5->ack_timer);
+    hci_transport_h5->ack_timer_active = 0;
+}
+
+static void h5_stop_resend_timer(void){
+    if (!hci_transport_h5->resend_timer_active) return;
+    run_loop_remove_timer(&hci_transport_h5->resend_timer);
+    hci_transport_h5->resend_timer_active = 0;
+}
+
+static void h5_start_resend_timer(void){
+    h5_set_timer(&hci_transport_h5->resend_timer, h5_resend_timer_handler, h5_resend_timeout_ms);
+    hci_transport_h5->resend_timer_active = 1;
+}
+
+static void h5_update_timing(uint32_t baudrate){
+    if (!baudrate) baudrate = 115200;
+    // time to send a window of max size frames, 10 bits per byte
+    uint32_t window_ms = (H5_MAX_WINDOW_SIZE * H5_MAX_FRAME_SIZE * 10 * 1000) / baudrate;
+    h5_resend_timeout_ms = window_ms > H5_RESEND_TIMEOUT_MS ? window_ms : H5_RESEND_TIMEOUT_MS;
+}
+
+// output buffer
+
+static int h5_out_space(void){
+    // compact buffer if possible
+    if (h5_out_pos == h5_out_len){
+        h5_out_pos = 0;
+        h5_out_len = 0;
+    } else if (h5_out_pos > 0){
+        memmove(&h5_out_buffer[0], &h5_out_buffer[h5_out_pos], h5_out_len - h5_out_pos);
+        h5_out_len -= h5_out_pos;
+        h5_out_pos  = 0;
+    }
+    return H5_OUT_BUFFER_SIZE - h5_out_len;
+}
+
+static int h5_out_can_store(int payload_size){
+    return h5_out_space() >= 2 * (H5_HEADER_SIZE + payload_size + H5_CRC_SIZE) + 2;
+}
+
+static void h5_out_slip_byte(uint8_t data){
+    switch (data){
+        case H5_SLIP_DELIMITER:
+            h5_out_buffer[h5_out_len++] = H5_SLIP_ESCAPE;
+            h5_out_buffer[h5_out_len++] = H5_SLIP_ESCAPED_DELIMITER;
+            break;
+        case H5_SLIP_ESCAPE:
+            h5_out_buffer[h5_out_len++] = H5_SLIP_ESCAPE;
+            h5_out_buffer[h5_out_len++] = H5_SLIP_ESCAPED_ESCAPE;
+            break;
+        default:
+            h5_out_buffer[h5_out_len++] = data;
+            break;
+    }
+}
+
+static void h5_out_slip_block(const uint8_t * data, int size){
+    int i;
+    for (i = 0; i < size; i++){
+        h5_out_slip_byte(data[i]);
+    }
+}
+
+// request h5_process/h5_tx_timer_handler to get called when the UART can accept more data
+static void h5_request_write_callback(void){
+    if (run_loop_enable_data_source_write(hci_transport_h5->ds, 1)) return;
+    // fallback: poll with timer
+    if (hci_transport_h5->tx_timer_active) return;
+    run_loop_set_timer_handler(&hci_transport_h5->tx_timer, h5_tx_timer_handler);
+    run_loop_set_timer(&hci_transport_h5->tx_timer, H5_TX_RETRY_INTERVAL_MS);
+    run_loop_add_timer(&hci_transport_h5->tx_timer);
+    hci_transport_h5->tx_timer_active = 1;
+}
+
+static void h5_stop_tx_timer(void){
+    if (!hci_transport_h5->tx_timer_active) return;
+    run_loop_remove_timer(&hci_transport_h5->tx_timer);
+    hci_transport_h5->tx_timer_active = 0;
+}
+
+// encode frame into output buffer. pre: h5_out_can_store(size)
+static void h5_queue_frame(uint8_t packet_type, int reliable, uint8_t seq, const uint8_t * payload, uint16_t size){
+    uint8_t header[H5_HEADER_SIZE];
+    header[0] = seq | (h5_rx_seq << 3) | (h5_data_integrity ? 0x40 : 0) | (reliable ? 0x80 : 0);
+    header[1] = packet_type | ((size & 0x0f) << 4);
+    header[2] = size >> 4;
+    header[3] = ~(header[0] + header[1] + header[2]);
+
+    h5_out_buffer[h5_out_len++] = H5_SLIP_DELIMITER;
+    h5_out_slip_block(header, H5_HEADER_SIZE);
+    h5_out_slip_block(payload, size);
+    if (h5_data_integrity){
+        uint16_t crc = h5_crc(header, payload, size);
+        h5_out_slip_byte(crc >> 8);
+        h5_out_slip_byte(crc & 0xff);
+    }
+    h5_out_buffer[h5_out_len++] = H5_SLIP_DELIMITER;
+
+    // every frame acknowledges all received packets
+    h5_ack_pending = 0;
+    h5_stop_ack_timer();
+
+    h5_request_write_callback();
+}
+
+static void h5_send_link_control(const uint8_t * message, int size, int with_config){
+    uint8_t payload[3];
+    memcpy(payload, message, size);
+    if (with_config){
+        payload[size++] = (h5_window_size_config & H5_CONFIG_WINDOW_MASK) | (h5_data_integrity_config ? H5_CONFIG_DATA_INTEGRITY : 0);
+    }
+    if (!h5_out_can_store(size)) return;
+    h5_queue_frame(H5_PACKET_TYPE_LINK_CONTROL, 0, 0, payload, size);
+}
+
+static void h5_send_pure_ack(void){
+    if (!h5_out_can_store(0)) return;
+    h5_queue_frame(H5_PACKET_TYPE_ACK, 0, 0, NULL, 0);
+}
+
+// send reliable packet from tx window
+static void h5_send_reliable(uint8_t seq){
+    h5_tx_slot_t * slot = &h5_tx_window[seq];
+    h5_queue_frame(slot->packet_type, 1, seq, slot->data, slot->size);
+}
+
+static void h5_ack_timer_handler(timer_source_t *ts){
+    hci_transport_h5->ack_timer_active = 0;
+    if (!h5_ack_pending) return;
+    h5_send_pure_ack();
+}
+
+static void h5_resend_timer_handler(timer_source_t *ts){
+    hci_transport_h5->resend_timer_active = 0;
+    if (!h5_tx_unacked) return;
+
+    // go-back-N: resend all unacknowledged packets, if output buffer is empty
+    if (h5_out_pos == h5_out_len){
+        uint8_t seq = (h5_tx_seq - h5_tx_unacked) & 0x07;
+        log_info("h5: resend %u packets starting with seq %u", h5_tx_unacked, seq);
+        while (seq != h5_tx_seq && h5_out_can_store(h5_tx_window[seq].size)){
+            h5_send_reliable(seq);
+            h5_retransmissions++;
+            seq = (seq + 1) & 0x07;
+        }
+    }
+    h5_start_resend_timer();
+}
+
+static void h5_link_timer_handler(timer_source_t *ts){
+    switch (h5_link_state){
+        case H5_LINK_UNINITIALIZED:
+            h5_send_link_control(link_control_sync, sizeof(link_control_sync), 0);
+            break;
+        case H5_LINK_INITIALIZED:
+            h5_send_link_control(link_control_config, sizeof(link_control_config), 1);
+            break;
+        default:
+            return;
+    }
+    h5_set_timer(&hci_transport_h5->link_timer, h5_link_timer_handler, H5_LINK_TIMER_MS);
+}
+
+static void h5_link_reset(void){
+    h5_link_state = H5_LINK_UNINITIALIZED;
+    h5_window_size = 1;
+    h5_data_integrity = 0;
+    h5_rx_seq = 0;
+    h5_ack_pending = 0;
+    h5_tx_seq = 0;
+    h5_tx_unacked = 0;
+    h5_stop_ack_timer();
+    h5_stop_resend_timer();
+}
+
+// process incoming acknowledgement number
+static void h5_process_ack(uint8_t ack){
+    if (!h5_tx_unacked) return;
+    uint8_t oldest = (h5_tx_seq - h5_tx_unacked) & 0x07;
+    int num_acked = (ack - oldest) & 0x07;
+    if (num_acked == 0 || num_acked > h5_tx_unacked) return;
+    h5_tx_unacked -= num_acked;
+    if (h5_tx_unacked){
+        h5_start_resend_timer();
+    } else {
+        h5_stop_resend_timer();
+    }
+    // window has room again
+    h5_packet_sent_pending = 1;
+    h5_request_write_callback();
+}
+
+static void h5_process_link_control(uint8_t * payload, uint16_t size){
+    if (size < 2) return;
+    if (memcmp(payload, link_control_sync, 2) == 0){
+        if (h5_link_state == H5_LINK_ACTIVE){
+            // peer was reset, reset stack
+            log_error("h5: SYNC received in active state, peer reset");
+            h5_link_reset();
+            h5_set_timer(&hci_transport_h5->link_timer, h5_link_timer_handler, H5_LINK_TIMER_MS);
+            uint8_t event[] = { HCI_EVENT_HARDWARE_ERROR, 1, 0};
+            packet_handler(HCI_EVENT_PACKET, &event[0], sizeof(event));
+            return;
+        }
+        h5_send_link_control(link_control_sync_response, sizeof(link_control_sync_response), 0);
+        return;
+    }
+    if (memcmp(payload, link_control_sync_response, 2) == 0){
+        if (h5_link_state != H5_LINK_UNINITIALIZED) return;
+        log_info("h5: link initialized");
+        h5_link_state = H5_LINK_INITIALIZED;
+        h5_link_timer_handler(&hci_transport_h5->link_timer);
+        return;
+    }
+    if (memcmp(payload, link_control_config, 2) == 0){
+        if (h5_link_state == H5_LINK_UNINITIALIZED) return;
+        h5_send_link_control(link_control_config_response, sizeof(link_control_config_response), 1);
+        return;
+    }
+    if (memcmp(payload, link_control_config_response, 2) == 0){
+        if (h5_link_state != H5_LINK_INITIALIZED) return;
+        // use config of peer if lower. missing config field: window size 1, no data integrity check
+        uint8_t config = size > 2 ? payload[2] : 0x01;
+        h5_window_size = config & H5_CONFIG_WINDOW_MASK;
+        if (h5_window_size > h5_window_size_config) h5_window_size = h5_window_size_config;
+        if (h5_window_size < 1) h5_window_size = 1;
+        h5_data_integrity = h5_data_integrity_config && (config & H5_CONFIG_DATA_INTEGRITY);
+        log_info("h5: link active, window size %u, data integrity check %u", h5_window_size, h5_data_integrity);
+        h5_link_state = H5_LINK_ACTIVE;
+        run_loop_remove_timer(&hci_transport_h5->link_timer);
+        // HCI can send now
+        h5_packet_sent_pending = 1;
+        h5_request_write_callback();
+        return;
+    }
+    if (memcmp(payload, link_control_wakeup, 2) == 0){
+        h5_send_link_control(link_control_woken, sizeof(link_control_woken), 0);
+        return;
+    }
+}
+
+static void h5_process_frame(uint8_t * frame, uint16_t frame_size){
+    if (frame_size < H5_HEADER_SIZE) return;
+
+    // validate header
+    uint8_t checksum = ~(frame[0] + frame[1] + frame[2]);
+    if (checksum != frame[3]){
+        log_error("h5: header checksum error");
+        return;
+    }
+    uint8_t  seq            = frame[0] & 0x07;
+    uint8_t  ack            = (frame[0] >> 3) & 0x07;
+    int      data_integrity = (frame[0] >> 6) & 0x01;
+    int      reliable       = (frame[0] >> 7) & 0x01;
+    uint8_t  packet_type    = frame[1] & 0x0f;
+    uint16_t size           = (frame[1] >> 4) | (frame[2] << 4);
+    if (frame_size != H5_HEADER_SIZE + size + (data_integrity ? H5_CRC_SIZE : 0)){
+        log_error("h5: frame size %u does not match payload length %u", frame_size, size);
+        return;
+    }
+    uint8_t * payload = &frame[H5_HEADER_SIZE];
+    if (data_integrity){
+        uint16_t crc = h5_crc(frame, payload, size);
+        if (crc != READ_NET_16(payload, size)){
+            log_error("h5: crc error");
+            return;
+        }
+    }
+
+    if (packet_type == H5_PACKET_TYPE_LINK_CONTROL){
+        h5_process_link_control(payload, size);
+        return;
+    }
+
+    if (h5_link_state != H5_LINK_ACTIVE) return;
+
+    h5_process_ack(ack);
+
+    if (reliable){
+        if (seq != h5_rx_seq){
+            // out of order or duplicate: discard and acknowledge again
+            h5_send_pure_ack();
+            return;
+        }
+        h5_rx_seq = (h5_rx_seq + 1) & 0x07;
+        h5_ack_pending++;
+        if (h5_ack_pending >= h5_window_size){
+            // peer cannot send more, ack now
+            h5_send_pure_ack();
+        } else if (!hci_transport_h5->ack_timer_active){
+            h5_set_timer(&hci_transport_h5->ack_timer, h5_ack_timer_handler, H5_ACK_DELAY_MS);
+            hci_transport_h5->ack_timer_active = 1;
+        }
+    }
+
+    switch (packet_type){
+        case HCI_EVENT_PACKET:
+        case HCI_ACL_DATA_PACKET:
+        case HCI_SCO_DATA_PACKET:
+            packet_handler(packet_type, payload, size);
+            break;
+        default:
+            break;
+    }
+}
+
+static void h5_slip_init( h5_slip_t * sm){
+    sm->state = H5_SLIP_UNKNOWN;
+    sm->length = 0;
+}
+
+static void h5_slip_store(h5_slip_t * sm, uint8_t input){
+    if (sm->length >= sizeof(sm->data)){
+        log_error("h5: frame too large, dropping");
+        sm->state = H5_SLIP_UNKNOWN;
+        return;
+    }
+    sm->data[sm->length++] = input;
+    sm->state = H5_SLIP_DECODING;
+}
+
+static void h5_slip_process( h5_slip_t * sm, uint8_t input){
+    switch (sm->state) {
+        case H5_SLIP_UNKNOWN:
+            if (input == H5_SLIP_DELIMITER){
+                sm->length = 0;
+                sm->state  = H5_SLIP_X_C0;
+            }
+            break;
+        case H5_SLIP_X_C0:
+            switch (input){
+                case H5_SLIP_DELIMITER:
+                    break;
+                case H5_SLIP_ESCAPE:
+                    sm->state = H5_SLIP_X_DB;
+                    break;
+                default:
+                    h5_slip_store(sm, input);
+                    break;
+            }
+            break;
+        case H5_SLIP_DECODING:
+            switch (input){
+                case H5_SLIP_DELIMITER:
+                    // frame done, delimiter can also start next frame
+                    h5_process_frame(sm->data, sm->length);
+                    sm->length = 0;
+                    sm->state  = H5_SLIP_X_C0;
+                    break;
+                case H5_SLIP_ESCAPE:
+                    sm->state = H5_SLIP_X_DB;
+                    break;
+                default:
+                    h5_slip_store(sm, input);
+                    break;
+            }
+            break;
+        case H5_SLIP_X_DB:
+            switch (input) {
+                case H5_SLIP_ESCAPED_DELIMITER:
+                    h5_slip_store(sm, H5_SLIP_DELIMITER);
+                    break;
+                case H5_SLIP_ESCAPED_ESCAPE:
+                    h5_slip_store(sm, H5_SLIP_ESCAPE);
+                    break;
+                default:
+                    sm->state = H5_SLIP_UNKNOWN;
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// write output buffer and emit DAEMON_EVENT_HCI_PACKET_SENT if requested
+static void h5_tx_process(void){
+    while (h5_out_pos < h5_out_len){
+        ssize_t bytes_written = write(hci_transport_h5->ds->fd, &h5_out_buffer[h5_out_pos], h5_out_len - h5_out_pos);
+        if (bytes_written < 0){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_error("h5: write failed, errno %d", errno);
+            h5_out_pos = h5_out_len;
+            break;
+        }
+        h5_out_pos += bytes_written;
+    }
+
+    if (h5_out_pos == h5_out_len){
+        h5_out_pos = 0;
+        h5_out_len = 0;
+        run_loop_enable_data_source_write(hci_transport_h5->ds, 0);
+    }
+
+    if (!h5_packet_sent_pending) return;
+    h5_packet_sent_pending = 0;
+
+    // notify upper stack that it might be possible to send again
+    uint8_t event[] = { DAEMON_EVENT_HCI_PACKET_SENT, 0};
+    packet_handler(HCI_EVENT_PACKET, &event[0], sizeof(event));
+}
+
+static void h5_tx_timer_handler(timer_source_t *ts){
+    hci_transport_h5->tx_timer_active = 0;
+    h5_tx_process();
+    if (hci_transport_h5->ds && h5_out_len){
+        h5_request_write_callback();
+    }
+}
+
+static int    h5_process(struct data_source *ds) {
+    if (hci_transport_h5->ds->fd == 0) return -1;
+
+    // called for writable fd, too
+    h5_tx_process();
+    if (!hci_transport_h5->ds) return 0;
+
+    uint8_t data[256];
+    while (hci_transport_h5->ds){
+        ssize_t bytes_read = read(hci_transport_h5->ds->fd, data, sizeof(data));
+        if (bytes_read < 1) break;
+        int i;
+        for (i = 0; i < bytes_read && hci_transport_h5->ds; i++){
+            h5_slip_process(&read_sm, data[i]);
+        }
+    }
+    return 0;
+}
+
+static int    h5_set_baudrate(uint32_t baudrate){
+
+    log_info("h5_set_baudrate %u", baudrate);
+
+    struct termios toptions;
+    int fd = hci_transport_h5->ds->fd;
+
     if (tcgetattr(fd, &toptions) < 0) {
         perror("init_serialport: Couldn't get term attributes");
         return -1;
     }
-    speed_t brate = hci_uart_config->baudrate; // let you override switch below if needed
-    switch(hci_uart_config->baudrate) {
+    
+    speed_t brate = baudrate; // let you override switch below if needed
+    switch(baudrate) {
         case 57600:  brate=B57600;  break;
         case 115200: brate=B115200; break;
 #ifdef B230400
@@ -114,13 +706,37 @@ static int    h5_open(void *transport_config){
         case 921600: brate=B921600; break;
 #endif
     }
-    cfsetispeed(&toptions, brate);
     cfsetospeed(&toptions, brate);
+    cfsetispeed(&toptions, brate);
+
+    if( tcsetattr(fd, TCSANOW, &toptions) < 0) {
+        perror("init_serialport: Couldn't set term attributes");
+        return -1;
+    }
+
+    h5_update_timing(baudrate);
+    return 0;
+}
+
+static int    h5_open(void *transport_config){
+    hci_uart_config = (hci_uart_config_t*) transport_config;
+    struct termios toptions;
+    int fd = open(hci_uart_config->device_name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1)  {
+        perror("init_serialport: Unable to open port ");
+        perror(hci_uart_config->device_name);
+        return -1;
+    }
     
-    // 8N1
-    toptions.c_cflag &= ~PARENB;
+    if (tcgetattr(fd, &toptions) < 0) {
+        perror("init_serialport: Couldn't get term attributes");
+        return -1;
+    }
+
+    cfmakeraw(&toptions);   // make raw
+
+    // 8N1, H5 would allow for even parity
     toptions.c_cflag &= ~CSTOPB;
-    toptions.c_cflag &= ~CSIZE;
     toptions.c_cflag |= CS8;
 
     if (hci_uart_config->flowcontrol) {
@@ -134,9 +750,6 @@ static int    h5_open(void *transport_config){
     toptions.c_cflag |= CREAD | CLOCAL;  // turn on READ & ignore ctrl lines
     toptions.c_iflag &= ~(IXON | IXOFF | IXANY); // turn off s/w flow ctrl
     
-    toptions.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); // make raw
-    toptions.c_oflag &= ~OPOST; // make raw
-    
     // see: http://unixwiz.net/techtips/termios-vmin-vtime.html
     toptions.c_cc[VMIN]  = 1;
     toptions.c_cc[VTIME] = 0;
@@ -147,21 +760,37 @@ static int    h5_open(void *transport_config){
     }
     
     // set up data_source
-    hci_transport_h5->ds = malloc(sizeof(data_source_t));
-    if (!hci_transport_h5) return -1;
+    hci_transport_h5->ds = (data_source_t*) malloc(sizeof(data_source_t));
+    if (!hci_transport_h5->ds) return -1;
     hci_transport_h5->ds->fd = fd;
     hci_transport_h5->ds->process = h5_process;
     run_loop_add_data_source(hci_transport_h5->ds);
-    
+
+    // also set baudrate
+    if (h5_set_baudrate(hci_uart_config->baudrate_init) < 0){
+        return -1;
+    }
+
     // init state machine
-	h5_slip_init( &read_sm);
-	h5_slip_init( &write_sm);
+    h5_slip_init(&read_sm);
+    h5_out_len = 0;
+    h5_out_pos = 0;
+    h5_packet_sent_pending = 0;
+    h5_retransmissions = 0;
+    h5_link_reset();
+
+    // start link establishment
+    h5_link_timer_handler(&hci_transport_h5->link_timer);
     return 0;
 }
 
 static int    h5_close(void *transport_config){
     // first remove run loop handler
-	run_loop_remove_data_source(hci_transport_h5->ds);
+    run_loop_remove_data_source(hci_transport_h5->ds);
+    run_loop_remove_timer(&hci_transport_h5->link_timer);
+    h5_stop_tx_timer();
+    h5_link_reset();
+    log_info("h5: closed, %u retransmissions", h5_retransmissions);
     
     // close device 
     close(hci_transport_h5->ds->fd);
@@ -172,138 +801,81 @@ static int    h5_close(void *transport_config){
     return 0;
 }
 
+static int    h5_can_send_packet_now(uint8_t packet_type){
+    if (h5_link_state != H5_LINK_ACTIVE) return 0;
+    if (h5_reliable_packet_type(packet_type) && h5_tx_unacked >= h5_window_size) return 0;
+    return h5_out_can_store(H5_MAX_PAYLOAD_SIZE);
+}
+
 static int    h5_send_packet(uint8_t packet_type, uint8_t *packet, int size){
     if (hci_transport_h5->ds == NULL) return -1;
     if (hci_transport_h5->ds->fd == 0) return -1;
-    char *data = (char*) packet;
-    
-    write(hci_transport_h5->ds->fd, &packet_type, 1);
-    while (size > 0) {
-        int bytes_written = write(hci_transport_h5->ds->fd, data, size);
-        if (bytes_written < 0) {
-            usleep(5000);
-            continue;
+    if (!h5_can_send_packet_now(packet_type) || size > H5_MAX_PAYLOAD_SIZE){
+        log_error("h5_send_packet: cannot send packet type %u now", packet_type);
+        return -1;
+    }
+
+    if (h5_reliable_packet_type(packet_type)){
+        // keep in window until acknowledged
+        uint8_t seq = h5_tx_seq;
+        h5_tx_slot_t * slot = &h5_tx_window[seq];
+        slot->packet_type = packet_type;
+        slot->size = size;
+        memcpy(slot->data, packet, size);
+        h5_tx_seq = (h5_tx_seq + 1) & 0x07;
+        h5_tx_unacked++;
+        h5_send_reliable(seq);
+        if (!hci_transport_h5->resend_timer_active){
+            h5_start_resend_timer();
         }
-        data += bytes_written;
-        size -= bytes_written;
+    } else {
+        h5_queue_frame(packet_type, 0, 0, packet, size);
     }
+
+    // packet buffer is not used anymore, but HCI expects DAEMON_EVENT_HCI_PACKET_SENT outside of send_packet
+    h5_packet_sent_pending = 1;
+    h5_request_write_callback();
     return 0;
 }
 
-static void   h5_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, int size)){
+static void   h5_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
     packet_handler = handler;
 }
 
-static void h5_slip_init( h5_slip_t * sm){
-	sm->state = unknown;
-}
-
-static void h5_slip_process( h5_slip_t * sm, uint8_t input, uint8_t in){
-	uint8_t type;
-	switch (sm->state) {
-		case unknown:
-			if (input == 0xc0){
-				sm->length = 0;
-				sm->state  = x_c0;
-			}
-			break;
-		case x_c0:
-			switch (input ){
-				case 0xc0:
-					break;
-				case 0xdb:
-					sm->state = x_db;
-					break;
-				default:
-					sm->data[sm->length] = input;
-					++sm->length;
-					sm->state   = decoding;
-					break;
-			}
-			break;
-		case decoding:
-			switch (input ){
-				case 0xc0:
-					sm->state = unknown;
-					// packet done - check if valid HCI packet
-					if (sm->length < 6) break;
-					type = sm->data[1] & 0x0f;
-					if (type < 1 || type > 4) break;
-					switch (type) {
-						case HCI_ACL_DATA_PACKET:
-							acl_packet_handler( &sm->data[4], sm->length-4-2);
-							break;
-						case HCI_EVENT_PACKET:
-							event_packet_handler( &sm->data[4], sm->length-4-2);
-							break;
-						default:
-							break;
-					}
-					break;
-				case 0xdb:
-					sm->state = x_db;
-					break;
-				default:
-					sm->data[sm->length] = input;
-					++sm->length;
-					break;
-			}
-			break;
-		case x_db:
-			switch (input) {
-				case 0xdc:
-					sm->data[sm->length] = 0xc0;
-					++sm->length;
-					sm->state = decoding;
-					break;
-				case 0xdd:
-					sm->data[sm->length] = 0xdb;
-					++sm->length;
-					sm->state = decoding;
-					break;
-				default:
-					sm->state = unknown;
-					break;
-			}
-			break;
-		default:
-			break;
-	}
+static const char * h5_get_transport_name(void){
+    return "H5";
 }
 
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+}
 
-static int    h5_process(struct data_source *ds) {
-    if (hci_transport_h5->ds->fd == 0) return -1;
-
-    // read up to bytes_to_read data in
-	uint8_t data;
-	while (1) {
-		int bytes_read = read(hci_transport_h5->ds->fd, &data, 1);
-		if (bytes_read < 1) break;
-		h5_slip_process( &read_sm, data, 1);
-	};
-    return 0;
+void hci_transport_h5_set_window_size(int window_size){
+    if (window_size < 1) window_size = 1;
+    if (window_size > H5_MAX_WINDOW_SIZE) window_size = H5_MAX_WINDOW_SIZE;
+    h5_window_size_config = window_size;
 }
 
-static const char * h5_get_transport_name(void){
-    return "H5";
+void hci_transport_h5_enable_data_integrity_check(int enable){
+    h5_data_integrity_config = enable;
 }
 
-static void dummy_handler(uint8_t *packet, int size){
+uint32_t hci_transport_h5_get_retransmissions(void){
+    return h5_retransmissions;
 }
 
 // get h5 singleton
 hci_transport_t * hci_transport_h5_instance() {
     if (hci_transport_h5 == NULL) {
-        hci_transport_h5 = malloc( sizeof(hci_transport_h5_t));
+        hci_transport_h5 = (hci_transport_h5_t*) malloc( sizeof(hci_transport_h5_t));
+        memset(hci_transport_h5, 0, sizeof(hci_transport_h5_t));
         hci_transport_h5->ds                                      = NULL;
         hci_transport_h5->transport.open                          = h5_open;
         hci_transport_h5->transport.close                         = h5_close;
         hci_transport_h5->transport.send_packet                   = h5_send_packet;
-        hci_transport_h5->transport.register_packet_handler       = h5_register_event_packet_handler;
+        hci_transport_h5->transport.register_packet_handler       = h5_register_packet_handler;
         hci_transport_h5->transport.get_transport_name            = h5_get_transport_name;
-        hci_transport_h5->transport.set_baudrate                  = NULL;
-        hci_transport_h5->transport.can_send_packet_now           = NULL;
+        hci_transport_h5->transport.set_baudrate                  = h5_set_baudrate;
+        hci_transport_h5->transport.can_send_packet_now           = h5_can_send_packet_now;
     }
     return (hci_transport_t *) hci_transport_h5;
 }
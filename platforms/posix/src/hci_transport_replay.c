@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  hci_transport_replay.c
+ *
+ *  HCI Transport API implementation that replays a PacketLogger or BlueZ hcidump file
+ *
+ *  Controller to host packets from the log are delivered to the stack, either as fast as
+ *  possible or with the recorded timing scaled by hci_replay_config_t.speed. Host to
+ *  controller packets are absorbed and compared against the log: when the replay reaches
+ *  a recorded host packet, it waits until the stack has sent its packet, so that the
+ *  stack sees the controller responses in the recorded order.
+ *
+ *  Statistics (packets, bytes, mismatches, duration) can be used to benchmark
+ *  event and ACL processing on real traffic.
+ */
+
+#include "btstack-config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "hci.h"
+#include "hci_dump.h"
+#include "hci_transport.h"
+
+// max number of packets delivered per run loop iteration if replaying as fast as possible
+#ifndef REPLAY_BATCH_SIZE
+#define REPLAY_BATCH_SIZE 64
+#endif
+
+// max time to wait for a recorded host packet
+#ifndef REPLAY_HOST_TIMEOUT_MS
+#define REPLAY_HOST_TIMEOUT_MS 1000
+#endif
+
+#define REPLAY_PKLG_HEADER_SIZE  13
+#define REPLAY_BLUEZ_HEADER_SIZE 13
+
+// events emitted by the stack itself are logged, too, but must not be replayed
+#define REPLAY_STACK_EVENT_MIN 0x60
+
+typedef enum {
+    REPLAY_DIRECTION_NONE = 0,    // notes and unknown records
+    REPLAY_DIRECTION_TO_HOST,
+    REPLAY_DIRECTION_TO_CONTROLLER,
+} replay_direction_t;
+
+typedef struct {
+    replay_direction_t direction;
+    uint8_t  packet_type;
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    const uint8_t * packet;
+    uint32_t size;
+    uint32_t next;                  // offset of next record
+} replay_record_t;
+
+static int  replay_open(void *transport_config);
+static int  replay_close(void *transport_config);
+static int  replay_send_packet(uint8_t packet_type, uint8_t *packet, int size);
+static void replay_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size));
+static const char * replay_get_transport_name(void);
+static void replay_timer_handler(timer_source_t *ts);
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size);
+
+static hci_transport_t hci_transport_replay = {
+    /* .transport.open                          = */  replay_open,
+    /* .transport.close                         = */  replay_close,
+    /* .transport.send_packet                   = */  replay_send_packet,
+    /* .transport.register_packet_handler       = */  replay_register_packet_handler,
+    /* .transport.get_transport_name            = */  replay_get_transport_name,
+    /* .transport.set_baudrate                  = */  NULL,
+    /* .transport.can_send_packet_now           = */  NULL,
+};
+
+static void (*packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size) = dummy_handler;
+static void (*replay_done_handler)(void) = NULL;
+
+static int      replay_format;
+static uint32_t replay_speed;
+
+// log file in memory
+static uint8_t * replay_log;
+static uint32_t  replay_log_size;
+
+// delivery of controller to host packets
+static uint32_t replay_rx_offset;
+static int      replay_rx_waiting;      // for host packet
+static struct timeval replay_first_ts;  // first record
+static struct timeval replay_start;     // replay of first record
+static int      replay_timer_active;
+static timer_source_t replay_timer;
+static int      replay_active;
+
+// validation of host to controller packets, can be ahead of delivery
+static uint32_t replay_tx_offset;
+
+static hci_replay_statistics_t replay_statistics;
+
+static uint8_t hci_packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE + HCI_PACKET_BUFFER_SIZE]; // max(acl header + acl payload, event header + event data)
+static uint8_t * hci_packet = &hci_packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE];
+
+// @returns 0 if ok, -1 at end of log or for truncated records
+static int replay_parse_record(uint32_t offset, replay_record_t * record){
+    if (offset + REPLAY_PKLG_HEADER_SIZE > replay_log_size) return -1;
+    const uint8_t * header = &replay_log[offset];
+    uint32_t len;
+    record->direction = REPLAY_DIRECTION_NONE;
+    record->packet_type = 0;
+    if (replay_format == HCI_DUMP_PACKETLOGGER){
+        // len (ts, type and packet), ts_sec, ts_usec, type - all big endian
+        len = READ_NET_32(header, 0);
+        if (len < REPLAY_PKLG_HEADER_SIZE - 4) return -1;
+        record->ts_sec  = READ_NET_32(header, 4);
+        record->ts_usec = READ_NET_32(header, 8);
+        record->packet  = &header[REPLAY_PKLG_HEADER_SIZE];
+        record->size    = len - (REPLAY_PKLG_HEADER_SIZE - 4);
+        record->next    = offset + 4 + len;
+        switch (header[12]){
+            case 0x00:
+                record->packet_type = HCI_COMMAND_DATA_PACKET;
+                record->direction   = REPLAY_DIRECTION_TO_CONTROLLER;
+                break;
+            case 0x01:
+                record->packet_type = HCI_EVENT_PACKET;
+                record->direction   = REPLAY_DIRECTION_TO_HOST;
+                break;
+            case 0x02:
+                record->packet_type = HCI_ACL_DATA_PACKET;
+                record->direction   = REPLAY_DIRECTION_TO_CONTROLLER;
+                break;
+            case 0x03:
+                record->packet_type = HCI_ACL_DATA_PACKET;
+                record->direction   = REPLAY_DIRECTION_TO_HOST;
+                break;
+            case 0x08:
+                record->packet_type = HCI_SCO_DATA_PACKET;
+                record->direction   = REPLAY_DIRECTION_TO_CONTROLLER;
+                break;
+            case 0x09:
+                record->packet_type = HCI_SCO_DATA_PACKET;
+                record->direction   = REPLAY_DIRECTION_TO_HOST;
+                break;
+            default:
+                // notes, power on/off, ...
+                break;
+        }
+    } else {
+        // len (packet type and packet), in, pad, ts_sec, ts_usec, packet type - all little endian
+        len = READ_BT_16(header, 0);
+        if (len < 1) return -1;
+        record->ts_sec      = READ_BT_32(header, 4);
+        record->ts_usec     = READ_BT_32(header, 8);
+        record->packet_type = header[12];
+        record->packet      = &header[REPLAY_BLUEZ_HEADER_SIZE];
+        record->size        = len - 1;
+        record->next        = offset + REPLAY_BLUEZ_HEADER_SIZE + len - 1;
+        switch (record->packet_type){
+            case HCI_COMMAND_DATA_PACKET:
+                record->direction = REPLAY_DIRECTION_TO_CONTROLLER;
+                break;
+            case HCI_EVENT_PACKET:
+                record->direction = REPLAY_DIRECTION_TO_HOST;
+                break;
+            case HCI_ACL_DATA_PACKET:
+            case HCI_SCO_DATA_PACKET:
+                record->direction = header[2] ? REPLAY_DIRECTION_TO_HOST : REPLAY_DIRECTION_TO_CONTROLLER;
+                break;
+            default:
+                // log messages
+                break;
+        }
+    }
+    if (record->next > replay_log_size){
+        log_error("replay: truncated record at offset %u", offset);
+        return -1;
+    }
+    if (record->packet_type == HCI_EVENT_PACKET && record->size
+    &&  record->packet[0] >= REPLAY_STACK_EVENT_MIN && record->packet[0] != HCI_EVENT_VENDOR_SPECIFIC){
+        record->direction = REPLAY_DIRECTION_NONE;
+    }
+    if (record->direction != REPLAY_DIRECTION_NONE && record->size > HCI_PACKET_BUFFER_SIZE){
+        log_error("replay: packet at offset %u too large (%u bytes), skipped", offset, record->size);
+        record->direction = REPLAY_DIRECTION_NONE;
+    }
+    return 0;
+}
+
+static void replay_set_timer(uint32_t timeout_in_ms){
+    if (replay_timer_active){
+        run_loop_remove_timer(&replay_timer);
+    }
+    run_loop_set_timer_handler(&replay_timer, replay_timer_handler);
+    run_loop_set_timer(&replay_timer, timeout_in_ms);
+    run_loop_add_timer(&replay_timer);
+    replay_timer_active = 1;
+}
+
+static uint32_t replay_time_ms(struct timeval * from, struct timeval * to){
+    int32_t ms = (to->tv_sec - from->tv_sec) * 1000 + ((int32_t) to->tv_usec - (int32_t) from->tv_usec) / 1000;
+    return ms < 0 ? 0 : ms;
+}
+
+static void replay_finish(void){
+    struct timeval now;
+    replay_active = 0;
+    gettimeofday(&now, NULL);
+    replay_statistics.duration_ms = replay_time_ms(&replay_start, &now);
+    replay_statistics.finished = 1;
+    log_info("replay: done, %u events, %u ACL packets, %u host packets, %u mismatches, %u ms",
+        replay_statistics.events, replay_statistics.acl_packets, replay_statistics.host_packets,
+        replay_statistics.host_mismatches, replay_statistics.duration_ms);
+    if (replay_done_handler){
+        (*replay_done_handler)();
+    }
+}
+
+// @returns ms until record is due, 0 if due now
+static uint32_t replay_record_due_in_ms(replay_record_t * record){
+    if (!replay_speed) return 0;
+    struct timeval ts;
+    struct timeval now;
+    ts.tv_sec  = record->ts_sec;
+    ts.tv_usec = record->ts_usec;
+    uint32_t offset_ms = replay_time_ms(&replay_first_ts, &ts) / replay_speed;
+    gettimeofday(&now, NULL);
+    uint32_t elapsed_ms = replay_time_ms(&replay_start, &now);
+    return offset_ms > elapsed_ms ? offset_ms - elapsed_ms : 0;
+}
+
+static void replay_deliver(void){
+    replay_record_t record;
+    int batch = 0;
+    while (replay_active){
+        if (replay_parse_record(replay_rx_offset, &record) < 0){
+            replay_finish();
+            return;
+        }
+        if (record.direction == REPLAY_DIRECTION_TO_CONTROLLER){
+            // already sent by host?
+            if (replay_tx_offset > replay_rx_offset){
+                replay_rx_offset = record.next;
+                continue;
+            }
+            // wait for host
+            replay_rx_waiting = 1;
+            replay_set_timer(REPLAY_HOST_TIMEOUT_MS);
+            return;
+        }
+        if (record.direction == REPLAY_DIRECTION_NONE){
+            replay_rx_offset = record.next;
+            continue;
+        }
+        uint32_t due_in_ms = replay_record_due_in_ms(&record);
+        if (due_in_ms || batch == REPLAY_BATCH_SIZE){
+            replay_set_timer(due_in_ms);
+            return;
+        }
+        batch++;
+        replay_rx_offset = record.next;
+        switch (record.packet_type){
+            case HCI_EVENT_PACKET:
+                replay_statistics.events++;
+                break;
+            case HCI_ACL_DATA_PACKET:
+                replay_statistics.acl_packets++;
+                replay_statistics.acl_bytes += record.size;
+                break;
+            default:
+                replay_statistics.sco_packets++;
+                break;
+        }
+        // copy into buffer with pre-buffer, stack may modify packet
+        memcpy(hci_packet, record.packet, record.size);
+        packet_handler(record.packet_type, hci_packet, record.size);
+    }
+}
+
+static void replay_timer_handler(timer_source_t *ts){
+    replay_timer_active = 0;
+    if (replay_rx_waiting){
+        // host didn't send recorded packet
+        replay_rx_waiting = 0;
+        replay_statistics.host_missing++;
+        log_error("replay: host packet recorded at offset %u not sent", replay_rx_offset);
+        replay_record_t record;
+        replay_parse_record(replay_rx_offset, &record);
+        replay_rx_offset = record.next;
+        if (replay_tx_offset < replay_rx_offset){
+            replay_tx_offset = replay_rx_offset;
+        }
+    }
+    replay_deliver();
+}
+
+// continue delivery from run loop, not from within send_packet
+static void replay_schedule(void){
+    replay_set_timer(0);
+}
+
+static int replay_open(void *transport_config){
+    hci_replay_config_t * config = (hci_replay_config_t *) transport_config;
+    if (!config || !config->path) return -1;
+    if (config->format != HCI_DUMP_PACKETLOGGER && config->format != HCI_DUMP_BLUEZ){
+        log_error("replay: unsupported format %u", config->format);
+        return -1;
+    }
+
+    // read complete log to keep file I/O out of the measurement
+    int fd = open(config->path, O_RDONLY);
+    if (fd < 0){
+        log_error("replay: cannot open %s", config->path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0){
+        close(fd);
+        return -1;
+    }
+    replay_log = (uint8_t *) malloc(st.st_size);
+    if (!replay_log){
+        close(fd);
+        return -1;
+    }
+    replay_log_size = 0;
+    while (replay_log_size < st.st_size){
+        ssize_t bytes_read = read(fd, &replay_log[replay_log_size], st.st_size - replay_log_size);
+        if (bytes_read <= 0) break;
+        replay_log_size += bytes_read;
+    }
+    close(fd);
+
+    replay_format = config->format;
+    replay_speed  = config->speed;
+    replay_rx_offset = 0;
+    replay_tx_offset = 0;
+    replay_rx_waiting = 0;
+    replay_timer_active = 0;
+    memset(&replay_statistics, 0, sizeof(replay_statistics));
+
+    replay_record_t record;
+    if (replay_parse_record(0, &record) == 0){
+        replay_first_ts.tv_sec  = record.ts_sec;
+        replay_first_ts.tv_usec = record.ts_usec;
+    }
+    gettimeofday(&replay_start, NULL);
+    replay_active = 1;
+    replay_schedule();
+    log_info("replay: %s, %u bytes, speed %u", config->path, replay_log_size, replay_speed);
+    return 0;
+}
+
+static int replay_close(void *transport_config){
+    replay_active = 0;
+    if (replay_timer_active){
+        run_loop_remove_timer(&replay_timer);
+        replay_timer_active = 0;
+    }
+    free(replay_log);
+    replay_log = NULL;
+    replay_log_size = 0;
+    return 0;
+}
+
+static int replay_send_packet(uint8_t packet_type, uint8_t *packet, int size){
+    if (!replay_active) return 0;
+    replay_statistics.host_packets++;
+
+    // find next recorded host packet
+    replay_record_t record;
+    while (1){
+        if (replay_parse_record(replay_tx_offset, &record) < 0){
+            replay_statistics.host_mismatches++;
+            log_error("replay: unexpected host packet type %u after end of log", packet_type);
+            return 0;
+        }
+        if (record.direction == REPLAY_DIRECTION_TO_CONTROLLER) break;
+        replay_tx_offset = record.next;
+    }
+    if (record.packet_type != packet_type || record.size != size || memcmp(record.packet, packet, size)){
+        replay_statistics.host_mismatches++;
+        log_error("replay: host packet type %u, size %u differs from log at offset %u", packet_type, size, replay_tx_offset);
+    }
+    replay_tx_offset = record.next;
+
+    if (replay_rx_waiting && replay_tx_offset > replay_rx_offset){
+        replay_rx_waiting = 0;
+        replay_schedule();
+    }
+    return 0;
+}
+
+static void replay_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    packet_handler = handler;
+}
+
+static const char * replay_get_transport_name(void){
+    return "replay";
+}
+
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+}
+
+void hci_transport_replay_register_done_handler(void (*handler)(void)){
+    replay_done_handler = handler;
+}
+
+void hci_transport_replay_get_statistics(hci_replay_statistics_t * statistics){
+    *statistics = replay_statistics;
+}
+
+// get replay singleton
+hci_transport_t * hci_transport_replay_instance(void){
+    return &hci_transport_replay;
+}
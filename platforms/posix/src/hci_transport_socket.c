@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  hci_transport_socket.c
+ *
+ *  HCI Transport API implementation for H4 framing over a stream socket
+ *
+ *  Connects to a controller emulator or controller proxy via a UNIX domain
+ *  socket (hci_socket_config_t.path) or TCP (hci_socket_config_t.host/port).
+ *  Incoming data is read in chunks and split into HCI packets, outgoing
+ *  packets are written with a single sendmsg() and queued if the socket
+ *  cannot take them at once.
+ *
+ *  If the connection is lost, a Hardware Error event is emitted, which
+ *  lets HCI restart the stack and reconnect.
+ */
+
+#include "btstack-config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "debug.h"
+#include "hci.h"
+#include "hci_transport.h"
+
+typedef enum {
+    SOCKET_W4_PACKET_TYPE,
+    SOCKET_W4_EVENT_HEADER,
+    SOCKET_W4_ACL_HEADER,
+    SOCKET_W4_SCO_HEADER,
+    SOCKET_W4_PAYLOAD,
+} SOCKET_STATE;
+
+// retry interval if run loop doesn't support write notifications
+#define SOCKET_TX_RETRY_INTERVAL_MS 1
+
+// max number of bytes read with a single read()
+#ifndef SOCKET_RX_CHUNK_SIZE
+#define SOCKET_RX_CHUNK_SIZE 4096
+#endif
+
+static int  socket_open(void *transport_config);
+static int  socket_close(void *transport_config);
+static int  socket_send_packet(uint8_t packet_type, uint8_t * packet, int size);
+static void socket_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size));
+static const char * socket_get_transport_name(void);
+static int  socket_can_send_packet_now(uint8_t packet_type);
+static int  socket_process(struct data_source *ds);
+static void socket_tx_timer_handler(timer_source_t *ts);
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size);
+
+static hci_transport_t hci_transport_socket = {
+    /* .transport.open                          = */  socket_open,
+    /* .transport.close                         = */  socket_close,
+    /* .transport.send_packet                   = */  socket_send_packet,
+    /* .transport.register_packet_handler       = */  socket_register_packet_handler,
+    /* .transport.get_transport_name            = */  socket_get_transport_name,
+    /* .transport.set_baudrate                  = */  NULL,
+    /* .transport.can_send_packet_now           = */  socket_can_send_packet_now,
+};
+
+static void (*packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size) = dummy_handler;
+
+static data_source_t socket_ds;
+static int socket_fd = -1;
+
+// packet reader state machine
+static SOCKET_STATE socket_state;
+static int bytes_to_read;
+static int read_pos;
+
+static uint8_t hci_packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE + 1 + HCI_PACKET_BUFFER_SIZE]; // packet type + max(acl header + acl payload, event header + event data)
+static uint8_t * hci_packet = &hci_packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE];
+
+static uint8_t socket_rx_chunk[SOCKET_RX_CHUNK_SIZE];
+
+// outgoing queue: remainder of a packet that could not be written at once
+static uint8_t socket_tx_buffer[1 + HCI_PACKET_BUFFER_SIZE]; // packet type + max(acl header + acl payload, cmd header + cmd data)
+static int     socket_tx_len;
+static int     socket_tx_pos;
+static int     socket_tx_packet_sent_pending;  // emit DAEMON_EVENT_HCI_PACKET_SENT from run loop
+static timer_source_t socket_tx_timer;
+static int     socket_tx_timer_active;
+
+static void socket_rx_reset(void){
+    socket_state = SOCKET_W4_PACKET_TYPE;
+    read_pos = 0;
+    bytes_to_read = 1;
+}
+
+static void socket_tx_reset(void){
+    socket_tx_len = 0;
+    socket_tx_pos = 0;
+    socket_tx_packet_sent_pending = 0;
+}
+
+static int socket_connect_unix(const char * path){
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        log_error("socket_open: path too long: %s", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int socket_connect_tcp(const char * host, uint16_t port){
+    struct addrinfo hints;
+    struct addrinfo * result;
+    struct addrinfo * it;
+    char service[6];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host ? host : "localhost", service, &hints, &result)) return -1;
+    for (it = result; it; it = it->ai_next){
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, it->ai_addr, it->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) return -1;
+
+    // HCI packets are small, don't wait for more data
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+static int socket_open(void *transport_config){
+    hci_socket_config_t * config = (hci_socket_config_t *) transport_config;
+    if (!config) return -1;
+
+    int fd;
+    if (config->path){
+        fd = socket_connect_unix(config->path);
+    } else {
+        fd = socket_connect_tcp(config->host, config->port);
+    }
+    if (fd < 0){
+        log_error("socket_open: could not connect to %s:%u, errno %d", config->path ? config->path : config->host, config->port, errno);
+        return -1;
+    }
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    socket_fd = fd;
+    socket_ds.fd = fd;
+    socket_ds.process = socket_process;
+    run_loop_add_data_source(&socket_ds);
+
+    socket_rx_reset();
+    socket_tx_reset();
+    socket_tx_timer_active = 0;
+    return 0;
+}
+
+static int socket_close(void *transport_config){
+    if (socket_tx_timer_active){
+        run_loop_remove_timer(&socket_tx_timer);
+        socket_tx_timer_active = 0;
+    }
+    socket_tx_reset();
+    if (socket_fd < 0) return 0;
+    run_loop_remove_data_source(&socket_ds);
+    close(socket_fd);
+    socket_fd = -1;
+    return 0;
+}
+
+// connection closed by peer or broken: let HCI restart the stack
+static void socket_connection_lost(void){
+    log_error("socket: connection lost");
+    socket_close(NULL);
+    uint8_t event[] = { HCI_EVENT_HARDWARE_ERROR, 1, 0};
+    packet_handler(HCI_EVENT_PACKET, &event[0], sizeof(event));
+}
+
+static int socket_tx_pending(void){
+    return socket_tx_len || socket_tx_packet_sent_pending;
+}
+
+// request socket_process/socket_tx_timer_handler to get called when the socket can accept more data
+static void socket_tx_request_callback(void){
+    if (run_loop_enable_data_source_write(&socket_ds, 1)) return;
+    // fallback: poll with timer
+    if (socket_tx_timer_active) return;
+    run_loop_set_timer_handler(&socket_tx_timer, socket_tx_timer_handler);
+    run_loop_set_timer(&socket_tx_timer, SOCKET_TX_RETRY_INTERVAL_MS);
+    run_loop_add_timer(&socket_tx_timer);
+    socket_tx_timer_active = 1;
+}
+
+static ssize_t socket_write(struct iovec * iov, int iovcnt){
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = iovcnt;
+#ifdef MSG_NOSIGNAL
+    return sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+#else
+    return sendmsg(socket_fd, &msg, 0);
+#endif
+}
+
+// write queued packet. @returns 0 if done, 1 if more data is pending, -1 on error
+static int socket_tx_flush(void){
+    while (socket_tx_pos < socket_tx_len){
+        struct iovec iov;
+        iov.iov_base = &socket_tx_buffer[socket_tx_pos];
+        iov.iov_len  = socket_tx_len - socket_tx_pos;
+        ssize_t bytes_written = socket_write(&iov, 1);
+        if (bytes_written < 0){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_error("socket_tx_flush: write failed, errno %d", errno);
+            return -1;
+        }
+        socket_tx_pos += bytes_written;
+    }
+    if (socket_tx_len){
+        socket_tx_len = 0;
+        socket_tx_pos = 0;
+        socket_tx_packet_sent_pending = 1;
+    }
+    return 0;
+}
+
+// process outgoing queue, called from run loop. @returns -1 if connection was lost
+static int socket_tx_process(void){
+    if (!socket_tx_pending()) return 0;
+
+    if (socket_tx_flush() < 0){
+        socket_connection_lost();
+        return -1;
+    }
+
+    if (!socket_tx_len){
+        // all data written: stop write notifications
+        run_loop_enable_data_source_write(&socket_ds, 0);
+    }
+
+    if (!socket_tx_packet_sent_pending) return 0;
+    socket_tx_packet_sent_pending = 0;
+
+    // notify upper stack that it can send again
+    uint8_t event[] = { DAEMON_EVENT_HCI_PACKET_SENT, 0};
+    packet_handler(HCI_EVENT_PACKET, &event[0], sizeof(event));
+    return 0;
+}
+
+static void socket_tx_timer_handler(timer_source_t *ts){
+    socket_tx_timer_active = 0;
+    if (socket_tx_process() < 0) return;
+    if (socket_tx_pending()){
+        socket_tx_request_callback();
+    }
+}
+
+static int socket_can_send_packet_now(uint8_t packet_type){
+    return socket_tx_len == 0;
+}
+
+static int socket_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    if (socket_fd < 0) return -1;
+
+    if (socket_tx_len){
+        log_error("socket_send_packet: outgoing queue busy, dropping packet type %u", packet_type);
+        return -1;
+    }
+
+    // write packet type and packet with a single syscall
+    struct iovec iov[2];
+    iov[0].iov_base = &packet_type;
+    iov[0].iov_len  = 1;
+    iov[1].iov_base = packet;
+    iov[1].iov_len  = size;
+    ssize_t bytes_written = socket_write(iov, 2);
+    if (bytes_written < 0){
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            log_error("socket_send_packet: sendmsg failed, errno %d", errno);
+            return -1;
+        }
+        bytes_written = 0;
+    }
+
+    // queue remainder
+    if (bytes_written < 1 + size){
+        int pos = 0;
+        if (bytes_written == 0){
+            socket_tx_buffer[pos++] = packet_type;
+            bytes_written = 1;
+        }
+        memcpy(&socket_tx_buffer[pos], &packet[bytes_written - 1], 1 + size - bytes_written);
+        socket_tx_len = pos + 1 + size - bytes_written;
+        socket_tx_pos = 0;
+    }
+
+    // packet buffer is not used anymore, but HCI expects DAEMON_EVENT_HCI_PACKET_SENT outside of send_packet
+    socket_tx_packet_sent_pending = 1;
+    socket_tx_request_callback();
+    return 0;
+}
+
+static void socket_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    packet_handler = handler;
+}
+
+// @returns -1 if packet doesn't fit into buffer
+static int socket_statemachine(void){
+    switch (socket_state) {
+
+        case SOCKET_W4_PACKET_TYPE:
+            if (hci_packet[0] == HCI_EVENT_PACKET){
+                bytes_to_read = HCI_EVENT_HEADER_SIZE;
+                socket_state = SOCKET_W4_EVENT_HEADER;
+            } else if (hci_packet[0] == HCI_ACL_DATA_PACKET){
+                bytes_to_read = HCI_ACL_HEADER_SIZE;
+                socket_state = SOCKET_W4_ACL_HEADER;
+            } else if (hci_packet[0] == HCI_SCO_DATA_PACKET){
+                bytes_to_read = HCI_SCO_HEADER_SIZE;
+                socket_state = SOCKET_W4_SCO_HEADER;
+            } else {
+                log_error("socket_process: invalid packet type 0x%02x", hci_packet[0]);
+                return -1;
+            }
+            break;
+
+        case SOCKET_W4_EVENT_HEADER:
+            bytes_to_read = hci_packet[2];
+            socket_state = SOCKET_W4_PAYLOAD;
+            break;
+
+        case SOCKET_W4_ACL_HEADER:
+            bytes_to_read = READ_BT_16( hci_packet, 3);
+            socket_state = SOCKET_W4_PAYLOAD;
+            break;
+
+        case SOCKET_W4_SCO_HEADER:
+            bytes_to_read = hci_packet[3];
+            socket_state = SOCKET_W4_PAYLOAD;
+            break;
+
+        case SOCKET_W4_PAYLOAD:
+            packet_handler(hci_packet[0], &hci_packet[1], read_pos-1);
+            socket_rx_reset();
+            return 0;
+
+        default:
+            break;
+    }
+    if (read_pos + bytes_to_read > 1 + HCI_PACKET_BUFFER_SIZE){
+        log_error("socket_process: packet too large (%u bytes)", read_pos + bytes_to_read);
+        return -1;
+    }
+    // empty payload
+    if (bytes_to_read == 0){
+        return socket_statemachine();
+    }
+    return 0;
+}
+
+static int socket_process(struct data_source *ds) {
+    if (socket_fd < 0) return -1;
+
+    // called for writable fd, too
+    if (socket_tx_process() < 0) return -1;
+
+    ssize_t bytes_read = read(socket_fd, socket_rx_chunk, sizeof(socket_rx_chunk));
+    if (bytes_read == 0){
+        socket_connection_lost();
+        return -1;
+    }
+    if (bytes_read < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        log_error("socket_process: read failed, errno %d", errno);
+        socket_connection_lost();
+        return -1;
+    }
+
+    // split chunk into packets
+    int pos = 0;
+    while (pos < bytes_read){
+        int len = bytes_read - pos;
+        if (len > bytes_to_read){
+            len = bytes_to_read;
+        }
+        memcpy(&hci_packet[read_pos], &socket_rx_chunk[pos], len);
+        pos           += len;
+        read_pos      += len;
+        bytes_to_read -= len;
+        if (bytes_to_read > 0) break;
+        if (socket_statemachine() < 0){
+            // framing lost
+            socket_connection_lost();
+            return -1;
+        }
+        // transport closed by packet handler
+        if (socket_fd < 0) return 0;
+    }
+    return 0;
+}
+
+static const char * socket_get_transport_name(void){
+    return "socket";
+}
+
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+}
+
+// get socket singleton
+hci_transport_t * hci_transport_socket_instance(void){
+    return &hci_transport_socket;
+}
@@ -0,0 +1,1851 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+
+/*
+ *  hci_transport_virtual.c
+ *
+ *  Software Bluetooth Controller exposed as HCI Transport
+ *
+ *  Implements the subset of HCI used by BTstack without any hardware:
+ *  - init: reset, version, features, supported commands, buffer sizes, name, class of device, scan enable
+ *  - BR/EDR: inquiry, remote name request, page/accept/reject, disconnect, authentication, encryption
+ *  - LE: advertising, scanning, create connection/cancel, white list, connection update, encryption,
+ *        LE Encrypt and LE Rand
+ *  - ACL data with configurable buffer count/size and Number Of Completed Packets flow control
+ *
+ *  Two virtual controllers talk to each other over a stream socket ("air interface"), e.g. a
+ *  socket pair created by hci_transport_virtual_link(). As the BTstack core is a singleton,
+ *  each of the two stacks runs in its own process, e.g. after fork().
+ *
+ *  A packet sent by the host counts as completed as soon as it was handed to the socket,
+ *  so the throughput is only limited by the host stacks. Random numbers are derived from
+ *  the BD_ADDR to make test runs reproducible.
+ */
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "hci.h"
+#include "hci_transport.h"
+
+// default buffer configuration, used if the field in hci_virtual_config_t is 0
+#ifndef VIRTUAL_ACL_DATA_PACKET_LENGTH
+#define VIRTUAL_ACL_DATA_PACKET_LENGTH 1021
+#endif
+#ifndef VIRTUAL_ACL_NUM_PACKETS
+#define VIRTUAL_ACL_NUM_PACKETS 8
+#endif
+#ifndef VIRTUAL_LE_DATA_PACKET_LENGTH
+#define VIRTUAL_LE_DATA_PACKET_LENGTH 27
+#endif
+#ifndef VIRTUAL_LE_NUM_PACKETS
+#define VIRTUAL_LE_NUM_PACKETS 8
+#endif
+
+// packets queued for the host, delivered from the run loop
+#ifndef VIRTUAL_HOST_QUEUE_LEN
+#define VIRTUAL_HOST_QUEUE_LEN 16
+#endif
+
+#define VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH 1021
+#define VIRTUAL_MAX_ACL_PACKETS 32
+#define VIRTUAL_WHITE_LIST_SIZE 4
+
+// don't process incoming air frames if less slots are free, keeps room for command responses
+#define VIRTUAL_HOST_QUEUE_RESERVE 4
+
+#define VIRTUAL_HOST_PACKET_SIZE (HCI_ACL_HEADER_SIZE + VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH)
+
+// air interface frame: opcode (8), payload len (16), payload
+#define VIRTUAL_LINK_HEADER_SIZE 3
+#define VIRTUAL_LINK_MAX_FRAME_SIZE (VIRTUAL_LINK_HEADER_SIZE + 2 + VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH)
+#define VIRTUAL_LINK_RX_BUFFER_SIZE (4 * VIRTUAL_LINK_MAX_FRAME_SIZE)
+// all ACL buffers + room for control frames
+#define VIRTUAL_LINK_TX_BUFFER_SIZE (2 * VIRTUAL_MAX_ACL_PACKETS * VIRTUAL_LINK_MAX_FRAME_SIZE + 4096)
+
+#define VIRTUAL_TX_RETRY_INTERVAL_MS 1
+#define VIRTUAL_ADV_INTERVAL_MIN_MS 20
+
+#define VIRTUAL_HANDLE_CLASSIC 0x0001
+#define VIRTUAL_HANDLE_LE      0x0040
+
+#define VIRTUAL_NAME_LEN 248
+
+// air interface frames
+typedef enum {
+    LINK_INQUIRY = 1,               // -
+    LINK_INQUIRY_RESPONSE,          // addr(48), class of device(24)
+    LINK_NAME_REQUEST,              // addr(48)
+    LINK_NAME_RESPONSE,             // status(8), addr(48), name(248 bytes)
+    LINK_PAGE,                      // target addr(48), initiator addr(48), class of device(24), features(64)
+    LINK_PAGE_RESPONSE,             // status(8), features(64)
+    LINK_ACL,                       // link(8), packet boundary flags(8), data
+    LINK_DISCONNECT,                // link(8), reason(8)
+    LINK_AUTHENTICATION,            // link key(128)
+    LINK_ENCRYPTION,                // link(8), status(8), enabled(8)
+    LINK_ADVERTISEMENT,             // adv type(8), addr type(8), addr(48), adv len(8), adv data, scan response len(8), scan response data
+    LINK_LE_CONNECT,                // target addr type(8), target addr(48), initiator addr type(8), initiator addr(48), interval(16), latency(16), timeout(16)
+    LINK_LE_CONNECT_RESPONSE,       // status(8)
+    LINK_LE_CONNECTION_UPDATE,      // interval(16), latency(16), timeout(16)
+    LINK_LE_START_ENCRYPTION,       // rand(64), ediv(16)
+    LINK_LE_LTK_REPLY,              // status(8), ltk(128)
+} virtual_link_opcode_t;
+
+typedef enum {
+    VIRTUAL_LINK_CLASSIC = 0,
+    VIRTUAL_LINK_LE,
+    VIRTUAL_NUM_LINKS
+} virtual_link_type_t;
+
+typedef enum {
+    VIRTUAL_LINK_STATE_CLOSED = 0,
+    VIRTUAL_LINK_STATE_W4_PAGE_RESPONSE,
+    VIRTUAL_LINK_STATE_W4_ACCEPT,
+    VIRTUAL_LINK_STATE_W4_ADVERTISEMENT,
+    VIRTUAL_LINK_STATE_W4_CONNECT_RESPONSE,
+    VIRTUAL_LINK_STATE_OPEN,
+} virtual_link_state_t;
+
+typedef struct {
+    virtual_link_state_t state;
+    hci_con_handle_t handle;
+    uint16_t  max_packet_length;
+    uint8_t   generation;               // invalidates completion marks of previous connections
+    uint16_t  completed_packets;        // not reported yet
+    bd_addr_t peer_addr;
+    uint8_t   peer_addr_type;
+    uint8_t   peer_features[8];
+    uint8_t   encrypted;
+    uint8_t   authentication_pending;
+    // LE
+    uint8_t   role;
+    uint8_t   filter_policy;
+    uint8_t   own_addr_type;
+    uint16_t  conn_interval;
+    uint16_t  conn_latency;
+    uint16_t  supervision_timeout;
+    uint8_t   ltk[16];
+} virtual_link_t;
+
+typedef struct {
+    uint8_t  packet_type;
+    uint16_t size;
+    uint8_t  packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE + VIRTUAL_HOST_PACKET_SIZE];   // BNEP may restore the ethernet header in front of the packet
+} virtual_host_packet_t;
+
+typedef struct {
+    uint32_t end;                       // tx byte counter after the packet has been written
+    uint8_t  link;
+    uint8_t  generation;
+} virtual_completion_mark_t;
+
+typedef struct {
+    uint8_t   addr_type;
+    bd_addr_t addr;
+} virtual_white_list_entry_t;
+
+// prototypes
+static int  virtual_open(void *transport_config);
+static int  virtual_close(void *transport_config);
+static int  virtual_send_packet(uint8_t packet_type, uint8_t *packet, int size);
+static void virtual_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size));
+static const char * virtual_get_transport_name(void);
+static void virtual_host_deliver_handler(timer_source_t * ts);
+static void virtual_link_tx_flush(void);
+static void virtual_link_rx_parse(void);
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size);
+
+static hci_transport_t hci_transport_virtual = {
+    /* .transport.open                          = */  virtual_open,
+    /* .transport.close                         = */  virtual_close,
+    /* .transport.send_packet                   = */  virtual_send_packet,
+    /* .transport.register_packet_handler       = */  virtual_register_packet_handler,
+    /* .transport.get_transport_name            = */  virtual_get_transport_name,
+    /* .transport.set_baudrate                  = */  NULL,
+    /* .transport.can_send_packet_now           = */  NULL,
+};
+
+static void (*packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size) = dummy_handler;
+
+static int virtual_is_open;
+
+// configuration
+static int       virtual_link_fd = -1;
+static bd_addr_t virtual_bd_addr;
+static uint16_t  virtual_acl_data_packet_length;
+static uint16_t  virtual_acl_num_packets;
+static uint16_t  virtual_le_data_packet_length;
+static uint8_t   virtual_le_num_packets;
+static uint16_t  virtual_acl_drop_interval;
+
+// lossy link simulation
+static uint32_t  virtual_acl_drop_counter;
+static int       virtual_acl_dropping;
+
+// host queue
+static virtual_host_packet_t virtual_host_queue[VIRTUAL_HOST_QUEUE_LEN];
+static int  virtual_host_queue_head;
+static int  virtual_host_queue_count;
+static int  virtual_host_deliver_scheduled;
+static int  virtual_host_delivering;
+static timer_source_t virtual_host_deliver_timer;
+
+// air interface
+static data_source_t virtual_link_ds;
+static uint8_t  virtual_link_rx_buffer[VIRTUAL_LINK_RX_BUFFER_SIZE];
+static uint16_t virtual_link_rx_len;
+static uint8_t  virtual_link_tx_buffer[VIRTUAL_LINK_TX_BUFFER_SIZE];
+static uint32_t virtual_link_tx_len;
+static uint32_t virtual_link_tx_pos;
+static uint32_t virtual_link_tx_total_queued;
+static uint32_t virtual_link_tx_total_written;
+static int      virtual_link_tx_timer_active;
+static timer_source_t virtual_link_tx_timer;
+static virtual_completion_mark_t virtual_completion_marks[2 * VIRTUAL_MAX_ACL_PACKETS];
+static int virtual_completion_marks_head;
+static int virtual_completion_marks_count;
+
+// controller state
+static virtual_link_t virtual_links[VIRTUAL_NUM_LINKS];
+static uint32_t virtual_random_state;
+static uint8_t  virtual_scan_enable;
+static uint8_t  virtual_class_of_device[3];
+static uint8_t  virtual_local_name[VIRTUAL_NAME_LEN];
+
+static int      virtual_inquiry_active;
+static uint8_t  virtual_inquiry_max_responses;
+static uint8_t  virtual_inquiry_num_responses;
+static timer_source_t virtual_inquiry_timer;
+
+static int       virtual_name_request_active;
+static bd_addr_t virtual_name_request_addr;
+
+static bd_addr_t virtual_le_random_addr;
+static uint16_t  virtual_adv_interval_min;
+static uint8_t   virtual_adv_type;
+static uint8_t   virtual_adv_own_addr_type;
+static uint8_t   virtual_adv_data_len;
+static uint8_t   virtual_adv_data[LE_ADVERTISING_DATA_SIZE];
+static uint8_t   virtual_scan_response_data_len;
+static uint8_t   virtual_scan_response_data[LE_ADVERTISING_DATA_SIZE];
+static int       virtual_adv_enabled;
+static timer_source_t virtual_adv_timer;
+
+static uint8_t   virtual_le_scan_type;
+static int       virtual_le_scan_enabled;
+static uint8_t   virtual_le_scan_filter_duplicates;
+static uint8_t   virtual_le_scan_reported_adv;
+static uint8_t   virtual_le_scan_reported_scan_response;
+
+static virtual_white_list_entry_t virtual_white_list[VIRTUAL_WHITE_LIST_SIZE];
+static int virtual_white_list_count;
+
+// 3-slot, 5-slot, encryption / LE supported (controller) / secure simple pairing
+static const uint8_t virtual_local_features[8] = { 0x07, 0x00, 0x00, 0x00, 0x40, 0x00, 0x08, 0x00 };
+
+// LE encryption
+static const uint8_t virtual_le_features[8] = { 0x01, 0, 0, 0, 0, 0, 0, 0 };
+
+static const uint8_t virtual_aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t virtual_aes_xtime(uint8_t x){
+    return (x << 1) ^ ((x & 0x80) ? 0x1b : 0x00);
+}
+
+// AES-128, big endian key, plaintext and ciphertext as used by the Security Manager
+static void virtual_aes128_encrypt(const uint8_t key[16], const uint8_t plaintext[16], uint8_t ciphertext[16]){
+    uint8_t round_key[16];
+    uint8_t state[16];
+    uint8_t tmp[16];
+    uint8_t rcon = 1;
+    int round, i, c, r;
+    memcpy(round_key, key, 16);
+    for (i=0;i<16;i++){
+        state[i] = plaintext[i] ^ round_key[i];
+    }
+    for (round = 1; round <= 10; round++){
+        // key schedule
+        uint8_t t0 = virtual_aes_sbox[round_key[13]] ^ rcon;
+        uint8_t t1 = virtual_aes_sbox[round_key[14]];
+        uint8_t t2 = virtual_aes_sbox[round_key[15]];
+        uint8_t t3 = virtual_aes_sbox[round_key[12]];
+        rcon = virtual_aes_xtime(rcon);
+        round_key[0] ^= t0;
+        round_key[1] ^= t1;
+        round_key[2] ^= t2;
+        round_key[3] ^= t3;
+        for (i=4;i<16;i++){
+            round_key[i] ^= round_key[i-4];
+        }
+        // sub bytes + shift rows, state is stored column by column
+        for (c=0;c<4;c++){
+            for (r=0;r<4;r++){
+                tmp[c*4 + r] = virtual_aes_sbox[state[((c + r) & 3) * 4 + r]];
+            }
+        }
+        // mix columns, not in last round
+        if (round < 10){
+            for (c=0;c<4;c++){
+                uint8_t a0 = tmp[c*4];
+                uint8_t a1 = tmp[c*4+1];
+                uint8_t a2 = tmp[c*4+2];
+                uint8_t a3 = tmp[c*4+3];
+                uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                tmp[c*4]   = a0 ^ all ^ virtual_aes_xtime(a0 ^ a1);
+                tmp[c*4+1] = a1 ^ all ^ virtual_aes_xtime(a1 ^ a2);
+                tmp[c*4+2] = a2 ^ all ^ virtual_aes_xtime(a2 ^ a3);
+                tmp[c*4+3] = a3 ^ all ^ virtual_aes_xtime(a3 ^ a0);
+            }
+        }
+        for (i=0;i<16;i++){
+            state[i] = tmp[i] ^ round_key[i];
+        }
+    }
+    memcpy(ciphertext, state, 16);
+}
+
+// xorshift, seeded by BD_ADDR
+static uint32_t virtual_random(void){
+    uint32_t x = virtual_random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    virtual_random_state = x;
+    return x;
+}
+
+static virtual_link_t * virtual_link_for_handle(uint16_t handle){
+    int i;
+    for (i=0;i<VIRTUAL_NUM_LINKS;i++){
+        if (virtual_links[i].state != VIRTUAL_LINK_STATE_OPEN) continue;
+        if (virtual_links[i].handle != handle) continue;
+        return &virtual_links[i];
+    }
+    return NULL;
+}
+
+static uint8_t * virtual_le_own_addr(uint8_t own_addr_type){
+    return own_addr_type ? virtual_le_random_addr : virtual_bd_addr;
+}
+
+//
+// host queue
+//
+
+static void virtual_host_schedule_delivery(void){
+    if (virtual_host_deliver_scheduled || virtual_host_delivering) return;
+    run_loop_set_timer_handler(&virtual_host_deliver_timer, virtual_host_deliver_handler);
+    run_loop_set_timer(&virtual_host_deliver_timer, 0);
+    run_loop_add_timer(&virtual_host_deliver_timer);
+    virtual_host_deliver_scheduled = 1;
+}
+
+static int virtual_host_queue_free(void){
+    // one slot is kept for the packet that is currently delivered
+    return VIRTUAL_HOST_QUEUE_LEN - 1 - virtual_host_queue_count;
+}
+
+static uint8_t * virtual_host_queue_reserve(uint8_t packet_type, uint16_t size){
+    if (virtual_host_queue_free() <= 0){
+        log_error("virtual: host queue full, dropping packet type %u", packet_type);
+        return NULL;
+    }
+    virtual_host_packet_t * slot = &virtual_host_queue[(virtual_host_queue_head + virtual_host_queue_count) % VIRTUAL_HOST_QUEUE_LEN];
+    virtual_host_queue_count++;
+    slot->packet_type = packet_type;
+    slot->size = size;
+    virtual_host_schedule_delivery();
+    return &slot->packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE];
+}
+
+static void virtual_emit_event(uint8_t * event, uint16_t size){
+    uint8_t * packet = virtual_host_queue_reserve(HCI_EVENT_PACKET, size);
+    if (!packet) return;
+    memcpy(packet, event, size);
+}
+
+static void virtual_emit_command_complete(uint16_t opcode, const uint8_t * params, uint8_t params_len){
+    uint8_t event[HCI_EVENT_BUFFER_SIZE];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = 3 + params_len;
+    event[2] = 1;   // num hci command packets
+    bt_store_16(event, 3, opcode);
+    memcpy(&event[5], params, params_len);
+    virtual_emit_event(event, 5 + params_len);
+}
+
+static void virtual_emit_command_complete_status(uint16_t opcode, uint8_t status){
+    virtual_emit_command_complete(opcode, &status, 1);
+}
+
+// status + addr, used by all pairing replies
+static void virtual_emit_command_complete_addr(uint16_t opcode, uint8_t status, uint8_t * flipped_addr){
+    uint8_t params[7];
+    params[0] = status;
+    memcpy(&params[1], flipped_addr, 6);
+    virtual_emit_command_complete(opcode, params, sizeof(params));
+}
+
+static void virtual_emit_command_complete_handle(uint16_t opcode, uint8_t status, uint16_t handle){
+    uint8_t params[3];
+    params[0] = status;
+    bt_store_16(params, 1, handle);
+    virtual_emit_command_complete(opcode, params, sizeof(params));
+}
+
+static void virtual_emit_command_status(uint16_t opcode, uint8_t status){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_COMMAND_STATUS;
+    event[1] = sizeof(event) - 2;
+    event[2] = status;
+    event[3] = 1;   // num hci command packets
+    bt_store_16(event, 4, opcode);
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_connection_complete(uint8_t status, virtual_link_t * link){
+    uint8_t event[13];
+    event[0] = HCI_EVENT_CONNECTION_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    event[2] = status;
+    bt_store_16(event, 3, link->handle);
+    bt_flip_addr(&event[5], link->peer_addr);
+    event[11] = 1;  // ACL
+    event[12] = 0;  // encryption disabled
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_disconnection_complete(uint16_t handle, uint8_t reason){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_DISCONNECTION_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    event[2] = 0;
+    bt_store_16(event, 3, handle);
+    event[5] = reason;
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_encryption_change(uint8_t status, uint16_t handle, uint8_t enabled){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_ENCRYPTION_CHANGE;
+    event[1] = sizeof(event) - 2;
+    event[2] = status;
+    bt_store_16(event, 3, handle);
+    event[5] = enabled;
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_link_key_notification(bd_addr_t addr, uint8_t * link_key){
+    uint8_t event[25];
+    event[0] = HCI_EVENT_LINK_KEY_NOTIFICATION;
+    event[1] = sizeof(event) - 2;
+    bt_flip_addr(&event[2], addr);
+    memcpy(&event[8], link_key, 16);
+    event[24] = UNAUTHENTICATED_COMBINATION_KEY_GENERATED_FROM_P192;
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_le_connection_complete(uint8_t status, virtual_link_t * link){
+    uint8_t event[21];
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_COMPLETE;
+    event[3] = status;
+    bt_store_16(event, 4, link->handle);
+    event[6] = link->role;
+    event[7] = link->peer_addr_type;
+    bt_flip_addr(&event[8], link->peer_addr);
+    bt_store_16(event, 14, link->conn_interval);
+    bt_store_16(event, 16, link->conn_latency);
+    bt_store_16(event, 18, link->supervision_timeout);
+    event[20] = 0;  // master clock accuracy
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_le_connection_update_complete(virtual_link_t * link){
+    uint8_t event[12];
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE;
+    event[3] = 0;
+    bt_store_16(event, 4, link->handle);
+    bt_store_16(event, 6, link->conn_interval);
+    bt_store_16(event, 8, link->conn_latency);
+    bt_store_16(event, 10, link->supervision_timeout);
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_inquiry_complete(void){
+    uint8_t event[3];
+    event[0] = HCI_EVENT_INQUIRY_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    event[2] = 0;
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_remote_name_request_complete(uint8_t status, bd_addr_t addr, const uint8_t * name){
+    uint8_t event[2 + 1 + 6 + VIRTUAL_NAME_LEN];
+    event[0] = HCI_EVENT_REMOTE_NAME_REQUEST_COMPLETE;
+    event[1] = sizeof(event) - 2;
+    event[2] = status;
+    bt_flip_addr(&event[3], addr);
+    memset(&event[9], 0, VIRTUAL_NAME_LEN);
+    if (name){
+        memcpy(&event[9], name, VIRTUAL_NAME_LEN);
+    }
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_number_of_completed_packets(void){
+    uint8_t event[3 + 4 * VIRTUAL_NUM_LINKS];
+    int num_handles = 0;
+    int pos = 3;
+    int i;
+    for (i=0;i<VIRTUAL_NUM_LINKS;i++){
+        virtual_link_t * link = &virtual_links[i];
+        if (!link->completed_packets) continue;
+        bt_store_16(event, pos, link->handle);
+        bt_store_16(event, pos + 2, link->completed_packets);
+        link->completed_packets = 0;
+        pos += 4;
+        num_handles++;
+    }
+    if (!num_handles) return;
+    event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+    event[1] = pos - 2;
+    event[2] = num_handles;
+    virtual_emit_event(event, pos);
+}
+
+static void virtual_host_deliver_handler(timer_source_t * ts){
+    virtual_host_deliver_scheduled = 0;
+    virtual_host_delivering = 1;
+    while (virtual_is_open){
+        if (!virtual_host_queue_count){
+            virtual_emit_number_of_completed_packets();
+        }
+        if (!virtual_host_queue_count) break;
+        // pop before delivery, the slot stays untouched as one slot is always kept free
+        virtual_host_packet_t * slot = &virtual_host_queue[virtual_host_queue_head];
+        virtual_host_queue_head = (virtual_host_queue_head + 1) % VIRTUAL_HOST_QUEUE_LEN;
+        virtual_host_queue_count--;
+        packet_handler(slot->packet_type, &slot->packet_with_pre_buffer[HCI_INCOMING_PRE_BUFFER_SIZE], slot->size);
+    }
+    virtual_host_delivering = 0;
+    if (!virtual_is_open) return;
+    // continue with frames that have been buffered while the host queue was full
+    virtual_link_rx_parse();
+}
+
+//
+// air interface
+//
+
+static void virtual_link_tx_timer_handler(timer_source_t * ts){
+    virtual_link_tx_timer_active = 0;
+    virtual_link_tx_flush();
+}
+
+static void virtual_link_tx_request_callback(void){
+    if (run_loop_enable_data_source_write(&virtual_link_ds, 1)) return;
+    // fallback: poll with timer
+    if (virtual_link_tx_timer_active) return;
+    run_loop_set_timer_handler(&virtual_link_tx_timer, virtual_link_tx_timer_handler);
+    run_loop_set_timer(&virtual_link_tx_timer, VIRTUAL_TX_RETRY_INTERVAL_MS);
+    run_loop_add_timer(&virtual_link_tx_timer);
+    virtual_link_tx_timer_active = 1;
+}
+
+static int virtual_link_send_parts(uint8_t opcode, const uint8_t * header, uint16_t header_len, const uint8_t * data, uint16_t data_len){
+    if (virtual_link_fd < 0) return -1;
+    uint32_t frame_len = VIRTUAL_LINK_HEADER_SIZE + header_len + data_len;
+    if (virtual_link_tx_len + frame_len > sizeof(virtual_link_tx_buffer) && virtual_link_tx_pos){
+        memmove(virtual_link_tx_buffer, &virtual_link_tx_buffer[virtual_link_tx_pos], virtual_link_tx_len - virtual_link_tx_pos);
+        virtual_link_tx_len -= virtual_link_tx_pos;
+        virtual_link_tx_pos = 0;
+    }
+    if (virtual_link_tx_len + frame_len > sizeof(virtual_link_tx_buffer)){
+        log_error("virtual: air interface buffer full, dropping frame %u", opcode);
+        return -1;
+    }
+    uint8_t * frame = &virtual_link_tx_buffer[virtual_link_tx_len];
+    frame[0] = opcode;
+    bt_store_16(frame, 1, header_len + data_len);
+    memcpy(&frame[VIRTUAL_LINK_HEADER_SIZE], header, header_len);
+    memcpy(&frame[VIRTUAL_LINK_HEADER_SIZE + header_len], data, data_len);
+    virtual_link_tx_len += frame_len;
+    virtual_link_tx_total_queued += frame_len;
+    return 0;
+}
+
+static void virtual_link_send(uint8_t opcode, const uint8_t * payload, uint16_t len){
+    if (virtual_link_send_parts(opcode, payload, len, NULL, 0) < 0) return;
+    virtual_link_tx_flush();
+}
+
+static void virtual_link_send_disconnect(virtual_link_type_t link_type, uint8_t reason){
+    uint8_t payload[2];
+    payload[0] = link_type;
+    payload[1] = reason;
+    virtual_link_send(LINK_DISCONNECT, payload, sizeof(payload));
+}
+
+static void virtual_link_send_encryption(virtual_link_type_t link_type, uint8_t status, uint8_t enabled){
+    uint8_t payload[3];
+    payload[0] = link_type;
+    payload[1] = status;
+    payload[2] = enabled;
+    virtual_link_send(LINK_ENCRYPTION, payload, sizeof(payload));
+}
+
+static void virtual_link_open(virtual_link_t * link){
+    link->state = VIRTUAL_LINK_STATE_OPEN;
+    link->completed_packets = 0;
+    link->encrypted = 0;
+    link->authentication_pending = 0;
+}
+
+static void virtual_link_close(virtual_link_t * link){
+    link->state = VIRTUAL_LINK_STATE_CLOSED;
+    link->completed_packets = 0;
+    link->encrypted = 0;
+    link->authentication_pending = 0;
+    link->generation++;
+}
+
+static void virtual_link_lost(void){
+    log_error("virtual: connection to peer controller lost");
+    run_loop_remove_data_source(&virtual_link_ds);
+    if (virtual_link_tx_timer_active){
+        run_loop_remove_timer(&virtual_link_tx_timer);
+        virtual_link_tx_timer_active = 0;
+    }
+    close(virtual_link_fd);
+    virtual_link_fd = -1;
+    virtual_link_tx_len = 0;
+    virtual_link_tx_pos = 0;
+    virtual_link_rx_len = 0;
+    virtual_completion_marks_count = 0;
+
+    virtual_link_t * classic = &virtual_links[VIRTUAL_LINK_CLASSIC];
+    switch (classic->state){
+        case VIRTUAL_LINK_STATE_OPEN:
+            virtual_emit_disconnection_complete(classic->handle, ERROR_CODE_CONNECTION_TIMEOUT);
+            break;
+        case VIRTUAL_LINK_STATE_W4_PAGE_RESPONSE:
+        case VIRTUAL_LINK_STATE_W4_ACCEPT:
+            virtual_emit_connection_complete(ERROR_CODE_PAGE_TIMEOUT, classic);
+            break;
+        default:
+            break;
+    }
+    virtual_link_close(classic);
+
+    virtual_link_t * le = &virtual_links[VIRTUAL_LINK_LE];
+    switch (le->state){
+        case VIRTUAL_LINK_STATE_OPEN:
+            virtual_emit_disconnection_complete(le->handle, ERROR_CODE_CONNECTION_TIMEOUT);
+            virtual_link_close(le);
+            break;
+        case VIRTUAL_LINK_STATE_W4_CONNECT_RESPONSE:
+            // keep initiating
+            le->state = VIRTUAL_LINK_STATE_W4_ADVERTISEMENT;
+            break;
+        default:
+            break;
+    }
+    if (virtual_name_request_active){
+        virtual_name_request_active = 0;
+        virtual_emit_remote_name_request_complete(ERROR_CODE_PAGE_TIMEOUT, virtual_name_request_addr, NULL);
+    }
+}
+
+static void virtual_link_process_completion_marks(void){
+    int completed = 0;
+    while (virtual_completion_marks_count){
+        virtual_completion_mark_t * mark = &virtual_completion_marks[virtual_completion_marks_head];
+        if ((int32_t)(virtual_link_tx_total_written - mark->end) < 0) break;
+        virtual_link_t * link = &virtual_links[mark->link];
+        if (link->generation == mark->generation && link->state == VIRTUAL_LINK_STATE_OPEN){
+            link->completed_packets++;
+            completed = 1;
+        }
+        virtual_completion_marks_head = (virtual_completion_marks_head + 1) % (sizeof(virtual_completion_marks) / sizeof(virtual_completion_mark_t));
+        virtual_completion_marks_count--;
+    }
+    if (completed){
+        virtual_host_schedule_delivery();
+    }
+}
+
+static void virtual_link_tx_flush(void){
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (virtual_link_tx_pos < virtual_link_tx_len){
+        ssize_t res = send(virtual_link_fd, &virtual_link_tx_buffer[virtual_link_tx_pos], virtual_link_tx_len - virtual_link_tx_pos, flags);
+        if (res < 0){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_error("virtual: send failed, errno %d", errno);
+            virtual_link_lost();
+            return;
+        }
+        virtual_link_tx_pos += res;
+        virtual_link_tx_total_written += res;
+    }
+    if (virtual_link_tx_pos == virtual_link_tx_len){
+        virtual_link_tx_pos = 0;
+        virtual_link_tx_len = 0;
+        run_loop_enable_data_source_write(&virtual_link_ds, 0);
+    } else {
+        virtual_link_tx_request_callback();
+    }
+    virtual_link_process_completion_marks();
+}
+
+static void virtual_link_send_advertisement(void){
+    uint8_t payload[1 + 1 + 6 + 1 + LE_ADVERTISING_DATA_SIZE + 1 + LE_ADVERTISING_DATA_SIZE];
+    int pos = 0;
+    payload[pos++] = virtual_adv_type;
+    payload[pos++] = virtual_adv_own_addr_type;
+    memcpy(&payload[pos], virtual_le_own_addr(virtual_adv_own_addr_type), 6);
+    pos += 6;
+    payload[pos++] = virtual_adv_data_len;
+    memcpy(&payload[pos], virtual_adv_data, virtual_adv_data_len);
+    pos += virtual_adv_data_len;
+    payload[pos++] = virtual_scan_response_data_len;
+    memcpy(&payload[pos], virtual_scan_response_data, virtual_scan_response_data_len);
+    pos += virtual_scan_response_data_len;
+    virtual_link_send(LINK_ADVERTISEMENT, payload, pos);
+}
+
+static void virtual_adv_timer_handler(timer_source_t * ts){
+    if (!virtual_adv_enabled) return;
+    virtual_link_send_advertisement();
+    uint32_t interval_ms = virtual_adv_interval_min * 5 / 8;
+    if (interval_ms < VIRTUAL_ADV_INTERVAL_MIN_MS){
+        interval_ms = VIRTUAL_ADV_INTERVAL_MIN_MS;
+    }
+    run_loop_set_timer_handler(&virtual_adv_timer, virtual_adv_timer_handler);
+    run_loop_set_timer(&virtual_adv_timer, interval_ms);
+    run_loop_add_timer(&virtual_adv_timer);
+}
+
+static void virtual_adv_stop(void){
+    if (!virtual_adv_enabled) return;
+    virtual_adv_enabled = 0;
+    run_loop_remove_timer(&virtual_adv_timer);
+}
+
+static void virtual_inquiry_stop(void){
+    if (!virtual_inquiry_active) return;
+    virtual_inquiry_active = 0;
+    run_loop_remove_timer(&virtual_inquiry_timer);
+}
+
+static void virtual_inquiry_timer_handler(timer_source_t * ts){
+    virtual_inquiry_active = 0;
+    virtual_emit_inquiry_complete();
+}
+
+static void virtual_emit_advertising_report(uint8_t event_type, const uint8_t * adv_info, const uint8_t * data, uint8_t data_len){
+    uint8_t event[2 + 12 + LE_ADVERTISING_DATA_SIZE];
+    int pos = 0;
+    event[pos++] = HCI_EVENT_LE_META;
+    pos++;
+    event[pos++] = HCI_SUBEVENT_LE_ADVERTISING_REPORT;
+    event[pos++] = 1;
+    event[pos++] = event_type;
+    event[pos++] = adv_info[1];
+    bt_flip_addr(&event[pos], (uint8_t *) &adv_info[2]);
+    pos += 6;
+    event[pos++] = data_len;
+    memcpy(&event[pos], data, data_len);
+    pos += data_len;
+    event[pos++] = (uint8_t) -40;    // rssi
+    event[1] = pos - 2;
+    virtual_emit_event(event, pos);
+}
+
+static int virtual_white_list_contains(uint8_t addr_type, const uint8_t * addr){
+    int i;
+    for (i=0;i<virtual_white_list_count;i++){
+        if (virtual_white_list[i].addr_type != addr_type) continue;
+        if (memcmp(virtual_white_list[i].addr, addr, 6)) continue;
+        return 1;
+    }
+    return 0;
+}
+
+static void virtual_link_handle_advertisement(const uint8_t * payload, uint16_t len){
+    uint8_t adv_type  = payload[0];
+    uint8_t addr_type = payload[1];
+    const uint8_t * addr = &payload[2];
+    uint8_t adv_len = payload[8];
+    const uint8_t * adv_data = &payload[9];
+    uint8_t scan_response_len = payload[9 + adv_len];
+    const uint8_t * scan_response_data = &payload[10 + adv_len];
+
+    if (virtual_le_scan_enabled){
+        if (!virtual_le_scan_filter_duplicates || !virtual_le_scan_reported_adv){
+            virtual_emit_advertising_report(adv_type, payload, adv_data, adv_len);
+            virtual_le_scan_reported_adv = 1;
+        }
+        // active scanning of scannable advertisements
+        int scannable = adv_type == 0x00 || adv_type == 0x02;
+        if (virtual_le_scan_type && scannable && (!virtual_le_scan_filter_duplicates || !virtual_le_scan_reported_scan_response)){
+            virtual_emit_advertising_report(0x04, payload, scan_response_data, scan_response_len);
+            virtual_le_scan_reported_scan_response = 1;
+        }
+    }
+
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_LE];
+    if (link->state != VIRTUAL_LINK_STATE_W4_ADVERTISEMENT) return;
+    // connectable undirected or directed
+    if (adv_type != 0x00 && adv_type != 0x01) return;
+    if (link->filter_policy){
+        if (!virtual_white_list_contains(addr_type, addr)) return;
+        link->peer_addr_type = addr_type;
+        memcpy(link->peer_addr, addr, 6);
+    } else {
+        if (link->peer_addr_type != addr_type) return;
+        if (memcmp(link->peer_addr, addr, 6)) return;
+    }
+    uint8_t request[20];
+    request[0] = addr_type;
+    memcpy(&request[1], addr, 6);
+    request[7] = link->own_addr_type;
+    memcpy(&request[8], virtual_le_own_addr(link->own_addr_type), 6);
+    bt_store_16(request, 14, link->conn_interval);
+    bt_store_16(request, 16, link->conn_latency);
+    bt_store_16(request, 18, link->supervision_timeout);
+    link->state = VIRTUAL_LINK_STATE_W4_CONNECT_RESPONSE;
+    virtual_link_send(LINK_LE_CONNECT, request, sizeof(request));
+}
+
+static void virtual_link_handle_le_connect(const uint8_t * payload){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_LE];
+    uint8_t status = 0;
+    if (!virtual_adv_enabled || (virtual_adv_type != 0x00 && virtual_adv_type != 0x01)){
+        status = ERROR_CODE_COMMAND_DISALLOWED;
+    } else if (payload[0] != virtual_adv_own_addr_type || memcmp(&payload[1], virtual_le_own_addr(virtual_adv_own_addr_type), 6)){
+        status = ERROR_CODE_COMMAND_DISALLOWED;
+    } else if (link->state != VIRTUAL_LINK_STATE_CLOSED){
+        status = ERROR_CODE_ACL_CONNECTION_ALREADY_EXISTS;
+    }
+    virtual_link_send(LINK_LE_CONNECT_RESPONSE, &status, 1);
+    if (status) return;
+
+    virtual_adv_stop();
+    virtual_link_open(link);
+    link->role = 1;     // slave
+    link->peer_addr_type = payload[7];
+    memcpy(link->peer_addr, &payload[8], 6);
+    link->conn_interval = READ_BT_16(payload, 14);
+    link->conn_latency  = READ_BT_16(payload, 16);
+    link->supervision_timeout = READ_BT_16(payload, 18);
+    virtual_emit_le_connection_complete(0, link);
+}
+
+static void virtual_link_handle_le_connect_response(uint8_t status){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_LE];
+    if (link->state != VIRTUAL_LINK_STATE_W4_CONNECT_RESPONSE){
+        // connect was cancelled, but peer did already accept
+        if (status == 0){
+            virtual_link_send_disconnect(VIRTUAL_LINK_LE, ERROR_CODE_CONNECTION_TERMINATED_BY_LOCAL_HOST);
+        }
+        return;
+    }
+    if (status){
+        // retry with next advertisement
+        link->state = VIRTUAL_LINK_STATE_W4_ADVERTISEMENT;
+        return;
+    }
+    virtual_link_open(link);
+    link->role = 0;     // master
+    virtual_emit_le_connection_complete(0, link);
+}
+
+static void virtual_link_handle_page(const uint8_t * payload){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_CLASSIC];
+    uint8_t response[9];
+    memset(response, 0, sizeof(response));
+    if (memcmp(payload, virtual_bd_addr, 6) || (virtual_scan_enable & 0x02) == 0){
+        response[0] = ERROR_CODE_PAGE_TIMEOUT;
+    } else if (link->state != VIRTUAL_LINK_STATE_CLOSED){
+        response[0] = ERROR_CODE_ACL_CONNECTION_ALREADY_EXISTS;
+    }
+    if (response[0]){
+        virtual_link_send(LINK_PAGE_RESPONSE, response, sizeof(response));
+        return;
+    }
+    link->state = VIRTUAL_LINK_STATE_W4_ACCEPT;
+    memcpy(link->peer_addr, &payload[6], 6);
+    memcpy(link->peer_features, &payload[15], 8);
+
+    uint8_t event[12];
+    event[0] = HCI_EVENT_CONNECTION_REQUEST;
+    event[1] = sizeof(event) - 2;
+    bt_flip_addr(&event[2], link->peer_addr);
+    memcpy(&event[8], &payload[12], 3);
+    event[11] = 1;  // ACL
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_link_handle_page_response(const uint8_t * payload){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_CLASSIC];
+    if (link->state != VIRTUAL_LINK_STATE_W4_PAGE_RESPONSE) return;
+    uint8_t status = payload[0];
+    if (status){
+        virtual_link_close(link);
+        virtual_emit_connection_complete(status, link);
+        return;
+    }
+    memcpy(link->peer_features, &payload[1], 8);
+    virtual_link_open(link);
+    virtual_emit_connection_complete(0, link);
+}
+
+static void virtual_link_handle_acl(const uint8_t * payload, uint16_t len){
+    if (payload[0] >= VIRTUAL_NUM_LINKS) return;
+    virtual_link_t * link = &virtual_links[payload[0]];
+    if (link->state != VIRTUAL_LINK_STATE_OPEN) return;
+    uint16_t data_len = len - 2;
+    uint8_t * packet = virtual_host_queue_reserve(HCI_ACL_DATA_PACKET, HCI_ACL_HEADER_SIZE + data_len);
+    if (!packet) return;
+    bt_store_16(packet, 0, link->handle | (payload[1] << 12));
+    bt_store_16(packet, 2, data_len);
+    memcpy(&packet[HCI_ACL_HEADER_SIZE], &payload[2], data_len);
+}
+
+static void virtual_link_handle_disconnect(const uint8_t * payload){
+    if (payload[0] >= VIRTUAL_NUM_LINKS) return;
+    virtual_link_t * link = &virtual_links[payload[0]];
+    switch (link->state){
+        case VIRTUAL_LINK_STATE_OPEN:
+            virtual_emit_disconnection_complete(link->handle, payload[1]);
+            virtual_link_close(link);
+            break;
+        case VIRTUAL_LINK_STATE_W4_ACCEPT:
+            // initiator gave up
+            virtual_link_close(link);
+            virtual_emit_connection_complete(ERROR_CODE_PAGE_TIMEOUT, link);
+            break;
+        default:
+            break;
+    }
+}
+
+static void virtual_link_handle_le_ltk_reply(const uint8_t * payload){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_LE];
+    if (link->state != VIRTUAL_LINK_STATE_OPEN) return;
+    uint8_t status = payload[0];
+    if (status == 0 && memcmp(&payload[1], link->ltk, 16)){
+        status = ERROR_CODE_PIN_OR_KEY_MISSING;
+    }
+    link->encrypted = status == 0;
+    virtual_emit_encryption_change(status, link->handle, link->encrypted);
+    virtual_link_send_encryption(VIRTUAL_LINK_LE, status, link->encrypted);
+}
+
+static void virtual_link_handle_frame(uint8_t opcode, const uint8_t * payload, uint16_t len){
+    virtual_link_t * link;
+    uint8_t response[1 + 6 + VIRTUAL_NAME_LEN];
+    uint8_t event[17];
+
+    switch (opcode){
+        case LINK_INQUIRY:
+            if ((virtual_scan_enable & 0x01) == 0) break;
+            memcpy(&response[0], virtual_bd_addr, 6);
+            memcpy(&response[6], virtual_class_of_device, 3);
+            virtual_link_send(LINK_INQUIRY_RESPONSE, response, 9);
+            break;
+        case LINK_INQUIRY_RESPONSE:
+            if (!virtual_inquiry_active) break;
+            event[0] = HCI_EVENT_INQUIRY_RESULT;
+            event[1] = sizeof(event) - 2;
+            event[2] = 1;
+            bt_flip_addr(&event[3], (uint8_t *) payload);
+            event[9]  = 1;  // page scan repetition mode R1
+            event[10] = 0;
+            event[11] = 0;
+            memcpy(&event[12], &payload[6], 3);
+            bt_store_16(event, 15, 0);  // clock offset
+            virtual_emit_event(event, sizeof(event));
+            virtual_inquiry_num_responses++;
+            if (virtual_inquiry_max_responses && virtual_inquiry_num_responses >= virtual_inquiry_max_responses){
+                virtual_inquiry_stop();
+                virtual_emit_inquiry_complete();
+            }
+            break;
+        case LINK_NAME_REQUEST:
+            response[0] = ERROR_CODE_PAGE_TIMEOUT;
+            if (memcmp(payload, virtual_bd_addr, 6) == 0 && ((virtual_scan_enable & 0x02) || virtual_links[VIRTUAL_LINK_CLASSIC].state == VIRTUAL_LINK_STATE_OPEN)){
+                response[0] = 0;
+            }
+            memcpy(&response[1], virtual_bd_addr, 6);
+            memcpy(&response[7], virtual_local_name, VIRTUAL_NAME_LEN);
+            virtual_link_send(LINK_NAME_RESPONSE, response, sizeof(response));
+            break;
+        case LINK_NAME_RESPONSE:
+            if (!virtual_name_request_active) break;
+            virtual_name_request_active = 0;
+            virtual_emit_remote_name_request_complete(payload[0], virtual_name_request_addr, payload[0] ? NULL : &payload[7]);
+            break;
+        case LINK_PAGE:
+            virtual_link_handle_page(payload);
+            break;
+        case LINK_PAGE_RESPONSE:
+            virtual_link_handle_page_response(payload);
+            break;
+        case LINK_ACL:
+            virtual_link_handle_acl(payload, len);
+            break;
+        case LINK_DISCONNECT:
+            virtual_link_handle_disconnect(payload);
+            break;
+        case LINK_AUTHENTICATION:
+            link = &virtual_links[VIRTUAL_LINK_CLASSIC];
+            if (link->state != VIRTUAL_LINK_STATE_OPEN) break;
+            virtual_emit_link_key_notification(link->peer_addr, (uint8_t *) payload);
+            break;
+        case LINK_ENCRYPTION:
+            if (payload[0] >= VIRTUAL_NUM_LINKS) break;
+            link = &virtual_links[payload[0]];
+            if (link->state != VIRTUAL_LINK_STATE_OPEN) break;
+            if (payload[1] == 0){
+                link->encrypted = payload[2];
+            }
+            virtual_emit_encryption_change(payload[1], link->handle, payload[2]);
+            break;
+        case LINK_ADVERTISEMENT:
+            virtual_link_handle_advertisement(payload, len);
+            break;
+        case LINK_LE_CONNECT:
+            virtual_link_handle_le_connect(payload);
+            break;
+        case LINK_LE_CONNECT_RESPONSE:
+            virtual_link_handle_le_connect_response(payload[0]);
+            break;
+        case LINK_LE_CONNECTION_UPDATE:
+            link = &virtual_links[VIRTUAL_LINK_LE];
+            if (link->state != VIRTUAL_LINK_STATE_OPEN) break;
+            link->conn_interval = READ_BT_16(payload, 0);
+            link->conn_latency  = READ_BT_16(payload, 2);
+            link->supervision_timeout = READ_BT_16(payload, 4);
+            virtual_emit_le_connection_update_complete(link);
+            break;
+        case LINK_LE_START_ENCRYPTION:
+            link = &virtual_links[VIRTUAL_LINK_LE];
+            if (link->state != VIRTUAL_LINK_STATE_OPEN) break;
+            event[0] = HCI_EVENT_LE_META;
+            event[1] = 13;
+            event[2] = HCI_SUBEVENT_LE_LONG_TERM_KEY_REQUEST;
+            bt_store_16(event, 3, link->handle);
+            memcpy(&event[5], payload, 10);     // rand, ediv
+            virtual_emit_event(event, 15);
+            break;
+        case LINK_LE_LTK_REPLY:
+            virtual_link_handle_le_ltk_reply(payload);
+            break;
+        default:
+            log_error("virtual: unknown air interface frame %u", opcode);
+            break;
+    }
+}
+
+static void virtual_link_rx_parse(void){
+    uint16_t pos = 0;
+    while (virtual_link_fd >= 0 && pos + VIRTUAL_LINK_HEADER_SIZE <= virtual_link_rx_len){
+        if (virtual_host_queue_free() < VIRTUAL_HOST_QUEUE_RESERVE) break;
+        uint8_t  opcode = virtual_link_rx_buffer[pos];
+        uint16_t len    = READ_BT_16(virtual_link_rx_buffer, pos + 1);
+        if (pos + VIRTUAL_LINK_HEADER_SIZE + len > virtual_link_rx_len) break;
+        virtual_link_handle_frame(opcode, &virtual_link_rx_buffer[pos + VIRTUAL_LINK_HEADER_SIZE], len);
+        pos += VIRTUAL_LINK_HEADER_SIZE + len;
+    }
+    if (virtual_link_fd < 0 || pos == 0) return;
+    memmove(virtual_link_rx_buffer, &virtual_link_rx_buffer[pos], virtual_link_rx_len - pos);
+    virtual_link_rx_len -= pos;
+}
+
+static int virtual_link_process(struct data_source *ds){
+    if (virtual_link_tx_pos < virtual_link_tx_len){
+        virtual_link_tx_flush();
+        if (virtual_link_fd < 0) return 0;
+    }
+    if (virtual_link_rx_len < sizeof(virtual_link_rx_buffer)){
+        ssize_t res = read(virtual_link_fd, &virtual_link_rx_buffer[virtual_link_rx_len], sizeof(virtual_link_rx_buffer) - virtual_link_rx_len);
+        if (res == 0){
+            virtual_link_lost();
+            return 0;
+        }
+        if (res < 0){
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                log_error("virtual: read failed, errno %d", errno);
+                virtual_link_lost();
+                return 0;
+            }
+        } else {
+            virtual_link_rx_len += res;
+        }
+    }
+    virtual_link_rx_parse();
+    return 0;
+}
+
+//
+// controller
+//
+
+static void virtual_controller_reset(void){
+    int i;
+    // notify peer about all connections, incl. pending ones
+    for (i=0;i<VIRTUAL_NUM_LINKS;i++){
+        virtual_link_t * link = &virtual_links[i];
+        switch (link->state){
+            case VIRTUAL_LINK_STATE_OPEN:
+            case VIRTUAL_LINK_STATE_W4_PAGE_RESPONSE:
+            case VIRTUAL_LINK_STATE_W4_CONNECT_RESPONSE:
+                virtual_link_send_disconnect((virtual_link_type_t) i, ERROR_CODE_REMOTE_DEVICE_TERMINATED_CONNECTION_DUE_TO_POWER_OFF);
+                break;
+            default:
+                break;
+        }
+        virtual_link_close(link);
+        link->max_packet_length = (i == VIRTUAL_LINK_CLASSIC) ? virtual_acl_data_packet_length : virtual_le_data_packet_length;
+    }
+    virtual_links[VIRTUAL_LINK_CLASSIC].handle = VIRTUAL_HANDLE_CLASSIC;
+    virtual_links[VIRTUAL_LINK_LE].handle = VIRTUAL_HANDLE_LE;
+
+    virtual_inquiry_stop();
+    virtual_adv_stop();
+    virtual_name_request_active = 0;
+    virtual_scan_enable = 0;
+    memset(virtual_class_of_device, 0, sizeof(virtual_class_of_device));
+    memset(virtual_local_name, 0, sizeof(virtual_local_name));
+    memset(virtual_le_random_addr, 0, sizeof(bd_addr_t));
+    virtual_adv_interval_min = 0x0800;
+    virtual_adv_type = 0;
+    virtual_adv_own_addr_type = 0;
+    virtual_adv_data_len = 0;
+    virtual_scan_response_data_len = 0;
+    virtual_le_scan_enabled = 0;
+    virtual_le_scan_type = 0;
+    virtual_white_list_count = 0;
+    virtual_random_state = (READ_BT_16(virtual_bd_addr, 0) << 16 | READ_BT_16(virtual_bd_addr, 2)) ^ READ_BT_16(virtual_bd_addr, 4);
+    if (!virtual_random_state){
+        virtual_random_state = 0x5eed;
+    }
+}
+
+static void virtual_handle_link_control_command(uint16_t opcode, uint8_t * params){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_CLASSIC];
+    bd_addr_t addr;
+    uint8_t payload[23];
+    uint8_t event[13];
+
+    if (opcode == hci_inquiry.opcode){
+        if (virtual_inquiry_active){
+            virtual_emit_command_status(opcode, ERROR_CODE_COMMAND_DISALLOWED);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        virtual_inquiry_active = 1;
+        virtual_inquiry_num_responses = 0;
+        virtual_inquiry_max_responses = params[4];
+        run_loop_set_timer_handler(&virtual_inquiry_timer, virtual_inquiry_timer_handler);
+        run_loop_set_timer(&virtual_inquiry_timer, params[3] * 1280);
+        run_loop_add_timer(&virtual_inquiry_timer);
+        virtual_link_send(LINK_INQUIRY, NULL, 0);
+        return;
+    }
+    if (opcode == hci_create_connection.opcode){
+        if (link->state != VIRTUAL_LINK_STATE_CLOSED){
+            virtual_emit_command_status(opcode, ERROR_CODE_ACL_CONNECTION_ALREADY_EXISTS);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        bt_flip_addr(link->peer_addr, params);
+        if (virtual_link_fd < 0){
+            virtual_emit_connection_complete(ERROR_CODE_PAGE_TIMEOUT, link);
+            return;
+        }
+        link->state = VIRTUAL_LINK_STATE_W4_PAGE_RESPONSE;
+        memcpy(&payload[0], link->peer_addr, 6);
+        memcpy(&payload[6], virtual_bd_addr, 6);
+        memcpy(&payload[12], virtual_class_of_device, 3);
+        memcpy(&payload[15], virtual_local_features, 8);
+        virtual_link_send(LINK_PAGE, payload, 23);
+        return;
+    }
+    if (opcode == hci_create_connection_cancel.opcode){
+        bt_flip_addr(addr, params);
+        if (link->state != VIRTUAL_LINK_STATE_W4_PAGE_RESPONSE || BD_ADDR_CMP(addr, link->peer_addr)){
+            virtual_emit_command_complete_addr(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, params);
+            return;
+        }
+        virtual_emit_command_complete_addr(opcode, 0, params);
+        virtual_link_send_disconnect(VIRTUAL_LINK_CLASSIC, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+        virtual_link_close(link);
+        virtual_emit_connection_complete(ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, link);
+        return;
+    }
+    if (opcode == hci_accept_connection_request.opcode || opcode == hci_reject_connection_request.opcode){
+        bt_flip_addr(addr, params);
+        if (link->state != VIRTUAL_LINK_STATE_W4_ACCEPT || BD_ADDR_CMP(addr, link->peer_addr)){
+            virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        memset(payload, 0, 9);
+        if (opcode == hci_reject_connection_request.opcode){
+            payload[0] = params[6];
+            virtual_link_send(LINK_PAGE_RESPONSE, payload, 9);
+            virtual_link_close(link);
+            virtual_emit_connection_complete(params[6], link);
+            return;
+        }
+        memcpy(&payload[1], virtual_local_features, 8);
+        virtual_link_send(LINK_PAGE_RESPONSE, payload, 9);
+        virtual_link_open(link);
+        virtual_emit_connection_complete(0, link);
+        return;
+    }
+    if (opcode == hci_disconnect.opcode){
+        virtual_link_t * connection = virtual_link_for_handle(READ_BT_16(params, 0));
+        if (!connection){
+            virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        virtual_link_send_disconnect((virtual_link_type_t) (connection - virtual_links), params[2]);
+        virtual_link_close(connection);
+        virtual_emit_disconnection_complete(connection->handle, ERROR_CODE_CONNECTION_TERMINATED_BY_LOCAL_HOST);
+        return;
+    }
+    if (opcode == hci_remote_name_request.opcode){
+        if (virtual_name_request_active){
+            virtual_emit_command_status(opcode, ERROR_CODE_COMMAND_DISALLOWED);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        bt_flip_addr(virtual_name_request_addr, params);
+        if (virtual_link_fd < 0){
+            virtual_emit_remote_name_request_complete(ERROR_CODE_PAGE_TIMEOUT, virtual_name_request_addr, NULL);
+            return;
+        }
+        virtual_name_request_active = 1;
+        virtual_link_send(LINK_NAME_REQUEST, virtual_name_request_addr, 6);
+        return;
+    }
+    if (opcode == hci_remote_name_request_cancel.opcode){
+        virtual_emit_command_complete_addr(opcode, 0, params);
+        if (!virtual_name_request_active) return;
+        virtual_name_request_active = 0;
+        virtual_emit_remote_name_request_complete(ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, virtual_name_request_addr, NULL);
+        return;
+    }
+    if (opcode == hci_inquiry_cancel.opcode){
+        if (!virtual_inquiry_active){
+            virtual_emit_command_complete_status(opcode, ERROR_CODE_COMMAND_DISALLOWED);
+            return;
+        }
+        virtual_inquiry_stop();
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+
+    // commands on an established connection
+    link = virtual_link_for_handle(READ_BT_16(params, 0));
+
+    if (opcode == hci_read_remote_supported_features_command.opcode){
+        if (!link){
+            virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        event[0] = HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES_COMPLETE;
+        event[1] = 11;
+        event[2] = 0;
+        bt_store_16(event, 3, link->handle);
+        memcpy(&event[5], link->peer_features, 8);
+        virtual_emit_event(event, 13);
+        return;
+    }
+    if (opcode == hci_authentication_requested.opcode){
+        if (!link){
+            virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        link->authentication_pending = 1;
+        event[0] = HCI_EVENT_LINK_KEY_REQUEST;
+        event[1] = 6;
+        bt_flip_addr(&event[2], link->peer_addr);
+        virtual_emit_event(event, 8);
+        return;
+    }
+    if (opcode == hci_set_connection_encryption.opcode){
+        if (!link){
+            virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        link->encrypted = params[2];
+        virtual_emit_encryption_change(0, link->handle, link->encrypted);
+        virtual_link_send_encryption(VIRTUAL_LINK_CLASSIC, 0, link->encrypted);
+        return;
+    }
+
+    // pairing replies: status + bd_addr
+    if (opcode == hci_link_key_request_reply.opcode || opcode == hci_link_key_request_negative_reply.opcode){
+        virtual_emit_command_complete_addr(opcode, 0, params);
+        link = &virtual_links[VIRTUAL_LINK_CLASSIC];
+        if (link->state != VIRTUAL_LINK_STATE_OPEN || !link->authentication_pending) return;
+        link->authentication_pending = 0;
+        if (opcode == hci_link_key_request_negative_reply.opcode){
+            // no stored link key: simulate Secure Simple Pairing with Just Works
+            uint8_t link_key[16];
+            int i;
+            for (i=0;i<16;i++){
+                link_key[i] = virtual_random();
+            }
+            virtual_emit_link_key_notification(link->peer_addr, link_key);
+            virtual_link_send(LINK_AUTHENTICATION, link_key, 16);
+        }
+        event[0] = HCI_EVENT_AUTHENTICATION_COMPLETE_EVENT;
+        event[1] = 3;
+        event[2] = 0;
+        bt_store_16(event, 3, link->handle);
+        virtual_emit_event(event, 5);
+        return;
+    }
+    if (opcode == hci_pin_code_request_reply.opcode
+     || opcode == hci_pin_code_request_negative_reply.opcode
+     || opcode == hci_io_capability_request_reply.opcode
+     || opcode == hci_io_capability_request_negative_reply.opcode
+     || opcode == hci_user_confirmation_request_reply.opcode
+     || opcode == hci_user_confirmation_request_negative_reply.opcode
+     || opcode == hci_user_passkey_request_reply.opcode
+     || opcode == hci_user_passkey_request_negative_reply.opcode){
+        virtual_emit_command_complete_addr(opcode, 0, params);
+        return;
+    }
+
+    log_info("virtual: unsupported command 0x%04x", opcode);
+    virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_HCI_COMMAND);
+}
+
+static void virtual_handle_le_command(uint16_t opcode, uint8_t * params){
+    virtual_link_t * link = &virtual_links[VIRTUAL_LINK_LE];
+    uint8_t result[17];
+    uint8_t key[16];
+    uint8_t plaintext[16];
+    uint8_t ciphertext[16];
+    int i;
+
+    if (opcode == hci_le_read_buffer_size.opcode){
+        result[0] = 0;
+        bt_store_16(result, 1, virtual_le_data_packet_length);
+        result[3] = virtual_le_num_packets;
+        virtual_emit_command_complete(opcode, result, 4);
+        return;
+    }
+    if (opcode == hci_le_read_supported_features.opcode){
+        result[0] = 0;
+        memcpy(&result[1], virtual_le_features, 8);
+        virtual_emit_command_complete(opcode, result, 9);
+        return;
+    }
+    if (opcode == hci_le_read_white_list_size.opcode){
+        result[0] = 0;
+        result[1] = VIRTUAL_WHITE_LIST_SIZE;
+        virtual_emit_command_complete(opcode, result, 2);
+        return;
+    }
+    if (opcode == hci_le_clear_white_list.opcode){
+        virtual_white_list_count = 0;
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_add_device_to_white_list.opcode){
+        bd_addr_t addr;
+        bt_flip_addr(addr, &params[1]);
+        if (virtual_white_list_contains(params[0], addr)){
+            virtual_emit_command_complete_status(opcode, 0);
+            return;
+        }
+        if (virtual_white_list_count >= VIRTUAL_WHITE_LIST_SIZE){
+            virtual_emit_command_complete_status(opcode, ERROR_CODE_MEMORY_CAPACITY_EXCEEDED);
+            return;
+        }
+        virtual_white_list[virtual_white_list_count].addr_type = params[0];
+        BD_ADDR_COPY(virtual_white_list[virtual_white_list_count].addr, addr);
+        virtual_white_list_count++;
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_remove_device_from_white_list.opcode){
+        bd_addr_t addr;
+        bt_flip_addr(addr, &params[1]);
+        for (i=0;i<virtual_white_list_count;i++){
+            if (virtual_white_list[i].addr_type != params[0]) continue;
+            if (BD_ADDR_CMP(virtual_white_list[i].addr, addr)) continue;
+            virtual_white_list[i] = virtual_white_list[--virtual_white_list_count];
+            break;
+        }
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_set_random_address.opcode){
+        bt_flip_addr(virtual_le_random_addr, params);
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_set_advertising_parameters.opcode){
+        virtual_adv_interval_min  = READ_BT_16(params, 0);
+        virtual_adv_type          = params[4];
+        virtual_adv_own_addr_type = params[5];
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_set_advertising_data.opcode || opcode == hci_le_set_scan_response_data.opcode){
+        uint8_t len = params[0];
+        if (len > LE_ADVERTISING_DATA_SIZE){
+            len = LE_ADVERTISING_DATA_SIZE;
+        }
+        if (opcode == hci_le_set_advertising_data.opcode){
+            virtual_adv_data_len = len;
+            memcpy(virtual_adv_data, &params[1], len);
+        } else {
+            virtual_scan_response_data_len = len;
+            memcpy(virtual_scan_response_data, &params[1], len);
+        }
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_set_advertise_enable.opcode){
+        virtual_emit_command_complete_status(opcode, 0);
+        if (params[0] && !virtual_adv_enabled){
+            virtual_adv_enabled = 1;
+            virtual_adv_timer_handler(&virtual_adv_timer);
+        }
+        if (!params[0]){
+            virtual_adv_stop();
+        }
+        return;
+    }
+    if (opcode == hci_le_set_scan_parameters.opcode){
+        virtual_le_scan_type = params[0];
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_set_scan_enable.opcode){
+        virtual_le_scan_enabled = params[0];
+        virtual_le_scan_filter_duplicates = params[1];
+        virtual_le_scan_reported_adv = 0;
+        virtual_le_scan_reported_scan_response = 0;
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_le_create_connection.opcode){
+        if (link->state != VIRTUAL_LINK_STATE_CLOSED){
+            virtual_emit_command_status(opcode, ERROR_CODE_COMMAND_DISALLOWED);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        link->filter_policy  = params[4];
+        link->peer_addr_type = params[5];
+        bt_flip_addr(link->peer_addr, &params[6]);
+        link->own_addr_type  = params[12];
+        link->conn_interval  = READ_BT_16(params, 15);     // max interval
+        link->conn_latency   = READ_BT_16(params, 17);
+        link->supervision_timeout = READ_BT_16(params, 19);
+        link->state = VIRTUAL_LINK_STATE_W4_ADVERTISEMENT;
+        return;
+    }
+    if (opcode == hci_le_create_connection_cancel.opcode){
+        if (link->state != VIRTUAL_LINK_STATE_W4_ADVERTISEMENT && link->state != VIRTUAL_LINK_STATE_W4_CONNECT_RESPONSE){
+            virtual_emit_command_complete_status(opcode, ERROR_CODE_COMMAND_DISALLOWED);
+            return;
+        }
+        virtual_emit_command_complete_status(opcode, 0);
+        virtual_link_close(link);
+        link->role = 0;
+        virtual_emit_le_connection_complete(ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, link);
+        return;
+    }
+    if (opcode == hci_le_encrypt.opcode){
+        swap128(&params[0], key);
+        swap128(&params[16], plaintext);
+        virtual_aes128_encrypt(key, plaintext, ciphertext);
+        result[0] = 0;
+        swap128(ciphertext, &result[1]);
+        virtual_emit_command_complete(opcode, result, 17);
+        return;
+    }
+    if (opcode == hci_le_rand.opcode){
+        result[0] = 0;
+        bt_store_32(result, 1, virtual_random());
+        bt_store_32(result, 5, virtual_random());
+        virtual_emit_command_complete(opcode, result, 9);
+        return;
+    }
+
+    // commands on an established connection
+    uint16_t handle = READ_BT_16(params, 0);
+    link = virtual_link_for_handle(handle);
+    if (link && link != &virtual_links[VIRTUAL_LINK_LE]){
+        link = NULL;
+    }
+
+    if (opcode == hci_le_connection_update.opcode){
+        if (!link){
+            virtual_emit_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        link->conn_interval = READ_BT_16(params, 4);
+        link->conn_latency  = READ_BT_16(params, 6);
+        link->supervision_timeout = READ_BT_16(params, 8);
+        virtual_emit_le_connection_update_complete(link);
+        bt_store_16(result, 0, link->conn_interval);
+        bt_store_16(result, 2, link->conn_latency);
+        bt_store_16(result, 4, link->supervision_timeout);
+        virtual_link_send(LINK_LE_CONNECTION_UPDATE, result, 6);
+        return;
+    }
+    if (opcode == hci_le_start_encryption.opcode){
+        if (!link || link->role != 0){
+            virtual_emit_command_status(opcode, link ? ERROR_CODE_COMMAND_DISALLOWED : ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        memcpy(link->ltk, &params[12], 16);
+        virtual_link_send(LINK_LE_START_ENCRYPTION, &params[2], 10);
+        return;
+    }
+    if (opcode == hci_le_long_term_key_request_reply.opcode || opcode == hci_le_long_term_key_negative_reply.opcode){
+        if (!link){
+            virtual_emit_command_complete_handle(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER, handle);
+            return;
+        }
+        virtual_emit_command_complete_handle(opcode, 0, handle);
+        memset(result, 0, sizeof(result));
+        if (opcode == hci_le_long_term_key_request_reply.opcode){
+            memcpy(&result[1], &params[2], 16);
+        } else {
+            result[0] = ERROR_CODE_PIN_OR_KEY_MISSING;
+        }
+        virtual_link_send(LINK_LE_LTK_REPLY, result, 17);
+        return;
+    }
+
+    // set event mask, host channel classification, ...
+    virtual_emit_command_complete_status(opcode, 0);
+}
+
+static void virtual_handle_command(uint8_t * packet, int size){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t * params = &packet[3];
+    uint8_t result[65];
+
+    switch (opcode >> 10){
+        case OGF_LINK_CONTROL:
+            virtual_handle_link_control_command(opcode, params);
+            return;
+        case OGF_LE_CONTROLLER:
+            virtual_handle_le_command(opcode, params);
+            return;
+        default:
+            break;
+    }
+
+    if (opcode == hci_reset.opcode){
+        virtual_controller_reset();
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_read_local_version_information.opcode){
+        result[0] = 0;
+        result[1] = 0x06;               // HCI version 4.0
+        bt_store_16(result, 2, 0);      // HCI revision
+        result[4] = 0x06;               // LMP version 4.0
+        bt_store_16(result, 5, 0xffff); // manufacturer: internal use
+        bt_store_16(result, 7, 0);      // LMP subversion
+        virtual_emit_command_complete(opcode, result, 9);
+        return;
+    }
+    if (opcode == hci_read_bd_addr.opcode){
+        result[0] = 0;
+        bt_flip_addr(&result[1], virtual_bd_addr);
+        virtual_emit_command_complete(opcode, result, 7);
+        return;
+    }
+    if (opcode == hci_read_local_supported_commands.opcode){
+        memset(result, 0, sizeof(result));
+        result[1 + 14] = 0x80;          // Read Buffer Size
+        result[1 + 24] = 0x40;          // Write LE Host Supported
+        virtual_emit_command_complete(opcode, result, 65);
+        return;
+    }
+    if (opcode == hci_read_buffer_size.opcode){
+        result[0] = 0;
+        bt_store_16(result, 1, virtual_acl_data_packet_length);
+        result[3] = 0;                  // no SCO
+        bt_store_16(result, 4, virtual_acl_num_packets);
+        bt_store_16(result, 6, 0);
+        virtual_emit_command_complete(opcode, result, 8);
+        return;
+    }
+    if (opcode == hci_read_local_supported_features.opcode){
+        result[0] = 0;
+        memcpy(&result[1], virtual_local_features, 8);
+        virtual_emit_command_complete(opcode, result, 9);
+        return;
+    }
+    if (opcode == hci_write_scan_enable.opcode){
+        virtual_scan_enable = params[0];
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_write_class_of_device.opcode){
+        memcpy(virtual_class_of_device, params, 3);
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if (opcode == hci_write_local_name.opcode){
+        memcpy(virtual_local_name, params, VIRTUAL_NAME_LEN);
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+    if ((opcode >> 10) == OGF_CONTROLLER_BASEBAND){
+        // set event mask, write page timeout, write simple pairing mode, ...
+        virtual_emit_command_complete_status(opcode, 0);
+        return;
+    }
+
+    log_info("virtual: unsupported command 0x%04x", opcode);
+    virtual_emit_command_complete_status(opcode, ERROR_CODE_UNKNOWN_HCI_COMMAND);
+}
+
+static int virtual_handle_acl(uint8_t * packet, int size){
+    uint16_t handle = READ_ACL_CONNECTION_HANDLE(packet);
+    uint16_t len = READ_ACL_LENGTH(packet);
+    virtual_link_t * link = virtual_link_for_handle(handle);
+    if (!link){
+        log_error("virtual: ACL packet for unknown handle 0x%04x", handle);
+        return -1;
+    }
+    if (len + HCI_ACL_HEADER_SIZE != size || len > link->max_packet_length){
+        log_error("virtual: invalid ACL packet, len %u, size %u", len, size);
+        return -1;
+    }
+    if (virtual_completion_marks_count == sizeof(virtual_completion_marks) / sizeof(virtual_completion_mark_t)){
+        log_error("virtual: too many ACL packets in flight");
+        return -1;
+    }
+    uint8_t header[2];
+    header[0] = link - virtual_links;
+    header[1] = (packet[1] >> 4) & 0x03;    // packet boundary flags
+    if (virtual_acl_drop_interval && header[1] != 0x01){
+        // drop every n-th L2CAP PDU on a dynamic channel, signaling is kept
+        virtual_acl_dropping = 0;
+        if (len >= 4 && READ_BT_16(packet, HCI_ACL_HEADER_SIZE + 2) >= 0x40){
+            virtual_acl_dropping = ++virtual_acl_drop_counter % virtual_acl_drop_interval == 0;
+        }
+    }
+    if (virtual_acl_dropping || virtual_link_send_parts(LINK_ACL, header, 2, &packet[HCI_ACL_HEADER_SIZE], len) < 0){
+        // dropped or no peer: the packet is lost on air, but the buffer is freed
+        link->completed_packets++;
+        virtual_host_schedule_delivery();
+        return 0;
+    }
+    int index = (virtual_completion_marks_head + virtual_completion_marks_count) % (sizeof(virtual_completion_marks) / sizeof(virtual_completion_mark_t));
+    virtual_completion_marks[index].end = virtual_link_tx_total_queued;
+    virtual_completion_marks[index].link = header[0];
+    virtual_completion_marks[index].generation = link->generation;
+    virtual_completion_marks_count++;
+    virtual_link_tx_flush();
+    return 0;
+}
+
+//
+// hci_transport_t
+//
+
+static int virtual_open(void *transport_config){
+    hci_virtual_config_t * config = (hci_virtual_config_t *) transport_config;
+    if (!config){
+        log_error("virtual: no hci_virtual_config_t provided");
+        return -1;
+    }
+
+    virtual_link_fd = config->link_fd;
+    BD_ADDR_COPY(virtual_bd_addr, config->bd_addr);
+    virtual_acl_data_packet_length = config->acl_data_packet_length ? config->acl_data_packet_length : VIRTUAL_ACL_DATA_PACKET_LENGTH;
+    virtual_acl_num_packets        = config->acl_num_packets        ? config->acl_num_packets        : VIRTUAL_ACL_NUM_PACKETS;
+    virtual_le_data_packet_length  = config->le_data_packet_length  ? config->le_data_packet_length  : VIRTUAL_LE_DATA_PACKET_LENGTH;
+    virtual_le_num_packets         = config->le_num_packets         ? config->le_num_packets         : VIRTUAL_LE_NUM_PACKETS;
+    if (virtual_acl_data_packet_length > VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH) virtual_acl_data_packet_length = VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH;
+    if (virtual_le_data_packet_length  > VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH) virtual_le_data_packet_length  = VIRTUAL_MAX_ACL_DATA_PACKET_LENGTH;
+    if (virtual_acl_num_packets > VIRTUAL_MAX_ACL_PACKETS) virtual_acl_num_packets = VIRTUAL_MAX_ACL_PACKETS;
+    if (virtual_le_num_packets  > VIRTUAL_MAX_ACL_PACKETS) virtual_le_num_packets  = VIRTUAL_MAX_ACL_PACKETS;
+    virtual_acl_drop_interval = config->acl_drop_interval;
+    virtual_acl_drop_counter = 0;
+    virtual_acl_dropping = 0;
+
+    virtual_host_queue_head = 0;
+    virtual_host_queue_count = 0;
+    virtual_host_deliver_scheduled = 0;
+    virtual_host_delivering = 0;
+    virtual_completion_marks_head = 0;
+    virtual_completion_marks_count = 0;
+    virtual_is_open = 1;
+
+    virtual_controller_reset();
+
+    if (virtual_link_fd >= 0){
+        int flags = fcntl(virtual_link_fd, F_GETFL, 0);
+        fcntl(virtual_link_fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(virtual_link_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        virtual_link_ds.fd = virtual_link_fd;
+        virtual_link_ds.process = virtual_link_process;
+        run_loop_add_data_source(&virtual_link_ds);
+        // frames queued before the last close
+        if (virtual_link_tx_pos < virtual_link_tx_len){
+            virtual_link_tx_request_callback();
+        }
+    }
+    log_info("virtual: open, %s, ACL %u x %u, LE %u x %u, peer %s", bd_addr_to_str(virtual_bd_addr),
+             virtual_acl_num_packets, virtual_acl_data_packet_length, virtual_le_num_packets, virtual_le_data_packet_length,
+             virtual_link_fd >= 0 ? "linked" : "none");
+    return 0;
+}
+
+static int virtual_close(void *transport_config){
+    // connections are terminated as on power off, link stays usable for next open
+    virtual_controller_reset();
+    if (virtual_link_fd >= 0){
+        run_loop_remove_data_source(&virtual_link_ds);
+    }
+    if (virtual_link_tx_timer_active){
+        run_loop_remove_timer(&virtual_link_tx_timer);
+        virtual_link_tx_timer_active = 0;
+    }
+    if (virtual_host_deliver_scheduled){
+        run_loop_remove_timer(&virtual_host_deliver_timer);
+        virtual_host_deliver_scheduled = 0;
+    }
+    virtual_host_queue_count = 0;
+    virtual_completion_marks_count = 0;
+    virtual_is_open = 0;
+    return 0;
+}
+
+static int virtual_send_packet(uint8_t packet_type, uint8_t *packet, int size){
+    if (!virtual_is_open) return -1;
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+            virtual_handle_command(packet, size);
+            return 0;
+        case HCI_ACL_DATA_PACKET:
+            return virtual_handle_acl(packet, size);
+        default:
+            log_error("virtual: packet type %u not supported", packet_type);
+            return -1;
+    }
+}
+
+static void virtual_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    packet_handler = handler;
+}
+
+static const char * virtual_get_transport_name(void){
+    return "virtual";
+}
+
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+}
+
+int hci_transport_virtual_link(hci_virtual_config_t * config_a, hci_virtual_config_t * config_b){
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+        log_error("virtual: socketpair failed, errno %d", errno);
+        return -1;
+    }
+    config_a->link_fd = fds[0];
+    config_b->link_fd = fds[1];
+    return 0;
+}
+
+// get virtual singleton
+hci_transport_t * hci_transport_virtual_instance(void){
+    return &hci_transport_virtual;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+/*
+ *  pan_netif.c
+ *
+ *  PAN network interface: forwards Ethernet frames between a TAP device and a BNEP channel
+ *
+ *  Outgoing frames are read with readv(): the Ethernet header goes to a small buffer and
+ *  the payload directly into the outgoing ACL buffer, behind room for the ACL, L2CAP and
+ *  BNEP headers. bnep_send_prepared then writes the BNEP header in front of the payload.
+ *  Incoming frames are written from the BNEP receive buffer, where the Ethernet header is
+ *  restored in front of the payload if HCI_INCOMING_PRE_BUFFER_SIZE provides room for it.
+ *
+ *  On Linux, TUN/TAP is available by default. On OS X, tuntaposx from
+ *  http://tuntaposx.sourceforge.net needs to be installed.
+ */
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if_arp.h>
+
+#ifdef __APPLE__
+#include <net/if.h>
+#include <net/if_types.h>
+
+#include <netinet/if_ether.h>
+#endif
+
+#include <netinet/in.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __linux
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#endif
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+
+#include "hci.h"
+#include "bnep.h"
+#include "debug.h"
+#include "pan_netif.h"
+
+#ifdef __APPLE__
+// tuntaposx provides fixed set of tapX devices
+static const char * tap_dev = "/dev/tap0";
+static const char * tap_dev_name = "tap0";
+#endif
+
+#ifdef __linux
+// Linux uses single control device to bring up tunX or tapX interface
+static const char * tap_dev = "/dev/net/tun";
+static const char * tap_dev_name = "bnep%d";
+#endif
+
+static data_source_t pan_netif_ds;
+static int      pan_netif_reading;
+static uint16_t pan_netif_bnep_cid;
+
+// used if the outgoing buffer is in use while frames are queued by BNEP
+static uint8_t  pan_netif_frame[ETHER_HEADER_LEN + BNEP_MTU_MIN];
+
+int pan_netif_tap_alloc(char * dev_name, bd_addr_t bd_addr){
+    struct ifreq ifr;
+    int fd_dev;
+    int fd_socket;
+
+    if( (fd_dev = open(tap_dev, O_RDWR)) < 0 ) {
+        log_error("pan_netif: error opening %s: %s", tap_dev, strerror(errno));
+        return -1;
+    }
+
+#ifdef __linux
+    memset(&ifr, 0, sizeof(ifr));
+
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI; 
+    strncpy(ifr.ifr_name, *dev_name ? dev_name : tap_dev_name, IFNAMSIZ - 1);
+
+    if (ioctl(fd_dev, TUNSETIFF, (void *) &ifr) < 0) {
+        log_error("pan_netif: error setting device name: %s", strerror(errno));
+        close(fd_dev);
+        return -1;
+    }  
+    strcpy(dev_name, ifr.ifr_name);
+#endif
+#ifdef __APPLE__
+    strcpy(dev_name, tap_dev_name);
+#endif    
+
+    fd_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (fd_socket < 0) {
+        close(fd_dev);
+        log_error("pan_netif: error opening netlink socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Configure the MAC address of the newly created device to the local bd_address
+    memset (&ifr, 0, sizeof(struct ifreq));
+    strcpy(ifr.ifr_name, dev_name);
+#ifdef __linux
+    ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+    memcpy(ifr.ifr_hwaddr.sa_data, bd_addr, sizeof(bd_addr_t));
+    if (ioctl(fd_socket, SIOCSIFHWADDR, &ifr) == -1) {
+        close(fd_dev);
+        close(fd_socket);
+        log_error("pan_netif: error setting hw addr: %s", strerror(errno));
+        return -1;
+    }
+#endif
+#ifdef __APPLE__
+    ifr.ifr_addr.sa_len = ETHER_ADDR_LEN;
+    ifr.ifr_addr.sa_family = AF_LINK;
+    (void)memcpy(ifr.ifr_addr.sa_data, bd_addr, ETHER_ADDR_LEN);
+    if (ioctl(fd_socket, SIOCSIFLLADDR, &ifr) == -1) {
+        close(fd_dev);
+        close(fd_socket);
+        log_error("pan_netif: error setting hw addr: %s", strerror(errno));
+        return -1;
+    }
+#endif    
+
+    // Bring the interface up
+    if (ioctl(fd_socket, SIOCGIFFLAGS, &ifr) == -1) {
+        close(fd_dev);
+        close(fd_socket);
+        log_error("pan_netif: error reading interface flags: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((ifr.ifr_flags & IFF_UP) == 0) {
+        ifr.ifr_flags |= IFF_UP;
+
+        if (ioctl(fd_socket, SIOCSIFFLAGS, &ifr) == -1) {
+            close(fd_dev);
+            close(fd_socket);
+            log_error("pan_netif: error set IFF_UP: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    close(fd_socket);
+    return fd_dev;
+}
+
+static void pan_netif_start_reading(void){
+    if (pan_netif_reading) return;
+    pan_netif_reading = 1;
+    run_loop_add_data_source(&pan_netif_ds);
+}
+
+static void pan_netif_stop_reading(void){
+    if (!pan_netif_reading) return;
+    pan_netif_reading = 0;
+    run_loop_remove_data_source(&pan_netif_ds);
+}
+
+// frames stay in the network interface until BNEP can take them
+static int pan_netif_process(data_source_t *ds){
+    uint8_t ethernet_header[ETHER_HEADER_LEN];
+    struct iovec iov[2];
+    uint16_t max_payload_len;
+    ssize_t len;
+
+    if (!bnep_can_send_packet_now(pan_netif_bnep_cid)){
+        // resume on BNEP_EVENT_READY_TO_SEND
+        pan_netif_stop_reading();
+        return 0;
+    }
+
+    if (!bnep_reserve_packet_buffer()){
+        // outgoing buffer busy but BNEP has room in its TX queue
+        len = read(ds->fd, pan_netif_frame, sizeof(pan_netif_frame));
+        if (len < ETHER_HEADER_LEN){
+            if (len < 0) log_error("pan_netif: error while reading: %s", strerror(errno));
+            return 0;
+        }
+        bnep_send(pan_netif_bnep_cid, pan_netif_frame, len);
+        return 0;
+    }
+
+    iov[0].iov_base = ethernet_header;
+    iov[0].iov_len  = ETHER_HEADER_LEN;
+    iov[1].iov_base = bnep_get_outgoing_payload_buffer(pan_netif_bnep_cid, &max_payload_len);
+    iov[1].iov_len  = max_payload_len;
+    len = readv(ds->fd, iov, 2);
+    if (len < ETHER_HEADER_LEN){
+        if (len < 0) log_error("pan_netif: error while reading: %s", strerror(errno));
+        bnep_release_packet_buffer();
+        return 0;
+    }
+    bnep_send_prepared(pan_netif_bnep_cid, ethernet_header, len - ETHER_HEADER_LEN);
+    return 0;
+}
+
+void pan_netif_open(int fd, uint16_t bnep_cid){
+    pan_netif_close();
+    pan_netif_bnep_cid = bnep_cid;
+    pan_netif_ds.fd = fd;
+    pan_netif_ds.process = pan_netif_process;
+    pan_netif_start_reading();
+}
+
+void pan_netif_close(void){
+    pan_netif_stop_reading();
+    if (pan_netif_ds.fd > 0){
+        close(pan_netif_ds.fd);
+    }
+    pan_netif_ds.fd = -1;
+    pan_netif_bnep_cid = 0;
+}
+
+void pan_netif_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    ssize_t rc;
+
+    if (!pan_netif_bnep_cid) return;
+
+    switch (packet_type){
+        case BNEP_DATA_PACKET:
+            // packet is the Ethernet frame restored in the receive buffer
+            rc = write(pan_netif_ds.fd, packet, size);
+            if (rc < 0){
+                log_error("pan_netif: could not write to network interface: %s", strerror(errno));
+            } else if (rc != size){
+                log_error("pan_netif: frame written only partially %d of %u bytes", (int) rc, size);
+            }
+            break;
+        case HCI_EVENT_PACKET:
+            switch (packet[0]){
+                case BNEP_EVENT_READY_TO_SEND:
+                    if (channel != pan_netif_bnep_cid) break;
+                    pan_netif_start_reading();
+                    break;
+                case BNEP_EVENT_CHANNEL_CLOSED:
+                    if (channel != pan_netif_bnep_cid) break;
+                    pan_netif_close();
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+/*
+ *  pan_netif.h
+ *
+ *  PAN network interface: forwards Ethernet frames between a TAP device and a BNEP channel
+ */
+
+#ifndef __PAN_NETIF_H
+#define __PAN_NETIF_H
+
+#include <stdint.h>
+#include <btstack/utils.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// create TAP network interface with the given hardware address, dev_name gets the interface name (IFNAMSIZ)
+// returns file descriptor or -1 on error
+int  pan_netif_tap_alloc(char * dev_name, bd_addr_t bd_addr);
+
+// forward frames between the network interface file descriptor and the BNEP channel until pan_netif_close
+void pan_netif_open(int fd, uint16_t bnep_cid);
+
+// stop forwarding and close file descriptor
+void pan_netif_close(void);
+
+// to be called from the BNEP packet handler: handles BNEP_DATA_PACKET, BNEP_EVENT_READY_TO_SEND and BNEP_EVENT_CHANNEL_CLOSED
+void pan_netif_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // __PAN_NETIF_H
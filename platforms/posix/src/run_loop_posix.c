@@ -70,6 +70,7 @@ static struct timeval init_tv;
  */
 static void posix_add_data_source(data_source_t *ds){
     data_sources_modified = 1;
+    ds->write_enabled = 0;
     // log_info("posix_add_data_source %x with fd %u\n", (int) ds, ds->fd);
     linked_list_add(&data_sources, (linked_item_t *) ds);
 }
@@ -83,6 +84,13 @@ static int posix_remove_data_source(data_source_t *ds){
     return linked_list_remove(&data_sources, (linked_item_t *) ds);
 }
 
+/**
+ * Enable/Disable write notifications for data_source
+ */
+static void posix_enable_data_source_write(data_source_t *ds, int enable){
+    ds->write_enabled = enable;
+}
+
 /**
  * Add timer to run_loop (keep list sorted)
  */
@@ -126,6 +134,7 @@ static void posix_dump_timer(void){
  */
 static void posix_execute(void) {
     fd_set descriptors;
+    fd_set descriptors_write;
     
     timer_source_t       *ts;
     struct timeval current_tv;
@@ -136,12 +145,16 @@ static void posix_execute(void) {
     while (1) {
         // collect FDs
         FD_ZERO(&descriptors);
+        FD_ZERO(&descriptors_write);
         int highest_fd = 0;
         linked_list_iterator_init(&it, &data_sources);
         while (linked_list_iterator_has_next(&it)){
             data_source_t *ds = (data_source_t*) linked_list_iterator_next(&it);
             if (ds->fd >= 0) {
                 FD_SET(ds->fd, &descriptors);
+                if (ds->write_enabled){
+                    FD_SET(ds->fd, &descriptors_write);
+                }
                 if (ds->fd > highest_fd) {
                     highest_fd = ds->fd;
                 }
@@ -168,7 +181,7 @@ static void posix_execute(void) {
         }
                 
         // wait for ready FDs
-        select( highest_fd+1 , &descriptors, NULL, NULL, timeout);
+        select( highest_fd+1 , &descriptors, &descriptors_write, NULL, timeout);
         
         // process data sources very carefully
         // bt_control.close() triggered from a client can remove a different data source
@@ -179,7 +192,7 @@ static void posix_execute(void) {
         while (linked_list_iterator_has_next(&it) && !data_sources_modified){
             data_source_t *ds = (data_source_t*) linked_list_iterator_next(&it);
             // log_info("posix_execute: check %x with fd %u\n", (int) ds, ds->fd);
-            if (FD_ISSET(ds->fd, &descriptors)) {
+            if (FD_ISSET(ds->fd, &descriptors) || FD_ISSET(ds->fd, &descriptors_write)) {
                 // log_info("posix_execute: process %x with fd %u\n", (int) ds, ds->fd);
                 ds->process(ds);
             }
@@ -273,4 +286,5 @@ run_loop_t run_loop_posix = {
     &posix_execute,
     &posix_dump_timer,
     &posix_get_time_ms,
+    &posix_enable_data_source_write,
 };
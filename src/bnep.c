@@ -62,6 +62,13 @@
 #define BNEP_CONNECTION_TIMEOUT_MS 10000
 #define BNEP_CONNECTION_MAX_RETRIES 1
 
+/* Largest BNEP header: type, destination and source address, protocol type */
+#define BNEP_HEADER_MAX_LEN (1 + 2 * ETHER_ADDR_LEN + 2)
+
+#define IP_PROTOCOL_UDP 17
+#define UDP_PORT_DHCP_SERVER 67
+#define UDP_PORT_DHCP_CLIENT 68
+
 static linked_list_t bnep_services = NULL;
 static linked_list_t bnep_channels = NULL;
 
@@ -372,6 +379,175 @@ static int bnep_send_filter_multi_addr_response(bnep_channel_t *channel, uint16_
     return err;
 }
 
+/* Copy data to ring at tail, returns new tail */
+static uint16_t bnep_tx_ring_write(bnep_tx_ring_t *ring, uint16_t tail, const uint8_t *data, uint16_t len)
+{
+    uint16_t first = ring->size - tail;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(&ring->buffer[tail], data, first);
+    memcpy(ring->buffer, &data[first], len - first);
+    return (tail + len) % ring->size;
+}
+
+/* Store frame given as header and payload in ring, returns 0 if it does not fit */
+static int bnep_tx_ring_push(bnep_tx_ring_t *ring, const l2cap_iovec_t *iov, int iovcnt, uint16_t len)
+{
+    uint8_t  len_field[2];
+    uint16_t tail;
+    int      i;
+
+    if (!ring->buffer || (2 + len > ring->size - ring->len)) {
+        return 0;
+    }
+    bt_store_16(len_field, 0, len);
+    tail = (ring->pos + ring->len) % ring->size;
+    tail = bnep_tx_ring_write(ring, tail, len_field, 2);
+    for (i = 0; i < iovcnt; i++) {
+        tail = bnep_tx_ring_write(ring, tail, iov[i].data, iov[i].len);
+    }
+    ring->len += 2 + len;
+    ring->frames++;
+    return 1;
+}
+
+/* Get oldest frame in ring as one or two parts in place, returns frame length */
+static uint16_t bnep_tx_ring_peek(bnep_tx_ring_t *ring, l2cap_iovec_t *iov, int *iovcnt)
+{
+    uint16_t len   = ring->buffer[ring->pos] | (ring->buffer[(ring->pos + 1) % ring->size] << 8);
+    uint16_t start = (ring->pos + 2) % ring->size;
+    uint16_t first = ring->size - start;
+
+    if (first > len) {
+        first = len;
+    }
+    iov[0].data = &ring->buffer[start];
+    iov[0].len  = first;
+    iov[1].data = ring->buffer;
+    iov[1].len  = len - first;
+    *iovcnt = iov[1].len ? 2 : 1;
+    return len;
+}
+
+static void bnep_tx_ring_pop(bnep_tx_ring_t *ring, uint16_t len)
+{
+    ring->pos = (ring->pos + 2 + len) % ring->size;
+    ring->len -= 2 + len;
+    ring->frames--;
+}
+
+static void bnep_tx_ring_unpop(bnep_tx_ring_t *ring, uint16_t len)
+{
+    ring->pos = (ring->pos + ring->size - 2 - len) % ring->size;
+    ring->len += 2 + len;
+    ring->frames++;
+}
+
+static int bnep_tx_queue_has_room(bnep_channel_t *channel, uint16_t len)
+{
+    if (channel->tx_queue.frames >= channel->tx_queue_max_frames) {
+        return 0;
+    }
+    return 2 + len <= channel->tx_queue.size - channel->tx_queue.len;
+}
+
+/* Queue drained to half of its frames and bytes? */
+static int bnep_tx_queue_below_watermark(bnep_channel_t *channel)
+{
+    if (channel->tx_queue.frames > channel->tx_queue_max_frames / 2) {
+        return 0;
+    }
+    return channel->tx_queue.len <= channel->tx_queue.size / 2;
+}
+
+/* Send queued frames while ACL buffers are available, ARP and DHCP frames first */
+static void bnep_channel_send_tx_queue(bnep_channel_t *channel)
+{
+    bnep_tx_ring_t *ring;
+    l2cap_iovec_t   iov[2];
+    int             iovcnt;
+    uint16_t        len;
+
+    while (l2cap_can_send_packet_now(channel->l2cap_cid)) {
+        ring = channel->tx_priority.frames ? &channel->tx_priority : &channel->tx_queue;
+        if (!ring->frames) {
+            break;
+        }
+        /* Remove frame first, sending can emit events that lead back here.
+           The frame is copied into the ACL buffer before events are emitted. */
+        len = bnep_tx_ring_peek(ring, iov, &iovcnt);
+        bnep_tx_ring_pop(ring, len);
+        if (l2cap_sendv(channel->l2cap_cid, iov, iovcnt)) {
+            bnep_tx_ring_unpop(ring, len);
+            break;
+        }
+        channel->statistics.frames_sent++;
+    }
+}
+
+/* Send frame now if nothing is waiting, queue it otherwise */
+static int bnep_channel_send_or_queue(bnep_channel_t *channel, const l2cap_iovec_t *iov, int iovcnt, int priority)
+{
+    uint16_t len = iov[0].len + iov[1].len;
+    int      err;
+
+    if (!channel->tx_queue.frames && !channel->tx_priority.frames && l2cap_can_send_packet_now(channel->l2cap_cid)) {
+        err = l2cap_sendv(channel->l2cap_cid, iov, iovcnt);
+        if (!err) {
+            channel->statistics.frames_sent++;
+            return 0;
+        }
+        if (err != BTSTACK_ACL_BUFFERS_FULL) {
+            return err;
+        }
+    }
+
+    if (priority && bnep_tx_ring_push(&channel->tx_priority, iov, iovcnt, len)) {
+        channel->statistics.priority_frames_queued++;
+    } else if (!bnep_tx_queue_has_room(channel, len) || !bnep_tx_ring_push(&channel->tx_queue, iov, iovcnt, len)) {
+        /* Tail drop, application is notified when the queue has drained */
+        log_info("bnep_send cid 0x%02x, tx queue full", channel->l2cap_cid);
+        channel->statistics.frames_dropped++;
+        channel->tx_blocked = 1;
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+    channel->statistics.frames_queued++;
+    if (channel->tx_queue.frames + channel->tx_priority.frames > channel->statistics.queue_frames_max) {
+        channel->statistics.queue_frames_max = channel->tx_queue.frames + channel->tx_priority.frames;
+    }
+    if (channel->tx_queue.len + channel->tx_priority.len > channel->statistics.queue_bytes_max) {
+        channel->statistics.queue_bytes_max = channel->tx_queue.len + channel->tx_priority.len;
+    }
+
+    bnep_channel_send_tx_queue(channel);
+    return 0;
+}
+
+/* Small frames needed to establish the network connection: ARP and DHCP */
+static int bnep_frame_is_priority(uint16_t network_protocol_type, const uint8_t *payload, uint16_t len)
+{
+    uint16_t ip_header_len;
+    uint16_t port_dest;
+
+    if (network_protocol_type == ETHERTYPE_ARP) {
+        return 1;
+    }
+    if (network_protocol_type != ETHERTYPE_IP) {
+        return 0;
+    }
+    if ((len < 20) || (payload[9] != IP_PROTOCOL_UDP)) {
+        return 0;
+    }
+    ip_header_len = (payload[0] & 0x0f) * 4;
+    if (len < ip_header_len + 4) {
+        return 0;
+    }
+    port_dest = READ_NET_16(payload, ip_header_len + 2);
+    return (port_dest == UDP_PORT_DHCP_SERVER) || (port_dest == UDP_PORT_DHCP_CLIENT);
+}
+
 int bnep_can_send_packet_now(uint16_t bnep_cid)
 {
     bnep_channel_t *channel = bnep_channel_for_l2cap_cid(bnep_cid);
@@ -381,9 +557,63 @@ int bnep_can_send_packet_now(uint16_t bnep_cid)
         return 0;
     }
     
+    if (channel->tx_queue.buffer) {
+        /* Room for a frame of max size */
+        if (bnep_tx_queue_has_room(channel, BNEP_HEADER_MAX_LEN + channel->max_frame_size)) {
+            return 1;
+        }
+        channel->tx_blocked = 1;
+        return 0;
+    }
+
     return l2cap_can_send_packet_now(channel->l2cap_cid);
 }
 
+int bnep_enable_tx_queue(uint16_t bnep_cid, uint8_t *buffer, uint16_t size, uint16_t max_frames)
+{
+    bnep_channel_t *channel = bnep_channel_for_l2cap_cid(bnep_cid);
+
+    if (!channel){
+        log_error("bnep_enable_tx_queue cid 0x%02x doesn't exist!", bnep_cid);
+        return 1;
+    }
+
+    /* Queued frames must be sent before buffer changes */
+    bnep_channel_send_tx_queue(channel);
+    if (channel->tx_queue.frames || channel->tx_priority.frames) {
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+
+    memset(&channel->tx_queue, 0, sizeof(bnep_tx_ring_t));
+    memset(&channel->tx_priority, 0, sizeof(bnep_tx_ring_t));
+    channel->tx_blocked = 0;
+    if (buffer == NULL) {
+        return 0;
+    }
+
+    if (size <= BNEP_TX_PRIORITY_QUEUE_SIZE) {
+        log_error("bnep_enable_tx_queue cid 0x%02x, buffer too small", bnep_cid);
+        return 1;
+    }
+    channel->tx_priority.buffer = buffer;
+    channel->tx_priority.size   = BNEP_TX_PRIORITY_QUEUE_SIZE;
+    channel->tx_queue.buffer    = buffer + BNEP_TX_PRIORITY_QUEUE_SIZE;
+    channel->tx_queue.size      = size - BNEP_TX_PRIORITY_QUEUE_SIZE;
+    channel->tx_queue_max_frames = max_frames ? max_frames : 0xffff;
+    return 0;
+}
+
+int bnep_get_channel_statistics(uint16_t bnep_cid, bnep_channel_statistics_t *statistics)
+{
+    bnep_channel_t *channel = bnep_channel_for_l2cap_cid(bnep_cid);
+
+    if (!channel){
+        return 1;
+    }
+    *statistics = channel->statistics;
+    return 0;
+}
+
 
 static int bnep_filter_protocol(bnep_channel_t *channel, uint16_t network_protocol_type)
 {
@@ -430,55 +660,36 @@ static int bnep_filter_multicast(bnep_channel_t *channel, bd_addr_t addr_dest)
 }
 
 
-/* Send BNEP ethernet packet */
-int bnep_send(uint16_t bnep_cid, uint8_t *packet, uint16_t len)
+/* Check filters and build the BNEP header for an ethernet frame with the given header (destination, source, protocol type).
+   Returns 0 and header_len = 0 if the frame shall be omitted. */
+static int bnep_build_frame_header(bnep_channel_t *channel, const uint8_t *ethernet_header, const uint8_t *payload,
+                                   uint16_t *payload_len, uint8_t *header, uint16_t *header_len, int *priority)
 {
-    bnep_channel_t *channel;
-    uint8_t        *bnep_out_buffer = NULL;
-    uint16_t        pos = 0;
     uint16_t        pos_out = 0;
-    uint16_t        payload_len;
-    int             err = 0;
     int             has_source;
     int             has_dest;
 
     bd_addr_t       addr_dest;
     bd_addr_t       addr_source;
     uint16_t        network_protocol_type;
+    uint16_t        payload_offset = 0;
 
-    channel = bnep_channel_for_l2cap_cid(bnep_cid);
-    if (channel == NULL) {
-        log_error("bnep_send cid 0x%02x doesn't exist!", bnep_cid);
-        return 1;
-    }
-        
-    if (channel->state != BNEP_CHANNEL_STATE_CONNECTED) {
-        return BNEP_CHANNEL_NOT_CONNECTED;
-    }
-    
-    /* Check for free ACL buffers */
-    if (!l2cap_can_send_packet_now(channel->l2cap_cid)) {
-        return BTSTACK_ACL_BUFFERS_FULL;
-    }
-
-    /* Extract destination and source address from the ethernet packet */
-    pos = 0;
-    BD_ADDR_COPY(addr_dest, &packet[pos]);
-    pos += sizeof(bd_addr_t);
-    BD_ADDR_COPY(addr_source, &packet[pos]);
-    pos += sizeof(bd_addr_t);
-    network_protocol_type = READ_NET_16(packet, pos);
-    pos += sizeof(uint16_t);
+    *header_len = 0;
+    *priority = 0;
 
-    payload_len = len - pos;
+    /* Extract destination and source address from the ethernet header */
+    BD_ADDR_COPY(addr_dest, &ethernet_header[0]);
+    BD_ADDR_COPY(addr_source, &ethernet_header[sizeof(bd_addr_t)]);
+    network_protocol_type = READ_NET_16(ethernet_header, 2 * sizeof(bd_addr_t));
 
 	if (network_protocol_type == ETHERTYPE_VLAN) {	/* IEEE 802.1Q tag header */
-		if (payload_len < 4) {
+		if (*payload_len < 4) {
             /* Omit this packet */
 			return 0;
         }
         /* The "real" network protocol type is 4 bytes ahead in a VLAN packet */
-		network_protocol_type = READ_NET_16(packet, pos + 2);
+		network_protocol_type = READ_NET_16(payload, 2);
+        payload_offset = 4;
 	}
 
     /* Check network protocol and multicast filters before sending */
@@ -486,22 +697,18 @@ int bnep_send(uint16_t bnep_cid, uint8_t *packet, uint16_t len)
         !bnep_filter_multicast(channel, addr_dest)) {
         /* Packet did not pass filter... */
         if ((network_protocol_type == ETHERTYPE_VLAN) && 
-            (payload_len >= 4)) {
+            (*payload_len >= 4)) {
             /* The packet has been tagged as a with IEE 802.1Q tag and has been filtered out.
                According to the spec the IEE802.1Q tag header shall be sended without ethernet payload.
                So limit the payload_len to 4.
              */
-            payload_len = 4;
+            *payload_len = 4;
         } else {
             /* Packet is not tagged with IEE802.1Q header and was filtered out. Omit this packet */        
             return 0;
         }
     }
 
-    /* Reserve l2cap packet buffer */    
-    l2cap_reserve_packet_buffer();
-    bnep_out_buffer = l2cap_get_outgoing_buffer();
-
     /* Check if source address is the same as our local address and if the 
        destination address is the same as the remote addr. Maybe we can use
        the compressed data format
@@ -510,46 +717,93 @@ int bnep_send(uint16_t bnep_cid, uint8_t *packet, uint16_t len)
     has_dest = (memcmp(addr_dest, channel->remote_addr, ETHER_ADDR_LEN) != 0);
 
     /* Check for MTU limits */
-    if (payload_len > channel->max_frame_size) {
-        log_error("bnep_send: Max frame size (%d) exceeded: %d", channel->max_frame_size, payload_len);
+    if (*payload_len > channel->max_frame_size) {
+        log_error("bnep_send: Max frame size (%d) exceeded: %d", channel->max_frame_size, *payload_len);
         return BNEP_DATA_LEN_EXCEEDS_MTU;
     }
     
     /* Fill in the package type depending on the given source and destination address */
     if (has_source && has_dest) {
-        bnep_out_buffer[pos_out++] = BNEP_PKT_TYPE_GENERAL_ETHERNET;
+        header[pos_out++] = BNEP_PKT_TYPE_GENERAL_ETHERNET;
     } else 
     if (has_source && !has_dest) {
-        bnep_out_buffer[pos_out++] = BNEP_PKT_TYPE_COMPRESSED_ETHERNET_SOURCE_ONLY;
+        header[pos_out++] = BNEP_PKT_TYPE_COMPRESSED_ETHERNET_SOURCE_ONLY;
     } else 
     if (!has_source && has_dest) {
-        bnep_out_buffer[pos_out++] = BNEP_PKT_TYPE_COMPRESSED_ETHERNET_DEST_ONLY;
+        header[pos_out++] = BNEP_PKT_TYPE_COMPRESSED_ETHERNET_DEST_ONLY;
     } else {
-        bnep_out_buffer[pos_out++] = BNEP_PKT_TYPE_COMPRESSED_ETHERNET;
+        header[pos_out++] = BNEP_PKT_TYPE_COMPRESSED_ETHERNET;
     }
 
     /* Add the destination address if needed */
     if (has_dest) {
-        BD_ADDR_COPY(bnep_out_buffer + pos_out, addr_dest);
+        BD_ADDR_COPY(header + pos_out, addr_dest);
         pos_out += sizeof(bd_addr_t);
     }
 
     /* Add the source address if needed */
     if (has_source) {
-        BD_ADDR_COPY(bnep_out_buffer + pos_out, addr_source);
+        BD_ADDR_COPY(header + pos_out, addr_source);
         pos_out += sizeof(bd_addr_t);
     }
 
     /* Add protocol type */
-    net_store_16(bnep_out_buffer, pos_out, network_protocol_type);
+    net_store_16(header, pos_out, network_protocol_type);
     pos_out += 2;
-    
+
     /* TODO: Add extension headers, if we may support them at a later stage */
-    /* Add the payload and then send out the package */
-    memcpy(bnep_out_buffer + pos_out, packet + pos, payload_len);
-    pos_out += payload_len;
+    *header_len = pos_out;
+    *priority = (*payload_len > payload_offset) &&
+        bnep_frame_is_priority(network_protocol_type, payload + payload_offset, *payload_len - payload_offset);
+    return 0;
+}
 
-    err = l2cap_send_prepared(channel->l2cap_cid, pos_out);
+/* Send BNEP ethernet packet */
+int bnep_send(uint16_t bnep_cid, uint8_t *packet, uint16_t len)
+{
+    bnep_channel_t *channel;
+    uint8_t         bnep_out_buffer[BNEP_HEADER_MAX_LEN];
+    l2cap_iovec_t   iov[2];
+    uint16_t        header_len;
+    uint16_t        payload_len;
+    int             priority;
+    int             err = 0;
+
+    channel = bnep_channel_for_l2cap_cid(bnep_cid);
+    if (channel == NULL) {
+        log_error("bnep_send cid 0x%02x doesn't exist!", bnep_cid);
+        return 1;
+    }
+        
+    if (channel->state != BNEP_CHANNEL_STATE_CONNECTED) {
+        return BNEP_CHANNEL_NOT_CONNECTED;
+    }
+    
+    /* Check for free ACL buffers, frames are queued if enabled */
+    if (!channel->tx_queue.buffer && !l2cap_can_send_packet_now(channel->l2cap_cid)) {
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+
+    payload_len = len - ETHER_HEADER_LEN;
+    err = bnep_build_frame_header(channel, packet, packet + ETHER_HEADER_LEN, &payload_len, bnep_out_buffer, &header_len, &priority);
+    if (err || !header_len) {
+        return err;
+    }
+
+    /* Send out the header and the payload, gathered by l2cap */
+    iov[0].data = bnep_out_buffer;
+    iov[0].len  = header_len;
+    iov[1].data = packet + ETHER_HEADER_LEN;
+    iov[1].len  = payload_len;
+
+    if (channel->tx_queue.buffer) {
+        return bnep_channel_send_or_queue(channel, iov, 2, priority);
+    }
+
+    err = l2cap_sendv(channel->l2cap_cid, iov, 2);
+    if (!err) {
+        channel->statistics.frames_sent++;
+    }
     
     if (err) {
         log_error("bnep_send: error %d", err);
@@ -557,6 +811,101 @@ int bnep_send(uint16_t bnep_cid, uint8_t *packet, uint16_t len)
     return err;        
 }
 
+int bnep_reserve_packet_buffer(void)
+{
+    return l2cap_reserve_packet_buffer();
+}
+
+void bnep_release_packet_buffer(void)
+{
+    l2cap_release_packet_buffer();
+}
+
+/* The payload is placed behind the header length of the last prepared frame, which is the same for most frames of a connection */
+uint8_t * bnep_get_outgoing_payload_buffer(uint16_t bnep_cid, uint16_t *max_payload_len)
+{
+    bnep_channel_t *channel = bnep_channel_for_l2cap_cid(bnep_cid);
+
+    if (!channel){
+        log_error("bnep_get_outgoing_payload_buffer cid 0x%02x doesn't exist!", bnep_cid);
+        return NULL;
+    }
+    *max_payload_len = l2cap_max_mtu() - BNEP_HEADER_MAX_LEN;
+    if (*max_payload_len > channel->max_frame_size) {
+        *max_payload_len = channel->max_frame_size;
+    }
+    return l2cap_get_outgoing_buffer() + channel->tx_prepared_header_len;
+}
+
+/* Send BNEP ethernet packet with payload in outgoing buffer */
+int bnep_send_prepared(uint16_t bnep_cid, const uint8_t *ethernet_header, uint16_t payload_len)
+{
+    bnep_channel_t *channel;
+    uint8_t         bnep_out_buffer[BNEP_HEADER_MAX_LEN];
+    l2cap_iovec_t   iov[2];
+    uint8_t        *buffer = l2cap_get_outgoing_buffer();
+    uint8_t        *payload;
+    uint16_t        header_len;
+    int             priority;
+    int             err;
+
+    channel = bnep_channel_for_l2cap_cid(bnep_cid);
+    if (channel == NULL) {
+        log_error("bnep_send_prepared cid 0x%02x doesn't exist!", bnep_cid);
+        l2cap_release_packet_buffer();
+        return 1;
+    }
+
+    if (channel->state != BNEP_CHANNEL_STATE_CONNECTED) {
+        l2cap_release_packet_buffer();
+        return BNEP_CHANNEL_NOT_CONNECTED;
+    }
+
+    payload = buffer + channel->tx_prepared_header_len;
+    err = bnep_build_frame_header(channel, ethernet_header, payload, &payload_len, bnep_out_buffer, &header_len, &priority);
+    if (err || !header_len) {
+        l2cap_release_packet_buffer();
+        return err;
+    }
+
+    /* Header length differs from last frame, move payload once and expect the new length from now on */
+    if (header_len != channel->tx_prepared_header_len) {
+        memmove(buffer + header_len, payload, payload_len);
+        channel->tx_prepared_header_len = header_len;
+        channel->statistics.prepared_frames_moved++;
+    }
+    memcpy(buffer, bnep_out_buffer, header_len);
+
+    /* Queued frames go first, the frame is copied into the queue */
+    if (channel->tx_queue.buffer && (channel->tx_queue.frames || channel->tx_priority.frames ||
+                                     !l2cap_can_send_prepared_packet_now(channel->l2cap_cid))) {
+        iov[0].data = buffer;
+        iov[0].len  = header_len + payload_len;
+        iov[1].data = NULL;
+        iov[1].len  = 0;
+        l2cap_release_packet_buffer();
+        return bnep_channel_send_or_queue(channel, iov, 1, priority);
+    }
+
+    if (!l2cap_can_send_prepared_packet_now(channel->l2cap_cid)) {
+        l2cap_release_packet_buffer();
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+
+    err = l2cap_send_prepared(channel->l2cap_cid, header_len + payload_len);
+    if (!err) {
+        channel->statistics.frames_sent++;
+        channel->statistics.prepared_frames_sent++;
+        return 0;
+    }
+
+    log_error("bnep_send_prepared: error %d", err);
+    if (hci_is_packet_buffer_reserved()) {
+        l2cap_release_packet_buffer();
+    }
+    return err;
+}
+
 
 /* Set BNEP network protocol type filter */
 int bnep_set_net_type_filter(uint16_t bnep_cid, bnep_net_filter_t *filter, uint16_t len)
@@ -705,6 +1054,8 @@ static bnep_channel_t * bnep_channel_create_for_addr(bd_addr_t addr)
     channel->net_filter_count = 0;
     channel->multicast_filter_count = 0;
     channel->retry_count = 0;
+    /* Compressed header without addresses, see bnep_get_outgoing_payload_buffer */
+    channel->tx_prepared_header_len = 3;
 
     /* Finally add it to the channel list */
     linked_list_add(&bnep_channels, (linked_item_t *) channel);
@@ -1512,6 +1863,16 @@ static void bnep_channel_state_machine(bnep_channel_t* channel, bnep_channel_eve
         }
 
 
+        /* Send queued frames, notify the application layer once the queue has drained */
+        if (channel->tx_queue.buffer) {
+            bnep_channel_send_tx_queue(channel);
+            if (!channel->tx_blocked || !bnep_tx_queue_below_watermark(channel)) {
+                return;
+            }
+            channel->tx_blocked = 0;
+            channel->statistics.ready_to_send_events++;
+        }
+
         /* If the event was not yet handled, notify the application layer */
         bnep_emit_ready_to_send(channel);
     }    
@@ -57,16 +57,33 @@ extern "C" {
 #define ETHER_ADDR_LEN sizeof(bd_addr_t)
 #endif
 
+#ifndef ETHER_HEADER_LEN
+#define ETHER_HEADER_LEN (2 * ETHER_ADDR_LEN + 2) /* destination, source, protocol type */
+#endif
+
 #ifndef ETHERTYPE_VLAN
 #define	ETHERTYPE_VLAN		                            0x8100 /* IEEE 802.1Q VLAN tag */
 #endif
 
+#ifndef ETHERTYPE_IP
+#define	ETHERTYPE_IP		                            0x0800 /* IPv4 */
+#endif
+
+#ifndef ETHERTYPE_ARP
+#define	ETHERTYPE_ARP		                            0x0806 /* Address resolution */
+#endif
+
 #define	BNEP_MTU_MIN		                            1691
 
 #define MAX_BNEP_NETFILTER                              8
 #define MAX_BNEP_MULTICAST_FILTER                       8
 #define MAX_BNEP_NETFILTER_OUT                          421
 #define MAX_BNEP_MULTICAST_FULTER_OUT                   140
+
+/* Part of the TX queue buffer used for small control frames (ARP, DHCP), see bnep_enable_tx_queue */
+#ifndef BNEP_TX_PRIORITY_QUEUE_SIZE
+#define BNEP_TX_PRIORITY_QUEUE_SIZE                     1024
+#endif
     
 #define BNEP_EXT_FLAG                                   0x80
 #define BNEP_TYPE_MASK                                  0x7F
@@ -144,6 +161,28 @@ typedef struct {
 	uint8_t		        addr_end[ETHER_ADDR_LEN];
 } bnep_multi_filter_t;
 
+/* BNEP frames waiting for an ACL slot, stored as 16 bit length followed by the frame, memory provided by application */
+typedef struct {
+    uint8_t            *buffer;
+    uint16_t            size;
+    uint16_t            pos;              // oldest byte
+    uint16_t            len;              // bytes used
+    uint16_t            frames;
+} bnep_tx_ring_t;
+
+/* TX queue counters, see bnep_get_channel_statistics */
+typedef struct {
+    uint32_t            frames_sent;              // including frames sent without queuing
+    uint32_t            frames_queued;            // frames that had to wait for an ACL slot
+    uint32_t            priority_frames_queued;   // ARP and DHCP frames queued ahead of other frames
+    uint32_t            frames_dropped;           // frames refused by bnep_send with a full queue
+    uint16_t            queue_frames_max;
+    uint16_t            queue_bytes_max;
+    uint32_t            ready_to_send_events;     // emitted after the queue drained below the watermark
+    uint32_t            prepared_frames_sent;     // sent by bnep_send_prepared from the outgoing buffer
+    uint32_t            prepared_frames_moved;    // payload moved by bnep_send_prepared for a different header length
+} bnep_channel_statistics_t;
+
 
 // info regarding multiplexer
 // note: spec mandates single multplexer per device combination
@@ -184,6 +223,14 @@ typedef struct {
     timer_source_t     timer;             // Timeout timer
     int                timer_active;      // Is a timer running?
     int                retry_count;       // number of retries for CONTROL SETUP MSG
+
+    bnep_tx_ring_t     tx_queue;          // outgoing frames, not used if buffer is NULL
+    bnep_tx_ring_t     tx_priority;       // outgoing ARP and DHCP frames, sent before tx_queue
+    uint16_t           tx_queue_max_frames;
+    int                tx_blocked;        // application was refused, emit BNEP_EVENT_READY_TO_SEND at watermark
+    bnep_channel_statistics_t statistics;
+    uint16_t           tx_prepared_header_len;  // payload offset in outgoing buffer, see bnep_get_outgoing_payload_buffer
+
     // l2cap packet handler
     btstack_packet_handler_t packet_handler;
 } bnep_channel_t;
@@ -219,6 +266,44 @@ int bnep_can_send_packet_now(uint16_t bnep_cid);
  */
 int bnep_send(uint16_t bnep_cid, uint8_t *packet, uint16_t len);
 
+/**
+ * @brief Reserve the outgoing buffer for bnep_send_prepared. Returns 1 on success.
+ */
+int bnep_reserve_packet_buffer(void);
+
+/**
+ * @brief Release the outgoing buffer without sending.
+ */
+void bnep_release_packet_buffer(void);
+
+/**
+ * @brief Get the location of the ethernet payload in the reserved outgoing buffer, and its maximal length.
+ *        The payload can be read there directly, e.g. from a TAP device, with room for the BNEP header in front of it.
+ */
+uint8_t * bnep_get_outgoing_payload_buffer(uint16_t bnep_cid, uint16_t *max_payload_len);
+
+/**
+ * @brief Send an ethernet frame with its payload in the outgoing buffer, given its 14 byte header (destination, source,
+ *        protocol type). The BNEP header is written in front of the payload, which is only moved if the header length
+ *        differs from the last frame. The outgoing buffer is released in any case. Returns 0 on success.
+ */
+int bnep_send_prepared(uint16_t bnep_cid, const uint8_t *ethernet_header, uint16_t payload_len);
+
+/**
+ * @brief Queue frames passed to bnep_send while the ACL buffers are busy, in a buffer provided by the application.
+ *        BNEP_TX_PRIORITY_QUEUE_SIZE bytes of the buffer are used for small control frames (ARP, DHCP) that are sent first,
+ *        the rest holds up to max_frames other frames. Each frame uses 2 bytes plus its BNEP header and payload.
+ *        bnep_send queues the frame if needed and fails only if the queue is full (tail drop). After that, 
+ *        BNEP_EVENT_READY_TO_SEND is emitted once the queue has drained to half of its frames and bytes.
+ *        buffer = NULL disables queuing, this fails while frames are queued. Returns 0 on success.
+ */
+int bnep_enable_tx_queue(uint16_t bnep_cid, uint8_t *buffer, uint16_t size, uint16_t max_frames);
+
+/**
+ * @brief Get TX queue counters of the channel. Returns 0 on success.
+ */
+int bnep_get_channel_statistics(uint16_t bnep_cid, bnep_channel_statistics_t *statistics);
+
 /**
  * @brief Set the network protocol filter.
  */
@@ -75,6 +75,40 @@ typedef struct {
     int   flowcontrol; // 
 } hci_uart_config_t;
 
+typedef struct {
+    int      link_fd;                   // stream socket connected to the peer virtual controller, -1 = no peer
+    uint8_t  bd_addr[6];                // public address reported by HCI Read BD ADDR
+    uint16_t acl_data_packet_length;    // 0 = default
+    uint16_t acl_num_packets;           // 0 = default
+    uint16_t le_data_packet_length;     // 0 = default
+    uint8_t  le_num_packets;            // 0 = default
+    uint16_t acl_drop_interval;         // n > 0: drop every n-th outgoing L2CAP PDU on dynamic channels, 0 = lossless
+} hci_virtual_config_t;
+
+typedef struct {
+    const char * path;  // UNIX domain socket, NULL = use TCP
+    const char * host;  // TCP host name or address, NULL = localhost
+    uint16_t     port;  // TCP port
+} hci_socket_config_t;
+
+typedef struct {
+    const char * path;  // log file
+    int      format;    // HCI_DUMP_PACKETLOGGER or HCI_DUMP_BLUEZ
+    uint32_t speed;     // 0 = as fast as possible, 1 = recorded timing, n = n times faster
+} hci_replay_config_t;
+
+typedef struct {
+    uint32_t events;            // delivered to host
+    uint32_t acl_packets;
+    uint32_t acl_bytes;
+    uint32_t sco_packets;
+    uint32_t host_packets;      // sent by host
+    uint32_t host_mismatches;   // host packets that differ from the log
+    uint32_t host_missing;      // recorded host packets not sent within timeout
+    uint32_t duration_ms;       // set when finished
+    int      finished;
+} hci_replay_statistics_t;
+
 
 // inline various hci_transport_X.h files
 
@@ -103,10 +137,40 @@ extern hci_transport_t * hci_transport_h5_instance(void);
  */
 extern hci_transport_t * hci_transport_usb_instance(void);
 
+/*
+ * @brief Software controller, configured by hci_virtual_config_t
+ */
+extern hci_transport_t * hci_transport_virtual_instance(void);
+
+/*
+ * @brief H4 over UNIX domain or TCP socket, configured by hci_socket_config_t
+ */
+extern hci_transport_t * hci_transport_socket_instance(void);
+
+/*
+ * @brief Replay of PacketLogger or BlueZ hcidump file, configured by hci_replay_config_t
+ */
+extern hci_transport_t * hci_transport_replay_instance(void);
+
 /* API_END */
 
 // support for "enforece wake device" in h4 - used by iOS power management
 extern void hci_transport_h4_iphone_set_enforce_wake_device(char *path);
+
+// H5 configuration - sliding window size (1-7) and data integrity check, used for link establishment in open
+extern void hci_transport_h5_set_window_size(int window_size);
+extern void hci_transport_h5_enable_data_integrity_check(int enable);
+extern uint32_t hci_transport_h5_get_retransmissions(void);
+
+// USB transfer statistics - per endpoint transfer count, latency and number of transfers in flight
+extern void hci_transport_usb_dump_statistics(void);
+
+// Virtual controller - connect two configurations via a socket pair, returns 0 on success
+extern int hci_transport_virtual_link(hci_virtual_config_t * config_a, hci_virtual_config_t * config_b);
+
+// Replay - called when the end of the log is reached, and statistics of the current replay
+extern void hci_transport_replay_register_done_handler(void (*handler)(void));
+extern void hci_transport_replay_get_statistics(hci_replay_statistics_t * statistics);
     
 #if defined __cplusplus
 }
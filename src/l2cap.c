@@ -54,12 +54,44 @@
 
 #include <stdio.h>
 
-// nr of buffered acl packets in outgoing queue to get max performance 
-#define NR_BUFFERED_ACL_PACKETS 3
+// max nr of credits handed out to a channel at once, limited by free ACL buffers in the controller
+#ifndef L2CAP_MAX_CREDITS
+#define L2CAP_MAX_CREDITS 8
+#endif
+
+// nr of local CIDs found by table lookup, channels beyond are found by list walk
+#ifndef L2CAP_CID_TABLE_SIZE
+#define L2CAP_CID_TABLE_SIZE 32
+#endif
+
+// first dynamically allocated CID
+#define L2CAP_CID_DYNAMIC_START 0x0040
+
+// nr of ACL connections with classic channels at the same time, see l2cap_connection_t
+#ifndef L2CAP_CONNECTION_TABLE_SIZE
+#if defined(MAX_NO_HCI_CONNECTIONS) && !defined(HAVE_MALLOC) && (MAX_NO_HCI_CONNECTIONS > 0)
+#define L2CAP_CONNECTION_TABLE_SIZE MAX_NO_HCI_CONNECTIONS
+#else
+#define L2CAP_CONNECTION_TABLE_SIZE 8
+#endif
+#endif
+
+// a scheduling class that waited while higher classes on its ACL link got this many credits is served first once
+#ifndef L2CAP_PRIORITY_MIN_SHARE_CREDITS
+#define L2CAP_PRIORITY_MIN_SHARE_CREDITS 8
+#endif
 
 // used to cache l2cap rejects, echo, and informational requests
 #define NR_PENDING_SIGNALING_RESPONSES 3
 
+// signaling commands sent by l2cap_run for the same handle are collected in a single C-frame of this size
+#ifndef L2CAP_SIGNALING_BATCH_MTU
+#define L2CAP_SIGNALING_BATCH_MTU L2CAP_MINIMAL_MTU
+#endif
+#if (L2CAP_SIGNALING_BATCH_MTU + L2CAP_HEADER_SIZE) > HCI_ACL_PAYLOAD_SIZE
+#error "L2CAP_SIGNALING_BATCH_MTU too large for HCI_ACL_PAYLOAD_SIZE"
+#endif
+
 // offsets for L2CAP SIGNALING COMMANDS
 #define L2CAP_SIGNALING_COMMAND_CODE_OFFSET   0
 #define L2CAP_SIGNALING_COMMAND_SIGID_OFFSET  1
@@ -73,12 +105,53 @@ static void l2cap_packet_handler(uint8_t packet_type, uint8_t *packet, uint16_t
 static l2cap_signaling_response_t signaling_responses[NR_PENDING_SIGNALING_RESPONSES];
 static int signaling_responses_pending;
 
+// signaling commands collected by l2cap_run, sent as one C-frame
+static uint8_t  signaling_batch[L2CAP_SIGNALING_BATCH_MTU];
+static uint16_t signaling_batch_len;        // 0 = no commands collected
+static hci_con_handle_t signaling_batch_handle;
+static int      signaling_batch_hold;       // set while a received C-frame is processed, responses are sent together
+static int      signaling_batch_security_block; // C-frame contains a connection response refused for security, disconnect after it
+static l2cap_signaling_statistics_t signaling_statistics;
+
+// classic channels with pending work for l2cap_run, in order of scheduling, see l2cap_channel_schedule
+typedef struct {
+    l2cap_channel_t * head;
+    l2cap_channel_t * tail;
+} l2cap_channel_queue_t;
+
+static l2cap_channel_queue_t l2cap_channels_pending;
+static l2cap_channel_queue_t l2cap_channels_blocked;   // no progress in current run, e.g. no ACL buffer
+
+// classic channels on an ACL connection, slot is unused if it has no channels
+typedef struct {
+    hci_con_handle_t  handle;
+    l2cap_channel_t * channels;             // continue with next_for_handle
+    int               packets_granted;      // ACL buffers promised to the channels, sum of packets_promised
+    // channels that might want credits per scheduling class, in round-robin order, linked by next_credits
+    l2cap_channel_queue_t credit_queues[L2CAP_PRIORITY_CONTROL + 1];
+    // credits higher classes got while a class waited, see L2CAP_PRIORITY_MIN_SHARE_CREDITS
+    uint16_t          credits_skipped[L2CAP_PRIORITY_CONTROL + 1];
+} l2cap_connection_t;
+
+static l2cap_connection_t l2cap_connections[L2CAP_CONNECTION_TABLE_SIZE];
+static int l2cap_run_active;
+static int l2cap_run_pending;
+static l2cap_run_statistics_t run_statistics;
+
 static linked_list_t l2cap_channels;
 static linked_list_t l2cap_services;
 static linked_list_t l2cap_le_channels;
 static linked_list_t l2cap_le_services;
 static void (*packet_handler) (void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) = null_packet_handler;
 static int new_credits_blocked = 0;
+static uint8_t max_credits = L2CAP_MAX_CREDITS;
+static int hand_out_active;
+static int hand_out_pending;
+
+// local CIDs are allocated densely from L2CAP_CID_DYNAMIC_START, so the channel is found by index
+static l2cap_channel_t * cid_table[L2CAP_CID_TABLE_SIZE];
+static uint16_t cid_table_next;             // slot tried first for the next CID, avoids immediate reuse
+static uint16_t cid_overflow_next;          // next CID if all slots are used
 
 static btstack_packet_handler_t attribute_protocol_packet_handler;
 static btstack_packet_handler_t security_protocol_packet_handler;
@@ -92,11 +165,40 @@ static void l2cap_emit_channel_opened(l2cap_channel_t *channel, uint8_t status);
 static void l2cap_emit_channel_closed(l2cap_channel_t *channel);
 static void l2cap_emit_connection_request(l2cap_channel_t *channel);
 static int l2cap_channel_ready_for_open(l2cap_channel_t *channel);
+void l2cap_run(void);
+static void l2cap_channel_update_packets_promised(l2cap_channel_t * channel);
+static void l2cap_channel_queue_for_credits(l2cap_channel_t * channel);
+#ifdef HAVE_L2CAP_ERTM
+static int l2cap_ertm_can_store_packet_now(l2cap_channel_t * channel);
+static int l2cap_ertm_send_sdu(l2cap_channel_t * channel, const l2cap_iovec_t * iov, int iovcnt, uint16_t len);
+#endif
+#ifdef HAVE_BLE
+static l2cap_channel_t * l2cap_le_get_channel_for_local_cid(uint16_t local_cid);
+static void l2cap_le_signaling_handler(hci_con_handle_t handle, uint8_t * command);
+static void l2cap_le_handle_pdu(l2cap_channel_t * channel, uint8_t * packet, uint16_t size);
+static void l2cap_le_run(void);
+#endif
 
 
 void l2cap_init(void){
     new_credits_blocked = 0;
+    max_credits = L2CAP_MAX_CREDITS;
+    hand_out_active = 0;
+    hand_out_pending = 0;
+    memset(cid_table, 0, sizeof(cid_table));
+    cid_table_next = 0;
+    cid_overflow_next = L2CAP_CID_DYNAMIC_START + L2CAP_CID_TABLE_SIZE;
     signaling_responses_pending = 0;
+    signaling_batch_len = 0;
+    signaling_batch_hold = 0;
+    signaling_batch_security_block = 0;
+    memset(&signaling_statistics, 0, sizeof(signaling_statistics));
+    memset(&l2cap_channels_pending, 0, sizeof(l2cap_channels_pending));
+    memset(&l2cap_channels_blocked, 0, sizeof(l2cap_channels_blocked));
+    memset(l2cap_connections, 0, sizeof(l2cap_connections));
+    l2cap_run_active = 0;
+    l2cap_run_pending = 0;
+    memset(&run_statistics, 0, sizeof(run_statistics));
     
     l2cap_channels = NULL;
     l2cap_services = NULL;
@@ -205,6 +307,18 @@ void l2cap_emit_credits(l2cap_channel_t *channel, uint8_t credits) {
     log_info("L2CAP_EVENT_CREDITS local_cid 0x%x credits %u", channel->local_cid, credits);
     // track credits
     channel->packets_granted += credits;
+    channel->active = 0;
+    l2cap_channel_update_packets_promised(channel);
+    l2cap_channel_queue_for_credits(channel);
+
+    if (channel->waiting_for_credits){
+        uint32_t delay_ms = run_loop_get_time_ms() - channel->waiting_since_ms;
+        channel->waiting_for_credits = 0;
+        channel->statistics.queueing_delay_ms += delay_ms;
+        if (delay_ms > channel->statistics.queueing_delay_max_ms){
+            channel->statistics.queueing_delay_max_ms = delay_ms;
+        }
+    }
     
     uint8_t event[5];
     event[0] = L2CAP_EVENT_CREDITS;
@@ -219,25 +333,20 @@ void l2cap_block_new_credits(uint8_t blocked){
     new_credits_blocked = blocked;
 }
 
-void l2cap_hand_out_credits(void){
-
-    if (new_credits_blocked) return;    // we're told not to. used by daemon
-
-    linked_list_iterator_t it;    
+void l2cap_set_max_credits(uint8_t credits){
+    max_credits = credits ? credits : 1;
+    // channels with all credits might want more now
+    linked_list_iterator_t it;
     linked_list_iterator_init(&it, &l2cap_channels);
     while (linked_list_iterator_has_next(&it)){
         l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-        if (channel->state != L2CAP_STATE_OPEN) continue;
-        if (!hci_number_free_acl_slots_for_handle(channel->handle)) return;
-        if (hci_number_outgoing_packets(channel->handle) < NR_BUFFERED_ACL_PACKETS && channel->packets_granted == 0) {
-            l2cap_emit_credits(channel, 1);
-        }
+        l2cap_channel_queue_for_credits(channel);
     }
 }
 
-l2cap_channel_t * l2cap_get_channel_for_local_cid(uint16_t local_cid){
+static l2cap_channel_t * l2cap_get_channel_in_list(linked_list_t * channels, uint16_t local_cid){
     linked_list_iterator_t it;    
-    linked_list_iterator_init(&it, &l2cap_channels);
+    linked_list_iterator_init(&it, channels);
     while (linked_list_iterator_has_next(&it)){
         l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
         if ( channel->local_cid == local_cid) {
@@ -247,13 +356,476 @@ l2cap_channel_t * l2cap_get_channel_for_local_cid(uint16_t local_cid){
     return NULL;
 }
 
+static int l2cap_cid_in_table(uint16_t local_cid){
+    return local_cid >= L2CAP_CID_DYNAMIC_START && local_cid < L2CAP_CID_DYNAMIC_START + L2CAP_CID_TABLE_SIZE;
+}
+
+static int l2cap_cid_in_use(uint16_t local_cid){
+    if (l2cap_get_channel_in_list(&l2cap_channels, local_cid)) return 1;
+#ifdef HAVE_BLE
+    if (l2cap_get_channel_in_list(&l2cap_le_channels, local_cid)) return 1;
+#endif
+    return 0;
+}
+
+static uint16_t l2cap_allocate_local_cid(l2cap_channel_t * channel){
+    int i;
+    for (i = 0; i < L2CAP_CID_TABLE_SIZE; i++){
+        uint16_t slot = (cid_table_next + i) % L2CAP_CID_TABLE_SIZE;
+        if (cid_table[slot]) continue;
+        cid_table[slot] = channel;
+        cid_table_next = (slot + 1) % L2CAP_CID_TABLE_SIZE;
+        return L2CAP_CID_DYNAMIC_START + slot;
+    }
+    // table full, use CIDs above table
+    uint16_t local_cid;
+    do {
+        local_cid = cid_overflow_next++;
+        if (cid_overflow_next == 0){
+            cid_overflow_next = L2CAP_CID_DYNAMIC_START + L2CAP_CID_TABLE_SIZE;
+        }
+    } while (l2cap_cid_in_use(local_cid));
+    return local_cid;
+}
+
+static void l2cap_release_local_cid(l2cap_channel_t * channel){
+    if (!l2cap_cid_in_table(channel->local_cid)) return;
+    uint16_t slot = channel->local_cid - L2CAP_CID_DYNAMIC_START;
+    if (cid_table[slot] != channel) return;
+    cid_table[slot] = NULL;
+}
+
+l2cap_channel_t * l2cap_get_channel_for_local_cid(uint16_t local_cid){
+    if (!l2cap_cid_in_table(local_cid)) {
+        return l2cap_get_channel_in_list(&l2cap_channels, local_cid);
+    }
+    l2cap_channel_t * channel = cid_table[local_cid - L2CAP_CID_DYNAMIC_START];
+#ifdef HAVE_BLE
+    if (channel && channel->le_credit_based) return NULL;
+#endif
+    return channel;
+}
+
+static l2cap_connection_t * l2cap_connection_for_handle(hci_con_handle_t handle){
+    int i;
+    for (i = 0; i < L2CAP_CONNECTION_TABLE_SIZE; i++){
+        l2cap_connection_t * connection = &l2cap_connections[i];
+        if (connection->channels && connection->handle == handle) return connection;
+    }
+    return NULL;
+}
+
+// connection for handle or unused slot for it, NULL if table is full
+static l2cap_connection_t * l2cap_connection_get_for_handle(hci_con_handle_t handle){
+    l2cap_connection_t * connection = l2cap_connection_for_handle(handle);
+    if (connection) return connection;
+    int i;
+    for (i = 0; i < L2CAP_CONNECTION_TABLE_SIZE; i++){
+        connection = &l2cap_connections[i];
+        if (connection->channels) continue;
+        memset(connection, 0, sizeof(l2cap_connection_t));
+        connection->handle = handle;
+        return connection;
+    }
+    log_error("l2cap_connection_get_for_handle: no slot for handle 0x%04x, increase L2CAP_CONNECTION_TABLE_SIZE", handle);
+    return NULL;
+}
+
+// first channel on ACL connection, continue with channel->next_for_handle
+static l2cap_channel_t * l2cap_get_channels_for_handle(hci_con_handle_t handle){
+    l2cap_connection_t * connection = l2cap_connection_for_handle(handle);
+    if (!connection) return NULL;
+    return connection->channels;
+}
+
+// pre: connection from l2cap_connection_get_for_handle(channel->handle)
+static void l2cap_add_channel_to_connection(l2cap_connection_t * connection, l2cap_channel_t * channel){
+    channel->next_for_handle = connection->channels;
+    connection->channels = channel;
+}
+
+static void l2cap_channel_unqueue_for_credits(l2cap_connection_t * connection, l2cap_channel_t * channel);
+
+static void l2cap_remove_channel_from_handle(l2cap_channel_t * channel){
+    l2cap_connection_t * connection = l2cap_connection_for_handle(channel->handle);
+    if (!connection) return;
+    l2cap_channel_t ** it = &connection->channels;
+    for (; *it; it = &(*it)->next_for_handle){
+        if (*it != channel) continue;
+        *it = channel->next_for_handle;
+        l2cap_channel_unqueue_for_credits(connection, channel);
+        connection->packets_granted -= channel->packets_promised;
+        channel->packets_promised = 0;
+        break;
+    }
+    channel->next_for_handle = NULL;
+}
+
+static void l2cap_channel_queue_add(l2cap_channel_queue_t * queue, l2cap_channel_t * channel){
+    channel->next_pending = NULL;
+    if (queue->tail){
+        queue->tail->next_pending = channel;
+    } else {
+        queue->head = channel;
+    }
+    queue->tail = channel;
+}
+
+static l2cap_channel_t * l2cap_channel_queue_pop(l2cap_channel_queue_t * queue){
+    l2cap_channel_t * channel = queue->head;
+    if (!channel) return NULL;
+    queue->head = channel->next_pending;
+    if (!queue->head){
+        queue->tail = NULL;
+    }
+    return channel;
+}
+
+static void l2cap_channel_queue_remove(l2cap_channel_queue_t * queue, l2cap_channel_t * channel){
+    l2cap_channel_t * prev = NULL;
+    l2cap_channel_t * it;
+    for (it = queue->head; it; prev = it, it = it->next_pending){
+        if (it != channel) continue;
+        if (prev){
+            prev->next_pending = channel->next_pending;
+        } else {
+            queue->head = channel->next_pending;
+        }
+        if (queue->tail == channel){
+            queue->tail = prev;
+        }
+        return;
+    }
+}
+
+// credit queues are linked by next_credits, channels with credits_queued = 1 are listed
+static void l2cap_credit_queue_add(l2cap_channel_queue_t * queue, l2cap_channel_t * channel){
+    channel->next_credits = NULL;
+    if (queue->tail){
+        queue->tail->next_credits = channel;
+    } else {
+        queue->head = channel;
+    }
+    queue->tail = channel;
+}
+
+static l2cap_channel_t * l2cap_credit_queue_pop(l2cap_channel_queue_t * queue){
+    l2cap_channel_t * channel = queue->head;
+    if (!channel) return NULL;
+    queue->head = channel->next_credits;
+    if (!queue->head){
+        queue->tail = NULL;
+    }
+    return channel;
+}
+
+// add classic channel to the work list of l2cap_run, called when its state or state_var requires sending
+static void l2cap_channel_schedule(l2cap_channel_t * channel){
+#ifdef HAVE_BLE
+    if (channel->le_credit_based) return;
+#endif
+    if (channel->pending) return;
+    channel->pending = 1;
+    l2cap_channel_queue_add(&l2cap_channels_pending, channel);
+}
+
+static void l2cap_channel_unschedule(l2cap_channel_t * channel){
+    if (!channel->pending) return;
+    l2cap_channel_queue_remove(&l2cap_channels_pending, channel);
+    l2cap_channel_queue_remove(&l2cap_channels_blocked, channel);
+    channel->pending = 0;
+}
+
+// release local CID and connection list entry, caller removes channel from l2cap_channels or l2cap_le_channels
+static void l2cap_free_channel(l2cap_channel_t * channel){
+    l2cap_release_local_cid(channel);
+#ifdef HAVE_BLE
+    if (!channel->le_credit_based)
+#endif
+    {
+        l2cap_remove_channel_from_handle(channel);
+        l2cap_channel_unschedule(channel);
+    }
+    btstack_memory_l2cap_channel_free(channel);
+}
+
+// nr of ACL packets needed for an SDU of remote MTU size
+static int l2cap_acl_packets_per_sdu(l2cap_channel_t * channel){
+    uint16_t acl_data_packet_length = hci_max_acl_data_packet_length();
+    if (!acl_data_packet_length) return 1;
+    return (channel->remote_mtu + L2CAP_HEADER_SIZE + acl_data_packet_length - 1) / acl_data_packet_length;
+}
+
+// ACL buffers promised to a channel
+static int l2cap_packets_granted_for_channel(l2cap_channel_t * channel){
+    // credits of channels that did not send since they got them don't hold back ACL buffers for the others
+    int credits = channel->credits_scheduled;
+    if (channel->active){
+        credits += channel->packets_granted;
+    }
+    return credits * l2cap_acl_packets_per_sdu(channel);
+}
+
+// keep packets_granted of the connection up to date, called when credits_scheduled, packets_granted or active changed
+static void l2cap_channel_update_packets_promised(l2cap_channel_t * channel){
+#ifdef HAVE_BLE
+    if (channel->le_credit_based) return;
+#endif
+    l2cap_connection_t * connection = l2cap_connection_for_handle(channel->handle);
+    if (!connection) return;
+    int promised = l2cap_packets_granted_for_channel(channel);
+    connection->packets_granted += promised - channel->packets_promised;
+    channel->packets_promised = promised;
+}
+
+static int l2cap_channel_gets_credits(l2cap_channel_t * channel){
+    if (channel->state != L2CAP_STATE_OPEN) return 0;
+#ifdef HAVE_L2CAP_ERTM
+    // ERTM/Streaming channels get credits when tx buffers become free
+    if (channel->mode != L2CAP_CHANNEL_MODE_BASIC) return 0;
+#endif
+    return 1;
+}
+
+static int l2cap_channel_wants_credits(l2cap_channel_t * channel){
+    if (!l2cap_channel_gets_credits(channel)) return 0;
+    return channel->packets_granted < max_credits;
+}
+
+// list channel in the credit queue of its class, called when it might want credits. dropped by hand out if it doesn't
+static void l2cap_channel_queue_for_credits(l2cap_channel_t * channel){
+    if (channel->credits_queued) return;
+    if (!l2cap_channel_wants_credits(channel)) return;
+    l2cap_connection_t * connection = l2cap_connection_for_handle(channel->handle);
+    if (!connection) return;
+    channel->credits_queued = 1;
+    l2cap_credit_queue_add(&connection->credit_queues[channel->priority], channel);
+}
+
+static void l2cap_channel_unqueue_for_credits(l2cap_connection_t * connection, l2cap_channel_t * channel){
+    if (!channel->credits_queued) return;
+    l2cap_channel_queue_t * queue = &connection->credit_queues[channel->priority];
+    l2cap_channel_t * prev = NULL;
+    l2cap_channel_t * it;
+    for (it = queue->head; it; prev = it, it = it->next_credits){
+        if (it != channel) continue;
+        if (prev){
+            prev->next_credits = channel->next_credits;
+        } else {
+            queue->head = channel->next_credits;
+        }
+        if (queue->tail == channel){
+            queue->tail = prev;
+        }
+        break;
+    }
+    channel->credits_queued = 0;
+}
+
+static void l2cap_schedule_credits(l2cap_channel_t * channel, int credits){
+    channel->credits_scheduled += credits;
+    l2cap_channel_update_packets_promised(channel);
+}
+
+// weighted round-robin over the channels of one scheduling class, credits are only assigned here. returns credits assigned
+static int l2cap_schedule_credits_for_class(l2cap_connection_t * connection, uint8_t priority, int single_round){
+    l2cap_channel_queue_t * queue = &connection->credit_queues[priority];
+    int free_slots = hci_number_free_acl_slots_for_handle(connection->handle);
+    int assigned = 0;
+    int progress;
+    do {
+        progress = 0;
+        // one round, served channels go to the end of the queue so others are served first next time
+        l2cap_channel_t * last = queue->tail;
+        l2cap_channel_t * channel;
+        while (free_slots > connection->packets_granted && (channel = l2cap_credit_queue_pop(queue))){
+            if (!l2cap_channel_wants_credits(channel)){
+                channel->credits_queued = 0;
+            } else {
+                int credits = max_credits - channel->packets_granted - channel->credits_scheduled;
+                if (credits > channel->weight) {
+                    credits = channel->weight;
+                }
+                // ACL buffers not promised to other channels on this connection yet
+                int available = (free_slots - connection->packets_granted) / l2cap_acl_packets_per_sdu(channel);
+                if (credits > available) {
+                    credits = available;
+                }
+                if (credits > 0) {
+                    l2cap_schedule_credits(channel, credits);
+                    assigned += credits;
+                    progress = 1;
+                }
+                l2cap_credit_queue_add(queue, channel);
+            }
+            if (channel == last) break;
+        }
+    } while (progress && !single_round);
+
+    // SDU larger than free ACL buffers, hci sends remaining fragments when buffers get free
+    if (!free_slots || connection->packets_granted) return assigned;
+    l2cap_channel_t * channel;
+    for (channel = queue->head; channel; channel = channel->next_credits){
+        if (!l2cap_channel_wants_credits(channel)) continue;
+        if (channel->packets_granted || channel->credits_scheduled) continue;
+        l2cap_schedule_credits(channel, 1);
+        return assigned + 1;
+    }
+    return assigned;
+}
+
+// strict priority between classes, but a class that waited for L2CAP_PRIORITY_MIN_SHARE_CREDITS is served first once
+static void l2cap_schedule_credits_for_connection(l2cap_connection_t * connection){
+    int assigned[L2CAP_PRIORITY_CONTROL + 1];
+    int priority;
+    memset(assigned, 0, sizeof(assigned));
+    for (priority = L2CAP_PRIORITY_CONTROL; priority >= L2CAP_PRIORITY_LOW; priority--){
+        if (connection->credits_skipped[priority] < L2CAP_PRIORITY_MIN_SHARE_CREDITS) continue;
+        assigned[priority] += l2cap_schedule_credits_for_class(connection, priority, 1);
+    }
+    for (priority = L2CAP_PRIORITY_CONTROL; priority >= L2CAP_PRIORITY_LOW; priority--){
+        if (!connection->credit_queues[priority].head) continue;
+        assigned[priority] += l2cap_schedule_credits_for_class(connection, priority, 0);
+    }
+
+    // account credits of higher classes to waiting classes
+    int higher = 0;
+    for (priority = L2CAP_PRIORITY_CONTROL; priority >= L2CAP_PRIORITY_LOW; priority--){
+        if (assigned[priority] || !connection->credit_queues[priority].head){
+            connection->credits_skipped[priority] = 0;
+        } else if (connection->credits_skipped[priority] + higher < 0xffff){
+            connection->credits_skipped[priority] += higher;
+        }
+        higher += assigned[priority];
+    }
+}
+
+// emit credits of one channel per call, the client may send, close channels or disconnect from the event
+static int l2cap_emit_scheduled_credits(void){
+    int i;
+    int priority;
+    for (i = 0; i < L2CAP_CONNECTION_TABLE_SIZE; i++){
+        l2cap_connection_t * connection = &l2cap_connections[i];
+        if (!connection->channels) continue;
+        for (priority = L2CAP_PRIORITY_CONTROL; priority >= L2CAP_PRIORITY_LOW; priority--){
+            l2cap_channel_t * channel;
+            for (channel = connection->credit_queues[priority].head; channel; channel = channel->next_credits){
+                if (!channel->credits_scheduled) continue;
+                uint8_t credits = channel->credits_scheduled;
+                channel->credits_scheduled = 0;
+                l2cap_emit_credits(channel, credits);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void l2cap_hand_out_credits(void){
+
+    if (new_credits_blocked) return;    // we're told not to. used by daemon
+
+    // clients may send from L2CAP_EVENT_CREDITS, schedule again after all credits have been emitted
+    if (hand_out_active) {
+        hand_out_pending = 1;
+        return;
+    }
+    hand_out_active = 1;
+
+    do {
+        hand_out_pending = 0;
+
+        // only visit connections with channels that might want credits
+        int i;
+        int priority;
+        for (i = 0; i < L2CAP_CONNECTION_TABLE_SIZE; i++){
+            l2cap_connection_t * connection = &l2cap_connections[i];
+            if (!connection->channels) continue;
+            for (priority = L2CAP_PRIORITY_CONTROL; priority >= L2CAP_PRIORITY_LOW; priority--){
+                if (connection->credit_queues[priority].head) break;
+            }
+            if (priority < L2CAP_PRIORITY_LOW) continue;
+            l2cap_schedule_credits_for_connection(connection);
+        }
+
+        while (l2cap_emit_scheduled_credits());
+    } while (hand_out_pending && !new_credits_blocked);
+
+    hand_out_active = 0;
+}
+
+// start measuring queueing delay until the next L2CAP_EVENT_CREDITS
+static void l2cap_channel_wait_for_credits(l2cap_channel_t * channel){
+    if (channel->waiting_for_credits) return;
+    channel->waiting_for_credits = 1;
+    channel->waiting_since_ms = run_loop_get_time_ms();
+    channel->statistics.credit_waits++;
+}
+
+static void l2cap_channel_sdu_sent(l2cap_channel_t * channel, uint16_t len){
+    channel->active = 1;
+    l2cap_channel_update_packets_promised(channel);
+    l2cap_channel_queue_for_credits(channel);
+    channel->statistics.bytes_sent += len;
+    channel->statistics.sdus_sent++;
+    if (channel->packets_granted == 0){
+        l2cap_channel_wait_for_credits(channel);
+    }
+}
+
+void l2cap_set_channel_priority(uint16_t local_cid, uint8_t priority, uint8_t weight){
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel) return;
+    // move to credit queue of new class
+    l2cap_connection_t * connection = l2cap_connection_for_handle(channel->handle);
+    if (connection){
+        l2cap_channel_unqueue_for_credits(connection, channel);
+    }
+    channel->priority = priority > L2CAP_PRIORITY_CONTROL ? L2CAP_PRIORITY_CONTROL : priority;
+    channel->weight   = weight ? weight : 1;
+    l2cap_channel_queue_for_credits(channel);
+}
+
+int l2cap_get_channel_statistics(uint16_t local_cid, l2cap_channel_statistics_t * statistics){
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel) return -1;
+    memcpy(statistics, &channel->statistics, sizeof(l2cap_channel_statistics_t));
+    // include current wait for credits
+    if (channel->waiting_for_credits){
+        uint32_t delay_ms = run_loop_get_time_ms() - channel->waiting_since_ms;
+        statistics->queueing_delay_ms += delay_ms;
+        if (delay_ms > statistics->queueing_delay_max_ms){
+            statistics->queueing_delay_max_ms = delay_ms;
+        }
+    }
+    return 0;
+}
+
 int  l2cap_can_send_packet_now(uint16_t local_cid){
     l2cap_channel_t *channel = l2cap_get_channel_for_local_cid(local_cid);
     if (!channel) return 0;
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+        return l2cap_ertm_can_store_packet_now(channel);
+    }
+#endif
     if (!channel->packets_granted) return 0;
     return hci_can_send_acl_packet_now(channel->handle);
 }
 
+// same as l2cap_can_send_packet_now, with the packet buffer reserved by the caller
+int  l2cap_can_send_prepared_packet_now(uint16_t local_cid){
+    l2cap_channel_t *channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel) return 0;
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+        return l2cap_ertm_can_store_packet_now(channel);
+    }
+#endif
+    if (!channel->packets_granted) return 0;
+    return hci_can_send_prepared_acl_packet_now(channel->handle);
+}
+
 // @deprecated
 int l2cap_can_send_connectionless_packet_now(void){
     // TODO provide real handle
@@ -298,7 +870,7 @@ static void l2cap_rtx_timeout(timer_source_t * ts){
     // discard channel
     // no need to stop timer here, it is removed from list during timer callback
     linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
-    btstack_memory_l2cap_channel_free(channel);
+    l2cap_free_channel(channel);
 }
 
 static void l2cap_stop_rtx(l2cap_channel_t * channel){
@@ -368,6 +940,96 @@ int l2cap_send_le_signaling_packet(hci_con_handle_t handle, L2CAP_SIGNALING_COMM
 }
 #endif
 
+// MARK: signaling command batching
+
+// move collected signaling commands into the HCI packet buffer, returns packet len
+static uint16_t l2cap_signaling_batch_prepare(int * security_block){
+    *security_block = signaling_batch_security_block;
+    signaling_batch_security_block = 0;
+    hci_reserve_packet_buffer();
+    uint8_t *acl_buffer = hci_get_outgoing_packet_buffer();
+    int pb = hci_non_flushable_packet_boundary_flag_supported() ? 0x00 : 0x02;
+    bt_store_16(acl_buffer, 0, signaling_batch_handle | (pb << 12) | (0 << 14));
+    bt_store_16(acl_buffer, 2, signaling_batch_len + L2CAP_HEADER_SIZE);
+    bt_store_16(acl_buffer, 4, signaling_batch_len);
+    bt_store_16(acl_buffer, 6, L2CAP_CID_SIGNALING);
+    memcpy(&acl_buffer[COMPLETE_L2CAP_HEADER], signaling_batch, signaling_batch_len);
+    uint16_t len = COMPLETE_L2CAP_HEADER + signaling_batch_len;
+    signaling_batch_len = 0;
+    signaling_statistics.c_frames_sent++;
+    return len;
+}
+
+// send C-frame from l2cap_signaling_batch_prepare
+static void l2cap_signaling_batch_send(hci_con_handle_t handle, uint16_t len, int security_block){
+    hci_send_acl_packet_buffer(len);
+    // disconnect only after the refused connection response is on its way
+    if (security_block){
+        hci_disconnect_security_block(handle);
+    }
+}
+
+// send collected signaling commands, returns 0 if they are still pending
+static int l2cap_signaling_batch_flush(void){
+    if (!signaling_batch_len) return 1;
+    if (!hci_can_send_acl_packet_now(signaling_batch_handle)) return 0;
+    int security_block;
+    uint16_t len = l2cap_signaling_batch_prepare(&security_block);
+    l2cap_signaling_batch_send(signaling_batch_handle, len, security_block);
+    return 1;
+}
+
+// check if a signaling command for handle can be collected now, flushes commands for other handles.
+// A single l2cap_signaling_batch_add is guaranteed to succeed afterwards, check again before each further command
+static int l2cap_signaling_batch_can_send(hci_con_handle_t handle){
+    if (signaling_batch_len && signaling_batch_handle != handle){
+        if (!l2cap_signaling_batch_flush()) return 0;
+    }
+    // a free ACL buffer is reserved for the C-frame
+    return hci_can_send_acl_packet_now(handle);
+}
+
+// add signaling command to C-frame for handle, call only after l2cap_signaling_batch_can_send
+// returns BTSTACK_ACL_BUFFERS_FULL without collecting the command if a full C-frame cannot be sent
+static int l2cap_signaling_batch_add(hci_con_handle_t handle, L2CAP_SIGNALING_COMMANDS cmd, uint8_t identifier, ...){
+    uint8_t command_buffer[COMPLETE_L2CAP_HEADER + L2CAP_SIGNALING_BATCH_MTU];
+    va_list argptr;
+    va_start(argptr, identifier);
+    uint16_t len = l2cap_create_signaling_classic(command_buffer, handle, cmd, identifier, argptr) - COMPLETE_L2CAP_HEADER;
+    va_end(argptr);
+    
+    // start new C-frame if command doesn't fit
+    uint16_t full_len = 0;
+    hci_con_handle_t full_handle = signaling_batch_handle;
+    int security_block = 0;
+    int fits = signaling_batch_handle == handle && signaling_batch_len + len <= L2CAP_SIGNALING_BATCH_MTU;
+    if (signaling_batch_len && !fits){
+        if (!hci_can_send_acl_packet_now(signaling_batch_handle)){
+            log_error("l2cap_signaling_batch_add, cannot send pending commands for handle 0x%04x", signaling_batch_handle);
+            return BTSTACK_ACL_BUFFERS_FULL;
+        }
+        full_len = l2cap_signaling_batch_prepare(&security_block);
+    }
+    signaling_batch_handle = handle;
+    memcpy(&signaling_batch[signaling_batch_len], &command_buffer[COMPLETE_L2CAP_HEADER], len);
+    signaling_batch_len += len;
+    signaling_statistics.commands_sent++;
+    
+    // send previous C-frame
+    if (full_len){
+        l2cap_signaling_batch_send(full_handle, full_len, security_block);
+    }
+    return 0;
+}
+
+void l2cap_get_signaling_statistics(l2cap_signaling_statistics_t * statistics){
+    *statistics = signaling_statistics;
+}
+
+void l2cap_get_run_statistics(l2cap_run_statistics_t * statistics){
+    *statistics = run_statistics;
+}
+
 uint8_t *l2cap_get_outgoing_buffer(void){
     return hci_get_outgoing_packet_buffer() + COMPLETE_L2CAP_HEADER; // 8 bytes
 }
@@ -391,8 +1053,19 @@ int l2cap_send_prepared(uint16_t local_cid, uint16_t len){
     l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
     if (!channel) {
         log_error("l2cap_send_prepared no channel for cid 0x%02x", local_cid);
-        return -1;   // TODO: define error
+        return L2CAP_LOCAL_CID_DOES_NOT_EXIST;
+    }
+
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+        // SDU is stored in tx buffers, I-frames are sent from l2cap_run
+        l2cap_iovec_t iov;
+        iov.data = hci_get_outgoing_packet_buffer() + COMPLETE_L2CAP_HEADER;
+        iov.len  = len;
+        hci_release_packet_buffer();
+        return l2cap_ertm_send_sdu(channel, &iov, 1, len);
     }
+#endif
 
     if (channel->packets_granted == 0){
         log_error("l2cap_send_prepared cid 0x%02x, no credits!", local_cid);
@@ -405,6 +1078,7 @@ int l2cap_send_prepared(uint16_t local_cid, uint16_t len){
     }
     
     --channel->packets_granted;
+    l2cap_channel_sdu_sent(channel, len);
 
     log_debug("l2cap_send_prepared cid 0x%02x, handle %u, 1 credit used, credits left %u;",
                   local_cid, channel->handle, channel->packets_granted);
@@ -463,32 +1137,89 @@ int l2cap_send_prepared_connectionless(uint16_t handle, uint16_t cid, uint16_t l
     return err;
 }
 
-int l2cap_send_internal(uint16_t local_cid, uint8_t *data, uint16_t len){
+// total length of all fragments
+static uint16_t l2cap_iovec_len(const l2cap_iovec_t * iov, int iovcnt){
+    uint16_t len = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++){
+        len += iov[i].len;
+    }
+    return len;
+}
+
+// copy len bytes starting at offset of the concatenated fragments to dest
+static void l2cap_iovec_copy(uint8_t * dest, const l2cap_iovec_t * iov, int iovcnt, uint16_t offset, uint16_t len){
+    int i;
+    for (i = 0; i < iovcnt && len; i++){
+        if (offset >= iov[i].len){
+            offset -= iov[i].len;
+            continue;
+        }
+        uint16_t chunk = iov[i].len - offset;
+        if (chunk > len){
+            chunk = len;
+        }
+        memcpy(dest, &iov[i].data[offset], chunk);
+        dest   += chunk;
+        len    -= chunk;
+        offset  = 0;
+    }
+}
+
+int l2cap_sendv(uint16_t local_cid, const l2cap_iovec_t * iov, int iovcnt){
 
     l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
     if (!channel) {
-        log_error("l2cap_send_internal no channel for cid 0x%02x", local_cid);
-        return -1;   // TODO: define error
+        log_error("l2cap_sendv no channel for cid 0x%02x", local_cid);
+        return L2CAP_LOCAL_CID_DOES_NOT_EXIST;
     }
 
+    uint16_t len = l2cap_iovec_len(iov, iovcnt);
     if (len > channel->remote_mtu){
-        log_error("l2cap_send_internal cid 0x%02x, data length exceeds remote MTU.", local_cid);
+        log_error("l2cap_sendv cid 0x%02x, data length exceeds remote MTU.", local_cid);
         return L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU;
     }
 
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+        return l2cap_ertm_send_sdu(channel, iov, iovcnt, len);
+    }
+#endif
+
     if (!hci_can_send_acl_packet_now(channel->handle)){
-        log_info("l2cap_send_internal cid 0x%02x, cannot send", local_cid);
+        log_info("l2cap_sendv cid 0x%02x, cannot send", local_cid);
         return BTSTACK_ACL_BUFFERS_FULL;
     }
 
     hci_reserve_packet_buffer();
-    uint8_t *acl_buffer = hci_get_outgoing_packet_buffer();
-
-    memcpy(&acl_buffer[8], data, len);
+    l2cap_iovec_copy(l2cap_get_outgoing_buffer(), iov, iovcnt, 0, len);
 
     return l2cap_send_prepared(local_cid, len);
 }
 
+int l2cap_send_internal(uint16_t local_cid, uint8_t *data, uint16_t len){
+    l2cap_iovec_t iov;
+    iov.data = data;
+    iov.len  = len;
+    return l2cap_sendv(local_cid, &iov, 1);
+}
+
+// sends SDUs while possible without queuing them, caller resubmits the rest, see l2cap.h
+int l2cap_send_batch(uint16_t local_cid, uint8_t **data, uint16_t *len, int num_sdus){
+    // hand out new credits once after the batch instead of after each SDU
+    int blocked = new_credits_blocked;
+    new_credits_blocked = 1;
+    int i;
+    for (i = 0; i < num_sdus; i++){
+        if (!l2cap_can_send_packet_now(local_cid)) break;
+        if (l2cap_send_internal(local_cid, data[i], len[i])) break;
+    }
+    new_credits_blocked = blocked;
+    l2cap_hand_out_credits();
+    log_debug("l2cap_send_batch cid 0x%02x, %u of %u SDUs sent", local_cid, i, num_sdus);
+    return i;
+}
+
 int l2cap_send_connectionless(uint16_t handle, uint16_t cid, uint8_t *data, uint16_t len){
     
     if (!hci_can_send_acl_packet_now(handle)){
@@ -510,6 +1241,7 @@ int l2cap_send_echo_request(uint16_t handle, uint8_t *data, uint16_t len){
 
 static inline void channelStateVarSetFlag(l2cap_channel_t *channel, L2CAP_CHANNEL_STATE_VAR flag){
     channel->state_var = (L2CAP_CHANNEL_STATE_VAR) (channel->state_var | flag);
+    l2cap_channel_schedule(channel);
 }
 
 static inline void channelStateVarClearFlag(l2cap_channel_t *channel, L2CAP_CHANNEL_STATE_VAR flag){
@@ -518,74 +1250,1128 @@ static inline void channelStateVarClearFlag(l2cap_channel_t *channel, L2CAP_CHAN
 
 
 
-// MARK: L2CAP_RUN
-// process outstanding signaling tasks
-void l2cap_run(void){
-    
-    // log_info("l2cap_run: entered");
+// Retransmission and Flow Control option { type(8): 4, len(8): 9, mode(8), tx window(8), max transmit(8), retransmission timeout(16), monitor timeout(16), mps(16) }
+static uint16_t l2cap_setup_rfc_option(uint8_t * config_options, uint16_t pos, uint8_t mode, uint8_t tx_window, uint8_t max_transmit,
+                                       uint16_t retransmission_timeout_ms, uint16_t monitor_timeout_ms, uint16_t mps){
+    config_options[pos++] = L2CAP_CONFIG_OPTION_TYPE_RETRANSMISSION_AND_FLOW_CONTROL;
+    config_options[pos++] = 9;
+    config_options[pos++] = mode;
+    config_options[pos++] = tx_window;
+    config_options[pos++] = max_transmit;
+    bt_store_16(config_options, pos, retransmission_timeout_ms);
+    bt_store_16(config_options, pos + 2, monitor_timeout_ms);
+    bt_store_16(config_options, pos + 4, mps);
+    return pos + 6;
+}
+
+#ifdef HAVE_L2CAP_ERTM
+
+// MARK: ERTM / Streaming Mode
+
+// control field, standard format
+#define L2CAP_ERTM_CONTROL_S_FRAME      0x0001
+#define L2CAP_ERTM_SEQ_MASK             0x3f
+
+#define L2CAP_ERTM_SUPERVISORY_RR       0
+#define L2CAP_ERTM_SUPERVISORY_REJ      1
+#define L2CAP_ERTM_SUPERVISORY_RNR      2
+#define L2CAP_ERTM_SUPERVISORY_SREJ     3
+
+#define L2CAP_ERTM_SAR_UNSEGMENTED      0
+#define L2CAP_ERTM_SAR_START            1
+#define L2CAP_ERTM_SAR_END              2
+#define L2CAP_ERTM_SAR_CONTINUATION     3
+
+#define L2CAP_ERTM_CONTROL_SIZE         2
+#define L2CAP_ERTM_SDU_LENGTH_SIZE      2
+#define L2CAP_ERTM_FCS_SIZE             2
+
+// max tx window with standard control field
+#define L2CAP_ERTM_MAX_TX_WINDOW        63
+
+// smallest usable PDU payload: SDU length and some data
+#define L2CAP_ERTM_MIN_MPS              8
+
+// FCS: CRC-16 with polynomial x^16 + x^15 + x^2 + 1, LSB first
+static const uint16_t l2cap_ertm_crc16_table[256] = {
+    0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+    0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+    0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+    0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+    0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+    0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+    0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+    0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+    0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+    0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+    0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+    0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+    0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+    0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+    0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+    0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+    0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+    0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+    0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+    0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+    0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+    0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+    0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+    0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+    0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+    0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+    0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+    0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+    0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+    0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+    0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+    0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040,
+};
+
+static uint16_t l2cap_ertm_crc16_calc(const uint8_t * data, uint16_t len){
+    uint16_t crc = 0;
+    while (len--){
+        crc = (crc >> 8) ^ l2cap_ertm_crc16_table[(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
 
-    // check pending signaling responses
-    while (signaling_responses_pending){
-        
-        hci_con_handle_t handle = signaling_responses[0].handle;
-        
-        if (!hci_can_send_acl_packet_now(handle)) break;
+static inline uint8_t l2cap_ertm_next_seq(uint8_t seq){
+    return (seq + 1) & L2CAP_ERTM_SEQ_MASK;
+}
 
-        uint8_t  sig_id = signaling_responses[0].sig_id;
-        uint16_t infoType = signaling_responses[0].data;    // INFORMATION_REQUEST
-        uint16_t result   = signaling_responses[0].data;    // CONNECTION_REQUEST, COMMAND_REJECT
-        uint8_t  response_code = signaling_responses[0].code;
+// number of frames from seq 'from' to seq 'to'
+static inline uint8_t l2cap_ertm_seq_offset(uint8_t from, uint8_t to){
+    return (to - from) & L2CAP_ERTM_SEQ_MASK;
+}
 
-        // remove first item before sending (to avoid sending response mutliple times)
-        signaling_responses_pending--;
-        int i;
-        for (i=0; i < signaling_responses_pending; i++){
-            memcpy(&signaling_responses[i], &signaling_responses[i+1], sizeof(l2cap_signaling_response_t));
-        }
+// tx buffer index of a stored I-frame
+static inline int l2cap_ertm_tx_index(l2cap_channel_t * channel, uint8_t seq){
+    return (channel->tx_ack_index + l2cap_ertm_seq_offset(channel->expected_ack_seq, seq)) % channel->num_tx_buffers;
+}
+
+// rx buffer index of an out-of-sequence I-frame
+static inline int l2cap_ertm_rx_index(l2cap_channel_t * channel, uint8_t seq){
+    return (channel->rx_expected_index + l2cap_ertm_seq_offset(channel->expected_tx_seq, seq)) % channel->num_rx_buffers;
+}
+
+// max PDU payload used for outgoing I-frames
+static uint16_t l2cap_ertm_tx_mps(l2cap_channel_t * channel){
+    if (channel->remote_mps && channel->remote_mps < channel->local_mps) return channel->remote_mps;
+    return channel->local_mps;
+}
+
+static int l2cap_ertm_num_segments(l2cap_channel_t * channel, uint16_t len){
+    uint16_t mps = l2cap_ertm_tx_mps(channel);
+    if (len <= mps) return 1;
+    // start frame carries SDU length
+    len -= mps - L2CAP_ERTM_SDU_LENGTH_SIZE;
+    return 1 + (len + mps - 1) / mps;
+}
+
+static int l2cap_ertm_num_free_tx_buffers(l2cap_channel_t * channel){
+    return channel->num_tx_buffers - l2cap_ertm_seq_offset(channel->expected_ack_seq, channel->tx_next_seq);
+}
+
+static int l2cap_ertm_can_store_packet_now(l2cap_channel_t * channel){
+    if (channel->state != L2CAP_STATE_OPEN) return 0;
+    return l2cap_ertm_num_free_tx_buffers(channel) >= l2cap_ertm_num_segments(channel, channel->remote_mtu);
+}
+
+// emit L2CAP_EVENT_CREDITS once, if application can send again after it stored an SDU
+static void l2cap_ertm_notify_can_send(l2cap_channel_t * channel){
+    if (channel->packets_granted) return;
+    if (!l2cap_ertm_can_store_packet_now(channel)) return;
+    l2cap_emit_credits(channel, 1);
+}
+
+static int l2cap_ertm_setup_buffers(l2cap_channel_t * channel, l2cap_ertm_config_t * config, uint8_t * buffer, uint32_t size){
+    int num_rx_buffers = config->mode == L2CAP_CHANNEL_MODE_STREAMING ? 0 : config->num_rx_buffers;
+    if (config->num_tx_buffers == 0 || config->num_tx_buffers > L2CAP_ERTM_MAX_TX_WINDOW) return -1;
+    if (config->mode == L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION && num_rx_buffers == 0) return -1;
+    if (num_rx_buffers > L2CAP_ERTM_MAX_TX_WINDOW) return -1;
+    if (config->mode != L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION && config->mode != L2CAP_CHANNEL_MODE_STREAMING) return -1;
+
+    // packet states first, 4 byte aligned
+    uint32_t pos = (4 - (((uintptr_t) buffer) & 3)) & 3;
+    uint32_t tx_state_pos = pos;
+    pos += config->num_tx_buffers * sizeof(l2cap_ertm_tx_packet_state_t);
+    uint32_t rx_state_pos = pos;
+    pos += num_rx_buffers * sizeof(l2cap_ertm_rx_packet_state_t);
+    uint32_t reassembly_pos = pos;
+    pos += config->local_mtu;
+    if (pos >= size) return -1;
+
+    // remaining space is split into tx and rx buffers, limited by a single ACL packet
+    uint32_t mps = (size - pos) / (config->num_tx_buffers + num_rx_buffers);
+    uint16_t max_mps = l2cap_max_mtu() - L2CAP_ERTM_CONTROL_SIZE - L2CAP_ERTM_FCS_SIZE;
+    if (mps > max_mps) mps = max_mps;
+    if (mps < L2CAP_ERTM_MIN_MPS) return -1;
+
+    channel->tx_packets_state  = (l2cap_ertm_tx_packet_state_t *) &buffer[tx_state_pos];
+    channel->rx_packets_state  = (l2cap_ertm_rx_packet_state_t *) &buffer[rx_state_pos];
+    channel->reassembly_buffer = &buffer[reassembly_pos];
+    channel->tx_packets_data   = &buffer[pos];
+    channel->rx_packets_data   = &buffer[pos + config->num_tx_buffers * mps];
+    channel->num_tx_buffers    = config->num_tx_buffers;
+    channel->num_rx_buffers    = num_rx_buffers;
+    channel->local_mps         = mps;
+    channel->local_mtu         = config->local_mtu;
+    channel->local_tx_window   = num_rx_buffers;
+    channel->local_max_transmit = config->max_transmit;
+    channel->local_fcs_option  = config->fcs_option;
+    channel->mode              = config->mode;
+    channel->mode_mandatory    = config->mode_mandatory;
+    channel->retransmission_timeout_ms = config->retransmission_timeout_ms ? config->retransmission_timeout_ms : L2CAP_ERTM_RETRANSMISSION_TIMEOUT_MS;
+    channel->monitor_timeout_ms        = config->monitor_timeout_ms        ? config->monitor_timeout_ms        : L2CAP_ERTM_MONITOR_TIMEOUT_MS;
+
+    // remote defaults until its configuration request is received
+    channel->remote_mode       = L2CAP_CHANNEL_MODE_BASIC;
+    channel->remote_fcs_option = 1;
+    channel->remote_tx_window  = 1;
+    channel->remote_mps        = mps;
+
+    log_info("l2cap_ertm_setup_buffers mode %u, mtu %u, mps %u, %u tx and %u rx buffers", channel->mode, channel->local_mtu, mps,
+        channel->num_tx_buffers, channel->num_rx_buffers);
+    return 0;
+}
+
+static void l2cap_ertm_fallback_to_basic_mode(l2cap_channel_t * channel){
+    log_info("l2cap cid 0x%02x, remote does not support mode %u, use Basic mode", channel->local_cid, channel->mode);
+    channel->mode = L2CAP_CHANNEL_MODE_BASIC;
+    // SDUs are not segmented in Basic mode
+    if (channel->local_mtu > l2cap_max_mtu()){
+        channel->local_mtu = l2cap_max_mtu();
+    }
+}
+
+// called before L2CAP_EVENT_CHANNEL_OPENED is emitted
+static void l2cap_ertm_channel_opened(l2cap_channel_t * channel){
+    if (channel->mode == L2CAP_CHANNEL_MODE_BASIC) return;
+    channel->fcs_option = channel->local_fcs_option || channel->remote_fcs_option;
+    channel->tx_state = L2CAP_ERTM_TX_STATE_XMIT;
+    channel->tx_next_seq = 0;
+    channel->tx_send_seq = 0;
+    channel->tx_high_seq = 0;
+    channel->tx_ack_index = 0;
+    channel->expected_ack_seq = 0;
+    channel->expected_tx_seq = 0;
+    channel->rx_expected_index = 0;
+    channel->reassembly_sdu_length = 0;
+    channel->reassembly_pos = 0;
+    memset(channel->rx_packets_state, 0, channel->num_rx_buffers * sizeof(l2cap_ertm_rx_packet_state_t));
+    // SDUs larger than all tx buffers cannot be sent
+    uint32_t max_sdu = channel->num_tx_buffers * l2cap_ertm_tx_mps(channel) - L2CAP_ERTM_SDU_LENGTH_SIZE;
+    if (channel->remote_mtu > max_sdu){
+        channel->remote_mtu = max_sdu;
+    }
+    log_info("l2cap cid 0x%02x, mode %u, fcs %u, tx window %u, remote tx window %u, tx mps %u", channel->local_cid, channel->mode,
+        channel->fcs_option, channel->local_tx_window, channel->remote_tx_window, l2cap_ertm_tx_mps(channel));
+    // application may have stored SDUs already
+    l2cap_channel_schedule(channel);
+}
+
+static l2cap_channel_t * l2cap_ertm_channel_for_timer(timer_source_t * ts){
+    linked_list_iterator_t it;    
+    linked_list_iterator_init(&it, &l2cap_channels);
+    while (linked_list_iterator_has_next(&it)){
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+        if (&channel->ertm_timer == ts || &channel->ack_timer == ts) {
+            return channel;
+        }
+    }
+    return NULL;
+}
+
+static void l2cap_ertm_timeout(timer_source_t * ts);
+static void l2cap_ertm_ack_timeout(timer_source_t * ts);
+
+static void l2cap_ertm_stop_timer(l2cap_channel_t * channel){
+    if (!channel->ertm_timer_active) return;
+    run_loop_remove_timer(&channel->ertm_timer);
+    channel->ertm_timer_active = 0;
+}
+
+// Retransmission timer in XMIT, Monitor timer in WAIT_F
+static void l2cap_ertm_start_timer(l2cap_channel_t * channel){
+    l2cap_ertm_stop_timer(channel);
+    uint16_t timeout_ms = channel->tx_state == L2CAP_ERTM_TX_STATE_XMIT ? channel->retransmission_timeout_ms : channel->monitor_timeout_ms;
+    run_loop_set_timer_handler(&channel->ertm_timer, l2cap_ertm_timeout);
+    run_loop_set_timer(&channel->ertm_timer, timeout_ms);
+    run_loop_add_timer(&channel->ertm_timer);
+    channel->ertm_timer_active = 1;
+}
+
+static void l2cap_ertm_stop_ack_timer(l2cap_channel_t * channel){
+    if (!channel->ack_timer_active) return;
+    run_loop_remove_timer(&channel->ack_timer);
+    channel->ack_timer_active = 0;
+}
+
+static void l2cap_ertm_start_ack_timer(l2cap_channel_t * channel){
+    if (channel->ack_timer_active) return;
+    run_loop_set_timer_handler(&channel->ack_timer, l2cap_ertm_ack_timeout);
+    run_loop_set_timer(&channel->ack_timer, L2CAP_ERTM_ACK_TIMEOUT_MS);
+    run_loop_add_timer(&channel->ack_timer);
+    channel->ack_timer_active = 1;
+}
+
+static void l2cap_ertm_stop_timers(l2cap_channel_t * channel){
+    if (channel->mode == L2CAP_CHANNEL_MODE_BASIC) return;
+    l2cap_ertm_stop_timer(channel);
+    l2cap_ertm_stop_ack_timer(channel);
+}
+
+static void l2cap_ertm_timeout(timer_source_t * ts){
+    l2cap_channel_t * channel = l2cap_ertm_channel_for_timer(ts);
+    if (!channel) return;
+    channel->ertm_timer_active = 0;
+    if (channel->state != L2CAP_STATE_OPEN) return;
+    if (channel->tx_state == L2CAP_ERTM_TX_STATE_XMIT){
+        // Retransmission timer: I-frames not acknowledged, poll remote
+        log_info("l2cap cid 0x%02x, retransmission timeout", channel->local_cid);
+        channel->tx_state = L2CAP_ERTM_TX_STATE_WAIT_F;
+        channel->retry_count = 1;
+        channel->send_poll = 1;
+    } else if (channel->remote_max_transmit && channel->retry_count >= channel->remote_max_transmit){
+        // Monitor timer: no response to polls
+        log_info("l2cap cid 0x%02x, no response to poll, disconnect", channel->local_cid);
+        channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+        l2cap_channel_schedule(channel);
+    } else {
+        log_info("l2cap cid 0x%02x, monitor timeout", channel->local_cid);
+        channel->retry_count++;
+        channel->send_poll = 1;
+    }
+    l2cap_channel_schedule(channel);
+    l2cap_run();
+}
+
+static void l2cap_ertm_ack_timeout(timer_source_t * ts){
+    l2cap_channel_t * channel = l2cap_ertm_channel_for_timer(ts);
+    if (!channel) return;
+    channel->ack_timer_active = 0;
+    if (channel->state != L2CAP_STATE_OPEN) return;
+    if (channel->unacked_rx_frames){
+        channel->send_rr = 1;
+        l2cap_channel_schedule(channel);
+    }
+    l2cap_run();
+}
+
+// add basic L2CAP header, control field and FCS to payload at acl_buffer[10]. @returns size of ACL packet
+static uint16_t l2cap_ertm_setup_pdu(l2cap_channel_t * channel, uint8_t * acl_buffer, uint16_t control, uint16_t payload_len){
+    uint16_t l2cap_len = L2CAP_ERTM_CONTROL_SIZE + payload_len + (channel->fcs_option ? L2CAP_ERTM_FCS_SIZE : 0);
+    int pb = hci_non_flushable_packet_boundary_flag_supported() ? 0x00 : 0x02;
+    // 0 - Connection handle : PB=pb : BC=00 
+    bt_store_16(acl_buffer, 0, channel->handle | (pb << 12) | (0 << 14));
+    // 2 - ACL length
+    bt_store_16(acl_buffer, 2, l2cap_len + L2CAP_HEADER_SIZE);
+    // 4 - L2CAP packet length
+    bt_store_16(acl_buffer, 4, l2cap_len);
+    // 6 - L2CAP channel DEST
+    bt_store_16(acl_buffer, 6, channel->remote_cid);
+    // 8 - Control
+    bt_store_16(acl_buffer, 8, control);
+    uint16_t pos = COMPLETE_L2CAP_HEADER + L2CAP_ERTM_CONTROL_SIZE + payload_len;
+    if (channel->fcs_option){
+        // FCS covers basic L2CAP header, control and payload
+        bt_store_16(acl_buffer, pos, l2cap_ertm_crc16_calc(&acl_buffer[HCI_ACL_HEADER_SIZE], pos - HCI_ACL_HEADER_SIZE));
+        pos += L2CAP_ERTM_FCS_SIZE;
+    }
+    return pos;
+}
+
+// frames carrying ReqSeq = ExpectedTxSeq acknowledge all received I-frames
+static void l2cap_ertm_rx_frames_acknowledged(l2cap_channel_t * channel){
+    channel->unacked_rx_frames = 0;
+    channel->send_rr = 0;
+    l2cap_ertm_stop_ack_timer(channel);
+}
+
+static void l2cap_ertm_send_s_frame(l2cap_channel_t * channel, uint8_t supervisory, uint8_t poll, uint8_t final, uint8_t req_seq){
+    log_debug("l2cap cid 0x%02x, send S-frame %u, p %u, f %u, req_seq %u", channel->local_cid, supervisory, poll, final, req_seq);
+    if (supervisory != L2CAP_ERTM_SUPERVISORY_SREJ){
+        l2cap_ertm_rx_frames_acknowledged(channel);
+    }
+    hci_reserve_packet_buffer();
+    uint8_t * acl_buffer = hci_get_outgoing_packet_buffer();
+    uint16_t control = (req_seq << 8) | (final << 7) | (poll << 4) | (supervisory << 2) | L2CAP_ERTM_CONTROL_S_FRAME;
+    uint16_t len = l2cap_ertm_setup_pdu(channel, acl_buffer, control, 0);
+    hci_send_acl_packet_buffer(len);
+}
+
+// copy stored I-frame into HCI packet buffer. @returns size of ACL packet
+static uint16_t l2cap_ertm_prepare_i_frame(l2cap_channel_t * channel, uint8_t tx_seq){
+    int index = l2cap_ertm_tx_index(channel, tx_seq);
+    l2cap_ertm_tx_packet_state_t * tx_state = &channel->tx_packets_state[index];
+    hci_reserve_packet_buffer();
+    uint8_t * acl_buffer = hci_get_outgoing_packet_buffer();
+    memcpy(&acl_buffer[COMPLETE_L2CAP_HEADER + L2CAP_ERTM_CONTROL_SIZE], &channel->tx_packets_data[index * channel->local_mps], tx_state->len);
+    uint8_t req_seq = 0;
+    if (channel->mode == L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION){
+        req_seq = channel->expected_tx_seq;
+        l2cap_ertm_rx_frames_acknowledged(channel);
+    }
+    uint16_t control = (tx_state->sar << 14) | (req_seq << 8) | (tx_seq << 1);
+    return l2cap_ertm_setup_pdu(channel, acl_buffer, control, tx_state->len);
+}
+
+// segment SDU into tx buffers
+static int l2cap_ertm_store_sdu(l2cap_channel_t * channel, const l2cap_iovec_t * iov, int iovcnt, uint16_t len){
+    if (l2cap_ertm_num_free_tx_buffers(channel) < l2cap_ertm_num_segments(channel, len)){
+        log_info("l2cap_ertm_store_sdu cid 0x%02x, not enough tx buffers", channel->local_cid);
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+    uint16_t mps = l2cap_ertm_tx_mps(channel);
+    uint16_t pos = 0;
+    do {
+        int index = l2cap_ertm_tx_index(channel, channel->tx_next_seq);
+        l2cap_ertm_tx_packet_state_t * tx_state = &channel->tx_packets_state[index];
+        uint8_t * payload = &channel->tx_packets_data[index * channel->local_mps];
+        uint16_t payload_len = 0;
+        uint16_t chunk;
+        if (pos == 0 && len <= mps){
+            tx_state->sar = L2CAP_ERTM_SAR_UNSEGMENTED;
+            chunk = len;
+        } else if (pos == 0){
+            tx_state->sar = L2CAP_ERTM_SAR_START;
+            bt_store_16(payload, 0, len);
+            payload_len = L2CAP_ERTM_SDU_LENGTH_SIZE;
+            chunk = mps - L2CAP_ERTM_SDU_LENGTH_SIZE;
+        } else {
+            chunk = len - pos;
+            if (chunk > mps){
+                chunk = mps;
+            }
+            tx_state->sar = (pos + chunk == len) ? L2CAP_ERTM_SAR_END : L2CAP_ERTM_SAR_CONTINUATION;
+        }
+        l2cap_iovec_copy(&payload[payload_len], iov, iovcnt, pos, chunk);
+        pos += chunk;
+        tx_state->len = payload_len + chunk;
+        tx_state->transmissions = 0;
+        tx_state->retransmission_requested = 0;
+        channel->tx_next_seq = l2cap_ertm_next_seq(channel->tx_next_seq);
+    } while (pos < len);
+    // application has to wait for L2CAP_EVENT_CREDITS, if it cannot send another SDU
+    channel->packets_granted = 0;
+    l2cap_channel_update_packets_promised(channel);
+    return 0;
+}
+
+static int l2cap_ertm_send_sdu(l2cap_channel_t * channel, const l2cap_iovec_t * iov, int iovcnt, uint16_t len){
+    if (channel->state != L2CAP_STATE_OPEN){
+        log_error("l2cap_ertm_send_sdu cid 0x%02x, channel not open", channel->local_cid);
+        return L2CAP_CHANNEL_NOT_OPEN;
+    }
+    if (len > channel->remote_mtu){
+        log_error("l2cap_ertm_send_sdu cid 0x%02x, data length exceeds remote MTU.", channel->local_cid);
+        return L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU;
+    }
+    int err = l2cap_ertm_store_sdu(channel, iov, iovcnt, len);
+    if (err) return err;
+    l2cap_channel_sdu_sent(channel, len);
+    l2cap_channel_schedule(channel);
+    l2cap_run();
+    return 0;
+}
+
+static void l2cap_ertm_reset_reassembly(l2cap_channel_t * channel){
+    channel->reassembly_sdu_length = 0;
+    channel->reassembly_pos = 0;
+}
+
+static void l2cap_ertm_reassemble(l2cap_channel_t * channel, uint8_t sar, uint8_t * payload, uint16_t len){
+    switch (sar){
+        case L2CAP_ERTM_SAR_UNSEGMENTED:
+            if (channel->reassembly_sdu_length){
+                log_error("l2cap cid 0x%02x, unsegmented SDU during reassembly, drop partial SDU", channel->local_cid);
+                l2cap_ertm_reset_reassembly(channel);
+            }
+            l2cap_dispatch(channel, L2CAP_DATA_PACKET, payload, len);
+            break;
+        case L2CAP_ERTM_SAR_START: {
+            l2cap_ertm_reset_reassembly(channel);
+            if (len < L2CAP_ERTM_SDU_LENGTH_SIZE) break;
+            uint16_t sdu_length = READ_BT_16(payload, 0);
+            len -= L2CAP_ERTM_SDU_LENGTH_SIZE;
+            if (sdu_length > channel->local_mtu || len >= sdu_length){
+                log_error("l2cap cid 0x%02x, invalid SDU length %u", channel->local_cid, sdu_length);
+                break;
+            }
+            memcpy(channel->reassembly_buffer, &payload[L2CAP_ERTM_SDU_LENGTH_SIZE], len);
+            channel->reassembly_sdu_length = sdu_length;
+            channel->reassembly_pos = len;
+            break;
+        }
+        default:
+            // continuation or end
+            if (!channel->reassembly_sdu_length) break;
+            if (channel->reassembly_pos + len > channel->reassembly_sdu_length){
+                log_error("l2cap cid 0x%02x, SDU longer than announced, drop", channel->local_cid);
+                l2cap_ertm_reset_reassembly(channel);
+                break;
+            }
+            memcpy(&channel->reassembly_buffer[channel->reassembly_pos], payload, len);
+            channel->reassembly_pos += len;
+            if (sar == L2CAP_ERTM_SAR_CONTINUATION) break;
+            if (channel->reassembly_pos == channel->reassembly_sdu_length){
+                uint16_t sdu_length = channel->reassembly_sdu_length;
+                l2cap_ertm_reset_reassembly(channel);
+                l2cap_dispatch(channel, L2CAP_DATA_PACKET, channel->reassembly_buffer, sdu_length);
+            } else {
+                log_error("l2cap cid 0x%02x, SDU shorter than announced, drop", channel->local_cid);
+                l2cap_ertm_reset_reassembly(channel);
+            }
+            break;
+    }
+}
+
+// @returns 1 if ReqSeq acknowledges sent I-frames or nothing, 0 if invalid
+static int l2cap_ertm_process_req_seq(l2cap_channel_t * channel, uint8_t req_seq){
+    uint8_t num_acked = l2cap_ertm_seq_offset(channel->expected_ack_seq, req_seq);
+    uint8_t num_unacked = l2cap_ertm_seq_offset(channel->expected_ack_seq, channel->tx_high_seq);
+    if (num_acked > num_unacked){
+        log_error("l2cap cid 0x%02x, invalid ReqSeq %u", channel->local_cid, req_seq);
+        return 0;
+    }
+    if (!num_acked) return 1;
+    // free tx buffers
+    if (l2cap_ertm_seq_offset(channel->expected_ack_seq, channel->tx_send_seq) < num_acked){
+        channel->tx_send_seq = req_seq;
+    }
+    channel->expected_ack_seq = req_seq;
+    channel->tx_ack_index = (channel->tx_ack_index + num_acked) % channel->num_tx_buffers;
+    // Retransmission timer runs while I-frames are unacknowledged
+    if (channel->tx_state == L2CAP_ERTM_TX_STATE_XMIT){
+        if (channel->expected_ack_seq == channel->tx_high_seq){
+            l2cap_ertm_stop_timer(channel);
+        } else {
+            l2cap_ertm_start_timer(channel);
+        }
+    }
+    return 1;
+}
+
+// retransmit all unacknowledged I-frames, e.g. after REJ
+static void l2cap_ertm_retransmit_all(l2cap_channel_t * channel){
+    channel->tx_send_seq = channel->expected_ack_seq;
+}
+
+static void l2cap_ertm_handle_final(l2cap_channel_t * channel){
+    if (channel->tx_state != L2CAP_ERTM_TX_STATE_WAIT_F) return;
+    // poll answered, remote reported its receive state
+    l2cap_ertm_stop_timer(channel);
+    channel->tx_state = L2CAP_ERTM_TX_STATE_XMIT;
+    channel->retry_count = 0;
+    l2cap_ertm_retransmit_all(channel);
+}
+
+static int l2cap_ertm_srej_active(l2cap_channel_t * channel){
+    int i;
+    for (i=0;i<channel->num_rx_buffers;i++){
+        if (channel->rx_packets_state[i].state != L2CAP_ERTM_RX_SLOT_EMPTY) return 1;
+    }
+    return 0;
+}
+
+static void l2cap_ertm_handle_out_of_sequence_i_frame(l2cap_channel_t * channel, uint8_t tx_seq, uint8_t sar, uint8_t * payload, uint16_t len){
+    uint8_t offset = l2cap_ertm_seq_offset(channel->expected_tx_seq, tx_seq);
+    int index = l2cap_ertm_rx_index(channel, tx_seq);
+    l2cap_ertm_rx_packet_state_t * rx_state = &channel->rx_packets_state[index];
+    // duplicate
+    if (rx_state->state == L2CAP_ERTM_RX_SLOT_RECEIVED) return;
+    // discard until requested I-frame arrives
+    if (channel->rej_sent) return;
+    if (offset > 1 && !l2cap_ertm_srej_active(channel)){
+        // several I-frames missing, request retransmission of all of them
+        log_info("l2cap cid 0x%02x, %u I-frames missing, send REJ", channel->local_cid, offset);
+        channel->rej_sent = 1;
+        channel->send_rej = 1;
+        return;
+    }
+    if (len > channel->local_mps) return;
+    // keep I-frame and request missing ones selectively
+    memcpy(&channel->rx_packets_data[index * channel->local_mps], payload, len);
+    rx_state->state = L2CAP_ERTM_RX_SLOT_RECEIVED;
+    rx_state->sar = sar;
+    rx_state->len = len;
+    int i;
+    for (i=0;i<offset;i++){
+        rx_state = &channel->rx_packets_state[(channel->rx_expected_index + i) % channel->num_rx_buffers];
+        if (rx_state->state != L2CAP_ERTM_RX_SLOT_EMPTY) continue;
+        rx_state->state = L2CAP_ERTM_RX_SLOT_SREJ_PENDING;
+    }
+}
+
+static void l2cap_ertm_handle_i_frame(l2cap_channel_t * channel, uint8_t tx_seq, uint8_t sar, uint8_t * payload, uint16_t len){
+    uint8_t offset = l2cap_ertm_seq_offset(channel->expected_tx_seq, tx_seq);
+    if (offset >= channel->local_tx_window){
+        log_info("l2cap cid 0x%02x, I-frame %u outside tx window, expected %u", channel->local_cid, tx_seq, channel->expected_tx_seq);
+        return;
+    }
+    if (offset){
+        l2cap_ertm_handle_out_of_sequence_i_frame(channel, tx_seq, sar, payload, len);
+        return;
+    }
+    channel->rej_sent = 0;
+    channel->rx_packets_state[channel->rx_expected_index].state = L2CAP_ERTM_RX_SLOT_EMPTY;
+    channel->expected_tx_seq = l2cap_ertm_next_seq(channel->expected_tx_seq);
+    channel->rx_expected_index = (channel->rx_expected_index + 1) % channel->num_rx_buffers;
+    channel->unacked_rx_frames++;
+    l2cap_ertm_reassemble(channel, sar, payload, len);
+    // deliver stored I-frames that are in sequence now
+    while (channel->state == L2CAP_STATE_OPEN){
+        int index = channel->rx_expected_index;
+        l2cap_ertm_rx_packet_state_t * rx_state = &channel->rx_packets_state[index];
+        if (rx_state->state != L2CAP_ERTM_RX_SLOT_RECEIVED) break;
+        rx_state->state = L2CAP_ERTM_RX_SLOT_EMPTY;
+        channel->expected_tx_seq = l2cap_ertm_next_seq(channel->expected_tx_seq);
+        channel->rx_expected_index = (channel->rx_expected_index + 1) % channel->num_rx_buffers;
+        channel->unacked_rx_frames++;
+        l2cap_ertm_reassemble(channel, rx_state->sar, &channel->rx_packets_data[index * channel->local_mps], rx_state->len);
+    }
+    // acknowledge when half of the tx window is used, otherwise after ack timeout
+    if (channel->unacked_rx_frames >= (channel->local_tx_window + 1) / 2){
+        channel->send_rr = 1;
+    } else {
+        l2cap_ertm_start_ack_timer(channel);
+    }
+}
+
+static void l2cap_ertm_handle_pdu(l2cap_channel_t * channel, uint8_t * packet, uint16_t size){
+    uint16_t pdu_end = size;
+    if (size < COMPLETE_L2CAP_HEADER + L2CAP_ERTM_CONTROL_SIZE) return;
+    if (channel->fcs_option){
+        if (size < COMPLETE_L2CAP_HEADER + L2CAP_ERTM_CONTROL_SIZE + L2CAP_ERTM_FCS_SIZE) return;
+        pdu_end -= L2CAP_ERTM_FCS_SIZE;
+        if (l2cap_ertm_crc16_calc(&packet[HCI_ACL_HEADER_SIZE], pdu_end - HCI_ACL_HEADER_SIZE) != READ_BT_16(packet, pdu_end)){
+            log_error("l2cap cid 0x%02x, FCS error, drop PDU", channel->local_cid);
+            return;
+        }
+    }
+    uint16_t control = READ_BT_16(packet, COMPLETE_L2CAP_HEADER);
+    uint8_t  req_seq = (control >> 8) & L2CAP_ERTM_SEQ_MASK;
+    uint8_t  final   = (control >> 7) & 1;
+    uint8_t * payload = &packet[COMPLETE_L2CAP_HEADER + L2CAP_ERTM_CONTROL_SIZE];
+    uint16_t payload_len = pdu_end - (COMPLETE_L2CAP_HEADER + L2CAP_ERTM_CONTROL_SIZE);
+
+    if (channel->mode == L2CAP_CHANNEL_MODE_STREAMING){
+        // no S-frames and no retransmissions, drop partial SDU on missing I-frames
+        if (control & L2CAP_ERTM_CONTROL_S_FRAME) return;
+        uint8_t tx_seq = (control >> 1) & L2CAP_ERTM_SEQ_MASK;
+        if (tx_seq != channel->expected_tx_seq){
+            log_info("l2cap cid 0x%02x, %u I-frames lost", channel->local_cid, l2cap_ertm_seq_offset(channel->expected_tx_seq, tx_seq));
+            l2cap_ertm_reset_reassembly(channel);
+        }
+        channel->expected_tx_seq = l2cap_ertm_next_seq(tx_seq);
+        l2cap_ertm_reassemble(channel, control >> 14, payload, payload_len);
+        return;
+    }
+
+    if (control & L2CAP_ERTM_CONTROL_S_FRAME){
+        uint8_t supervisory = (control >> 2) & 0x03;
+        uint8_t poll = (control >> 4) & 1;
+        log_debug("l2cap cid 0x%02x, received S-frame %u, p %u, f %u, req_seq %u", channel->local_cid, supervisory, poll, final, req_seq);
+        if (supervisory == L2CAP_ERTM_SUPERVISORY_SREJ){
+            // retransmit single I-frame, ReqSeq doesn't acknowledge
+            if (l2cap_ertm_seq_offset(channel->expected_ack_seq, req_seq) < l2cap_ertm_seq_offset(channel->expected_ack_seq, channel->tx_high_seq)){
+                channel->tx_packets_state[l2cap_ertm_tx_index(channel, req_seq)].retransmission_requested = 1;
+            }
+        } else {
+            if (!l2cap_ertm_process_req_seq(channel, req_seq)) return;
+            channel->remote_busy = supervisory == L2CAP_ERTM_SUPERVISORY_RNR;
+            if (supervisory == L2CAP_ERTM_SUPERVISORY_REJ){
+                l2cap_ertm_retransmit_all(channel);
+            }
+        }
+        if (final){
+            l2cap_ertm_handle_final(channel);
+        }
+        if (poll){
+            channel->send_final = 1;
+        }
+    } else {
+        uint8_t tx_seq = (control >> 1) & L2CAP_ERTM_SEQ_MASK;
+        if (!l2cap_ertm_process_req_seq(channel, req_seq)) return;
+        if (final){
+            l2cap_ertm_handle_final(channel);
+        }
+        l2cap_ertm_handle_i_frame(channel, tx_seq, control >> 14, payload, payload_len);
+    }
+    l2cap_ertm_notify_can_send(channel);
+}
+
+// @returns seq of I-frame requested by SREJ or -1
+static int l2cap_ertm_next_requested_retransmission(l2cap_channel_t * channel){
+    uint8_t seq = channel->expected_ack_seq;
+    while (seq != channel->tx_high_seq){
+        if (channel->tx_packets_state[l2cap_ertm_tx_index(channel, seq)].retransmission_requested) return seq;
+        seq = l2cap_ertm_next_seq(seq);
+    }
+    return -1;
+}
+
+// @returns seq of missing I-frame to request with SREJ or -1
+static int l2cap_ertm_next_srej(l2cap_channel_t * channel){
+    int i;
+    for (i=0;i<channel->num_rx_buffers;i++){
+        l2cap_ertm_rx_packet_state_t * rx_state = &channel->rx_packets_state[(channel->rx_expected_index + i) % channel->num_rx_buffers];
+        if (rx_state->state != L2CAP_ERTM_RX_SLOT_SREJ_PENDING) continue;
+        rx_state->state = L2CAP_ERTM_RX_SLOT_SREJ_SENT;
+        return (channel->expected_tx_seq + i) & L2CAP_ERTM_SEQ_MASK;
+    }
+    return -1;
+}
+
+// @returns seq of next I-frame to (re)transmit or -1
+static int l2cap_ertm_next_i_frame(l2cap_channel_t * channel){
+    // I-frames are not sent while waiting for Final bit or while remote is busy
+    if (channel->tx_state != L2CAP_ERTM_TX_STATE_XMIT || channel->remote_busy) return -1;
+    int seq = l2cap_ertm_next_requested_retransmission(channel);
+    if (seq >= 0) return seq;
+    if (channel->tx_send_seq == channel->tx_next_seq) return -1;
+    if (channel->tx_send_seq == channel->tx_high_seq){
+        // new I-frame, limited by remote tx window and own tx buffers
+        int tx_window = channel->remote_tx_window < channel->num_tx_buffers ? channel->remote_tx_window : channel->num_tx_buffers;
+        if (l2cap_ertm_seq_offset(channel->expected_ack_seq, channel->tx_high_seq) >= tx_window) return -1;
+    }
+    return channel->tx_send_seq;
+}
+
+static void l2cap_ertm_run(l2cap_channel_t * channel){
+    int tx_buffers_freed = 0;
+    while (channel->state == L2CAP_STATE_OPEN && hci_can_send_acl_packet_now(channel->handle)){
+
+        if (channel->mode == L2CAP_CHANNEL_MODE_STREAMING){
+            if (channel->tx_send_seq == channel->tx_next_seq) break;
+            uint16_t len = l2cap_ertm_prepare_i_frame(channel, channel->tx_send_seq);
+            // no retransmissions, tx buffer is free after sending
+            channel->tx_send_seq = l2cap_ertm_next_seq(channel->tx_send_seq);
+            channel->tx_high_seq = channel->tx_send_seq;
+            channel->expected_ack_seq = channel->tx_send_seq;
+            channel->tx_ack_index = (channel->tx_ack_index + 1) % channel->num_tx_buffers;
+            tx_buffers_freed = 1;
+            hci_send_acl_packet_buffer(len);
+            continue;
+        }
+
+        // answer poll
+        if (channel->send_final){
+            channel->send_final = 0;
+            l2cap_ertm_send_s_frame(channel, L2CAP_ERTM_SUPERVISORY_RR, 0, 1, channel->expected_tx_seq);
+            continue;
+        }
+
+        // poll remote after Retransmission or Monitor timeout
+        if (channel->send_poll){
+            channel->send_poll = 0;
+            l2cap_ertm_start_timer(channel);
+            l2cap_ertm_send_s_frame(channel, L2CAP_ERTM_SUPERVISORY_RR, 1, 0, channel->expected_tx_seq);
+            continue;
+        }
+
+        // request missing I-frames
+        int seq = l2cap_ertm_next_srej(channel);
+        if (seq >= 0){
+            l2cap_ertm_send_s_frame(channel, L2CAP_ERTM_SUPERVISORY_SREJ, 0, 0, seq);
+            continue;
+        }
+        if (channel->send_rej){
+            channel->send_rej = 0;
+            l2cap_ertm_send_s_frame(channel, L2CAP_ERTM_SUPERVISORY_REJ, 0, 0, channel->expected_tx_seq);
+            continue;
+        }
+
+        // send or retransmit I-frame, acknowledges received I-frames, too
+        seq = l2cap_ertm_next_i_frame(channel);
+        if (seq >= 0){
+            l2cap_ertm_tx_packet_state_t * tx_state = &channel->tx_packets_state[l2cap_ertm_tx_index(channel, seq)];
+            if (channel->remote_max_transmit && tx_state->transmissions >= channel->remote_max_transmit){
+                log_info("l2cap cid 0x%02x, I-frame %u sent %u times, disconnect", channel->local_cid, seq, tx_state->transmissions);
+                channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+                l2cap_channel_schedule(channel);
+                break;
+            }
+            tx_state->transmissions++;
+            tx_state->retransmission_requested = 0;
+            if (seq == channel->tx_send_seq){
+                if (channel->tx_send_seq == channel->tx_high_seq){
+                    channel->tx_high_seq = l2cap_ertm_next_seq(channel->tx_high_seq);
+                }
+                channel->tx_send_seq = l2cap_ertm_next_seq(channel->tx_send_seq);
+            }
+            if (!channel->ertm_timer_active){
+                l2cap_ertm_start_timer(channel);
+            }
+            uint16_t len = l2cap_ertm_prepare_i_frame(channel, seq);
+            hci_send_acl_packet_buffer(len);
+            continue;
+        }
+
+        // acknowledge received I-frames
+        if (channel->send_rr){
+            l2cap_ertm_send_s_frame(channel, L2CAP_ERTM_SUPERVISORY_RR, 0, 0, channel->expected_tx_seq);
+            continue;
+        }
+        break;
+    }
+    if (tx_buffers_freed){
+        l2cap_ertm_notify_can_send(channel);
+    }
+}
+
+// check without side effects if l2cap_ertm_run would send a frame
+static int l2cap_ertm_has_work(l2cap_channel_t * channel){
+    if (channel->mode == L2CAP_CHANNEL_MODE_STREAMING){
+        return channel->tx_send_seq != channel->tx_next_seq;
+    }
+    if (channel->send_final || channel->send_poll || channel->send_rej || channel->send_rr) return 1;
+    if (l2cap_ertm_next_i_frame(channel) >= 0) return 1;
+    int i;
+    for (i=0;i<channel->num_rx_buffers;i++){
+        if (channel->rx_packets_state[i].state == L2CAP_ERTM_RX_SLOT_SREJ_PENDING) return 1;
+    }
+    return 0;
+}
+
+// @returns length of options for configure request or response
+static uint16_t l2cap_ertm_setup_config_options(l2cap_channel_t * channel, uint8_t * config_options, uint16_t pos){
+    if (channel->mode == L2CAP_CHANNEL_MODE_BASIC) return pos;
+    pos = l2cap_setup_rfc_option(config_options, pos, channel->mode, channel->local_tx_window, channel->local_max_transmit,
+                                 channel->retransmission_timeout_ms, channel->monitor_timeout_ms, channel->local_mps);
+    if (!channel->local_fcs_option){
+        config_options[pos++] = L2CAP_CONFIG_OPTION_TYPE_FRAME_CHECK_SEQUENCE;
+        config_options[pos++] = 1;
+        config_options[pos++] = 0;  // no FCS
+    }
+    return pos;
+}
+
+static void l2cap_ertm_refuse_mode(l2cap_channel_t * channel){
+    log_info("l2cap cid 0x%02x, remote refused mandatory mode %u", channel->local_cid, channel->mode);
+    l2cap_stop_rtx(channel);
+    l2cap_emit_channel_opened(channel, L2CAP_ERTM_MODE_REFUSED);
+    channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+    l2cap_channel_schedule(channel);
+}
+
+// called after configure request was parsed
+static void l2cap_ertm_handle_remote_mode(l2cap_channel_t * channel){
+    if (channel->mode == channel->remote_mode) return;
+    if (channel->remote_mode == L2CAP_CHANNEL_MODE_BASIC){
+        if (channel->mode_mandatory){
+            l2cap_ertm_refuse_mode(channel);
+        } else {
+            l2cap_ertm_fallback_to_basic_mode(channel);
+        }
+        return;
+    }
+    // propose own mode
+    channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE);
+}
+
+// handle RFC option in configure response
+static void l2cap_ertm_handle_configure_response(l2cap_channel_t * channel, uint16_t result, uint8_t * option){
+    if (result == L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS){
+        uint8_t mode = option ? option[0] : L2CAP_CHANNEL_MODE_BASIC;
+        if (mode == L2CAP_CHANNEL_MODE_BASIC && channel->mode != L2CAP_CHANNEL_MODE_BASIC && !channel->mode_mandatory){
+            l2cap_ertm_fallback_to_basic_mode(channel);
+            channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
+            return;
+        }
+        if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+            l2cap_ertm_refuse_mode(channel);
+            return;
+        }
+        // retry with Basic mode
+        channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
+        return;
+    }
+    if (!option || channel->mode == L2CAP_CHANNEL_MODE_BASIC) return;
+    // timeouts to use are given in response
+    uint16_t retransmission_timeout_ms = READ_BT_16(option, 3);
+    uint16_t monitor_timeout_ms = READ_BT_16(option, 5);
+    if (retransmission_timeout_ms) channel->retransmission_timeout_ms = retransmission_timeout_ms;
+    if (monitor_timeout_ms) channel->monitor_timeout_ms = monitor_timeout_ms;
+}
+
+#endif
+
+static uint16_t l2cap_setup_config_options(l2cap_channel_t * channel, uint8_t * config_options, uint16_t mtu){
+    uint16_t pos = 0;
+    if (mtu){
+        config_options[pos++] = L2CAP_CONFIG_OPTION_TYPE_MAX_TRANSMISSION_UNIT;
+        config_options[pos++] = 2; // len param
+        bt_store_16(config_options, pos, mtu);
+        pos += 2;
+    }
+#ifdef HAVE_L2CAP_ERTM
+    pos = l2cap_ertm_setup_config_options(channel, config_options, pos);
+#endif
+    return pos;
+}
+
+// configuration complete
+static void l2cap_handle_channel_open(l2cap_channel_t * channel){
+    channel->state = L2CAP_STATE_OPEN;
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+        l2cap_ertm_channel_opened(channel);
+        l2cap_emit_channel_opened(channel, 0);
+        // application may have stored SDUs already
+        l2cap_ertm_notify_can_send(channel);
+        return;
+    }
+#endif
+    l2cap_emit_channel_opened(channel, 0);  // success
+    l2cap_emit_credits(channel, 1);
+}
+
+static uint8_t l2cap_channel_mode(l2cap_channel_t * channel){
+#ifdef HAVE_L2CAP_ERTM
+    return channel->mode;
+#else
+    return L2CAP_CHANNEL_MODE_BASIC;
+#endif
+}
+
+// open channel if configuration is complete, collected signaling commands are sent before any data
+static void l2cap_open_channel_if_ready(l2cap_channel_t * channel){
+    if (!l2cap_channel_ready_for_open(channel)) return;
+    if (!l2cap_signaling_batch_flush()) return;
+    // sending the C-frame can re-enter l2cap_run
+    if (!l2cap_channel_ready_for_open(channel)) return;
+    l2cap_handle_channel_open(channel);
+}
+
+// check if l2cap_run_channel has something to send for this channel
+static int l2cap_channel_has_work(l2cap_channel_t * channel){
+    switch (channel->state){
+        case L2CAP_STATE_WAIT_INCOMING_SECURITY_LEVEL_UPDATE:
+        case L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT:
+            return (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND) != 0;
+        case L2CAP_STATE_WILL_SEND_CREATE_CONNECTION:
+        case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE:
+        case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT:
+        case L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST:
+        case L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE:
+        case L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST:
+            return 1;
+        case L2CAP_STATE_CONFIG:
+            if (channel->state_var & (L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP | L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ)) return 1;
+            return l2cap_channel_ready_for_open(channel);
+#ifdef HAVE_L2CAP_ERTM
+        case L2CAP_STATE_OPEN:
+            if (channel->mode == L2CAP_CHANNEL_MODE_BASIC) return 0;
+            return l2cap_ertm_has_work(channel);
+#endif
+        default:
+            return 0;
+    }
+}
+
+// process outstanding signaling tasks of a classic channel, returns 0 if channel was freed
+static int l2cap_run_channel(l2cap_channel_t * channel){
+    uint8_t  config_options[18];
+    uint16_t options_len;
+    // log_info("l2cap_run: channel %p, state %u, var 0x%02x", channel, channel->state, channel->state_var);
+    switch (channel->state){
+
+        case L2CAP_STATE_WAIT_INCOMING_SECURITY_LEVEL_UPDATE:
+        case L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND) {
+                channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND);
+                l2cap_signaling_batch_add(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, 1, 0);
+            }
+            break;
+
+        case L2CAP_STATE_WILL_SEND_CREATE_CONNECTION:
+            if (!hci_can_send_command_packet_now()) break;
+            // send connection request - set state first
+            channel->state = L2CAP_STATE_WAIT_CONNECTION_COMPLETE;
+            // BD_ADDR, Packet_Type, Page_Scan_Repetition_Mode, Reserved, Clock_Offset, Allow_Role_Switch
+            hci_send_cmd(&hci_create_connection, channel->address, hci_usable_acl_packet_types(), 0, 0, 0, 1); 
+            break;
+            
+        case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            channel->state = L2CAP_STATE_INVALID;
+            l2cap_signaling_batch_add(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, channel->reason, 0);
+            // discard channel - l2cap_finialize_channel_close without sending l2cap close event
+            l2cap_stop_rtx(channel);
+            linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
+            l2cap_free_channel(channel); 
+            return 0;
+            
+        case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            channel->state = L2CAP_STATE_CONFIG;
+            channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
+            l2cap_signaling_batch_add(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, 0, 0);
+            break;
+            
+        case L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            // success, start l2cap handshake
+            channel->local_sig_id = l2cap_next_sig_id();
+            channel->state = L2CAP_STATE_WAIT_CONNECT_RSP;
+            l2cap_signaling_batch_add( channel->handle, CONNECTION_REQUEST, channel->local_sig_id, channel->psm, channel->local_cid);
+            l2cap_start_rtx(channel);
+            break;
+        
+        case L2CAP_STATE_CONFIG:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP){
+                uint16_t flags = 0;
+                channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP);
+                if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT) {
+                    flags = 1;
+                } else if ((channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE) == 0){
+                    channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SENT_CONF_RSP);
+                }
+                if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_INVALID){
+                    l2cap_signaling_batch_add(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, L2CAP_CONF_RESULT_UNKNOWN_OPTIONS, 0, NULL);
+                } else if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE){
+                    // propose local mode, remote sends new configure request
+                    channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE);
+                    channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU);
+                    if (l2cap_channel_mode(channel) == L2CAP_CHANNEL_MODE_BASIC){
+                        options_len = l2cap_setup_rfc_option(config_options, 0, L2CAP_CHANNEL_MODE_BASIC, 0, 0, 0, 0, 0);
+                    } else {
+                        options_len = l2cap_setup_config_options(channel, config_options, 0);
+                    }
+                    l2cap_signaling_batch_add(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS, options_len, &config_options);
+                } else if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU || l2cap_channel_mode(channel) != L2CAP_CHANNEL_MODE_BASIC){
+                    uint16_t mtu = (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU) ? channel->remote_mtu : 0;
+                    options_len = l2cap_setup_config_options(channel, config_options, mtu);
+                    l2cap_signaling_batch_add(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, options_len, &config_options);
+                    channelStateVarClearFlag(channel,L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU);
+                } else {
+                    l2cap_signaling_batch_add(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, 0, NULL);
+                }
+                channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT);
+            }
+            // configure request goes into the same C-frame, the response might have used the ACL buffer for the previous one
+            if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ){
+                if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+                channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
+                channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SENT_CONF_REQ);
+                channel->local_sig_id = l2cap_next_sig_id();
+                options_len = l2cap_setup_config_options(channel, config_options, channel->local_mtu);
+                l2cap_signaling_batch_add(channel->handle, CONFIGURE_REQUEST, channel->local_sig_id, channel->remote_cid, 0, options_len, &config_options);
+                l2cap_start_rtx(channel);
+            }
+            l2cap_open_channel_if_ready(channel);
+            break;
+
+        case L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            channel->state = L2CAP_STATE_INVALID;
+            l2cap_signaling_batch_add( channel->handle, DISCONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid);   
+            // we don't start an RTX timer for a disconnect - there's no point in closing the channel if the other side doesn't respond :)
+            l2cap_finialize_channel_close(channel);  // -- remove from list
+            return 0;
+
+#ifdef HAVE_L2CAP_ERTM
+        case L2CAP_STATE_OPEN:
+            if (channel->mode == L2CAP_CHANNEL_MODE_BASIC) break;
+            l2cap_ertm_run(channel);
+            // I-frame not acknowledged after MaxTransmit attempts
+            if (channel->state != L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST) break;
+            /* fall through */
+#endif
+            
+        case L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST:
+            if (!l2cap_signaling_batch_can_send(channel->handle)) break;
+            channel->local_sig_id = l2cap_next_sig_id();
+            channel->state = L2CAP_STATE_WAIT_DISCONNECT;
+            l2cap_signaling_batch_add( channel->handle, DISCONNECTION_REQUEST, channel->local_sig_id, channel->remote_cid, channel->local_cid);   
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+// MARK: L2CAP_RUN
+// process outstanding signaling tasks
+static void l2cap_run_internal(void){
+    
+    // log_info("l2cap_run: entered");
+
+    // check pending signaling responses
+    while (signaling_responses_pending){
+        
+        hci_con_handle_t handle = signaling_responses[0].handle;
+        
+        if (!l2cap_signaling_batch_can_send(handle)) break;
+
+        uint8_t  sig_id = signaling_responses[0].sig_id;
+        uint16_t infoType = signaling_responses[0].data;    // INFORMATION_REQUEST
+        uint16_t result   = signaling_responses[0].data;    // CONNECTION_REQUEST, COMMAND_REJECT
+        uint8_t  response_code = signaling_responses[0].code;
+
+        // remove first item before sending (to avoid sending response mutliple times)
+        signaling_responses_pending--;
+        int i;
+        for (i=0; i < signaling_responses_pending; i++){
+            memcpy(&signaling_responses[i], &signaling_responses[i+1], sizeof(l2cap_signaling_response_t));
+        }
 
         switch (response_code){
             case CONNECTION_REQUEST:
-                l2cap_send_signaling_packet(handle, CONNECTION_RESPONSE, sig_id, 0, 0, result, 0);
-                // also disconnect if result is 0x0003 - security blocked
+                l2cap_signaling_batch_add(handle, CONNECTION_RESPONSE, sig_id, 0, 0, result, 0);
+                // also disconnect if result is 0x0003 - security blocked, once the response was sent
                 if (result == 0x0003){
-                    hci_disconnect_security_block(handle);
+                    signaling_batch_security_block = 1;
+                    l2cap_signaling_batch_flush();
                 }
                 break;
             case ECHO_REQUEST:
-                l2cap_send_signaling_packet(handle, ECHO_RESPONSE, sig_id, 0, NULL);
+                l2cap_signaling_batch_add(handle, ECHO_RESPONSE, sig_id, 0, NULL);
                 break;
             case INFORMATION_REQUEST:
                 switch (infoType){
                     case 1: { // Connectionless MTU
                         uint16_t connectionless_mtu = hci_max_acl_data_packet_length();
-                        l2cap_send_signaling_packet(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(connectionless_mtu), &connectionless_mtu);
+                        l2cap_signaling_batch_add(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(connectionless_mtu), &connectionless_mtu);
                         break;
                     }
                     case 2: { // Extended Features Supported
                         // extended features request supported, features: fixed channels, unicast connectionless data reception
                         uint32_t features = 0x280;
-                        l2cap_send_signaling_packet(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(features), &features);
+#ifdef HAVE_L2CAP_ERTM
+                        // Enhanced Retransmission Mode, Streaming Mode, FCS Option
+                        features |= 0x38;
+#endif
+                        l2cap_signaling_batch_add(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(features), &features);
                         break;
                     }
                     case 3: { // Fixed Channels Supported
                         uint8_t map[8];
                         memset(map, 0, 8);
                         map[0] = 0x01;  // L2CAP Signaling Channel (0x01) + Connectionless reception (0x02)
-                        l2cap_send_signaling_packet(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(map), &map);
+                        l2cap_signaling_batch_add(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(map), &map);
                         break;
                     }
                     default:
                         // all other types are not supported
-                        l2cap_send_signaling_packet(handle, INFORMATION_RESPONSE, sig_id, infoType, 1, 0, NULL);
+                        l2cap_signaling_batch_add(handle, INFORMATION_RESPONSE, sig_id, infoType, 1, 0, NULL);
                         break;                        
                 }
                 break;
             case COMMAND_REJECT:
-                l2cap_send_signaling_packet(handle, COMMAND_REJECT, sig_id, result, 0, NULL);
+                l2cap_signaling_batch_add(handle, COMMAND_REJECT, sig_id, result, 0, NULL);
+                break;
 #ifdef HAVE_BLE
             case COMMAND_REJECT_LE:
                 l2cap_send_le_signaling_packet(handle, COMMAND_REJECT, sig_id, result, 0, NULL);
                 break;
+            case LE_CREDIT_BASED_CONNECTION_REQUEST:
+                l2cap_send_le_signaling_packet(handle, LE_CREDIT_BASED_CONNECTION_RESPONSE, sig_id, 0, 0, 0, 0, result);
+                break;
 #endif
             default:
                 // should not happen
@@ -593,119 +2379,40 @@ void l2cap_run(void){
         }
     }
     
-    uint8_t  config_options[4];
-    linked_list_iterator_t it;    
-    linked_list_iterator_init(&it, &l2cap_channels);
-    while (linked_list_iterator_has_next(&it)){
-
-        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-        // log_info("l2cap_run: channel %p, state %u, var 0x%02x", channel, channel->state, channel->state_var);
-        switch (channel->state){
-
-            case L2CAP_STATE_WAIT_INCOMING_SECURITY_LEVEL_UPDATE:
-            case L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND) {
-                    channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND);
-                    l2cap_send_signaling_packet(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, 1, 0);
-                }
-                break;
-
-            case L2CAP_STATE_WILL_SEND_CREATE_CONNECTION:
-                if (!hci_can_send_command_packet_now()) break;
-                // send connection request - set state first
-                channel->state = L2CAP_STATE_WAIT_CONNECTION_COMPLETE;
-                // BD_ADDR, Packet_Type, Page_Scan_Repetition_Mode, Reserved, Clock_Offset, Allow_Role_Switch
-                hci_send_cmd(&hci_create_connection, channel->address, hci_usable_acl_packet_types(), 0, 0, 0, 1); 
-                break;
-                
-            case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                channel->state = L2CAP_STATE_INVALID;
-                l2cap_send_signaling_packet(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, channel->reason, 0);
-                // discard channel - l2cap_finialize_channel_close without sending l2cap close event
-                l2cap_stop_rtx(channel);
-                linked_list_iterator_remove(&it);
-                btstack_memory_l2cap_channel_free(channel); 
-                break;
-                
-            case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                channel->state = L2CAP_STATE_CONFIG;
-                channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
-                l2cap_send_signaling_packet(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, 0, 0);
-                break;
-                
-            case L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                // success, start l2cap handshake
-                channel->local_sig_id = l2cap_next_sig_id();
-                channel->state = L2CAP_STATE_WAIT_CONNECT_RSP;
-                l2cap_send_signaling_packet( channel->handle, CONNECTION_REQUEST, channel->local_sig_id, channel->psm, channel->local_cid);
-                l2cap_start_rtx(channel);
-                break;
-            
-            case L2CAP_STATE_CONFIG:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP){
-                    uint16_t flags = 0;
-                    channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP);
-                    if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT) {
-                        flags = 1;
-                    } else {
-                        channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SENT_CONF_RSP);
-                    }
-                    if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_INVALID){
-                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, L2CAP_CONF_RESULT_UNKNOWN_OPTIONS, 0, NULL);
-                    } else if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU){
-                        config_options[0] = 1; // MTU
-                        config_options[1] = 2; // len param
-                        bt_store_16( (uint8_t*)&config_options, 2, channel->remote_mtu);
-                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, 4, &config_options);
-                        channelStateVarClearFlag(channel,L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU);
-                    } else {
-                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, 0, NULL);
-                    }
-                    channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT);
-                }
-                else if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ){
-                    channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
-                    channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SENT_CONF_REQ);
-                    channel->local_sig_id = l2cap_next_sig_id();
-                    config_options[0] = 1; // MTU
-                    config_options[1] = 2; // len param
-                    bt_store_16( (uint8_t*)&config_options, 2, channel->local_mtu);
-                    l2cap_send_signaling_packet(channel->handle, CONFIGURE_REQUEST, channel->local_sig_id, channel->remote_cid, 0, 4, &config_options);
-                    l2cap_start_rtx(channel);
-                }
-                if (l2cap_channel_ready_for_open(channel)){
-                    channel->state = L2CAP_STATE_OPEN;
-                    l2cap_emit_channel_opened(channel, 0);  // success
-                    l2cap_emit_credits(channel, 1);
-                }
-                break;
-
-            case L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                channel->state = L2CAP_STATE_INVALID;
-                l2cap_send_signaling_packet( channel->handle, DISCONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid);   
-                // we don't start an RTX timer for a disconnect - there's no point in closing the channel if the other side doesn't respond :)
-                l2cap_finialize_channel_close(channel);  // -- remove from list
-                break;
-                
-            case L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST:
-                if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                channel->local_sig_id = l2cap_next_sig_id();
-                channel->state = L2CAP_STATE_WAIT_DISCONNECT;
-                l2cap_send_signaling_packet( channel->handle, DISCONNECTION_REQUEST, channel->local_sig_id, channel->remote_cid, channel->local_cid);   
-                break;
-            default:
-                break;
+    // visit channels with pending work, including channels scheduled during this run
+    uint16_t visited = 0;
+    l2cap_channel_t * channel;
+    while ((channel = l2cap_channel_queue_pop(&l2cap_channels_pending)) != NULL){
+        // channel->pending stays set while visited, changes are checked below
+        L2CAP_STATE state = channel->state;
+        L2CAP_CHANNEL_STATE_VAR state_var = channel->state_var;
+        visited++;
+        if (!l2cap_run_channel(channel)) continue;
+        if (!l2cap_channel_has_work(channel)){
+            channel->pending = 0;
+        } else if (state == channel->state && state_var == channel->state_var){
+            // no progress, retry in next run
+            l2cap_channel_queue_add(&l2cap_channels_blocked, channel);
+        } else {
+            l2cap_channel_queue_add(&l2cap_channels_pending, channel);
         }
     }
+    l2cap_channels_pending = l2cap_channels_blocked;
+    memset(&l2cap_channels_blocked, 0, sizeof(l2cap_channels_blocked));
+    run_statistics.runs++;
+    run_statistics.channels_visited += visited;
+    if (visited > run_statistics.channels_visited_max){
+        run_statistics.channels_visited_max = visited;
+    }
+
+    // send C-frame, kept for next run if no ACL buffer is available
+    if (!signaling_batch_hold){
+        l2cap_signaling_batch_flush();
+    }
 
 #ifdef HAVE_BLE
     // send l2cap con paramter update if necessary
+    linked_list_iterator_t it;
     hci_connections_get_iterator(&it);
     while(linked_list_iterator_has_next(&it)){
         hci_connection_t * connection = (hci_connection_t *) linked_list_iterator_next(&it);
@@ -728,11 +2435,27 @@ void l2cap_run(void){
                 break;
         }
     }
+
+    l2cap_le_run();
 #endif
 
     // log_info("l2cap_run: exit");
 }
 
+void l2cap_run(void){
+    // called again by event handlers while sending, e.g. for DAEMON_EVENT_HCI_PACKET_SENT
+    if (l2cap_run_active){
+        l2cap_run_pending = 1;
+        return;
+    }
+    l2cap_run_active = 1;
+    do {
+        l2cap_run_pending = 0;
+        l2cap_run_internal();
+    } while (l2cap_run_pending);
+    l2cap_run_active = 0;
+}
+
 uint16_t l2cap_max_mtu(void){
     return HCI_ACL_PAYLOAD_SIZE - L2CAP_HEADER_SIZE;
 }
@@ -741,15 +2464,26 @@ uint16_t l2cap_max_le_mtu(void){
     return l2cap_max_mtu();
 }
 
-static void l2cap_handle_connection_complete(uint16_t handle, l2cap_channel_t * channel){
+// returns 1 if the channel was freed
+static int l2cap_handle_connection_complete(uint16_t handle, l2cap_channel_t * channel){
     if (channel->state == L2CAP_STATE_WAIT_CONNECTION_COMPLETE || channel->state == L2CAP_STATE_WILL_SEND_CREATE_CONNECTION) {
         log_info("l2cap_handle_connection_complete expected state");
+        l2cap_connection_t * connection = l2cap_connection_get_for_handle(handle);
+        if (!connection){
+            l2cap_emit_channel_opened(channel, BTSTACK_MEMORY_ALLOC_FAILED);
+            l2cap_stop_rtx(channel);
+            linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
+            l2cap_free_channel(channel);
+            return 1;
+        }
         // success, start l2cap handshake
         channel->handle = handle;
-        channel->local_cid = l2cap_next_local_cid();
+        channel->local_cid = l2cap_allocate_local_cid(channel);
+        l2cap_add_channel_to_connection(connection, channel);
         // check remote SSP feature first
         channel->state = L2CAP_STATE_WAIT_REMOTE_SUPPORTED_FEATURES;
     }
+    return 0;
 }
 
 static void l2cap_handle_remote_supported_features_received(l2cap_channel_t * channel){
@@ -765,14 +2499,11 @@ static void l2cap_handle_remote_supported_features_received(l2cap_channel_t * ch
     }
     // fine, go ahead
     channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST;
+    l2cap_channel_schedule(channel);
 }
 
-// open outgoing L2CAP channel
-void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler,
-                                   bd_addr_t address, uint16_t psm, uint16_t mtu){
-    
-    log_info("L2CAP_CREATE_CHANNEL_MTU addr %s psm 0x%x mtu %u", bd_addr_to_str(address), psm, mtu);
-    
+static l2cap_channel_t * l2cap_create_channel_entry(void * connection, btstack_packet_handler_t packet_handler,
+                                                    bd_addr_t address, uint16_t psm, uint16_t mtu){
     // alloc structure
     l2cap_channel_t * chan = btstack_memory_l2cap_channel_get();
     if (!chan) {
@@ -781,7 +2512,7 @@ void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t p
         BD_ADDR_COPY(dummy_channel.address, address);
         dummy_channel.psm = psm;
         l2cap_emit_channel_opened(&dummy_channel, BTSTACK_MEMORY_ALLOC_FAILED);
-        return;
+        return NULL;
     }
     // Init memory (make valgrind happy)
     memset(chan, 0, sizeof(l2cap_channel_t));
@@ -799,6 +2530,8 @@ void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t p
     chan->remote_mtu = L2CAP_MINIMAL_MTU;
     chan->local_mtu = mtu;
     chan->packets_granted = 0;
+    chan->priority = L2CAP_PRIORITY_NORMAL;
+    chan->weight = L2CAP_DEFAULT_WEIGHT;
     
     // set initial state
     chan->state = L2CAP_STATE_WILL_SEND_CREATE_CONNECTION;
@@ -806,15 +2539,24 @@ void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t p
     chan->remote_sig_id = L2CAP_SIG_ID_INVALID;
     chan->local_sig_id = L2CAP_SIG_ID_INVALID;
     chan->required_security_level = LEVEL_0;
+    return chan;
+}
+
+static void l2cap_start_channel(l2cap_channel_t * chan){
 
     // add to connections list
     linked_list_add(&l2cap_channels, (linked_item_t *) chan);
+    l2cap_channel_schedule(chan);
     
     // check if hci connection is already usable
-    hci_connection_t * conn = hci_connection_for_bd_addr_and_type(address, BD_ADDR_TYPE_CLASSIC);
-    if (conn){
+    hci_connection_t * conn = hci_connection_for_bd_addr_and_type(chan->address, BD_ADDR_TYPE_CLASSIC);
+    if (conn && conn->state != OPEN){
+        // hci connection is being established, continue on connection complete
+        log_info("l2cap_create_channel_internal, hci connection pending");
+        chan->state = L2CAP_STATE_WAIT_CONNECTION_COMPLETE;
+    } else if (conn){
         log_info("l2cap_create_channel_internal, hci connection already exists");
-        l2cap_handle_connection_complete(conn->con_handle, chan);
+        if (l2cap_handle_connection_complete(conn->con_handle, chan)) return;
         // check if remote supported fearures are already received
         if (conn->bonding_flags & BONDING_RECEIVED_REMOTE_FEATURES) {
             l2cap_handle_remote_supported_features_received(chan);
@@ -824,12 +2566,45 @@ void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t p
     l2cap_run();
 }
 
+// open outgoing L2CAP channel
+void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler,
+                                   bd_addr_t address, uint16_t psm, uint16_t mtu){
+    
+    log_info("L2CAP_CREATE_CHANNEL_MTU addr %s psm 0x%x mtu %u", bd_addr_to_str(address), psm, mtu);
+    
+    l2cap_channel_t * chan = l2cap_create_channel_entry(connection, packet_handler, address, psm, mtu);
+    if (!chan) return;
+
+    l2cap_start_channel(chan);
+}
+
+#ifdef HAVE_L2CAP_ERTM
+// open outgoing L2CAP channel in Enhanced Retransmission or Streaming Mode
+void l2cap_create_ertm_channel_internal(void * connection, btstack_packet_handler_t packet_handler, bd_addr_t address, uint16_t psm,
+                                        l2cap_ertm_config_t * ertm_config, uint8_t * buffer, uint32_t size){
+
+    log_info("L2CAP_CREATE_ERTM_CHANNEL addr %s psm 0x%x mode %u mtu %u", bd_addr_to_str(address), psm, ertm_config->mode, ertm_config->local_mtu);
+
+    l2cap_channel_t * chan = l2cap_create_channel_entry(connection, packet_handler, address, psm, ertm_config->local_mtu);
+    if (!chan) return;
+
+    if (l2cap_ertm_setup_buffers(chan, ertm_config, buffer, size)){
+        l2cap_emit_channel_opened(chan, L2CAP_ERTM_BUFFER_TOO_SMALL);
+        l2cap_free_channel(chan);
+        return;
+    }
+
+    l2cap_start_channel(chan);
+}
+#endif
+
 void l2cap_disconnect_internal(uint16_t local_cid, uint8_t reason){
     log_info("L2CAP_DISCONNECT local_cid 0x%x reason 0x%x", local_cid, reason);
     // find channel for local_cid
     l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
     if (channel) {
         channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+        l2cap_channel_schedule(channel);
     }
     // process
     l2cap_run();
@@ -850,7 +2625,7 @@ static void l2cap_handle_connection_failed_for_addr(bd_addr_t address, uint8_t s
                 // discard channel
                 l2cap_stop_rtx(channel);
                 linked_list_iterator_remove(&it);
-                btstack_memory_l2cap_channel_free(channel);
+                l2cap_free_channel(channel);
                 break;
             default:
                 break;               
@@ -876,7 +2651,7 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
     bd_addr_t address;
     hci_con_handle_t handle;
     linked_list_iterator_t it;
-    int hci_con_used;
+    l2cap_channel_t * channel;
     
     switch(packet[0]){
             
@@ -911,35 +2686,44 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
         case HCI_EVENT_DISCONNECTION_COMPLETE:
             // send l2cap disconnect events for all channels on this handle and free them
             handle = READ_BT_16(packet, 3);
-            linked_list_iterator_init(&it, &l2cap_channels);
+            if (signaling_batch_len && signaling_batch_handle == handle){
+                signaling_batch_len = 0;
+                signaling_batch_security_block = 0;
+            }
+            channel = l2cap_get_channels_for_handle(handle);
+            while (channel){
+                l2cap_channel_t * next = channel->next_for_handle;
+                l2cap_emit_channel_closed(channel);
+                l2cap_stop_rtx(channel);
+#ifdef HAVE_L2CAP_ERTM
+                l2cap_ertm_stop_timers(channel);
+#endif
+                linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
+                l2cap_free_channel(channel);
+                channel = next;
+            }
+#ifdef HAVE_BLE
+            linked_list_iterator_init(&it, &l2cap_le_channels);
             while (linked_list_iterator_has_next(&it)){
                 l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
                 if (channel->handle != handle) continue;
                 l2cap_emit_channel_closed(channel);
-                l2cap_stop_rtx(channel);
                 linked_list_iterator_remove(&it);
-                btstack_memory_l2cap_channel_free(channel);
+                l2cap_free_channel(channel);
             }
+#endif
             break;
             
         case HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS:
             l2cap_run();    // try sending signaling packets first
             l2cap_hand_out_credits();
             break;
-            
-        // HCI Connection Timeouts
-        case L2CAP_EVENT_TIMEOUT_CHECK:
-            handle = READ_BT_16(packet, 2);
-            if (hci_authentication_active_for_handle(handle)) break;
-            hci_con_used = 0;
-            linked_list_iterator_init(&it, &l2cap_channels);
-            while (linked_list_iterator_has_next(&it)){
-                l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-                if (channel->handle != handle) continue;
-                hci_con_used = 1;
-                break;
-            }
-            if (hci_con_used) break;
+            
+        // HCI Connection Timeouts
+        case L2CAP_EVENT_TIMEOUT_CHECK:
+            handle = READ_BT_16(packet, 2);
+            if (hci_authentication_active_for_handle(handle)) break;
+            if (l2cap_get_channels_for_handle(handle)) break;
             if (!hci_can_send_command_packet_now()) break;
             hci_send_cmd(&hci_disconnect, handle, 0x13); // remote closed connection             
             break;
@@ -951,6 +2735,14 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
                 if (!channel->packet_handler) continue;
                 (* (channel->packet_handler))(HCI_EVENT_PACKET, channel->local_cid, packet, size);
             }
+#ifdef HAVE_BLE
+            linked_list_iterator_init(&it, &l2cap_le_channels);
+            while (linked_list_iterator_has_next(&it)){
+                l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+                if (!channel->packet_handler) continue;
+                (* (channel->packet_handler))(HCI_EVENT_PACKET, channel->local_cid, packet, size);
+            }
+#endif
             if (attribute_protocol_packet_handler) {
                 (*attribute_protocol_packet_handler)(HCI_EVENT_PACKET, 0, packet, size);
             }
@@ -964,22 +2756,22 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
 
         case HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES_COMPLETE:
             handle = READ_BT_16(packet, 3);
-            linked_list_iterator_init(&it, &l2cap_channels);
-            while (linked_list_iterator_has_next(&it)){
-                l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-                if (channel->handle != handle) continue;
+            // channel might get freed by the application, e.g. when it declines from the connection request
+            channel = l2cap_get_channels_for_handle(handle);
+            while (channel){
+                l2cap_channel_t * next = channel->next_for_handle;
                 l2cap_handle_remote_supported_features_received(channel);
-                break;
+                channel = next;
             }
             break;           
 
         case GAP_SECURITY_LEVEL:
             handle = READ_BT_16(packet, 2);
             log_info("l2cap - security level update");
-            linked_list_iterator_init(&it, &l2cap_channels);
-            while (linked_list_iterator_has_next(&it)){
-                l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-                if (channel->handle != handle) continue;
+            // channel might get freed by the application, e.g. when it declines from the connection request
+            channel = l2cap_get_channels_for_handle(handle);
+            while (channel){
+                l2cap_channel_t * next = channel->next_for_handle;
 
                 log_info("l2cap - state %u", channel->state);
 
@@ -990,16 +2782,20 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
                     case L2CAP_STATE_WAIT_INCOMING_SECURITY_LEVEL_UPDATE:
                         if (actual_level >= required_level){
                             channel->state = L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT;
-                            l2cap_emit_connection_request(channel);                
+                            // pending connection response might not have been sent yet
+                            l2cap_channel_schedule(channel);
+                            l2cap_emit_connection_request(channel);
                         } else {
                             channel->reason = 0x0003; // security block
                             channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE;
+                            l2cap_channel_schedule(channel);
                         }
                         break;
 
                     case L2CAP_STATE_WAIT_OUTGOING_SECURITY_LEVEL_UPDATE:
                         if (actual_level >= required_level){
                             channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST;
+                            l2cap_channel_schedule(channel);
                         } else {
                             // disconnnect, authentication not good enough
                             hci_disconnect_security_block(handle);
@@ -1009,6 +2805,7 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
                     default:
                         break;
                 } 
+                channel = next;
             }
             break;
             
@@ -1034,6 +2831,7 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
 static void l2cap_handle_disconnect_request(l2cap_channel_t *channel, uint16_t identifier){
     channel->remote_sig_id = identifier;
     channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE;
+    l2cap_channel_schedule(channel);
     l2cap_run();
 }
 
@@ -1068,7 +2866,8 @@ static void l2cap_handle_connection_request(hci_con_handle_t handle, uint8_t sig
 
     // alloc structure
     // log_info("l2cap_handle_connection_request register channel");
-    l2cap_channel_t * channel = btstack_memory_l2cap_channel_get();
+    l2cap_connection_t * connection = l2cap_connection_get_for_handle(handle);
+    l2cap_channel_t * channel = connection ? btstack_memory_l2cap_channel_get() : NULL;
     if (!channel){
         // 0x0004 No resources available
         l2cap_register_signaling_response(handle, CONNECTION_REQUEST, sig_id, 0x0004);
@@ -1082,13 +2881,16 @@ static void l2cap_handle_connection_request(hci_con_handle_t handle, uint8_t sig
     channel->handle = handle;
     channel->connection = service->connection;
     channel->packet_handler = service->packet_handler;
-    channel->local_cid  = l2cap_next_local_cid();
+    channel->local_cid  = l2cap_allocate_local_cid(channel);
+    l2cap_add_channel_to_connection(connection, channel);
     channel->remote_cid = source_cid;
     channel->local_mtu  = service->mtu;
     channel->remote_mtu = L2CAP_DEFAULT_MTU;
     channel->packets_granted = 0;
     channel->remote_sig_id = sig_id; 
     channel->required_security_level = service->required_security_level;
+    channel->priority = service->priority;
+    channel->weight = service->weight;
 
     // limit local mtu to max acl packet length - l2cap header
     if (channel->local_mtu > l2cap_max_mtu()) {
@@ -1101,6 +2903,7 @@ static void l2cap_handle_connection_request(hci_con_handle_t handle, uint8_t sig
     
     // add to connections list
     linked_list_add(&l2cap_channels, (linked_item_t *) channel);
+    l2cap_channel_schedule(channel);
 
     // assert security requirements
     gap_request_security_level(handle, channel->required_security_level);
@@ -1116,10 +2919,30 @@ void l2cap_accept_connection_internal(uint16_t local_cid){
 
     channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT;
 
+    l2cap_channel_schedule(channel);
+
     // process
     l2cap_run();
 }
 
+#ifdef HAVE_L2CAP_ERTM
+void l2cap_accept_ertm_connection_internal(uint16_t local_cid, l2cap_ertm_config_t * ertm_config, uint8_t * buffer, uint32_t size){
+    log_info("L2CAP_ACCEPT_ERTM_CONNECTION local_cid 0x%x mode %u", local_cid, ertm_config->mode);
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel) {
+        log_error("l2cap_accept_ertm_connection_internal called but local_cid 0x%x not found", local_cid);
+        return;
+    }
+    if (l2cap_ertm_setup_buffers(channel, ertm_config, buffer, size)){
+        log_error("l2cap_accept_ertm_connection_internal local_cid 0x%x, invalid config or buffer too small", local_cid);
+        // 0x0004 No resources available
+        l2cap_decline_connection_internal(local_cid, 0x0004);
+        return;
+    }
+    l2cap_accept_connection_internal(local_cid);
+}
+#endif
+
 void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason){
     log_info("L2CAP_DECLINE_CONNECTION local_cid 0x%x, reason %x", local_cid, reason);
     l2cap_channel_t * channel = l2cap_get_channel_for_local_cid( local_cid);
@@ -1129,6 +2952,10 @@ void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason){
     }
     channel->state  = L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE;
     channel->reason = reason;
+
+    l2cap_channel_schedule(channel);
+
+    // process
     l2cap_run();
 }
 
@@ -1137,6 +2964,12 @@ void l2cap_signaling_handle_configure_request(l2cap_channel_t *channel, uint8_t
     channel->remote_sig_id = command[L2CAP_SIGNALING_COMMAND_SIGID_OFFSET];
 
     uint16_t flags = READ_BT_16(command, 6);
+#ifdef HAVE_L2CAP_ERTM
+    // remote uses Basic mode if RFC option is missing
+    if ((channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT) == 0){
+        channel->remote_mode = L2CAP_CHANNEL_MODE_BASIC;
+    }
+#endif
     if (flags & 1) {
         channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT);
     }
@@ -1160,6 +2993,26 @@ void l2cap_signaling_handle_configure_request(l2cap_channel_t *channel, uint8_t
         if (option_type == 2 && length == 2){
             channel->flush_timeout = READ_BT_16(command, pos);
         }
+        // Retransmission and Flow Control { type(8):4, len(8): 9, mode(8), tx window(8), max transmit(8), timeouts(32), mps(16) }
+        if (option_type == 4 && length == 9){
+#ifdef HAVE_L2CAP_ERTM
+            channel->remote_mode = command[pos];
+            channel->remote_tx_window = command[pos+1];
+            channel->remote_max_transmit = command[pos+2];
+            channel->remote_mps = READ_BT_16(command, pos+7);
+#else
+            // only Basic mode supported
+            if (command[pos] != L2CAP_CHANNEL_MODE_BASIC){
+                channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE);
+            }
+#endif
+        }
+#ifdef HAVE_L2CAP_ERTM
+        // Frame Check Sequence { type(8):5, len(8): 1, FCS(8) }
+        if (option_type == 5 && length == 1){
+            channel->remote_fcs_option = command[pos];
+        }
+#endif
         // check for unknown options
         if (option_hint == 0 && (option_type == 0 || option_type >= 0x07)){
             log_info("l2cap cid %u, unknown options", channel->local_cid);
@@ -1169,12 +3022,30 @@ void l2cap_signaling_handle_configure_request(l2cap_channel_t *channel, uint8_t
     }
 }
 
+#ifdef HAVE_L2CAP_ERTM
+static void l2cap_signaling_handle_configure_response(l2cap_channel_t *channel, uint16_t result, uint8_t *command){
+    uint8_t * rfc_option = NULL;
+    uint16_t end_pos = 4 + READ_BT_16(command, L2CAP_SIGNALING_COMMAND_LENGTH_OFFSET);
+    uint16_t pos     = 10;
+    while (pos + 2 <= end_pos){
+        uint8_t option_type = command[pos] & 0x7f;
+        uint8_t length = command[pos+1];
+        pos += 2;
+        if (option_type == L2CAP_CONFIG_OPTION_TYPE_RETRANSMISSION_AND_FLOW_CONTROL && length == 9){
+            rfc_option = &command[pos];
+        }
+        pos += length;
+    }
+    l2cap_ertm_handle_configure_response(channel, result, rfc_option);
+}
+#endif
+
 static int l2cap_channel_ready_for_open(l2cap_channel_t *channel){
     // log_info("l2cap_channel_ready_for_open 0x%02x", channel->state_var);
     if ((channel->state_var & L2CAP_CHANNEL_STATE_VAR_RCVD_CONF_RSP) == 0) return 0;
     if ((channel->state_var & L2CAP_CHANNEL_STATE_VAR_SENT_CONF_RSP) == 0) return 0;
     // addition check that fixes re-entrance issue causing l2cap event channel opened twice
-    if (channel->state == L2CAP_STATE_OPEN) return 0;
+    if (channel->state != L2CAP_STATE_CONFIG) return 0;
     return 1;
 }
 
@@ -1236,7 +3107,7 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                             
                             // discard channel
                             linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
-                            btstack_memory_l2cap_channel_free(channel);
+                            l2cap_free_channel(channel);
                             break;
                     }
                     break;
@@ -1256,6 +3127,9 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                     if (!(channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT)){
                         // only done if continuation not set
                         channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_RCVD_CONF_REQ);
+#ifdef HAVE_L2CAP_ERTM
+                        l2cap_ertm_handle_remote_mode(channel);
+#endif
                     }
                     break;
                 case CONFIGURE_RESPONSE:
@@ -1263,10 +3137,18 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                     switch (result){
                         case 0: // success
                             channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_RCVD_CONF_RSP);
+#ifdef HAVE_L2CAP_ERTM
+                            l2cap_signaling_handle_configure_response(channel, result, command);
+#endif
                             break;
                         case 4: // pending
                             l2cap_start_ertx(channel);
                             break;
+#ifdef HAVE_L2CAP_ERTM
+                        case L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS:
+                            l2cap_signaling_handle_configure_response(channel, result, command);
+                            break;
+#endif
                         default:
                             // retry on negative result
                             channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ);
@@ -1276,12 +3158,7 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                 default:
                     break;
             }
-            if (l2cap_channel_ready_for_open(channel)){
-                // for open:
-                channel->state = L2CAP_STATE_OPEN;
-                l2cap_emit_channel_opened(channel, 0);
-                l2cap_emit_credits(channel, 1);
-            }
+            l2cap_open_channel_if_ready(channel);
             break;
             
         case L2CAP_STATE_WAIT_DISCONNECT:
@@ -1350,23 +3227,19 @@ void l2cap_signaling_handler_dispatch( hci_con_handle_t handle, uint8_t * comman
     uint16_t dest_cid = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET);
     
     // Find channel for this sig_id and connection handle
-    linked_list_iterator_t it;    
-    linked_list_iterator_init(&it, &l2cap_channels);
-    while (linked_list_iterator_has_next(&it)){
-        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-        if (channel->handle != handle) continue;
-        if (code & 1) {
-            // match odd commands (responses) by previous signaling identifier 
-            if (channel->local_sig_id == sig_id) {
-                l2cap_signaling_handler_channel(channel, command);
-                break;
-            }
-        } else {
-            // match even commands (requests) by local channel id
-            if (channel->local_cid == dest_cid) {
-                l2cap_signaling_handler_channel(channel, command);
-                break;
-            }
+    l2cap_channel_t * channel;
+    if (code & 1) {
+        // match odd commands (responses) by previous signaling identifier 
+        for (channel = l2cap_get_channels_for_handle(handle); channel; channel = channel->next_for_handle){
+            if (channel->local_sig_id != sig_id) continue;
+            l2cap_signaling_handler_channel(channel, command);
+            break;
+        }
+    } else {
+        // match even commands (requests) by local channel id
+        channel = l2cap_get_channel_for_local_cid(dest_cid);
+        if (channel && channel->handle == handle) {
+            l2cap_signaling_handler_channel(channel, command);
         }
     }
 }
@@ -1382,6 +3255,8 @@ void l2cap_acl_handler( uint8_t *packet, uint16_t size ){
         case L2CAP_CID_SIGNALING: {
             
             uint16_t command_offset = 8;
+            // l2cap_run is called by the application, e.g. to accept a connection: collect responses, send after the C-frame
+            signaling_batch_hold = 1;
             while (command_offset < size) {                
                 
                 // handle signaling commands
@@ -1390,6 +3265,7 @@ void l2cap_acl_handler( uint8_t *packet, uint16_t size ){
                 // increment command_offset
                 command_offset += L2CAP_SIGNALING_COMMAND_DATA_OFFSET + READ_BT_16(packet, command_offset + L2CAP_SIGNALING_COMMAND_LENGTH_OFFSET);
             }
+            signaling_batch_hold = 0;
             break;
         }
             
@@ -1459,6 +3335,15 @@ void l2cap_acl_handler( uint8_t *packet, uint16_t size ){
 
                     break;
                 }
+#ifdef HAVE_BLE
+                case LE_CREDIT_BASED_CONNECTION_REQUEST:
+                case LE_CREDIT_BASED_CONNECTION_RESPONSE:
+                case LE_FLOW_CONTROL_CREDIT:
+                case DISCONNECTION_REQUEST:
+                case DISCONNECTION_RESPONSE:
+                    l2cap_le_signaling_handler(handle, &packet[COMPLETE_L2CAP_HEADER]);
+                    break;
+#endif
                 default: {
                     uint8_t sig_id = packet[COMPLETE_L2CAP_HEADER + 1]; 
                     l2cap_register_signaling_response(handle, COMMAND_REJECT_LE, sig_id, L2CAP_REJ_CMD_UNKNOWN);
@@ -1471,9 +3356,26 @@ void l2cap_acl_handler( uint8_t *packet, uint16_t size ){
         default: {
             // Find channel for this channel_id and connection handle
             l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(channel_id);
-            if (channel) {
-                l2cap_dispatch(channel, L2CAP_DATA_PACKET, &packet[COMPLETE_L2CAP_HEADER], size-COMPLETE_L2CAP_HEADER);
+#ifdef HAVE_BLE
+            if (!channel){
+                channel = l2cap_le_get_channel_for_local_cid(channel_id);
+                if (channel && channel->handle == handle){
+                    l2cap_le_handle_pdu(channel, packet, size);
+                }
+                break;
+            }
+#endif
+            if (!channel) break;
+#ifdef HAVE_L2CAP_ERTM
+            if (channel->mode != L2CAP_CHANNEL_MODE_BASIC){
+                if (channel->state == L2CAP_STATE_OPEN){
+                    l2cap_ertm_handle_pdu(channel, packet, size);
+                    l2cap_channel_schedule(channel);
+                }
+                break;
             }
+#endif
+            l2cap_dispatch(channel, L2CAP_DATA_PACKET, &packet[COMPLETE_L2CAP_HEADER], size-COMPLETE_L2CAP_HEADER);
             break;
         }
     }
@@ -1499,8 +3401,11 @@ void l2cap_finialize_channel_close(l2cap_channel_t *channel){
     l2cap_emit_channel_closed(channel);
     // discard channel
     l2cap_stop_rtx(channel);
+#ifdef HAVE_L2CAP_ERTM
+    l2cap_ertm_stop_timers(channel);
+#endif
     linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
-    btstack_memory_l2cap_channel_free(channel);
+    l2cap_free_channel(channel);
 }
 
 static l2cap_service_t * l2cap_get_service_internal(linked_list_t * services, uint16_t psm){
@@ -1520,8 +3425,13 @@ static inline l2cap_service_t * l2cap_get_service(uint16_t psm){
 }
 
 void l2cap_register_service_internal(void *connection, btstack_packet_handler_t packet_handler, uint16_t psm, uint16_t mtu, gap_security_level_t security_level){
+    l2cap_register_service_with_priority_internal(connection, packet_handler, psm, mtu, security_level, L2CAP_PRIORITY_NORMAL, L2CAP_DEFAULT_WEIGHT);
+}
+
+void l2cap_register_service_with_priority_internal(void *connection, btstack_packet_handler_t packet_handler, uint16_t psm, uint16_t mtu,
+                                                   gap_security_level_t security_level, uint8_t priority, uint8_t weight){
     
-    log_info("L2CAP_REGISTER_SERVICE psm 0x%x mtu %u connection %p", psm, mtu, connection);
+    log_info("L2CAP_REGISTER_SERVICE psm 0x%x mtu %u connection %p priority %u weight %u", psm, mtu, connection, priority, weight);
     
     // check for alread registered psm 
     // TODO: emit error event
@@ -1547,6 +3457,8 @@ void l2cap_register_service_internal(void *connection, btstack_packet_handler_t
     service->connection = connection;
     service->packet_handler = packet_handler;
     service->required_security_level = security_level;
+    service->priority = priority > L2CAP_PRIORITY_CONTROL ? L2CAP_PRIORITY_CONTROL : priority;
+    service->weight = weight ? weight : 1;
 
     // add to services list
     linked_list_add(&l2cap_services, (linked_item_t *) service);
@@ -1624,6 +3536,7 @@ void l2cap_le_register_service_internal(void * connection, btstack_packet_handle
     service->psm = psm;
     service->mtu = mtu;
     service->mps = mps;
+    service->initial_credits = initial_credits;
     service->connection = connection;
     service->packet_handler = packet_handler;
     service->required_security_level = security_level;
@@ -1644,4 +3557,438 @@ void l2cap_le_unregister_service_internal(void * connection, uint16_t psm) {
     linked_list_remove(&l2cap_le_services, (linked_item_t *) service);
     btstack_memory_l2cap_service_free(service);
 }
+
+// MARK: LE Credit Based Flow Control Mode
+
+static l2cap_channel_t * l2cap_le_get_channel_for_local_cid(uint16_t local_cid){
+    if (!l2cap_cid_in_table(local_cid)) {
+        return l2cap_get_channel_in_list(&l2cap_le_channels, local_cid);
+    }
+    l2cap_channel_t * channel = cid_table[local_cid - L2CAP_CID_DYNAMIC_START];
+    if (channel && !channel->le_credit_based) return NULL;
+    return channel;
+}
+
+static void l2cap_le_finialize_channel_close(l2cap_channel_t * channel){
+    channel->state = L2CAP_STATE_CLOSED;
+    l2cap_emit_channel_closed(channel);
+    linked_list_remove(&l2cap_le_channels, (linked_item_t *) channel);
+    l2cap_free_channel(channel);
+}
+
+// map result of LE Credit Based Connection Response onto BTstack error codes used for Classic
+static uint8_t l2cap_le_status_for_result(uint16_t result){
+    switch (result){
+        case 0x0002: // LE_PSM not supported
+            return L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_PSM;
+        case 0x0005: // Insufficient Authentication
+        case 0x0006: // Insufficient Authorization
+        case 0x0007: // Insufficient Encryption Key Size
+        case 0x0008: // Insufficient Encryption
+            return L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_SECURITY;
+        default:
+            return L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_RESOURCES;
+    }
+}
+
+// K-frames are sent and received as single L2CAP PDU
+static uint16_t l2cap_le_limit_mps(uint16_t mps){
+    if (mps == 0 || mps > l2cap_max_le_mtu()) return l2cap_max_le_mtu();
+    if (mps < L2CAP_LE_DEFAULT_MTU) return L2CAP_LE_DEFAULT_MTU;
+    return mps;
+}
+
+static l2cap_channel_t * l2cap_le_create_channel_entry(void * connection, btstack_packet_handler_t packet_handler, hci_con_handle_t handle,
+                                                       uint16_t psm, uint16_t mtu, uint16_t mps, uint16_t initial_credits){
+    hci_connection_t * hci_connection = hci_connection_for_handle(handle);
+    if (!hci_connection) return NULL;
+    l2cap_channel_t * channel = btstack_memory_l2cap_channel_get();
+    if (!channel) return NULL;
+    memset(channel, 0, sizeof(l2cap_channel_t));
+    BD_ADDR_COPY(channel->address, hci_connection->address);
+    channel->handle = handle;
+    channel->psm = psm;
+    channel->connection = connection;
+    channel->packet_handler = packet_handler;
+    channel->local_cid = l2cap_allocate_local_cid(channel);
+    channel->le_credit_based = 1;
+    channel->local_mtu = mtu < L2CAP_LE_DEFAULT_MTU ? L2CAP_LE_DEFAULT_MTU : mtu;
+    channel->remote_mtu = L2CAP_LE_DEFAULT_MTU;
+    channel->flush_timeout = 0xffff;
+    channel->le_local_mps = l2cap_le_limit_mps(mps);
+    channel->le_credits_initial = initial_credits ? initial_credits : 1;
+    channel->remote_sig_id = L2CAP_SIG_ID_INVALID;
+    channel->local_sig_id = L2CAP_SIG_ID_INVALID;
+    channel->required_security_level = LEVEL_0;
+    return channel;
+}
+
+static void l2cap_le_channel_opened(l2cap_channel_t * channel){
+    channel->state = L2CAP_STATE_OPEN;
+    l2cap_emit_channel_opened(channel, 0);
+    if (channel->le_send_sdu_buffer) return;
+    l2cap_emit_credits(channel, 1);
+}
+
+static void l2cap_le_handle_connection_request(hci_con_handle_t handle, uint8_t sig_id, uint8_t * command){
+    uint16_t psm        = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET);
+    uint16_t source_cid = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 2);
+    uint16_t mtu        = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 4);
+    uint16_t mps        = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 6);
+    uint16_t credits    = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 8);
+
+    log_info("l2cap_le_handle_connection_request for handle %u, psm 0x%x, cid 0x%x, mtu %u, mps %u, credits %u",
+             handle, psm, source_cid, mtu, mps, credits);
+
+    l2cap_service_t * service = l2cap_le_get_service(psm);
+    if (!service){
+        // 0x0002 LE_PSM not supported
+        l2cap_register_signaling_response(handle, LE_CREDIT_BASED_CONNECTION_REQUEST, sig_id, 0x0002);
+        return;
+    }
+
+    if (gap_security_level(handle) < service->required_security_level){
+        // 0x0005 Insufficient Authentication
+        l2cap_register_signaling_response(handle, LE_CREDIT_BASED_CONNECTION_REQUEST, sig_id, 0x0005);
+        return;
+    }
+
+    l2cap_channel_t * channel = NULL;
+    if (mtu >= L2CAP_LE_DEFAULT_MTU && mps >= L2CAP_LE_DEFAULT_MTU){
+        channel = l2cap_le_create_channel_entry(service->connection, service->packet_handler, handle, psm,
+                                                service->mtu, service->mps, service->initial_credits);
+    }
+    if (!channel){
+        // 0x0004 No resources available
+        l2cap_register_signaling_response(handle, LE_CREDIT_BASED_CONNECTION_REQUEST, sig_id, 0x0004);
+        return;
+    }
+
+    channel->remote_sig_id = sig_id;
+    channel->remote_cid = source_cid;
+    channel->remote_mtu = mtu;
+    channel->le_remote_mps = mps;
+    channel->le_credits_outgoing = credits;
+    channel->required_security_level = service->required_security_level;
+    channel->state = L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT;
+
+    linked_list_add(&l2cap_le_channels, (linked_item_t *) channel);
+    l2cap_emit_connection_request(channel);
+}
+
+static void l2cap_le_signaling_handler(hci_con_handle_t handle, uint8_t * command){
+    uint8_t  code   = command[L2CAP_SIGNALING_COMMAND_CODE_OFFSET];
+    uint8_t  sig_id = command[L2CAP_SIGNALING_COMMAND_SIGID_OFFSET];
+    uint16_t result;
+    uint16_t credits;
+    uint16_t cid    = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET);
+    linked_list_iterator_t it;
+
+    if (code == LE_CREDIT_BASED_CONNECTION_REQUEST){
+        l2cap_le_handle_connection_request(handle, sig_id, command);
+        return;
+    }
+
+    linked_list_iterator_init(&it, &l2cap_le_channels);
+    while (linked_list_iterator_has_next(&it)){
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+        if (channel->handle != handle) continue;
+        switch (code){
+            case LE_CREDIT_BASED_CONNECTION_RESPONSE:
+                if (channel->state != L2CAP_STATE_WAIT_LE_CONNECTION_RESPONSE) break;
+                if (channel->local_sig_id != sig_id) break;
+                result = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 8);
+                if (result){
+                    log_info("l2cap_le_signaling_handler: connection refused, result 0x%04x", result);
+                    l2cap_emit_channel_opened(channel, l2cap_le_status_for_result(result));
+                    linked_list_iterator_remove(&it);
+                    l2cap_free_channel(channel);
+                    return;
+                }
+                channel->remote_cid = cid;
+                channel->remote_mtu = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 2);
+                channel->le_remote_mps = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 4);
+                channel->le_credits_outgoing = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 6);
+                l2cap_le_channel_opened(channel);
+                return;
+
+            case LE_FLOW_CONTROL_CREDIT:
+                // source cid of the sender
+                if (channel->state != L2CAP_STATE_OPEN) break;
+                if (channel->remote_cid != cid) break;
+                credits = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 2);
+                if (credits > 0xffff - channel->le_credits_outgoing){
+                    log_error("l2cap_le_signaling_handler: cid 0x%02x, credit overflow", channel->local_cid);
+                    channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+                    return;
+                }
+                channel->le_credits_outgoing += credits;
+                return;
+
+            case DISCONNECTION_REQUEST:
+                if (channel->local_cid != cid) break;
+                channel->remote_sig_id = sig_id;
+                channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE;
+                return;
+
+            case DISCONNECTION_RESPONSE:
+                if (channel->state != L2CAP_STATE_WAIT_DISCONNECT) break;
+                if (channel->local_sig_id != sig_id) break;
+                l2cap_le_finialize_channel_close(channel);
+                return;
+
+            default:
+                return;
+        }
+    }
+}
+
+static void l2cap_le_handle_pdu(l2cap_channel_t * channel, uint8_t * packet, uint16_t size){
+    if (channel->state != L2CAP_STATE_OPEN) return;
+
+    uint8_t * payload = &packet[COMPLETE_L2CAP_HEADER];
+    uint16_t len = size - COMPLETE_L2CAP_HEADER;
+
+    // remote must not send without credits or exceed MPS
+    if (channel->le_credits_incoming == 0 || len > channel->le_local_mps){
+        log_error("l2cap_le_handle_pdu: cid 0x%02x, len %u, credits %u - disconnect", channel->local_cid, len, channel->le_credits_incoming);
+        channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+        return;
+    }
+    channel->le_credits_incoming--;
+
+    // first K-frame of SDU starts with SDU length
+    if (channel->le_receive_sdu_len == 0){
+        if (len < 2) {
+            channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+            return;
+        }
+        channel->le_receive_sdu_len = READ_BT_16(payload, 0);
+        channel->le_receive_sdu_pos = 0;
+        payload += 2;
+        len -= 2;
+        if (channel->le_receive_sdu_len > channel->local_mtu){
+            log_error("l2cap_le_handle_pdu: cid 0x%02x, SDU len %u > MTU %u - disconnect", channel->local_cid, channel->le_receive_sdu_len, channel->local_mtu);
+            channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+            return;
+        }
+    }
+
+    if (channel->le_receive_sdu_pos + len > channel->le_receive_sdu_len){
+        log_error("l2cap_le_handle_pdu: cid 0x%02x, SDU longer than announced - disconnect", channel->local_cid);
+        channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+        return;
+    }
+    memcpy(&channel->le_receive_sdu_buffer[channel->le_receive_sdu_pos], payload, len);
+    channel->le_receive_sdu_pos += len;
+    if (channel->le_receive_sdu_pos < channel->le_receive_sdu_len) return;
+
+    uint16_t sdu_len = channel->le_receive_sdu_len;
+    channel->le_receive_sdu_len = 0;
+    channel->le_receive_sdu_pos = 0;
+    l2cap_dispatch(channel, L2CAP_DATA_PACKET, channel->le_receive_sdu_buffer, sdu_len);
+}
+
+// pre: hci_can_send_acl_packet_now, outgoing SDU and credits available
+static void l2cap_le_send_k_frame(l2cap_channel_t * channel){
+    hci_reserve_packet_buffer();
+    uint8_t * acl_buffer = hci_get_outgoing_packet_buffer();
+
+    uint16_t pos = COMPLETE_L2CAP_HEADER;
+    uint16_t mps = l2cap_le_limit_mps(channel->le_remote_mps);
+    if (channel->le_send_sdu_pos == 0){
+        bt_store_16(acl_buffer, pos, channel->le_send_sdu_len);
+        pos += 2;
+        mps -= 2;
+    }
+    uint16_t payload_len = channel->le_send_sdu_len - channel->le_send_sdu_pos;
+    if (payload_len > mps){
+        payload_len = mps;
+    }
+    memcpy(&acl_buffer[pos], &channel->le_send_sdu_buffer[channel->le_send_sdu_pos], payload_len);
+    pos += payload_len;
+    channel->le_send_sdu_pos += payload_len;
+    channel->le_credits_outgoing--;
+
+    int sdu_complete = channel->le_send_sdu_pos == channel->le_send_sdu_len;
+    if (sdu_complete){
+        channel->le_send_sdu_buffer = NULL;
+    }
+
+    int pb = hci_non_flushable_packet_boundary_flag_supported() ? 0x00 : 0x02;
+
+    // 0 - Connection handle : PB=pb : BC=00 
+    bt_store_16(acl_buffer, 0, channel->handle | (pb << 12) | (0 << 14));
+    // 2 - ACL length
+    bt_store_16(acl_buffer, 2, pos - 4);
+    // 4 - L2CAP packet length
+    bt_store_16(acl_buffer, 4, pos - 8);
+    // 6 - L2CAP channel DEST
+    bt_store_16(acl_buffer, 6, channel->remote_cid);
+    hci_send_acl_packet_buffer(pos);
+
+    // SDU buffer can be reused
+    if (sdu_complete){
+        l2cap_emit_credits(channel, 1);
+    }
+}
+
+static void l2cap_le_run(void){
+    linked_list_iterator_t it;    
+    linked_list_iterator_init(&it, &l2cap_le_channels);
+    while (linked_list_iterator_has_next(&it)){
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+        if (!hci_can_send_acl_packet_now(channel->handle)) continue;
+        switch (channel->state){
+            case L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST:
+                channel->state = L2CAP_STATE_WAIT_LE_CONNECTION_RESPONSE;
+                channel->local_sig_id = l2cap_next_sig_id();
+                channel->le_credits_incoming = channel->le_credits_initial;
+                l2cap_send_le_signaling_packet(channel->handle, LE_CREDIT_BASED_CONNECTION_REQUEST, channel->local_sig_id, channel->psm,
+                                               channel->local_cid, channel->local_mtu, channel->le_local_mps, channel->le_credits_incoming);
+                break;
+
+            case L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT:
+                channel->le_credits_incoming = channel->le_credits_initial;
+                l2cap_send_le_signaling_packet(channel->handle, LE_CREDIT_BASED_CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid,
+                                               channel->local_mtu, channel->le_local_mps, channel->le_credits_incoming, 0);
+                l2cap_le_channel_opened(channel);
+                break;
+
+            case L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE:
+                channel->state = L2CAP_STATE_INVALID;
+                l2cap_send_le_signaling_packet(channel->handle, LE_CREDIT_BASED_CONNECTION_RESPONSE, channel->remote_sig_id, 0, 0, 0, 0, channel->le_result);
+                l2cap_le_finialize_channel_close(channel);  // -- remove from list
+                break;
+
+            case L2CAP_STATE_OPEN:
+                // return credits in batches, when half of the initial credits have been used
+                if (channel->le_credits_incoming <= channel->le_credits_initial / 2){
+                    uint16_t credits = channel->le_credits_initial - channel->le_credits_incoming;
+                    channel->le_credits_incoming = channel->le_credits_initial;
+                    l2cap_send_le_signaling_packet(channel->handle, LE_FLOW_CONTROL_CREDIT, l2cap_next_sig_id(), channel->local_cid, credits);
+                    break;
+                }
+                while (channel->state == L2CAP_STATE_OPEN && channel->le_send_sdu_buffer && channel->le_credits_outgoing
+                && hci_can_send_acl_packet_now(channel->handle)){
+                    l2cap_le_send_k_frame(channel);
+                }
+                break;
+
+            case L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST:
+                channel->state = L2CAP_STATE_WAIT_DISCONNECT;
+                channel->local_sig_id = l2cap_next_sig_id();
+                l2cap_send_le_signaling_packet(channel->handle, DISCONNECTION_REQUEST, channel->local_sig_id, channel->remote_cid, channel->local_cid);
+                break;
+
+            case L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE:
+                channel->state = L2CAP_STATE_INVALID;
+                l2cap_send_le_signaling_packet(channel->handle, DISCONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid);
+                l2cap_le_finialize_channel_close(channel);  // -- remove from list
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+void l2cap_le_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler, hci_con_handle_t handle, uint16_t psm,
+                                      uint8_t * receive_sdu_buffer, uint16_t mtu, uint16_t mps, uint16_t initial_credits){
+
+    log_info("L2CAP_LE_CREATE_CHANNEL handle 0x%x psm 0x%x mtu %u mps %u credits %u", handle, psm, mtu, mps, initial_credits);
+
+    hci_connection_t * hci_connection = hci_connection_for_handle(handle);
+    l2cap_channel_t * channel = NULL;
+    if (hci_connection && hci_is_le_connection(hci_connection)){
+        channel = l2cap_le_create_channel_entry(connection, packet_handler, handle, psm, mtu, mps, initial_credits);
+    }
+    if (!channel){
+        // emit error event
+        l2cap_channel_t dummy_channel;
+        memset(&dummy_channel, 0, sizeof(l2cap_channel_t));
+        dummy_channel.handle = handle;
+        dummy_channel.psm = psm;
+        dummy_channel.connection = connection;
+        dummy_channel.packet_handler = packet_handler;
+        l2cap_emit_channel_opened(&dummy_channel, hci_connection ? BTSTACK_MEMORY_ALLOC_FAILED : ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+        return;
+    }
+
+    channel->le_receive_sdu_buffer = receive_sdu_buffer;
+    channel->state = L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST;
+    linked_list_add(&l2cap_le_channels, (linked_item_t *) channel);
+
+    // process
+    l2cap_run();
+}
+
+void l2cap_le_accept_connection_internal(uint16_t local_cid, uint8_t * receive_sdu_buffer){
+    log_info("L2CAP_LE_ACCEPT_CONNECTION local_cid 0x%x", local_cid);
+    l2cap_channel_t * channel = l2cap_le_get_channel_for_local_cid(local_cid);
+    if (!channel || channel->state != L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT) {
+        log_error("l2cap_le_accept_connection_internal called but local_cid 0x%x not found", local_cid);
+        return;
+    }
+    channel->le_receive_sdu_buffer = receive_sdu_buffer;
+    channel->state = L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT;
+
+    // process
+    l2cap_run();
+}
+
+void l2cap_le_decline_connection_internal(uint16_t local_cid){
+    log_info("L2CAP_LE_DECLINE_CONNECTION local_cid 0x%x", local_cid);
+    l2cap_channel_t * channel = l2cap_le_get_channel_for_local_cid(local_cid);
+    if (!channel || channel->state != L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT) {
+        log_error("l2cap_le_decline_connection_internal called but local_cid 0x%x not found", local_cid);
+        return;
+    }
+    // 0x0004 No resources available
+    channel->le_result = 0x0004;
+    channel->state = L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE;
+    l2cap_run();
+}
+
+int l2cap_le_can_send_now(uint16_t local_cid){
+    l2cap_channel_t * channel = l2cap_le_get_channel_for_local_cid(local_cid);
+    if (!channel) return 0;
+    return channel->state == L2CAP_STATE_OPEN && channel->le_send_sdu_buffer == NULL;
+}
+
+int l2cap_le_send_data(uint16_t local_cid, uint8_t * data, uint16_t len){
+    l2cap_channel_t * channel = l2cap_le_get_channel_for_local_cid(local_cid);
+    if (!channel) {
+        log_error("l2cap_le_send_data no channel for cid 0x%02x", local_cid);
+        return L2CAP_LOCAL_CID_DOES_NOT_EXIST;
+    }
+
+    if (len > channel->remote_mtu){
+        log_error("l2cap_le_send_data cid 0x%02x, data length exceeds remote MTU.", local_cid);
+        return L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU;
+    }
+
+    if (!l2cap_le_can_send_now(local_cid)){
+        log_info("l2cap_le_send_data cid 0x%02x, cannot send", local_cid);
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+
+    channel->le_send_sdu_buffer = data;
+    channel->le_send_sdu_len = len;
+    channel->le_send_sdu_pos = 0;
+
+    // process
+    l2cap_run();
+    return 0;
+}
+
+void l2cap_le_disconnect_internal(uint16_t local_cid){
+    log_info("L2CAP_LE_DISCONNECT local_cid 0x%x", local_cid);
+    l2cap_channel_t * channel = l2cap_le_get_channel_for_local_cid(local_cid);
+    if (channel && channel->state == L2CAP_STATE_OPEN) {
+        channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+    }
+    // process
+    l2cap_run();
+}
 #endif
@@ -82,16 +82,51 @@ extern "C" {
 #define L2CAP_CID_SECURITY_MANAGER_PROTOCOL 0x0006
 
 // L2CAP Configuration Result Codes
+#define L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS 0x0001
 #define L2CAP_CONF_RESULT_UNKNOWN_OPTIONS   0x0003
 
+// L2CAP Configuration Option Types
+#define L2CAP_CONFIG_OPTION_TYPE_MAX_TRANSMISSION_UNIT      0x01
+#define L2CAP_CONFIG_OPTION_TYPE_FLUSH_TIMEOUT              0x02
+#define L2CAP_CONFIG_OPTION_TYPE_RETRANSMISSION_AND_FLOW_CONTROL 0x04
+#define L2CAP_CONFIG_OPTION_TYPE_FRAME_CHECK_SEQUENCE       0x05
+
+// L2CAP Channel Modes
+#define L2CAP_CHANNEL_MODE_BASIC                    0x00
+#define L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION  0x03
+#define L2CAP_CHANNEL_MODE_STREAMING                0x04
+
 // L2CAP Reject Result Codes
 #define L2CAP_REJ_CMD_UNKNOWN               0x0000
     
 // Response Timeout eXpired
+#ifndef L2CAP_RTX_TIMEOUT_MS
 #define L2CAP_RTX_TIMEOUT_MS   10000
+#endif
 
 // Extended Response Timeout eXpired
+#ifndef L2CAP_ERTX_TIMEOUT_MS
 #define L2CAP_ERTX_TIMEOUT_MS 120000
+#endif
+
+// Scheduling classes for credit hand out, higher classes are served first. A class that waited while
+// higher classes on its ACL link got L2CAP_PRIORITY_MIN_SHARE_CREDITS credits is served first once
+#define L2CAP_PRIORITY_LOW      0
+#define L2CAP_PRIORITY_NORMAL   1
+#define L2CAP_PRIORITY_HIGH     2
+#define L2CAP_PRIORITY_CONTROL  3
+
+// Credits per round-robin round within a scheduling class
+#define L2CAP_DEFAULT_WEIGHT    1
+
+#ifdef HAVE_L2CAP_ERTM
+// ERTM - default Retransmission and Monitor timeouts
+#define L2CAP_ERTM_RETRANSMISSION_TIMEOUT_MS 2000
+#define L2CAP_ERTM_MONITOR_TIMEOUT_MS 12000
+
+// ERTM - acknowledge received I-frames at the latest after this time
+#define L2CAP_ERTM_ACK_TIMEOUT_MS 200
+#endif
 
 // private structs
 typedef enum {
@@ -112,6 +147,10 @@ typedef enum {
     L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT,   
     L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST,
     L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE,
+    L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST,
+    L2CAP_STATE_WAIT_LE_CONNECTION_RESPONSE,
+    L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT,
+    L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE,
     L2CAP_STATE_INVALID,
 } L2CAP_STATE;
 
@@ -128,12 +167,85 @@ typedef enum {
     L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_INVALID = 1 << 8,   // in CONF RSP, send UNKNOWN OPTIONS
     L2CAP_CHANNEL_STATE_VAR_SEND_CMD_REJ_UNKNOWN  = 1 << 9,   // send CMD_REJ with reason unknown
     L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND   = 1 << 10,  // send Connection Respond with pending
+    L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE = 1 << 11, // in CONF RSP, send UNACCEPTABLE PARAMETERS with local mode
 } L2CAP_CHANNEL_STATE_VAR;
 
-// info regarding an actual connection
+#ifdef HAVE_L2CAP_ERTM
+
+// ERTM/Streaming configuration, provided on channel creation or accept
+typedef struct {
+    uint8_t  mode;                          // L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION or L2CAP_CHANNEL_MODE_STREAMING
+    uint8_t  mode_mandatory;                // 0 = fall back to Basic mode if remote does not accept mode
+    uint8_t  max_transmit;                  // transmissions per I-frame before channel is closed, 0 = infinite
+    uint16_t retransmission_timeout_ms;     // 0 = default
+    uint16_t monitor_timeout_ms;            // 0 = default
+    uint16_t local_mtu;                     // max SDU size, SDUs larger than an ACL packet are segmented
+    uint8_t  num_tx_buffers;                // I-frames kept until acknowledged
+    uint8_t  num_rx_buffers;                // out-of-sequence I-frames kept during SREJ recovery, also tx window offered to remote
+    uint8_t  fcs_option;                    // 1 = use Frame Check Sequence, 0 = omit FCS if remote agrees
+} l2cap_ertm_config_t;
+
+typedef enum {
+    L2CAP_ERTM_TX_STATE_XMIT = 0,           // sending I-frames
+    L2CAP_ERTM_TX_STATE_WAIT_F,             // poll sent, waiting for frame with Final bit
+} L2CAP_ERTM_TX_STATE;
+
+typedef enum {
+    L2CAP_ERTM_RX_SLOT_EMPTY = 0,
+    L2CAP_ERTM_RX_SLOT_RECEIVED,            // out-of-sequence I-frame stored
+    L2CAP_ERTM_RX_SLOT_SREJ_PENDING,        // missing, SREJ to send
+    L2CAP_ERTM_RX_SLOT_SREJ_SENT,           // missing, SREJ sent
+} L2CAP_ERTM_RX_SLOT_STATE;
+
+// outgoing I-frame, payload stored in tx buffer
+typedef struct {
+    uint16_t len;                           // payload incl. SDU length field
+    uint8_t  sar;
+    uint8_t  transmissions;
+    uint8_t  retransmission_requested;      // by SREJ
+} l2cap_ertm_tx_packet_state_t;
+
+// out-of-sequence I-frame, payload stored in rx buffer
 typedef struct {
+    uint16_t len;
+    uint8_t  sar;
+    uint8_t  state;                         // L2CAP_ERTM_RX_SLOT_STATE
+} l2cap_ertm_rx_packet_state_t;
+#endif
+
+// per channel counters, see l2cap_get_channel_statistics
+typedef struct {
+    uint32_t bytes_sent;
+    uint32_t sdus_sent;
+    uint32_t credit_waits;              // nr of times the channel ran out of credits
+    uint32_t queueing_delay_ms;         // total time spent without credits
+    uint32_t queueing_delay_max_ms;
+} l2cap_channel_statistics_t;
+
+// signaling commands sent by l2cap_run, see l2cap_get_signaling_statistics
+typedef struct {
+    uint32_t commands_sent;
+    uint32_t c_frames_sent;             // commands for the same handle share a C-frame
+} l2cap_signaling_statistics_t;
+
+// channels visited by l2cap_run, see l2cap_get_run_statistics
+typedef struct {
+    uint32_t runs;
+    uint32_t channels_visited;          // only channels with pending work are visited
+    uint16_t channels_visited_max;      // in a single run
+} l2cap_run_statistics_t;
+
+// info regarding an actual connection
+typedef struct l2cap_channel {
     // linked list - assert: first field
     linked_item_t    item;
+
+    // next channel on the same ACL connection, list head in l2cap_connection_t
+    struct l2cap_channel * next_for_handle;
+    
+    // work list of l2cap_run, pending = 1 if listed
+    struct l2cap_channel * next_pending;
+    uint8_t   pending;
     
     L2CAP_STATE state;
     L2CAP_CHANNEL_STATE_VAR state_var;
@@ -157,11 +269,101 @@ typedef struct {
     gap_security_level_t required_security_level;
 
     uint8_t   packets_granted;    // number of L2CAP/ACL packets client is allowed to send
+
+    // scheduling among channels on the same ACL link, see l2cap_hand_out_credits
+    uint8_t   priority;
+    uint8_t   weight;
+    uint8_t   credits_scheduled;  // assigned in current hand out, not emitted yet
+    uint8_t   active;             // sent since last L2CAP_EVENT_CREDITS
+    uint16_t  packets_promised;   // ACL buffers counted for this channel in packets_granted of its connection
+    struct l2cap_channel * next_credits;    // credit queue of its class, credits_queued = 1 if listed
+    uint8_t   credits_queued;
+    uint8_t   waiting_for_credits;
+    uint32_t  waiting_since_ms;
+    l2cap_channel_statistics_t statistics;
     
     uint8_t   reason; // used in decline internal
     
     timer_source_t rtx; // also used for ertx
 
+#ifdef HAVE_L2CAP_ERTM
+    // negotiated mode, L2CAP_CHANNEL_MODE_BASIC if no ERTM/Streaming config was given
+    uint8_t   mode;
+    uint8_t   mode_mandatory;
+    uint8_t   local_fcs_option;
+    uint8_t   remote_fcs_option;
+    uint8_t   fcs_option;               // FCS used, negotiated
+
+    // local configuration
+    uint8_t   local_tx_window;          // = num_rx_buffers
+    uint8_t   local_max_transmit;
+    uint16_t  local_mps;
+    uint16_t  retransmission_timeout_ms;
+    uint16_t  monitor_timeout_ms;
+
+    // remote configuration
+    uint8_t   remote_mode;
+    uint8_t   remote_tx_window;
+    uint8_t   remote_max_transmit;
+    uint16_t  remote_mps;
+
+    // buffers provided by application
+    uint8_t   num_tx_buffers;
+    uint8_t   num_rx_buffers;
+    l2cap_ertm_tx_packet_state_t * tx_packets_state;
+    l2cap_ertm_rx_packet_state_t * rx_packets_state;
+    uint8_t * tx_packets_data;
+    uint8_t * rx_packets_data;
+    uint8_t * reassembly_buffer;
+
+    // tx: stored frames [expected_ack_seq, tx_next_seq), sent [expected_ack_seq, tx_high_seq)
+    L2CAP_ERTM_TX_STATE tx_state;
+    uint8_t   tx_next_seq;              // assigned to next stored I-frame
+    uint8_t   tx_send_seq;              // next I-frame to send, rewound to retransmit
+    uint8_t   tx_high_seq;              // next I-frame never sent before
+    uint8_t   expected_ack_seq;
+    uint8_t   tx_ack_index;             // tx buffer of I-frame expected_ack_seq
+    uint8_t   remote_busy;
+    uint8_t   retry_count;              // polls sent in WAIT_F
+    uint8_t   send_poll;
+    uint8_t   send_final;
+    uint8_t   send_rej;
+    uint8_t   send_rr;
+    timer_source_t ertm_timer;          // Retransmission or Monitor timer, depending on tx_state
+    uint8_t   ertm_timer_active;
+
+    // rx
+    uint8_t   expected_tx_seq;
+    uint8_t   rx_expected_index;        // rx buffer of I-frame expected_tx_seq
+    uint8_t   unacked_rx_frames;
+    uint8_t   rej_sent;
+    uint16_t  reassembly_sdu_length;
+    uint16_t  reassembly_pos;
+    timer_source_t ack_timer;
+    uint8_t   ack_timer_active;
+#endif
+
+#ifdef HAVE_BLE
+    // LE Credit Based Flow Control Mode
+    uint8_t   le_credit_based;          // channel in l2cap_le_channels
+    uint16_t  le_local_mps;
+    uint16_t  le_remote_mps;
+    uint16_t  le_credits_outgoing;      // K-frames we are allowed to send
+    uint16_t  le_credits_incoming;      // K-frames remote is allowed to send
+    uint16_t  le_credits_initial;       // returned in batches once half of them are used
+    uint16_t  le_result;                // result for LE Credit Based Connection Response
+
+    // outgoing SDU provided by application, valid until L2CAP_EVENT_CREDITS
+    uint8_t * le_send_sdu_buffer;
+    uint16_t  le_send_sdu_len;
+    uint16_t  le_send_sdu_pos;
+
+    // incoming SDU is reassembled in buffer provided by application
+    uint8_t * le_receive_sdu_buffer;
+    uint16_t  le_receive_sdu_len;
+    uint16_t  le_receive_sdu_pos;
+#endif
+
     // client connection
     void * connection;
     
@@ -183,6 +385,9 @@ typedef struct {
 
     // incoming MPS
     uint16_t mps;
+
+    // LE Credit Based Flow Control Mode: credits granted to remote on connect
+    uint16_t initial_credits;
     
     // client connection
     void *connection;    
@@ -192,6 +397,10 @@ typedef struct {
 
     // required security level
     gap_security_level_t required_security_level;    
+
+    // scheduling of incoming channels
+    uint8_t priority;
+    uint8_t weight;
 } l2cap_service_t;
 
 
@@ -201,10 +410,36 @@ typedef struct l2cap_signaling_response {
     uint8_t  code;
     uint16_t data; // infoType for INFORMATION REQUEST, result for CONNECTION request and command unknown
 } l2cap_signaling_response_t;
+
+// payload fragment for l2cap_sendv
+typedef struct {
+    const uint8_t * data;
+    uint16_t len;
+} l2cap_iovec_t;
     
 
 void l2cap_block_new_credits(uint8_t blocked);
 
+// Classic channel for local CID, NULL if not found
+l2cap_channel_t * l2cap_get_channel_for_local_cid(uint16_t local_cid);
+
+// max nr of credits handed out to a channel at once, 1 = single credits
+// Credits do not reserve ACL buffers for a channel that has not sent since its last L2CAP_EVENT_CREDITS,
+// other channels on the same ACL link may use them. A send can then fail with BTSTACK_ACL_BUFFERS_FULL
+// despite credits. The channel keeps its credits: retry once l2cap_can_send_packet_now is true again,
+// e.g. on HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS or DAEMON_EVENT_HCI_PACKET_SENT.
+void l2cap_set_max_credits(uint8_t max_credits);
+
+// scheduling class L2CAP_PRIORITY_x and weighted round-robin share of a channel, weight 0 = 1
+void l2cap_set_channel_priority(uint16_t local_cid, uint8_t priority, uint8_t weight);
+
+// counters since channel creation, returns 0 on success
+int  l2cap_get_channel_statistics(uint16_t local_cid, l2cap_channel_statistics_t * statistics);
+
+// counters since l2cap_init
+void l2cap_get_signaling_statistics(l2cap_signaling_statistics_t * statistics);
+void l2cap_get_run_statistics(l2cap_run_statistics_t * statistics);
+
 int  l2cap_can_send_fixed_channel_packet_now(uint16_t handle);
 
 // @deprecated use l2cap_can_send_fixed_channel_packet_now instead
@@ -246,11 +481,34 @@ uint16_t l2cap_get_remote_mtu_for_local_cid(uint16_t local_cid);
  */
 int l2cap_send_internal(uint16_t local_cid, uint8_t *data, uint16_t len);
 
+/** 
+ * @brief Sends L2CAP data packet composed of iovcnt fragments to the channel with given identifier.
+ *        The fragments are gathered directly into the outgoing packet buffer, or the tx buffers in ERTM.
+ */
+int l2cap_sendv(uint16_t local_cid, const l2cap_iovec_t * iov, int iovcnt);
+
+/** 
+ * @brief Sends up to num_sdus SDUs to the channel with given identifier, as long as credits are available
+ *        and the HCI transport accepts packets. New credits are handed out once afterwards.
+ *        The SDUs are not queued: returns nr of SDUs sent, which may be less than num_sdus, including 0.
+ *        With an asynchronous HCI transport, the outgoing packet buffer is busy until DAEMON_EVENT_HCI_PACKET_SENT,
+ *        so usually only one SDU is sent per call. Resubmit the remaining SDUs on L2CAP_EVENT_CREDITS
+ *        or DAEMON_EVENT_HCI_PACKET_SENT.
+ */
+int l2cap_send_batch(uint16_t local_cid, uint8_t **data, uint16_t *len, int num_sdus);
+
 /** 
  * @brief Registers L2CAP service with given PSM and MTU, and assigns a packet handler. On embedded systems, use NULL for connection parameter.
  */
 void l2cap_register_service_internal(void *connection, btstack_packet_handler_t packet_handler, uint16_t psm, uint16_t mtu, gap_security_level_t security_level);
 
+/** 
+ * @brief Registers L2CAP service like l2cap_register_service_internal. Incoming channels are scheduled in class priority (L2CAP_PRIORITY_x)
+ *        and get weight credits per round-robin round when several channels share an ACL link.
+ */
+void l2cap_register_service_with_priority_internal(void *connection, btstack_packet_handler_t packet_handler, uint16_t psm, uint16_t mtu,
+                                                   gap_security_level_t security_level, uint8_t priority, uint8_t weight);
+
 /** 
  * @brief Unregisters L2CAP service with given PSM.  On embedded systems, use NULL for connection parameter.
  */
@@ -266,6 +524,7 @@ void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason);
  * @brief Non-blocking UART write
  */
 int  l2cap_can_send_packet_now(uint16_t local_cid);    
+int  l2cap_can_send_prepared_packet_now(uint16_t local_cid);
 int  l2cap_reserve_packet_buffer(void);
 void l2cap_release_packet_buffer(void);
 
@@ -278,6 +537,20 @@ int l2cap_send_prepared(uint16_t local_cid, uint16_t len);
 
 int l2cap_send_prepared_connectionless(uint16_t handle, uint16_t cid, uint16_t len);
 
+#ifdef HAVE_L2CAP_ERTM
+/** 
+ * @brief Creates L2CAP channel in Enhanced Retransmission or Streaming Mode. The buffer holds outgoing and out-of-sequence I-frames
+ *        as well as the SDU reassembly buffer and must stay valid until the channel is closed. Max PDU size is derived from its size.
+ */
+void l2cap_create_ertm_channel_internal(void * connection, btstack_packet_handler_t packet_handler, bd_addr_t address, uint16_t psm,
+                                        l2cap_ertm_config_t * ertm_config, uint8_t * buffer, uint32_t size);
+
+/** 
+ * @brief Accepts incoming L2CAP connection in Enhanced Retransmission or Streaming Mode, see l2cap_create_ertm_channel_internal.
+ */
+void l2cap_accept_ertm_connection_internal(uint16_t local_cid, l2cap_ertm_config_t * ertm_config, uint8_t * buffer, uint32_t size);
+#endif
+
 /** 
  * @brief Bluetooth 4.0 - allows to register handler for Attribute Protocol and Security Manager Protocol.
  */
@@ -288,20 +561,43 @@ uint16_t l2cap_max_le_mtu(void);
 
 int  l2cap_send_connectionless(uint16_t handle, uint16_t cid, uint8_t *data, uint16_t len);
 
-/* API_END */
-
-#if 0
-
-// to be implemented soon
+#ifdef HAVE_BLE
 /**
- * @brief Regster L2CAP LE Credit Based Flow Control Mode service
- * @param
+ * @brief Registers L2CAP LE Credit Based Flow Control Mode service with given LE_PSM. Incoming SDUs up to mtu bytes are
+ *        received in K-frames of up to mps bytes, the remote device is granted initial_credits K-frames on connect.
  */
 void l2cap_le_register_service_internal(void * connection, btstack_packet_handler_t packet_handler, uint16_t psm,
                                         uint16_t mtu, uint16_t mps, uint16_t initial_credits, gap_security_level_t security_level);
 void l2cap_le_unregister_service_internal(void * connection, uint16_t psm);
+
+/**
+ * @brief Creates LE Credit Based Flow Control Mode channel on an existing LE connection. Incoming SDUs are reassembled
+ *        in the receive buffer, which holds mtu bytes and must stay valid until the channel is closed. mps = 0 selects the largest MPS.
+ */
+void l2cap_le_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler, hci_con_handle_t handle, uint16_t psm,
+                                      uint8_t * receive_sdu_buffer, uint16_t mtu, uint16_t mps, uint16_t initial_credits);
+
+/**
+ * @brief Accepts/Deny incoming LE Credit Based connection. The receive buffer must hold the MTU of the service.
+ */
+void l2cap_le_accept_connection_internal(uint16_t local_cid, uint8_t * receive_sdu_buffer);
+void l2cap_le_decline_connection_internal(uint16_t local_cid);
+
+/**
+ * @brief Sends SDU on LE Credit Based channel. The data is segmented into K-frames as credits allow and
+ *        must stay valid until L2CAP_EVENT_CREDITS is emitted for the channel.
+ */
+int  l2cap_le_send_data(uint16_t local_cid, uint8_t * data, uint16_t len);
+int  l2cap_le_can_send_now(uint16_t local_cid);
+
+/**
+ * @brief Disconnects LE Credit Based channel with given identifier.
+ */
+void l2cap_le_disconnect_internal(uint16_t local_cid);
 #endif
 
+/* API_END */
+
 #if defined __cplusplus
 }
 #endif
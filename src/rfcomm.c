@@ -96,6 +96,25 @@
 
 #define RFCOMM_CREDITS 10
 
+// upper bound for the incoming window provided automatically, in frames and in bytes of max frame size
+#ifndef RFCOMM_CREDITS_MAX
+#define RFCOMM_CREDITS_MAX 64
+#endif
+#ifndef RFCOMM_CREDITS_MAX_BYTES
+#define RFCOMM_CREDITS_MAX_BYTES 32768
+#endif
+
+// incoming window covers the frames the remote sends in this time at the measured rate,
+// so that new credits arrive before the remote runs out
+#ifndef RFCOMM_CREDITS_WINDOW_MS
+#define RFCOMM_CREDITS_WINDOW_MS 100
+#endif
+
+// RFCOMM CIDs are allocated densely from 1, so the channel is found by index
+#ifndef RFCOMM_CID_TABLE_SIZE
+#define RFCOMM_CID_TABLE_SIZE 32
+#endif
+
 // FCS calc 
 #define BT_RFCOMM_CODE_WORD         0xE0 // pol = x8+x2+x1+1
 #define BT_RFCOMM_CRC_CHECK_LEN     3
@@ -107,23 +126,50 @@
 // #define RFCOMM_LOG_CREDITS
 
 // global rfcomm data
-static uint16_t      rfcomm_client_cid_generator;  // used for client channel IDs
+static rfcomm_channel_t * rfcomm_cid_table[RFCOMM_CID_TABLE_SIZE];
+static uint16_t      rfcomm_cid_table_next;        // slot tried first for the next CID, avoids immediate reuse
+static uint16_t      rfcomm_cid_overflow_next;     // next CID if all slots are used
 
 // linked lists for all
 static linked_list_t rfcomm_multiplexers = NULL;
 static linked_list_t rfcomm_channels = NULL;
 static linked_list_t rfcomm_services = NULL;
 
+// multiplexer of last received L2CAP packet or event
+static rfcomm_multiplexer_t * rfcomm_multiplexer_last;
+
+// channels with pending work for rfcomm_run, in order of scheduling, see rfcomm_channel_schedule
+typedef struct {
+    rfcomm_channel_t * head;
+    rfcomm_channel_t * tail;
+} rfcomm_channel_queue_t;
+
+static rfcomm_channel_queue_t rfcomm_channels_pending;
+static rfcomm_channel_queue_t rfcomm_channels_blocked;    // no progress in current run, e.g. no ACL buffer
+static rfcomm_channel_t * rfcomm_run_visiting;            // cleared if channel gets freed while visited
+static uint32_t rfcomm_frames_sent;                       // used to detect progress of a visited channel
+static int rfcomm_run_active;
+static int rfcomm_run_pending;
+static rfcomm_run_statistics_t rfcomm_run_statistics;
+
 static gap_security_level_t rfcomm_security_level;
 
+static int rfcomm_hand_out_active;
+static int rfcomm_hand_out_pending;
+
 static void (*app_packet_handler)(void * connection, uint8_t packet_type,
                                   uint16_t channel, uint8_t *packet, uint16_t size);
 
 static void rfcomm_run(void);
 static void rfcomm_hand_out_credits(void);
+static int rfcomm_channel_flush_tx(rfcomm_channel_t * channel);
+static void rfcomm_channel_stop_tx_timer(rfcomm_channel_t * channel);
+static void rfcomm_channel_stream_received(rfcomm_channel_t * channel, uint8_t * data, uint16_t len);
+static void rfcomm_channel_stream_send(rfcomm_channel_t * channel);
 static void rfcomm_channel_state_machine(rfcomm_channel_t *channel, rfcomm_channel_event_t *event);
 static void rfcomm_channel_state_machine_2(rfcomm_multiplexer_t * multiplexer, uint8_t dlci, rfcomm_channel_event_t *event);
 static int rfcomm_channel_ready_for_open(rfcomm_channel_t *channel);
+static int rfcomm_channel_has_work(rfcomm_channel_t * channel);
 static void rfcomm_multiplexer_state_machine(rfcomm_multiplexer_t * multiplexer, RFCOMM_MULTIPLEXER_EVENT event);
 
 
@@ -218,6 +264,17 @@ static void rfcomm_emit_credits(rfcomm_channel_t * channel, uint8_t credits) {
 	(*app_packet_handler)(channel->connection, HCI_EVENT_PACKET, 0, (uint8_t *) event, sizeof(event));
 }
 
+// data: event(8), len(8), rfcomm_cid(16), bytes(16)
+static void rfcomm_emit_stream_event(rfcomm_channel_t * channel, uint8_t event_type, uint16_t bytes) {
+    uint8_t event[6];
+    event[0] = event_type;
+    event[1] = sizeof(event) - 2;
+    bt_store_16(event, 2, channel->rfcomm_cid);
+    bt_store_16(event, 4, bytes);
+    hci_dump_packet(HCI_EVENT_PACKET, 0, event, sizeof(event));
+	(*app_packet_handler)(channel->connection, HCI_EVENT_PACKET, 0, (uint8_t *) event, sizeof(event));
+}
+
 static void rfcomm_emit_service_registered(void *connection, uint8_t status, uint8_t channel){
     log_info("RFCOMM_EVENT_SERVICE_REGISTERED status 0x%x channel #%u", status, channel);
     uint8_t event[4];
@@ -345,10 +402,15 @@ static rfcomm_multiplexer_t * rfcomm_multiplexer_for_addr(bd_addr_t addr){
 }
 
 static rfcomm_multiplexer_t * rfcomm_multiplexer_for_l2cap_cid(uint16_t l2cap_cid) {
+    // consecutive packets usually belong to the same multiplexer
+    if (rfcomm_multiplexer_last && rfcomm_multiplexer_last->l2cap_cid == l2cap_cid) {
+        return rfcomm_multiplexer_last;
+    }
     linked_item_t *it;
     for (it = (linked_item_t *) rfcomm_multiplexers; it ; it = it->next){
         rfcomm_multiplexer_t * multiplexer = ((rfcomm_multiplexer_t *) it);
         if (multiplexer->l2cap_cid == l2cap_cid) {
+            rfcomm_multiplexer_last = multiplexer;
             return multiplexer;
         };
     }
@@ -356,14 +418,7 @@ static rfcomm_multiplexer_t * rfcomm_multiplexer_for_l2cap_cid(uint16_t l2cap_ci
 }
 
 static int rfcomm_multiplexer_has_channels(rfcomm_multiplexer_t * multiplexer){
-    linked_item_t *it;
-    for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
-        rfcomm_channel_t * channel = ((rfcomm_channel_t *) it);
-        if (channel->multiplexer == multiplexer) {
-            return 1;
-        }
-    }
-    return 0;
+    return multiplexer->num_channels > 0;
 }
 
 // MARK: RFCOMM CHANNEL HELPER
@@ -380,12 +435,103 @@ static void rfcomm_dump_channels(void){
 #endif
 }
 
+static int rfcomm_cid_in_table(uint16_t rfcomm_cid){
+    return rfcomm_cid >= 1 && rfcomm_cid <= RFCOMM_CID_TABLE_SIZE;
+}
+
+static rfcomm_channel_t * rfcomm_channel_for_rfcomm_cid_in_list(uint16_t rfcomm_cid){
+    linked_item_t *it;
+    for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
+        rfcomm_channel_t * channel = ((rfcomm_channel_t *) it);
+        if (channel->rfcomm_cid == rfcomm_cid) {
+            return channel;
+        };
+    }
+    return NULL;
+}
+
+// don't use 0 as channel id
+static uint16_t rfcomm_allocate_cid(rfcomm_channel_t * channel){
+    int i;
+    for (i = 0; i < RFCOMM_CID_TABLE_SIZE; i++){
+        uint16_t slot = (rfcomm_cid_table_next + i) % RFCOMM_CID_TABLE_SIZE;
+        if (rfcomm_cid_table[slot]) continue;
+        rfcomm_cid_table[slot] = channel;
+        rfcomm_cid_table_next = (slot + 1) % RFCOMM_CID_TABLE_SIZE;
+        return slot + 1;
+    }
+    // table full, use CIDs above table
+    uint16_t rfcomm_cid;
+    do {
+        rfcomm_cid = rfcomm_cid_overflow_next++;
+        if (rfcomm_cid_overflow_next == 0){
+            rfcomm_cid_overflow_next = RFCOMM_CID_TABLE_SIZE + 1;
+        }
+    } while (rfcomm_channel_for_rfcomm_cid_in_list(rfcomm_cid));
+    return rfcomm_cid;
+}
+
+static void rfcomm_release_cid(rfcomm_channel_t * channel){
+    if (!rfcomm_cid_in_table(channel->rfcomm_cid)) return;
+    uint16_t slot = channel->rfcomm_cid - 1;
+    if (rfcomm_cid_table[slot] != channel) return;
+    rfcomm_cid_table[slot] = NULL;
+}
+
+static void rfcomm_channel_queue_add(rfcomm_channel_queue_t * queue, rfcomm_channel_t * channel){
+    channel->next_pending = NULL;
+    if (queue->tail){
+        queue->tail->next_pending = channel;
+    } else {
+        queue->head = channel;
+    }
+    queue->tail = channel;
+}
+
+static rfcomm_channel_t * rfcomm_channel_queue_pop(rfcomm_channel_queue_t * queue){
+    rfcomm_channel_t * channel = queue->head;
+    if (!channel) return NULL;
+    queue->head = channel->next_pending;
+    if (!queue->head){
+        queue->tail = NULL;
+    }
+    return channel;
+}
+
+static void rfcomm_channel_queue_remove(rfcomm_channel_queue_t * queue, rfcomm_channel_t * channel){
+    rfcomm_channel_t * prev = NULL;
+    rfcomm_channel_t * it;
+    for (it = queue->head; it; prev = it, it = it->next_pending){
+        if (it != channel) continue;
+        if (prev){
+            prev->next_pending = channel->next_pending;
+        } else {
+            queue->head = channel->next_pending;
+        }
+        if (queue->tail == channel){
+            queue->tail = prev;
+        }
+        return;
+    }
+}
+
+// add channel to the work list of rfcomm_run, called when its state or state_var requires sending
+static void rfcomm_channel_schedule(rfcomm_channel_t * channel){
+    if (channel->pending) return;
+    channel->pending = 1;
+    rfcomm_channel_queue_add(&rfcomm_channels_pending, channel);
+}
+
+static void rfcomm_channel_unschedule(rfcomm_channel_t * channel){
+    if (!channel->pending) return;
+    rfcomm_channel_queue_remove(&rfcomm_channels_pending, channel);
+    rfcomm_channel_queue_remove(&rfcomm_channels_blocked, channel);
+    channel->pending = 0;
+}
+
 static void rfcomm_channel_initialize(rfcomm_channel_t *channel, rfcomm_multiplexer_t *multiplexer, 
                                rfcomm_service_t *service, uint8_t server_channel){
     
-    // don't use 0 as channel id
-    if (rfcomm_client_cid_generator == 0) ++rfcomm_client_cid_generator;
-    
     // setup channel
     memset(channel, 0, sizeof(rfcomm_channel_t));
     
@@ -394,12 +540,12 @@ static void rfcomm_channel_initialize(rfcomm_channel_t *channel, rfcomm_multiple
     
     channel->multiplexer      = multiplexer;
     channel->service          = service;
-    channel->rfcomm_cid       = rfcomm_client_cid_generator++;
     channel->max_frame_size   = multiplexer->max_frame_size;
 
     channel->credits_incoming = 0;
     channel->credits_outgoing = 0;
     channel->packets_granted  = 0;
+    channel->packets_scheduled = 0;
 
     // set defaults for port configuration (even for services)
     rfcomm_rpn_data_set_defaults(&channel->rpn_data);
@@ -425,6 +571,9 @@ static void rfcomm_channel_initialize(rfcomm_channel_t *channel, rfcomm_multiple
 		channel->dlci = (server_channel << 1) | (multiplexer->outgoing ^ 1);
 
 	}
+
+    channel->incoming_window = RFCOMM_CREDITS;
+    channel->statistics.incoming_window_max = channel->incoming_window;
 }
 
 // service == NULL -> outgoing channel
@@ -434,12 +583,22 @@ static rfcomm_channel_t * rfcomm_channel_create(rfcomm_multiplexer_t * multiplex
     log_info("rfcomm_channel_create for service %p, channel %u --- list of channels:", service, server_channel);
     rfcomm_dump_channels();
 
+    // DLCI must be unique within multiplexer
+    uint8_t dlci = (server_channel << 1) | (service ? multiplexer->outgoing : multiplexer->outgoing ^ 1);
+    if (dlci >= RFCOMM_DLCI_TABLE_SIZE || multiplexer->channels[dlci]){
+        log_error("rfcomm_channel_create dlci #%u invalid or in use", dlci);
+        return NULL;
+    }
+
     // alloc structure 
     rfcomm_channel_t * channel = btstack_memory_rfcomm_channel_get();
     if (!channel) return NULL;
     
     // fill in 
     rfcomm_channel_initialize(channel, multiplexer, service, server_channel);
+    channel->rfcomm_cid = rfcomm_allocate_cid(channel);
+    multiplexer->channels[dlci] = channel;
+    multiplexer->num_channels++;
     
     // add to services list
     linked_list_add(&rfcomm_channels, (linked_item_t *) channel);
@@ -447,26 +606,33 @@ static rfcomm_channel_t * rfcomm_channel_create(rfcomm_multiplexer_t * multiplex
     return channel;
 }
 
+// release CID, DLCI and work list entry, caller removes channel from rfcomm_channels
+static void rfcomm_channel_free(rfcomm_channel_t * channel){
+    rfcomm_multiplexer_t * multiplexer = channel->multiplexer;
+    rfcomm_release_cid(channel);
+    if (multiplexer->channels[channel->dlci] == channel){
+        multiplexer->channels[channel->dlci] = NULL;
+        multiplexer->num_channels--;
+    }
+    rfcomm_channel_unschedule(channel);
+    // coalesced writes are lost
+    rfcomm_channel_stop_tx_timer(channel);
+    if (rfcomm_run_visiting == channel){
+        rfcomm_run_visiting = NULL;
+    }
+    btstack_memory_rfcomm_channel_free(channel);
+}
+
 static rfcomm_channel_t * rfcomm_channel_for_rfcomm_cid(uint16_t rfcomm_cid){
-    linked_item_t *it;
-    for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
-        rfcomm_channel_t * channel = ((rfcomm_channel_t *) it);
-        if (channel->rfcomm_cid == rfcomm_cid) {
-            return channel;
-        };
+    if (!rfcomm_cid_in_table(rfcomm_cid)) {
+        return rfcomm_channel_for_rfcomm_cid_in_list(rfcomm_cid);
     }
-    return NULL;
+    return rfcomm_cid_table[rfcomm_cid - 1];
 }
 
 static rfcomm_channel_t * rfcomm_channel_for_multiplexer_and_dlci(rfcomm_multiplexer_t * multiplexer, uint8_t dlci){
-    linked_item_t *it;
-    for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
-        rfcomm_channel_t * channel = ((rfcomm_channel_t *) it);
-        if (channel->dlci == dlci && channel->multiplexer == multiplexer) {
-            return channel;
-        };
-    }
-    return NULL;
+    if (dlci >= RFCOMM_DLCI_TABLE_SIZE) return NULL;
+    return multiplexer->channels[dlci];
 }
 
 static rfcomm_service_t * rfcomm_service_for_channel(uint8_t server_channel){
@@ -482,63 +648,136 @@ static rfcomm_service_t * rfcomm_service_for_channel(uint8_t server_channel){
 
 // MARK: RFCOMM SEND
 
+// send RFCOMM frame as L2CAP PDU, uses l2cap credits of multiplexer if available
+static int rfcomm_multiplexer_sendv(rfcomm_multiplexer_t *multiplexer, const l2cap_iovec_t * iov, int iovcnt){
+    int credits_taken = 0;
+    if (multiplexer->l2cap_credits){
+        credits_taken++;
+        multiplexer->l2cap_credits--;
+    } else {
+        log_info( "rfcomm_send_packet addr %02x, ctrl %02x without l2cap credits", iov[0].data[0], iov[0].data[1]);
+    }
+    
+    int err = l2cap_sendv(multiplexer->l2cap_cid, iov, iovcnt);
+    
+    if (err) {
+        // undo credit counting
+        multiplexer->l2cap_credits += credits_taken;
+    }
+    return err;
+}
+
+// control frames are small and can be queued: SABM, UA, DM, DISC, multiplexer commands on DLCI 0 and credits
+static int rfcomm_is_control_frame(uint8_t address, uint8_t control, uint16_t len){
+    if ((control & 0xef) != BT_RFCOMM_UIH) return 1;
+    if ((address >> 2) == 0) return 1;
+    return control == BT_RFCOMM_UIH_PF && len == 0;
+}
+
+// send queued control frames while ACL slots are available, returns nr of frames still queued
+static int rfcomm_multiplexer_send_control_queue(rfcomm_multiplexer_t *multiplexer){
+    while (multiplexer->control_queue_len){
+        if (!l2cap_can_send_packet_now(multiplexer->l2cap_cid)) break;
+        // take frame from queue first, sending can emit events that lead back here
+        rfcomm_control_frame_t frame = multiplexer->control_queue[multiplexer->control_queue_head];
+        multiplexer->control_queue_head = (multiplexer->control_queue_head + 1) % RFCOMM_CONTROL_QUEUE_SIZE;
+        multiplexer->control_queue_len--;
+        l2cap_iovec_t iov;
+        iov.data = frame.data;
+        iov.len  = frame.len;
+        if (rfcomm_multiplexer_sendv(multiplexer, &iov, 1) == 0) continue;
+        // not sent, put back in front
+        multiplexer->control_queue_head = (multiplexer->control_queue_head + RFCOMM_CONTROL_QUEUE_SIZE - 1) % RFCOMM_CONTROL_QUEUE_SIZE;
+        multiplexer->control_queue_len++;
+        break;
+    }
+    return multiplexer->control_queue_len;
+}
+
+static int rfcomm_multiplexer_queue_control_frame(rfcomm_multiplexer_t *multiplexer, const l2cap_iovec_t * iov, int iovcnt){
+    if (multiplexer->control_queue_len >= RFCOMM_CONTROL_QUEUE_SIZE) return BTSTACK_ACL_BUFFERS_FULL;
+    uint8_t slot = (multiplexer->control_queue_head + multiplexer->control_queue_len) % RFCOMM_CONTROL_QUEUE_SIZE;
+    rfcomm_control_frame_t * frame = &multiplexer->control_queue[slot];
+    int i;
+    frame->len = 0;
+    for (i = 0; i < iovcnt; i++){
+        if (frame->len + iov[i].len > RFCOMM_CONTROL_FRAME_MAX_LEN) {
+            log_error("rfcomm_multiplexer_queue_control_frame frame too long");
+            return BTSTACK_ACL_BUFFERS_FULL;
+        }
+        memcpy(&frame->data[frame->len], iov[i].data, iov[i].len);
+        frame->len += iov[i].len;
+    }
+    multiplexer->control_queue_len++;
+    multiplexer->statistics.control_frames_queued++;
+    if (multiplexer->control_queue_len > multiplexer->statistics.control_queue_max){
+        multiplexer->statistics.control_queue_max = multiplexer->control_queue_len;
+    }
+    return 0;
+}
+
 /**
  * @param credits - only used for RFCOMM flow control in UIH wiht P/F = 1
  */
 static int rfcomm_send_packet_for_multiplexer(rfcomm_multiplexer_t *multiplexer, uint8_t address, uint8_t control, uint8_t credits, uint8_t *data, uint16_t len){
 
-    if (!l2cap_can_send_packet_now(multiplexer->l2cap_cid)) return BTSTACK_ACL_BUFFERS_FULL;
-    
-    l2cap_reserve_packet_buffer();
-    uint8_t * rfcomm_out_buffer = l2cap_get_outgoing_buffer();
+    int control_frame = rfcomm_is_control_frame(address, control, len);
+
+    // data frames are sent after queued control frames
+    if (!control_frame && rfcomm_multiplexer_send_control_queue(multiplexer)){
+        multiplexer->statistics.data_frames_deferred++;
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+
+    // control frames are queued if ACL slot is busy
+    if (!control_frame && !l2cap_can_send_packet_now(multiplexer->l2cap_cid)) return BTSTACK_ACL_BUFFERS_FULL;
     
+    // header and fcs are gathered with the payload by l2cap_sendv
+    uint8_t header[5];
+    uint8_t fcs;
 	uint16_t pos = 0;
 	uint8_t crc_fields = 3;
 	
-	rfcomm_out_buffer[pos++] = address;
-	rfcomm_out_buffer[pos++] = control;
+	header[pos++] = address;
+	header[pos++] = control;
 	
 	// length field can be 1 or 2 octets
 	if (len < 128){
-		rfcomm_out_buffer[pos++] = (len << 1)| 1;     // bits 0-6
+		header[pos++] = (len << 1)| 1;     // bits 0-6
 	} else {
-		rfcomm_out_buffer[pos++] = (len & 0x7f) << 1; // bits 0-6
-		rfcomm_out_buffer[pos++] = len >> 7;          // bits 7-14
+		header[pos++] = (len & 0x7f) << 1; // bits 0-6
+		header[pos++] = len >> 7;          // bits 7-14
 		crc_fields++;
 	}
 
 	// add credits for UIH frames when PF bit is set
 	if (control == BT_RFCOMM_UIH_PF){
-		rfcomm_out_buffer[pos++] = credits;
-	}
-	
-	// copy actual data
-	if (len) {
-		memcpy(&rfcomm_out_buffer[pos], data, len);
-		pos += len;
+		header[pos++] = credits;
 	}
 	
 	// UIH frames only calc FCS over address + control (5.1.1)
 	if ((control & 0xef) == BT_RFCOMM_UIH){
 		crc_fields = 2;
 	}
-	rfcomm_out_buffer[pos++] =  crc8_calc(rfcomm_out_buffer, crc_fields); // calc fcs
-
-    int credits_taken = 0;
-    if (multiplexer->l2cap_credits){
-        credits_taken++;
-        multiplexer->l2cap_credits--;
+	fcs = crc8_calc(header, crc_fields); // calc fcs
+
+    l2cap_iovec_t iov[3];
+    iov[0].data = header;
+    iov[0].len  = pos;
+    iov[1].data = data;
+    iov[1].len  = len;
+    iov[2].data = &fcs;
+    iov[2].len  = 1;
+
+    int err;
+    if (control_frame && (multiplexer->control_queue_len || !l2cap_can_send_packet_now(multiplexer->l2cap_cid))){
+        err = rfcomm_multiplexer_queue_control_frame(multiplexer, iov, 3);
     } else {
-        log_info( "rfcomm_send_packet addr %02x, ctrl %02x size %u without l2cap credits", address, control, pos);
+        err = rfcomm_multiplexer_sendv(multiplexer, iov, 3);
     }
-    
-    int err = l2cap_send_prepared(multiplexer->l2cap_cid, pos);
-    
-    if (err) {
-        // undo credit counting
-        multiplexer->l2cap_credits += credits_taken;
-    }
-    return err;
+    if (err) return err;
+    rfcomm_frames_sent++;
+    return 0;
 }
 
 // simplified version of rfcomm_send_packet_for_multiplexer for prepared rfcomm packet (UIH, 2 byte len, no credits)
@@ -547,6 +786,12 @@ static int rfcomm_send_uih_prepared(rfcomm_multiplexer_t *multiplexer, uint8_t d
     uint8_t address = (1 << 0) | (multiplexer->outgoing << 1) | (dlci << 2); 
     uint8_t control = BT_RFCOMM_UIH;
 
+    // payload is in outgoing buffer already, queued control frames cannot be sent first
+    if (multiplexer->control_queue_len){
+        multiplexer->statistics.data_frames_deferred++;
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+
     uint8_t * rfcomm_out_buffer = l2cap_get_outgoing_buffer();
     
     uint16_t pos = 0;
@@ -574,8 +819,10 @@ static int rfcomm_send_uih_prepared(rfcomm_multiplexer_t *multiplexer, uint8_t d
     if (err) {
         // undo credit counting
         multiplexer->l2cap_credits += credits_taken;
+        return err;
     }
-    return err;
+    rfcomm_frames_sent++;
+    return 0;
 }
 
 // C/R Flag in Address
@@ -797,6 +1044,9 @@ static void rfcomm_multiplexer_stop_timer(rfcomm_multiplexer_t * multiplexer){
     }
 }
 static void rfcomm_multiplexer_free(rfcomm_multiplexer_t * multiplexer){
+    if (rfcomm_multiplexer_last == multiplexer){
+        rfcomm_multiplexer_last = NULL;
+    }
     linked_list_remove( &rfcomm_multiplexers, (linked_item_t *) multiplexer);
     btstack_memory_rfcomm_multiplexer_free(multiplexer);
 }
@@ -819,7 +1069,7 @@ static void rfcomm_multiplexer_finalize(rfcomm_multiplexer_t * multiplexer){
             // remove from list
             it->next = it->next->next;
             // free channel struct
-            btstack_memory_rfcomm_channel_free(channel);
+            rfcomm_channel_free(channel);
         } else {
             it = it->next;
         }
@@ -951,7 +1201,7 @@ static int rfcomm_multiplexer_hci_event_handler(uint8_t *packet, uint16_t size){
                     if (channel->multiplexer == multiplexer){
                         rfcomm_emit_channel_opened(channel, status);
                         it->next = it->next->next;
-                        btstack_memory_rfcomm_channel_free(channel);
+                        rfcomm_channel_free(channel);
                     } else {
                         it = it->next;
                     }
@@ -1148,10 +1398,14 @@ static void rfcomm_multiplexer_state_machine(rfcomm_multiplexer_t * multiplexer,
         if (multiplexer->fcon == 0) return;
         // trigger client to send again after sending FCon Response
         uint8_t event[] = { DAEMON_EVENT_HCI_PACKET_SENT, 0};
-        linked_item_t *it;
-        for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
-            rfcomm_channel_t * channel = ((rfcomm_channel_t *) it);
-            if (channel->multiplexer != multiplexer) continue;
+        int dlci;
+        for (dlci = 0; dlci < RFCOMM_DLCI_TABLE_SIZE; dlci++){
+            rfcomm_channel_t * channel = multiplexer->channels[dlci];
+            if (!channel) continue;
+            // data held back by aggregate flow control
+            if (rfcomm_channel_has_work(channel)){
+                rfcomm_channel_schedule(channel);
+            }
             (*app_packet_handler)(channel->connection, HCI_EVENT_PACKET, 0, (uint8_t *) event, sizeof(event));
         }
         return;
@@ -1222,36 +1476,174 @@ static void rfcomm_multiplexer_state_machine(rfcomm_multiplexer_t * multiplexer,
 
 // MARK: RFCOMM CHANNEL
 
-static void rfcomm_hand_out_credits(void){
+static int rfcomm_channel_wants_credits(rfcomm_channel_t * channel){
+    if (channel->state != RFCOMM_CHANNEL_OPEN) return 0;
+    // limited by credits from remote
+    return channel->packets_granted + channel->packets_scheduled < channel->credits_outgoing;
+}
+
+// l2cap credits of the multiplexer not promised to one of its channels yet
+static int rfcomm_multiplexer_packets_available(rfcomm_multiplexer_t * multiplexer){
+    int available = multiplexer->l2cap_credits;
     linked_item_t * it;
     for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
         rfcomm_channel_t * channel = (rfcomm_channel_t *) it;
-        if (channel->state != RFCOMM_CHANNEL_OPEN) {
-            // log_info("RFCOMM_EVENT_CREDITS: multiplexer not open");
-            continue;
-        }
-        if (channel->packets_granted) {
-            // log_info("RFCOMM_EVENT_CREDITS: already packets granted");
-            continue;
-        }
-        if (!channel->credits_outgoing) {
-            // log_info("RFCOMM_EVENT_CREDITS: no outgoing credits");
-            continue;
+        if (channel->multiplexer != multiplexer) continue;
+        available -= channel->packets_granted + channel->packets_scheduled;
+    }
+    return available;
+}
+
+// max packets granted to a single channel, so an idle channel cannot hold all l2cap credits of the multiplexer
+static int rfcomm_multiplexer_packets_per_channel(rfcomm_multiplexer_t * multiplexer){
+    int open_channels = 0;
+    linked_item_t * it;
+    for (it = (linked_item_t *) rfcomm_channels; it ; it = it->next){
+        rfcomm_channel_t * channel = (rfcomm_channel_t *) it;
+        if (channel->multiplexer != multiplexer) continue;
+        if (channel->state != RFCOMM_CHANNEL_OPEN) continue;
+        open_channels++;
+    }
+    if (open_channels <= 1) return multiplexer->l2cap_credits;
+    int share = multiplexer->l2cap_credits / open_channels;
+    return share ? share : 1;
+}
+
+// move channels that got credits to the end of the list, so others are served first next time
+static void rfcomm_rotate_served_channels(void){
+    linked_list_t served = NULL;
+    linked_list_iterator_t it;    
+    linked_list_iterator_init(&it, &rfcomm_channels);
+    while (linked_list_iterator_has_next(&it)){
+        rfcomm_channel_t * channel = (rfcomm_channel_t *) linked_list_iterator_next(&it);
+        if (!channel->packets_scheduled) continue;
+        linked_list_iterator_remove(&it);
+        linked_list_add_tail(&served, (linked_item_t *) channel);
+    }
+    while (served){
+        linked_item_t * channel = served;
+        linked_list_remove(&served, channel);
+        linked_list_add_tail(&rfcomm_channels, channel);
+    }
+}
+
+static void rfcomm_hand_out_credits(void){
+
+    // clients may send from RFCOMM_EVENT_CREDITS, schedule again after all credits have been emitted
+    if (rfcomm_hand_out_active) {
+        rfcomm_hand_out_pending = 1;
+        return;
+    }
+    rfcomm_hand_out_active = 1;
+
+    do {
+        rfcomm_hand_out_pending = 0;
+
+        // round-robin, one packet per channel and pass, until the l2cap credits of each multiplexer are used up
+        linked_list_iterator_t it;    
+        int progress;
+        int scheduled = 0;
+        do {
+            progress = 0;
+            linked_list_iterator_init(&it, &rfcomm_channels);
+            while (linked_list_iterator_has_next(&it)){
+                rfcomm_channel_t * channel = (rfcomm_channel_t *) linked_list_iterator_next(&it);
+                if (!rfcomm_channel_wants_credits(channel)) continue;
+                if (rfcomm_multiplexer_packets_available(channel->multiplexer) <= 0) continue;
+                if (channel->packets_granted + channel->packets_scheduled >= rfcomm_multiplexer_packets_per_channel(channel->multiplexer)) continue;
+                channel->packets_scheduled++;
+                progress = 1;
+                scheduled = 1;
+            }
+        } while (progress);
+        if (!scheduled) break;
+
+        rfcomm_rotate_served_channels();
+
+        linked_list_iterator_init(&it, &rfcomm_channels);
+        while (linked_list_iterator_has_next(&it)){
+            rfcomm_channel_t * channel = (rfcomm_channel_t *) linked_list_iterator_next(&it);
+            if (!channel->packets_scheduled) continue;
+            uint8_t credits = channel->packets_scheduled;
+            channel->packets_scheduled = 0;
+            channel->packets_granted += credits;
+            channel->statistics.packets_granted += credits;
+            channel->statistics.grants++;
+            // buffered data can be sent now
+            if (rfcomm_channel_has_work(channel)){
+                rfcomm_channel_schedule(channel);
+            }
+            rfcomm_emit_credits(channel, credits);
         }
-        if (!channel->multiplexer->l2cap_credits){
-            // log_info("RFCOMM_EVENT_CREDITS: no l2cap credits");
-            continue;
+    } while (rfcomm_hand_out_pending);
+
+    rfcomm_hand_out_active = 0;
+}
+
+// coalesced writes fill a single frame
+static uint16_t rfcomm_channel_tx_capacity(rfcomm_channel_t * channel){
+    if (channel->tx_buffer_size < channel->max_frame_size) return channel->tx_buffer_size;
+    return channel->max_frame_size;
+}
+
+static uint8_t rfcomm_channel_max_incoming_window(rfcomm_channel_t * channel){
+    int window = RFCOMM_CREDITS_MAX;
+    if (channel->max_frame_size && RFCOMM_CREDITS_MAX_BYTES / channel->max_frame_size < window){
+        window = RFCOMM_CREDITS_MAX_BYTES / channel->max_frame_size;
+    }
+    if (window < RFCOMM_CREDITS) {
+        window = RFCOMM_CREDITS;
+    }
+    return window;
+}
+
+// resize incoming window by at most a factor of two
+static void rfcomm_channel_set_incoming_window(rfcomm_channel_t * channel, uint32_t window){
+    uint8_t max_window = rfcomm_channel_max_incoming_window(channel);
+    if (window > channel->incoming_window * 2) {
+        window = channel->incoming_window * 2;
+    }
+    if (window < channel->incoming_window / 2) {
+        window = channel->incoming_window / 2;
+    }
+    if (window > max_window) {
+        window = max_window;
+    }
+    if (window < RFCOMM_CREDITS) {
+        window = RFCOMM_CREDITS;
+    }
+    channel->incoming_window = window;
+    if (channel->incoming_window > channel->statistics.incoming_window_max){
+        channel->statistics.incoming_window_max = channel->incoming_window;
+    }
+}
+
+// remote used up all incoming credits and had to wait for new ones
+static void rfcomm_channel_incoming_stalled(rfcomm_channel_t * channel){
+    channel->statistics.incoming_stalls++;
+    if (channel->incoming_flow_control) return;
+    rfcomm_channel_set_incoming_window(channel, channel->incoming_window * 2);
+}
+
+// top up remote credits to the incoming window when half of it has been used
+static void rfcomm_channel_update_incoming_window(rfcomm_channel_t * channel){
+    if (channel->credits_incoming >= channel->incoming_window / 2) return;
+    if (!channel->new_credits_incoming){
+        // size window from the time the remote took for the consumed credits
+        uint32_t consumed = channel->incoming_window - channel->credits_incoming;
+        uint32_t consumption_ms = run_loop_get_time_ms() - channel->incoming_window_start_ms;
+        if (!consumption_ms) {
+            consumption_ms = 1;
         }
-        // channel open, multiplexer has l2cap credits and we didn't hand out credit before -> go!
-        // log_info("RFCOMM_EVENT_CREDITS: 1");
-        channel->packets_granted += 1;
-        rfcomm_emit_credits(channel, 1);
-    }        
+        rfcomm_channel_set_incoming_window(channel, consumed * RFCOMM_CREDITS_WINDOW_MS / consumption_ms);
+    }
+    channel->new_credits_incoming = channel->incoming_window - channel->credits_incoming;
 }
 
 static void rfcomm_channel_send_credits(rfcomm_channel_t *channel, uint8_t credits){
     rfcomm_send_uih_credits(channel->multiplexer, channel->dlci, credits);
     channel->credits_incoming += credits;
+    channel->statistics.credit_frames_sent++;
     
     rfcomm_emit_credit_status(channel);
 }
@@ -1305,25 +1697,49 @@ static void rfcomm_channel_packet_handler_uih(rfcomm_multiplexer_t *multiplexer,
 
         // log_info( "RFCOMM data UIH_PF, size %u, channel %p", size-payload_offset-1, rfChannel->connection);
 
+        // measure how fast the remote uses a full window
+        if (channel->credits_incoming >= channel->incoming_window){
+            channel->incoming_window_start_ms = run_loop_get_time_ms();
+        }
+
         // decrease incoming credit counter
         if (channel->credits_incoming > 0){
             channel->credits_incoming--;
+            if (!channel->credits_incoming){
+                rfcomm_channel_incoming_stalled(channel);
+            }
         }
         
+        // held by client until rfcomm_release_frames
+        if (channel->release_batch){
+            channel->frames_unreleased++;
+        }
+
         // deliver payload
-        (*app_packet_handler)(channel->connection, RFCOMM_DATA_PACKET, channel->rfcomm_cid,
-                              &packet[payload_offset], size-payload_offset-1);
+        if (channel->stream_rx.buffer){
+            rfcomm_channel_stream_received(channel, &packet[payload_offset], size-payload_offset-1);
+        } else {
+            (*app_packet_handler)(channel->connection, RFCOMM_DATA_PACKET, channel->rfcomm_cid,
+                                  &packet[payload_offset], size-payload_offset-1);
+        }
     }
     
     // automatically provide new credits to remote device, if no incoming flow control
-    if (!channel->incoming_flow_control && channel->credits_incoming < 5){
-        channel->new_credits_incoming =RFCOMM_CREDITS;
+    if (!channel->incoming_flow_control){
+        rfcomm_channel_update_incoming_window(channel);
     }    
+
+    // send new credits or data waiting for outgoing credits
+    if (rfcomm_channel_has_work(channel)){
+        rfcomm_channel_schedule(channel);
+    }
     
     rfcomm_emit_credit_status(channel);
     
     // we received new RFCOMM credits, hand them out if possible
-    rfcomm_hand_out_credits();
+    if (packet[1] == BT_RFCOMM_UIH_PF){
+        rfcomm_hand_out_credits();
+    }
 }
 
 static void rfcomm_channel_accept_pn(rfcomm_channel_t *channel, rfcomm_channel_event_pn_t *event){
@@ -1351,7 +1767,7 @@ static void rfcomm_channel_finalize(rfcomm_channel_t *channel){
     linked_list_remove( &rfcomm_channels, (linked_item_t *) channel);
 
     // free channel
-    btstack_memory_rfcomm_channel_free(channel);
+    rfcomm_channel_free(channel);
     
     // update multiplexer timeout after channel was removed from list
     rfcomm_multiplexer_prepare_idle_timer(multiplexer);
@@ -1623,6 +2039,51 @@ static int rfcomm_channel_ready_for_incoming_dlc_setup(rfcomm_channel_t * channe
     return 1;
 }            
 
+// check if rfcomm_channel_state_machine has something to send for CH_EVT_READY_TO_SEND
+static int rfcomm_channel_has_work(rfcomm_channel_t * channel){
+    if (channel->state_var & (RFCOMM_CHANNEL_STATE_VAR_SEND_RPN_RSP | RFCOMM_CHANNEL_STATE_VAR_SEND_MSC_RSP)) return 1;
+    if (channel->rls_line_status != RFCOMM_RLS_STATUS_INVALID) return 1;
+    int flow_on = channel->multiplexer->fcon & 1;
+    switch (channel->state){
+        case RFCOMM_CHANNEL_INCOMING_SETUP:
+            if (channel->state_var & (RFCOMM_CHANNEL_STATE_VAR_SEND_PN_RSP | RFCOMM_CHANNEL_STATE_VAR_SEND_UA)) return 1;
+            return rfcomm_channel_ready_for_incoming_dlc_setup(channel);
+        case RFCOMM_CHANNEL_SEND_UIH_PN:
+        case RFCOMM_CHANNEL_SEND_SABM_W4_UA:
+        case RFCOMM_CHANNEL_SEND_DM:
+        case RFCOMM_CHANNEL_SEND_DISC:
+        case RFCOMM_CHANNEL_SEND_UA_AFTER_DISC:
+            return 1;
+        case RFCOMM_CHANNEL_DLC_SETUP:
+            if (channel->state_var & (RFCOMM_CHANNEL_STATE_VAR_SEND_MSC_CMD | RFCOMM_CHANNEL_STATE_VAR_SEND_CREDITS)) return 1;
+            return rfcomm_channel_ready_for_open(channel);
+        case RFCOMM_CHANNEL_OPEN:
+            if (channel->new_credits_incoming) return 1;
+            if (channel->tx_flush_pending && channel->credits_outgoing && flow_on) return 1;
+            if (channel->stream_tx.len && channel->credits_outgoing && channel->packets_granted && flow_on) return 1;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// check if rfcomm_multiplexer_state_machine has something to send for MULT_EV_READY_TO_SEND
+static int rfcomm_multiplexer_has_work(rfcomm_multiplexer_t * multiplexer){
+    if (multiplexer->send_dm_for_dlci) return 1;
+    if (multiplexer->nsc_command) return 1;
+    if (multiplexer->fcon & 0x80) return 1;
+    switch (multiplexer->state){
+        case RFCOMM_MULTIPLEXER_SEND_SABM_0:
+        case RFCOMM_MULTIPLEXER_SEND_UA_0:
+        case RFCOMM_MULTIPLEXER_SEND_UA_0_AND_DISC:
+            return 1;
+        case RFCOMM_MULTIPLEXER_OPEN:
+            return multiplexer->test_data_len > 0;
+        default:
+            return 0;
+    }
+}
+
 inline static void rfcomm_channel_state_add(rfcomm_channel_t *channel, RFCOMM_CHANNEL_STATE_VAR event){
     channel->state_var = (RFCOMM_CHANNEL_STATE_VAR) (channel->state_var | event);    
 }
@@ -1635,6 +2096,11 @@ static void rfcomm_channel_state_machine(rfcomm_channel_t *channel, rfcomm_chann
     // log_info("rfcomm_channel_state_machine: state %u, state_var %04x, event %u", channel->state, channel->state_var ,event->type);
     
     rfcomm_multiplexer_t *multiplexer = channel->multiplexer;
+
+    // received events and multiplexer changes might require sending, checked by rfcomm_run
+    if (event->type != CH_EVT_READY_TO_SEND){
+        rfcomm_channel_schedule(channel);
+    }
     
     // TODO: integrate in common switch
     if (event->type == CH_EVT_RCVD_DISC){
@@ -1901,6 +2367,14 @@ static void rfcomm_channel_state_machine(rfcomm_channel_t *channel, rfcomm_chann
                         rfcomm_channel_send_credits(channel, new_credits);
                         break;
                     }
+                    if (channel->tx_flush_pending){
+                        rfcomm_channel_flush_tx(channel);
+                        break;
+                    }
+                    if (channel->stream_tx.len){
+                        rfcomm_channel_stream_send(channel);
+                        break;
+                    }
                     break;
                 case CH_EVT_RCVD_CREDITS: {
                     // notify daemon -> might trigger re-try of parked connections
@@ -1971,51 +2445,110 @@ static void rfcomm_channel_state_machine(rfcomm_channel_t *channel, rfcomm_chann
 
 // MARK: RFCOMM RUN
 // process outstanding signaling tasks
-static void rfcomm_run(void){
+static void rfcomm_run_internal(void){
     
     linked_item_t *it;
     linked_item_t *next;
     
     for (it = (linked_item_t *) rfcomm_multiplexers; it ; it = next){
 
-        next = it->next;    // be prepared for removal of channel in state machine
+        next = it->next;    // be prepared for removal of multiplexer in state machine
         
         rfcomm_multiplexer_t * multiplexer = ((rfcomm_multiplexer_t *) it);
+
+        // queued control frames go first
+        if (rfcomm_multiplexer_send_control_queue(multiplexer)) continue;
+
+        if (!rfcomm_multiplexer_has_work(multiplexer)) continue;
         
+        // multiplexer state machine might close l2cap channel after sending, no queuing
         if (!l2cap_can_send_packet_now(multiplexer->l2cap_cid)) {
             // log_info("rfcomm_run A cannot send l2cap packet for #%u, credits %u", multiplexer->l2cap_cid, multiplexer->l2cap_credits);
             continue;
         }
         // log_info("rfcomm_run: multi 0x%08x, state %u", (int) multiplexer, multiplexer->state);
 
+        rfcomm_run_statistics.multiplexers_visited++;
         rfcomm_multiplexer_state_machine(multiplexer, MULT_EV_READY_TO_SEND);
     }
 
-    for (it = (linked_item_t *) rfcomm_channels; it ; it = next){
-
-        next = it->next;    // be prepared for removal of channel in state machine
-
-        rfcomm_channel_t * channel = ((rfcomm_channel_t *) it);
+    // visit channels with pending work, including channels scheduled during this run
+    uint16_t visited = 0;
+    rfcomm_channel_t * channel;
+    while ((channel = rfcomm_channel_queue_pop(&rfcomm_channels_pending)) != NULL){
+        // channel->pending stays set while visited, changes are checked below
         rfcomm_multiplexer_t * multiplexer = channel->multiplexer;
         
-        if (!l2cap_can_send_packet_now(multiplexer->l2cap_cid)) {
+        // control frames are queued while ACL slot is busy, at most one is sent per visit
+        if (multiplexer->control_queue_len >= RFCOMM_CONTROL_QUEUE_SIZE) {
             // log_info("rfcomm_run B cannot send l2cap packet for #%u, credits %u", multiplexer->l2cap_cid, multiplexer->l2cap_credits);
+            rfcomm_channel_queue_add(&rfcomm_channels_blocked, channel);
             continue;
         }
 
+        RFCOMM_CHANNEL_STATE state = channel->state;
+        RFCOMM_CHANNEL_STATE_VAR state_var = channel->state_var;
+        uint32_t frames_sent = rfcomm_frames_sent;
+        visited++;
+        rfcomm_run_visiting = channel;
         rfcomm_channel_event_t event = { CH_EVT_READY_TO_SEND };
         rfcomm_channel_state_machine(channel, &event);
+        // freed in state machine
+        if (!rfcomm_run_visiting) continue;
+        rfcomm_run_visiting = NULL;
+
+        if (!rfcomm_channel_has_work(channel)){
+            channel->pending = 0;
+        } else if (state == channel->state && state_var == channel->state_var && frames_sent == rfcomm_frames_sent){
+            // no progress, retry in next run
+            rfcomm_channel_queue_add(&rfcomm_channels_blocked, channel);
+        } else {
+            rfcomm_channel_queue_add(&rfcomm_channels_pending, channel);
+        }
+    }
+    rfcomm_channels_pending = rfcomm_channels_blocked;
+    memset(&rfcomm_channels_blocked, 0, sizeof(rfcomm_channels_blocked));
+    rfcomm_run_statistics.runs++;
+    rfcomm_run_statistics.channels_visited += visited;
+    if (visited > rfcomm_run_statistics.channels_visited_max){
+        rfcomm_run_statistics.channels_visited_max = visited;
     }
 }
 
+static void rfcomm_run(void){
+    // called again by state machines and client event handlers while sending
+    if (rfcomm_run_active){
+        rfcomm_run_pending = 1;
+        return;
+    }
+    rfcomm_run_active = 1;
+    do {
+        rfcomm_run_pending = 0;
+        rfcomm_run_internal();
+    } while (rfcomm_run_pending);
+    rfcomm_run_active = 0;
+}
+
 // MARK: RFCOMM BTstack API
 
 void rfcomm_init(void){
-    rfcomm_client_cid_generator = 0;
+    memset(rfcomm_cid_table, 0, sizeof(rfcomm_cid_table));
+    rfcomm_cid_table_next = 0;
+    rfcomm_cid_overflow_next = RFCOMM_CID_TABLE_SIZE + 1;
+    rfcomm_multiplexer_last = NULL;
+    memset(&rfcomm_channels_pending, 0, sizeof(rfcomm_channels_pending));
+    memset(&rfcomm_channels_blocked, 0, sizeof(rfcomm_channels_blocked));
+    rfcomm_run_visiting = NULL;
+    rfcomm_frames_sent = 0;
+    rfcomm_run_active = 0;
+    rfcomm_run_pending = 0;
+    memset(&rfcomm_run_statistics, 0, sizeof(rfcomm_run_statistics));
     rfcomm_multiplexers = NULL;
     rfcomm_services     = NULL;
     rfcomm_channels     = NULL;
     rfcomm_security_level = LEVEL_2;
+    rfcomm_hand_out_active  = 0;
+    rfcomm_hand_out_pending = 0;
 }
 
 void rfcomm_set_required_security_level(gap_security_level_t security_level){
@@ -2034,9 +2567,13 @@ int rfcomm_can_send_packet_now(uint16_t rfcomm_cid){
         log_error("rfcomm_send_internal cid 0x%02x doesn't exist!", rfcomm_cid);
         return 0;
     }
+    // small writes are accepted while there is room in tx buffer
+    if (channel->tx_buffer && channel->tx_len < rfcomm_channel_tx_capacity(channel)) return 1;
     if (!channel->credits_outgoing) return 0;
     if (!channel->packets_granted)  return 0;
     if ((channel->multiplexer->fcon & 1) == 0) return 0;
+    // data frames are sent after queued control frames
+    if (rfcomm_multiplexer_send_control_queue(channel->multiplexer)) return 0;
         
     return l2cap_can_send_packet_now(channel->multiplexer->l2cap_cid);
 }
@@ -2079,6 +2616,25 @@ uint8_t * rfcomm_get_outgoing_buffer(void){
     return &rfcomm_out_buffer[4];
 }
 
+int rfcomm_get_channel_statistics(uint16_t rfcomm_cid, rfcomm_channel_statistics_t * statistics){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel) return -1;
+    memcpy(statistics, &channel->statistics, sizeof(rfcomm_channel_statistics_t));
+    statistics->incoming_window = channel->incoming_window;
+    return 0;
+}
+
+int rfcomm_get_multiplexer_statistics(uint16_t rfcomm_cid, rfcomm_multiplexer_statistics_t * statistics){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel) return -1;
+    *statistics = channel->multiplexer->statistics;
+    return 0;
+}
+
+void rfcomm_get_run_statistics(rfcomm_run_statistics_t * statistics){
+    *statistics = rfcomm_run_statistics;
+}
+
 uint16_t rfcomm_get_max_frame_size(uint16_t rfcomm_cid){
     rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
     if (!channel){
@@ -2087,12 +2643,8 @@ uint16_t rfcomm_get_max_frame_size(uint16_t rfcomm_cid){
     }
     return channel->max_frame_size;
 }
-int rfcomm_send_prepared(uint16_t rfcomm_cid, uint16_t len){
-    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
-    if (!channel){
-        log_error("rfcomm_send_prepared cid 0x%02x doesn't exist!", rfcomm_cid);
-        return 0;
-    }
+// data == NULL: payload has been prepared in the outgoing buffer
+static int rfcomm_send_uih_for_channel(rfcomm_channel_t * channel, uint8_t *data, uint16_t len){
 
     int err = rfcomm_assert_send_valid(channel, len);
     if (err) return err;
@@ -2105,7 +2657,13 @@ int rfcomm_send_prepared(uint16_t rfcomm_cid, uint16_t len){
         packets_granted_decreased++;
     }
         
-    int result = rfcomm_send_uih_prepared(channel->multiplexer, channel->dlci, len);
+    int result;
+    if (data){
+        uint8_t address = (1 << 0) | (channel->multiplexer->outgoing << 1) | (channel->dlci << 2);
+        result = rfcomm_send_packet_for_multiplexer(channel->multiplexer, address, BT_RFCOMM_UIH, 0, data, len);
+    } else {
+        result = rfcomm_send_uih_prepared(channel->multiplexer, channel->dlci, len);
+    }
     
     if (result != 0) {
         channel->credits_outgoing++;
@@ -2119,20 +2677,381 @@ int rfcomm_send_prepared(uint16_t rfcomm_cid, uint16_t len){
     return result;
 }
 
-int rfcomm_send_internal(uint16_t rfcomm_cid, uint8_t *data, uint16_t len){
+// MARK: RFCOMM WRITE COALESCING
+
+static void rfcomm_channel_tx_timer_handler(timer_source_t * timer){
+    rfcomm_channel_t * channel = (rfcomm_channel_t *) linked_item_get_user((linked_item_t *) timer);
+    channel->tx_timer_active = 0;
+    // retried by rfcomm_run if no credits
+    rfcomm_channel_flush_tx(channel);
+}
+
+static void rfcomm_channel_start_tx_timer(rfcomm_channel_t * channel){
+    if (!channel->tx_delay_ms) return;
+    if (channel->tx_timer_active) return;
+    run_loop_set_timer(&channel->tx_timer, channel->tx_delay_ms);
+    run_loop_set_timer_handler(&channel->tx_timer, rfcomm_channel_tx_timer_handler);
+    linked_item_set_user((linked_item_t *) &channel->tx_timer, channel);
+    run_loop_add_timer(&channel->tx_timer);
+    channel->tx_timer_active = 1;
+}
+
+static void rfcomm_channel_stop_tx_timer(rfcomm_channel_t * channel){
+    if (!channel->tx_timer_active) return;
+    run_loop_remove_timer(&channel->tx_timer);
+    channel->tx_timer_active = 0;
+}
+
+// send tx buffer as single UIH frame, kept pending on error
+static int rfcomm_channel_flush_tx(rfcomm_channel_t * channel){
+    if (!channel->tx_len) {
+        channel->tx_flush_pending = 0;
+        return 0;
+    }
+    channel->tx_flush_pending = 1;
+    rfcomm_channel_stop_tx_timer(channel);
+    // retried by rfcomm_run if kept pending
+    rfcomm_channel_schedule(channel);
+
+    if (!channel->credits_outgoing) return RFCOMM_NO_OUTGOING_CREDITS;
+    if ((channel->multiplexer->fcon & 1) == 0) return RFCOMM_AGGREGATE_FLOW_OFF;
+
+    // send might cause l2cap to emit events and the client to write again, update counters first
+    uint16_t len = channel->tx_len;
+    channel->tx_len = 0;
+    channel->credits_outgoing--;
+    int packets_granted_decreased = 0;
+    if (channel->packets_granted) {
+        channel->packets_granted--;
+        packets_granted_decreased++;
+    }
+
+    uint8_t address = (1 << 0) | (channel->multiplexer->outgoing << 1) | (channel->dlci << 2);
+    int err = rfcomm_send_packet_for_multiplexer(channel->multiplexer, address, BT_RFCOMM_UIH, 0, channel->tx_buffer, len);
+    if (err) {
+        channel->tx_len = len;
+        channel->credits_outgoing++;
+        channel->packets_granted += packets_granted_decreased;
+        return err;
+    }
+
+    channel->statistics.coalesced_frames++;
+    channel->statistics.coalesced_bytes += len;
+    channel->tx_flush_pending = 0;
+    // written during send
+    if (channel->tx_len){
+        rfcomm_channel_start_tx_timer(channel);
+    }
+
+    rfcomm_hand_out_credits();
+    return 0;
+}
+
+static int rfcomm_channel_write_coalesced(rfcomm_channel_t * channel, uint8_t * data, uint16_t len){
+    if (len > channel->max_frame_size){
+        log_error("rfcomm_send_internal cid 0x%02x, rfcomm data lenght exceeds MTU!", channel->rfcomm_cid);
+        return RFCOMM_DATA_LEN_EXCEEDS_MTU;
+    }
+
+    uint16_t capacity = rfcomm_channel_tx_capacity(channel);
+    if (channel->tx_len + len > capacity){
+        int err = rfcomm_channel_flush_tx(channel);
+        if (err) return err;
+    }
+
+    // too large for tx buffer, send directly after buffered data
+    if (len > capacity) {
+        return rfcomm_send_uih_for_channel(channel, data, len);
+    }
+
+    memcpy(&channel->tx_buffer[channel->tx_len], data, len);
+    channel->tx_len += len;
+    channel->statistics.coalesced_writes++;
+
+    if (channel->tx_len == capacity){
+        rfcomm_channel_flush_tx(channel);
+        return 0;
+    }
+
+    if (!channel->tx_flush_pending){
+        rfcomm_channel_start_tx_timer(channel);
+    }
+    return 0;
+}
+
+int rfcomm_enable_write_coalescing(uint16_t rfcomm_cid, uint8_t * buffer, uint16_t size, uint16_t delay_ms){
     rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
     if (!channel){
-        log_error("rfcomm_send_internal cid 0x%02x doesn't exist!", rfcomm_cid);
+        log_error("rfcomm_enable_write_coalescing cid 0x%02x doesn't exist!", rfcomm_cid);
         return 1;
     }
-
-    int err = rfcomm_assert_send_valid(channel, len);
+    // buffered writes must be sent before buffer changes
+    int err = rfcomm_channel_flush_tx(channel);
     if (err) return err;
+    channel->tx_buffer      = buffer;
+    channel->tx_buffer_size = buffer ? size : 0;
+    channel->tx_delay_ms    = delay_ms;
+    return 0;
+}
+
+int rfcomm_flush(uint16_t rfcomm_cid){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel){
+        log_error("rfcomm_flush cid 0x%02x doesn't exist!", rfcomm_cid);
+        return 1;
+    }
+    return rfcomm_channel_flush_tx(channel);
+}
+
+// MARK: RFCOMM STREAM
+
+static uint16_t rfcomm_ring_write(rfcomm_ring_t * ring, const uint8_t * data, uint16_t len){
+    if (len > ring->size - ring->len) {
+        len = ring->size - ring->len;
+    }
+    if (!len) return 0;
+    uint16_t tail  = (ring->pos + ring->len) % ring->size;
+    uint16_t first = ring->size - tail;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(&ring->buffer[tail], data, first);
+    memcpy(ring->buffer, &data[first], len - first);
+    ring->len += len;
+    return len;
+}
+
+static uint16_t rfcomm_ring_read(rfcomm_ring_t * ring, uint8_t * data, uint16_t len){
+    if (len > ring->len) {
+        len = ring->len;
+    }
+    if (!len) return 0;
+    uint16_t first = ring->size - ring->pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(data, &ring->buffer[ring->pos], first);
+    memcpy(&data[first], ring->buffer, len - first);
+    ring->pos = (ring->pos + len) % ring->size;
+    ring->len -= len;
+    return len;
+}
+
+// undo rfcomm_ring_read, pre: no write since
+static void rfcomm_ring_unread(rfcomm_ring_t * ring, uint16_t len){
+    ring->pos = (ring->pos + ring->size - len) % ring->size;
+    ring->len += len;
+}
+
+// provide credits for the frames that fit into free space of the rx ring, in batches of at least half of them
+static void rfcomm_channel_stream_grant_credits(rfcomm_channel_t * channel){
+    if (!channel->stream_rx.buffer) return;
+    if (!channel->max_frame_size) return;
+    int frames = (channel->stream_rx.size - channel->stream_rx.len) / channel->max_frame_size;
+    if (frames > RFCOMM_CREDITS_MAX) {
+        frames = RFCOMM_CREDITS_MAX;
+    }
+    int outstanding = channel->credits_incoming + channel->new_credits_incoming;
+    if (outstanding >= frames) return;
+    if (outstanding > frames / 2) return;
+    channel->new_credits_incoming += frames - outstanding;
+    rfcomm_channel_schedule(channel);
+}
+
+static void rfcomm_channel_stream_received(rfcomm_channel_t * channel, uint8_t * data, uint16_t len){
+    uint16_t stored = rfcomm_ring_write(&channel->stream_rx, data, len);
+    if (stored < len){
+        log_error("rfcomm stream cid 0x%02x, rx ring full, %u bytes dropped", channel->rfcomm_cid, len - stored);
+        channel->statistics.stream_rx_overflows++;
+    }
+    rfcomm_emit_stream_event(channel, RFCOMM_EVENT_STREAM_DATA_AVAILABLE, channel->stream_rx.len);
+}
+
+// send tx ring in frames up to max frame size while credits are available
+static void rfcomm_channel_stream_send(rfcomm_channel_t * channel){
+    while (channel->stream_tx.len){
+        if (!channel->credits_outgoing) break;
+        if (!channel->packets_granted) break;
+        if ((channel->multiplexer->fcon & 1) == 0) break;
+        if (rfcomm_multiplexer_send_control_queue(channel->multiplexer)) break;
+        if (!l2cap_can_send_packet_now(channel->multiplexer->l2cap_cid)) break;
+
+        uint16_t len = channel->stream_tx.len;
+        if (len > channel->max_frame_size) {
+            len = channel->max_frame_size;
+        }
+        // take data from ring first, send might cause the client to write again
+        l2cap_reserve_packet_buffer();
+        rfcomm_ring_read(&channel->stream_tx, rfcomm_get_outgoing_buffer(), len);
+        int err = rfcomm_send_uih_for_channel(channel, NULL, len);
+        if (err){
+            l2cap_release_packet_buffer();
+            rfcomm_ring_unread(&channel->stream_tx, len);
+            break;
+        }
+        channel->statistics.stream_frames_sent++;
+        channel->statistics.stream_bytes_sent += len;
+    }
+
+    if (channel->stream_disconnect_pending){
+        if (!channel->stream_tx.len){
+            channel->stream_disconnect_pending = 0;
+            channel->state = RFCOMM_CHANNEL_SEND_DISC;
+            rfcomm_channel_schedule(channel);
+        }
+        return;
+    }
+
+    if (channel->stream_tx_blocked && channel->stream_tx.len < channel->stream_tx.size){
+        channel->stream_tx_blocked = 0;
+        rfcomm_emit_stream_event(channel, RFCOMM_EVENT_STREAM_CAN_WRITE, channel->stream_tx.size - channel->stream_tx.len);
+    }
+}
+
+int rfcomm_stream_enable(uint16_t rfcomm_cid, uint8_t * tx_buffer, uint16_t tx_size, uint8_t * rx_buffer, uint16_t rx_size){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel){
+        log_error("rfcomm_stream_enable cid 0x%02x doesn't exist!", rfcomm_cid);
+        return 1;
+    }
+    // credits are only granted for whole frames, a smaller rx ring would never get any
+    if (rx_buffer && rx_size && rx_size < channel->max_frame_size){
+        log_error("rfcomm_stream_enable cid 0x%02x, rx ring %u smaller than max frame size %u", rfcomm_cid, rx_size, channel->max_frame_size);
+        return 1;
+    }
+    memset(&channel->stream_tx, 0, sizeof(rfcomm_ring_t));
+    memset(&channel->stream_rx, 0, sizeof(rfcomm_ring_t));
+    channel->stream_tx_blocked = 0;
+    if (tx_buffer && tx_size){
+        channel->stream_tx.buffer = tx_buffer;
+        channel->stream_tx.size   = tx_size;
+    }
+    if (rx_buffer && rx_size){
+        channel->stream_rx.buffer = rx_buffer;
+        channel->stream_rx.size   = rx_size;
+        // credits not sent yet are replaced by the ones that fit into the rx ring
+        channel->incoming_flow_control = 1;
+        channel->new_credits_incoming  = 0;
+        if (channel->credits_incoming * channel->max_frame_size > rx_size){
+            log_info("rfcomm_stream_enable cid 0x%02x, %u credits already provided exceed rx ring", rfcomm_cid, channel->credits_incoming);
+        }
+        rfcomm_channel_stream_grant_credits(channel);
+    }
+    rfcomm_run();
+    return 0;
+}
+
+uint16_t rfcomm_stream_write(uint16_t rfcomm_cid, const uint8_t * data, uint16_t len){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel || !channel->stream_tx.buffer){
+        log_error("rfcomm_stream_write cid 0x%02x is not a stream!", rfcomm_cid);
+        return 0;
+    }
+    if (channel->stream_disconnect_pending) return 0;
+    // keep filling while rfcomm_run frees space
+    uint16_t stored = 0;
+    while (stored < len){
+        uint16_t chunk = rfcomm_ring_write(&channel->stream_tx, &data[stored], len - stored);
+        if (!chunk) break;
+        stored += chunk;
+        rfcomm_channel_schedule(channel);
+        rfcomm_run();
+    }
+    if (stored < len){
+        channel->stream_tx_blocked = 1;
+    }
+    return stored;
+}
+
+uint16_t rfcomm_stream_read(uint16_t rfcomm_cid, uint8_t * buffer, uint16_t len){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel || !channel->stream_rx.buffer){
+        log_error("rfcomm_stream_read cid 0x%02x is not a stream!", rfcomm_cid);
+        return 0;
+    }
+    uint16_t read = rfcomm_ring_read(&channel->stream_rx, buffer, len);
+    if (!read) return 0;
+    rfcomm_channel_stream_grant_credits(channel);
+    if (channel->new_credits_incoming){
+        rfcomm_run();
+    }
+    return read;
+}
+
+uint16_t rfcomm_stream_available(uint16_t rfcomm_cid){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel) return 0;
+    return channel->stream_rx.len;
+}
+
+uint16_t rfcomm_stream_write_space(uint16_t rfcomm_cid){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel) return 0;
+    return channel->stream_tx.size - channel->stream_tx.len;
+}
+
+// MARK: RFCOMM FRAME RELEASE
+
+int rfcomm_enable_frame_release(uint16_t rfcomm_cid, uint8_t release_batch){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel){
+        log_error("rfcomm_enable_frame_release cid 0x%02x doesn't exist!", rfcomm_cid);
+        return 1;
+    }
+    // initial credits are kept, later ones only follow released frames
+    channel->incoming_flow_control = 1;
+    channel->release_batch = release_batch ? release_batch : 1;
+    return 0;
+}
 
-    rfcomm_reserve_packet_buffer();
-    uint8_t * rfcomm_payload = rfcomm_get_outgoing_buffer();
-    memcpy(rfcomm_payload, data, len);
-    return rfcomm_send_prepared(rfcomm_cid, len);    
+void rfcomm_release_frames(uint16_t rfcomm_cid, uint8_t frames){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel || !channel->release_batch){
+        log_error("rfcomm_release_frames cid 0x%02x doesn't use frame release!", rfcomm_cid);
+        return;
+    }
+    if (frames > channel->frames_unreleased){
+        frames = channel->frames_unreleased;
+    }
+    channel->frames_unreleased -= frames;
+    channel->frames_released   += frames;
+    channel->statistics.frames_released += frames;
+    if (!channel->frames_released) return;
+
+    // return credits in batches, unless remote cannot send anymore
+    if (channel->frames_released < channel->release_batch && channel->credits_incoming) return;
+    channel->new_credits_incoming += channel->frames_released;
+    channel->frames_released = 0;
+    rfcomm_channel_schedule(channel);
+    rfcomm_run();
+}
+
+int rfcomm_send_prepared(uint16_t rfcomm_cid, uint16_t len){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel){
+        log_error("rfcomm_send_prepared cid 0x%02x doesn't exist!", rfcomm_cid);
+        return 0;
+    }
+    // outgoing buffer is in use by prepared packet, cannot send coalesced writes first
+    if (channel->tx_len){
+        log_info("rfcomm_send_prepared cid 0x%02x, coalesced data pending", rfcomm_cid);
+        return RFCOMM_COALESCED_DATA_PENDING;
+    }
+    return rfcomm_send_uih_for_channel(channel, NULL, len);
+}
+
+int rfcomm_send_internal(uint16_t rfcomm_cid, uint8_t *data, uint16_t len){
+    rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
+    if (!channel){
+        log_error("rfcomm_send_internal cid 0x%02x doesn't exist!", rfcomm_cid);
+        return 1;
+    }
+    // empty payload must not be mistaken for a prepared one
+    uint8_t empty;
+    if (channel->tx_buffer){
+        return rfcomm_channel_write_coalesced(channel, data ? data : &empty, len);
+    }
+    return rfcomm_send_uih_for_channel(channel, data ? data : &empty, len);
 }
 
 // Sends Local Lnie Status, see LINE_STATUS_..
@@ -2221,6 +3140,7 @@ void rfcomm_create_channel2(void * connection, bd_addr_t addr, uint8_t server_ch
     }
     
     channel->state = RFCOMM_CHANNEL_SEND_UIH_PN;
+    rfcomm_channel_schedule(channel);
     
     // start connecting, if multiplexer is already up and running
     rfcomm_run();
@@ -2238,7 +3158,16 @@ void rfcomm_disconnect_internal(uint16_t rfcomm_cid){
     log_info("RFCOMM_DISCONNECT cid 0x%02x", rfcomm_cid);
     rfcomm_channel_t * channel = rfcomm_channel_for_rfcomm_cid(rfcomm_cid);
     if (channel) {
-        channel->state = RFCOMM_CHANNEL_SEND_DISC;
+        // best effort, send coalesced writes before DISC
+        rfcomm_channel_flush_tx(channel);
+        // DISC follows when tx ring has been sent
+        rfcomm_channel_stream_send(channel);
+        if (channel->stream_tx.len && channel->state == RFCOMM_CHANNEL_OPEN){
+            channel->stream_disconnect_pending = 1;
+        } else {
+            channel->state = RFCOMM_CHANNEL_SEND_DISC;
+        }
+        rfcomm_channel_schedule(channel);
     }
     
     // process
@@ -2319,6 +3248,7 @@ void rfcomm_accept_connection_internal(uint16_t rfcomm_cid){
             }
             // at least one of { PN RSP, UA } needs to be sent
             // state transistion incoming setup -> dlc setup happens in rfcomm_run after these have been sent
+            rfcomm_channel_schedule(channel);
             break;
         default:
             break;
@@ -2335,6 +3265,7 @@ void rfcomm_decline_connection_internal(uint16_t rfcomm_cid){
     switch (channel->state) {
         case RFCOMM_CHANNEL_INCOMING_SETUP:
             channel->state = RFCOMM_CHANNEL_SEND_DM;
+            rfcomm_channel_schedule(channel);
             break;
         default:
             break;
@@ -2350,6 +3281,7 @@ void rfcomm_grant_credits(uint16_t rfcomm_cid, uint8_t credits){
     if (!channel) return;
     if (!channel->incoming_flow_control) return;
     channel->new_credits_incoming += credits;
+    rfcomm_channel_schedule(channel);
 
     // process
     rfcomm_run();
@@ -57,6 +57,16 @@ extern "C" {
 
 #define RFCOMM_RLS_STATUS_INVALID 0xff
 
+// DLCI 2..61 for server channels 1..30, channels of a multiplexer are found by DLCI
+#define RFCOMM_DLCI_TABLE_SIZE 62
+
+// control frames of a multiplexer that wait for an ACL slot, sent before data frames
+#ifndef RFCOMM_CONTROL_QUEUE_SIZE
+#define RFCOMM_CONTROL_QUEUE_SIZE 4
+#endif
+// header with credits, largest multiplexer command (PN, RPN) and FCS
+#define RFCOMM_CONTROL_FRAME_MAX_LEN 16
+
 // Line Status
 #define LINE_STATUS_NO_ERROR       0x00
 #define LINE_STATUS_OVERRUN_ERROR  0x03
@@ -268,6 +278,20 @@ typedef struct {
     
 } rfcomm_service_t;
 
+struct rfcomm_channel;
+
+typedef struct {
+    uint8_t len;
+    uint8_t data[RFCOMM_CONTROL_FRAME_MAX_LEN];
+} rfcomm_control_frame_t;
+
+// per multiplexer frame counters, see rfcomm_get_multiplexer_statistics
+typedef struct {
+    uint32_t control_frames_queued;     // control frames that had to wait for an ACL slot
+    uint8_t  control_queue_max;
+    uint32_t data_frames_deferred;      // data frames refused while control frames were queued
+} rfcomm_multiplexer_statistics_t;
+
 // info regarding multiplexer
 // note: spec mandates single multiplexer per device combination
 typedef struct {
@@ -304,12 +328,60 @@ typedef struct {
     uint8_t test_data_len;
     uint8_t test_data[RFCOMM_TEST_DATA_MAX_LEN];
 
+    // channels by DLCI
+    struct rfcomm_channel * channels[RFCOMM_DLCI_TABLE_SIZE];
+    uint8_t num_channels;
+
+    // control frames in order of creation
+    rfcomm_control_frame_t control_queue[RFCOMM_CONTROL_QUEUE_SIZE];
+    uint8_t control_queue_head;
+    uint8_t control_queue_len;
+
+    rfcomm_multiplexer_statistics_t statistics;
+
 } rfcomm_multiplexer_t;
 
-// info regarding an actual connection
+// per channel credit counters, see rfcomm_get_channel_statistics
+typedef struct {
+    uint32_t packets_granted;           // total packets handed out to the client
+    uint32_t grants;                    // nr of RFCOMM_EVENT_CREDITS
+    uint32_t incoming_stalls;           // nr of times the remote used up all incoming credits
+    uint8_t  incoming_window;           // current nr of incoming credits provided automatically
+    uint8_t  incoming_window_max;
+    uint32_t coalesced_writes;          // writes stored in tx buffer
+    uint32_t coalesced_frames;          // frames sent from tx buffer
+    uint32_t coalesced_bytes;           // average frame fill = coalesced_bytes / coalesced_frames
+    uint32_t stream_frames_sent;        // frames sent from tx ring
+    uint32_t stream_bytes_sent;
+    uint32_t stream_rx_overflows;       // frames that did not fit into rx ring, excess bytes dropped
+    uint32_t frames_released;           // frames released by client, see rfcomm_enable_frame_release
+    uint32_t credit_frames_sent;        // UIH frames that provided incoming credits
+} rfcomm_channel_statistics_t;
+
+// byte ring of a stream channel, memory provided by application
+typedef struct {
+    uint8_t * buffer;
+    uint16_t  size;
+    uint16_t  pos;      // oldest byte
+    uint16_t  len;
+} rfcomm_ring_t;
+
+// multiplexers and channels visited by rfcomm_run, see rfcomm_get_run_statistics
 typedef struct {
+    uint32_t runs;
+    uint32_t multiplexers_visited;      // only multiplexers with pending work are visited
+    uint32_t channels_visited;          // only channels with pending work are visited
+    uint16_t channels_visited_max;      // in a single run
+} rfcomm_run_statistics_t;
+
+// info regarding an actual connection
+typedef struct rfcomm_channel {
     // linked list - assert: first field
     linked_item_t    item;
+
+    // work list of rfcomm_run
+    struct rfcomm_channel * next_pending;
+    uint8_t pending;
 	
 	rfcomm_multiplexer_t *multiplexer;
 	uint16_t rfcomm_cid;
@@ -319,6 +391,9 @@ typedef struct {
     // number of packets granted to client
     uint8_t packets_granted;
 
+    // number of packets to grant in current hand out
+    uint8_t packets_scheduled;
+
     // credits for outgoing traffic
     uint8_t credits_outgoing;
     
@@ -330,6 +405,12 @@ typedef struct {
     
     // use incoming flow control
     uint8_t incoming_flow_control;
+
+    // without incoming flow control: credits the remote may hold, sized by rfcomm_channel_update_incoming_window
+    uint8_t  incoming_window;
+
+    // start of consumption of the current window
+    uint32_t incoming_window_start_ms;
     
     // channel state
     RFCOMM_CHANNEL_STATE state;
@@ -360,6 +441,28 @@ typedef struct {
     
     // client connection
     void * connection;
+
+    // write coalescing, tx buffer provided by application
+    uint8_t *      tx_buffer;
+    uint16_t       tx_buffer_size;
+    uint16_t       tx_len;
+    uint16_t       tx_delay_ms;
+    uint8_t        tx_flush_pending;    // send tx buffer as soon as possible
+    uint8_t        tx_timer_active;
+    timer_source_t tx_timer;
+
+    // byte stream, see rfcomm_stream_enable
+    rfcomm_ring_t  stream_tx;
+    rfcomm_ring_t  stream_rx;
+    uint8_t        stream_tx_blocked;   // short write, emit RFCOMM_EVENT_STREAM_CAN_WRITE when space available
+    uint8_t        stream_disconnect_pending;
+
+    // frame release, see rfcomm_enable_frame_release
+    uint8_t        release_batch;       // 0 = credits provided automatically or by rfcomm_grant_credits
+    uint8_t        frames_unreleased;   // delivered but not released by client
+    uint8_t        frames_released;     // credits not returned yet
+
+    rfcomm_channel_statistics_t statistics;
     
 } rfcomm_channel_t;
 
@@ -461,6 +564,77 @@ void      rfcomm_release_packet_buffer(void);
 uint8_t * rfcomm_get_outgoing_buffer(void);
 uint16_t  rfcomm_get_max_frame_size(uint16_t rfcomm_cid);
 int       rfcomm_send_prepared(uint16_t rfcomm_cid, uint16_t len);
+
+/** 
+ * @brief Coalesce small writes by rfcomm_send_internal into frames up to max frame size, in a buffer provided by the application.
+ *        The frame is sent when full, on rfcomm_flush, or delay_ms after the first write, delay_ms = 0: no timer. buffer = NULL disables coalescing.
+ *        Writes that don't fit into the buffer fail if the buffered frame cannot be sent, retry on RFCOMM_EVENT_CREDITS.
+ *        rfcomm_send_prepared requires an empty buffer. Returns 0 on success.
+ */
+int rfcomm_enable_write_coalescing(uint16_t rfcomm_cid, uint8_t * buffer, uint16_t size, uint16_t delay_ms);
+
+/** 
+ * @brief Send coalesced writes now. If not possible, they are sent as soon as credits are available. Returns 0 if sent.
+ */
+int rfcomm_flush(uint16_t rfcomm_cid);
+
+/** 
+ * @brief Use channel as byte stream with TX and RX rings provided by the application, NULL keeps packet based operation for that direction.
+ *        Data in the TX ring is sent by RFCOMM in frames up to max frame size as credits allow, independent of write coalescing.
+ *        Data received is stored in the RX ring instead of being delivered as RFCOMM_DATA_PACKET, RFCOMM_EVENT_STREAM_DATA_AVAILABLE
+ *        is emitted for each frame. Credits are only provided for frames that fit into free space, so the RX ring should hold at least
+ *        the credits already provided times max frame size - enable it on RFCOMM_EVENT_INCOMING_CONNECTION or use channels with
+ *        initial credits for small rings. An RX ring smaller than the current max frame size is rejected.
+ *        rfcomm_disconnect_internal sends the TX ring first. Returns 0 on success.
+ */
+int rfcomm_stream_enable(uint16_t rfcomm_cid, uint8_t * tx_buffer, uint16_t tx_size, uint8_t * rx_buffer, uint16_t rx_size);
+
+/** 
+ * @brief Append data to TX ring. Returns number of bytes stored, RFCOMM_EVENT_STREAM_CAN_WRITE is emitted after a short write when space is available.
+ */
+uint16_t rfcomm_stream_write(uint16_t rfcomm_cid, const uint8_t * data, uint16_t len);
+
+/** 
+ * @brief Take up to len bytes from RX ring, returns number of bytes copied. Frees space for new credits.
+ */
+uint16_t rfcomm_stream_read(uint16_t rfcomm_cid, uint8_t * buffer, uint16_t len);
+
+/** 
+ * @brief Number of bytes in RX ring.
+ */
+uint16_t rfcomm_stream_available(uint16_t rfcomm_cid);
+
+/** 
+ * @brief Free space in TX ring.
+ */
+uint16_t rfcomm_stream_write_space(uint16_t rfcomm_cid);
+
+/** 
+ * @brief Return incoming credits only for frames released by the client, in batches of release_batch frames or
+ * when the remote ran out of credits. The payload of RFCOMM_DATA_PACKET points into the incoming L2CAP packet
+ * and is valid until the packet handler returns. Returns 0 on success.
+ */
+int rfcomm_enable_frame_release(uint16_t rfcomm_cid, uint8_t release_batch);
+
+/** 
+ * @brief Release frames delivered by RFCOMM_DATA_PACKET after processing them.
+ */
+void rfcomm_release_frames(uint16_t rfcomm_cid, uint8_t frames);
+
+/** 
+ * @brief Get credit counters since channel creation. Returns 0 on success.
+ */
+int rfcomm_get_channel_statistics(uint16_t rfcomm_cid, rfcomm_channel_statistics_t * statistics);
+
+/** 
+ * @brief Get control queue counters of the multiplexer used by the channel. Returns 0 on success.
+ */
+int rfcomm_get_multiplexer_statistics(uint16_t rfcomm_cid, rfcomm_multiplexer_statistics_t * statistics);
+
+/** 
+ * @brief Get number of multiplexers and channels visited by RFCOMM since rfcomm_init.
+ */
+void rfcomm_get_run_statistics(rfcomm_run_statistics_t * statistics);
 /* API_END */
 
 #if defined __cplusplus
@@ -99,6 +99,16 @@ int run_loop_remove_data_source(data_source_t *ds){
     return the_run_loop->remove_data_source(ds);
 }
 
+/**
+ * Enable/Disable write notifications for data source
+ */
+int run_loop_enable_data_source_write(data_source_t *ds, int enable){
+    run_loop_assert();
+    if (!the_run_loop->enable_data_source_write) return 0;
+    the_run_loop->enable_data_source_write(ds, enable);
+    return 1;
+}
+
 void run_loop_set_timer(timer_source_t *a, uint32_t timeout_in_ms){
     run_loop_assert();
     the_run_loop->set_timer(a, timeout_in_ms);
@@ -68,6 +68,8 @@ typedef struct {
 	void (*execute)(void);
 	void (*dump_timer)(void);
 	uint32_t (*get_time_ms)(void);
+	// optional, NULL if write notifications are not supported
+	void (*enable_data_source_write)(data_source_t *dataSource, int enable);
 } run_loop_t;
 
 #if defined __cplusplus
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// BNEP TX queue test: device A sends IPv4 frames with an ARP frame after every
+// ARP_INTERVAL frames to device B, either gated by bnep_can_send_packet_now or
+// through the TX queue until bnep_send refuses a frame. Refused frames are
+// sent again after BNEP_EVENT_READY_TO_SEND. B must receive all frames in
+// order, and queued ARP frames must overtake queued IPv4 frames.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/sdp_util.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "bnep.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define IP_PAYLOAD_LEN      1000
+#define ARP_PAYLOAD_LEN     28
+#define ARP_INTERVAL        100
+#define TX_QUEUE_SIZE       16384
+
+typedef struct {
+    const char *  name;
+    int           use_queue;
+    uint16_t      max_frames;
+    uint16_t      acl_num_packets;
+    uint32_t      num_frames;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "direct", 0, 0, 2, 2000 },
+    { "queued", 1, 8, 2, 2000 },
+};
+
+static const test_scenario_t * scenario;
+static uint16_t bnep_cid;
+static uint16_t classic_handle;
+static uint32_t frames_sent;
+static uint32_t arp_sent;
+static uint32_t frames_received;
+static uint32_t arp_received;
+static uint32_t arp_overtaken;
+static int      data_ok;
+static int      stats_ok;
+static uint8_t  frame[ETHER_HEADER_LEN + IP_PAYLOAD_LEN];
+static uint8_t  tx_queue_buffer[TX_QUEUE_SIZE];
+static bnep_channel_statistics_t stats;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("bnep_tx_queue_test: %s timeout, %u frames sent, %u received\n", scenario->name, frames_sent, frames_received);
+}
+
+// Device A: send IPv4 and ARP frames
+
+static int a_arp_due(void){
+    return frames_sent / ARP_INTERVAL > arp_sent;
+}
+
+static int a_frames_pending(void){
+    return frames_sent < scenario->num_frames || a_arp_due();
+}
+
+static uint16_t a_build_frame(void){
+    int i;
+    BD_ADDR_COPY(&frame[0], virtual_link_test_addr_b);
+    BD_ADDR_COPY(&frame[6], virtual_link_test_addr_a);
+    uint8_t * payload = &frame[ETHER_HEADER_LEN];
+    if (a_arp_due()){
+        net_store_16(frame, 12, ETHERTYPE_ARP);
+        memset(payload, 0, ARP_PAYLOAD_LEN);
+        bt_store_32(payload, 0, arp_sent);
+        bt_store_32(payload, 4, frames_sent);
+        return ETHER_HEADER_LEN + ARP_PAYLOAD_LEN;
+    }
+    net_store_16(frame, 12, ETHERTYPE_IP);
+    memset(payload, 0, 20);
+    payload[0] = 0x45;  // IPv4, 20 byte header
+    payload[9] = 6;     // TCP
+    bt_store_32(payload, 20, frames_sent);
+    for (i=24;i<IP_PAYLOAD_LEN;i++){
+        payload[i] = frames_sent + i;
+    }
+    return ETHER_HEADER_LEN + IP_PAYLOAD_LEN;
+}
+
+static void a_send_frames(void){
+    static int in_send;
+    // bnep_send can emit BNEP_EVENT_READY_TO_SEND synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (a_frames_pending()){
+        if (!scenario->use_queue && !bnep_can_send_packet_now(bnep_cid)) break;
+        int arp = a_arp_due();
+        // with the queue enabled, send until a frame is refused and send it again later
+        if (bnep_send(bnep_cid, frame, a_build_frame())) break;
+        if (arp){
+            arp_sent++;
+        } else {
+            frames_sent++;
+        }
+    }
+    in_send = 0;
+    if (a_frames_pending()) return;
+    // channel is gone after disconnect
+    stats_ok = bnep_get_channel_statistics(bnep_cid, &stats) == 0;
+}
+
+static void a_connect(timer_source_t * ts){
+    bnep_connect(NULL, virtual_link_test_addr_b, PSM_BNEP, SDP_PANU, SDP_NAP);
+}
+
+static void a_done(void){
+    int ok = stats_ok;
+    if (scenario->use_queue){
+        ok = ok && stats.frames_queued > 0 && stats.priority_frames_queued > 0;
+        ok = ok && stats.frames_dropped > 0 && stats.ready_to_send_events > 0;
+        // queue maxima include ARP frames queued ahead of a full queue
+        ok = ok && stats.queue_frames_max >= scenario->max_frames && stats.queue_bytes_max <= TX_QUEUE_SIZE;
+    } else {
+        ok = ok && stats.frames_sent == scenario->num_frames + arp_sent && stats.frames_queued == 0;
+    }
+    printf("bnep_tx_queue_test: %-6s %5u frames sent, %4u queued, %3u priority, %4u dropped, %3u ready to send, queue max %u frames %u bytes\n",
+        scenario->name, stats.frames_sent, stats.frames_queued, stats.priority_frames_queued, stats.frames_dropped,
+        stats.ready_to_send_events, stats.queue_frames_max, stats.queue_bytes_max);
+    if (!ok){
+        printf("bnep_tx_queue_test: %s failed on sender\n", scenario->name);
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case BNEP_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            bnep_cid = channel;
+            if (scenario->use_queue){
+                bnep_enable_tx_queue(bnep_cid, tx_queue_buffer, sizeof(tx_queue_buffer), scenario->max_frames);
+            }
+            a_send_frames();
+            break;
+        case BNEP_EVENT_READY_TO_SEND:
+            if (bnep_cid && a_frames_pending()){
+                a_send_frames();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            a_done();
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: check order and content of received frames
+
+static void b_done(void){
+    uint32_t arp_expected = scenario->num_frames / ARP_INTERVAL;
+    int ok = data_ok && frames_received == scenario->num_frames && arp_received == arp_expected;
+    if (scenario->use_queue){
+        ok = ok && arp_overtaken > 0;
+    }
+    printf("bnep_tx_queue_test: %-6s %5u frames received, %3u ARP, %3u ARP ahead of queued frames\n", scenario->name,
+        frames_received, arp_received, arp_overtaken);
+    if (!ok){
+        printf("bnep_tx_queue_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_handle_frame(uint8_t *packet, uint16_t size){
+    int i;
+    uint8_t * payload = &packet[ETHER_HEADER_LEN];
+    if (size < ETHER_HEADER_LEN || BD_ADDR_CMP(&packet[0], virtual_link_test_addr_b) || BD_ADDR_CMP(&packet[6], virtual_link_test_addr_a)){
+        data_ok = 0;
+        return;
+    }
+    switch (READ_NET_16(packet, 12)){
+        case ETHERTYPE_ARP:
+            if (size != ETHER_HEADER_LEN + ARP_PAYLOAD_LEN || READ_BT_32(payload, 0) != arp_received) data_ok = 0;
+            // queued behind IPv4 frames that were not sent yet
+            if (READ_BT_32(payload, 4) > frames_received) arp_overtaken++;
+            arp_received++;
+            break;
+        case ETHERTYPE_IP:
+            if (size != ETHER_HEADER_LEN + IP_PAYLOAD_LEN || READ_BT_32(payload, 20) != frames_received) data_ok = 0;
+            for (i=24;i<IP_PAYLOAD_LEN;i++){
+                if (payload[i] != (uint8_t)(frames_received + i)) data_ok = 0;
+            }
+            frames_received++;
+            break;
+        default:
+            data_ok = 0;
+            break;
+    }
+    if (frames_received == scenario->num_frames && arp_received == scenario->num_frames / ARP_INTERVAL){
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == BNEP_DATA_PACKET){
+        b_handle_frame(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            bnep_register_service(NULL, SDP_NAP, l2cap_max_mtu() - 15);
+            hci_connectable_control(1);
+            break;
+        case HCI_EVENT_CONNECTION_COMPLETE:
+            classic_handle = READ_BT_16(packet, 3);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    bnep_init();
+    bnep_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    hci_virtual_config_t config_a;
+    hci_virtual_config_t config_b;
+    memset(&config_a, 0, sizeof(config_a));
+    memset(&config_b, 0, sizeof(config_b));
+    config_a.acl_num_packets = scenarios[i].acl_num_packets;
+    config_b.acl_num_packets = scenarios[i].acl_num_packets;
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, &config_a, &config_b);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
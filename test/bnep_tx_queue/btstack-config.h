@@ -0,0 +1,7 @@
+// Configuration for BNEP TX queue test
+
+// BNEP requires an L2CAP MTU of at least 1691
+#define HCI_ACL_PAYLOAD_SIZE (1691 + 4)
+#define MAX_NO_L2CAP_CHANNELS  2
+
+#include "virtual_link_test_config.h"
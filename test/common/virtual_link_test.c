@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+// *****************************************************************************
+//
+// Virtual link test harness: each device runs in its own process with a stack
+// on top of the virtual HCI controller. The controllers of device A and B are
+// linked by a socketpair. Devices report success by their exit code.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "btstack_memory.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "remote_device_db.h"
+#include "virtual_link_test.h"
+
+bd_addr_t virtual_link_test_addr_a = { 0x00, 0x1a, 0x7d, 0xda, 0x71, 0x0a };
+bd_addr_t virtual_link_test_addr_b = { 0x00, 0x1a, 0x7d, 0xda, 0x71, 0x0b };
+
+static const virtual_link_test_t * test;
+static btstack_packet_handler_t app_packet_handler;
+static timer_source_t timeout_timer;
+
+static void timeout_handler(timer_source_t * ts){
+    if (test->timeout_handler){
+        (*test->timeout_handler)();
+    } else {
+        printf("virtual_link_test: timeout\n");
+    }
+    exit(EXIT_FAILURE);
+}
+
+void virtual_link_test_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    app_packet_handler(packet_type, channel, packet, size);
+}
+
+void virtual_link_test_stack_run(const virtual_link_test_t * virtual_link_test, const virtual_link_test_device_t * device,
+                                 hci_transport_t * transport, void * config){
+    test = virtual_link_test;
+    app_packet_handler = device->packet_handler;
+    if (device->setup){
+        (*device->setup)();
+    }
+
+    run_loop_init(RUN_LOOP_POSIX);
+    btstack_memory_init();
+    hci_init(transport, config, NULL, device->no_remote_device_db ? NULL : &remote_device_db_memory);
+    l2cap_init();
+    l2cap_register_packet_handler(virtual_link_test_packet_handler);
+    if (test->stack_init){
+        (*test->stack_init)();
+    }
+
+    run_loop_set_timer_handler(&timeout_timer, timeout_handler);
+    run_loop_set_timer(&timeout_timer, test->timeout_ms);
+    run_loop_add_timer(&timeout_timer);
+
+    hci_power_control(HCI_POWER_ON);
+    run_loop_execute();
+    exit(EXIT_FAILURE);
+}
+
+int virtual_link_test_wait_for_child(pid_t pid){
+    int status;
+    if (pid < 0) return 1;
+    if (waitpid(pid, &status, 0) < 0) return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int virtual_link_test_run(const virtual_link_test_t * virtual_link_test, hci_virtual_config_t * config_a, hci_virtual_config_t * config_b){
+    hci_virtual_config_t default_config_a;
+    hci_virtual_config_t default_config_b;
+    if (!config_a){
+        memset(&default_config_a, 0, sizeof(default_config_a));
+        config_a = &default_config_a;
+    }
+    if (!config_b){
+        memset(&default_config_b, 0, sizeof(default_config_b));
+        config_b = &default_config_b;
+    }
+    BD_ADDR_COPY(config_a->bd_addr, virtual_link_test_addr_a);
+    BD_ADDR_COPY(config_b->bd_addr, virtual_link_test_addr_b);
+    if (hci_transport_virtual_link(config_a, config_b)) return 2;
+
+    pid_t pid_b = fork();
+    if (pid_b == 0){
+        close(config_a->link_fd);
+        virtual_link_test_stack_run(virtual_link_test, &virtual_link_test->b, hci_transport_virtual_instance(), config_b);
+    }
+    pid_t pid_a = fork();
+    if (pid_a == 0){
+        close(config_b->link_fd);
+        virtual_link_test_stack_run(virtual_link_test, &virtual_link_test->a, hci_transport_virtual_instance(), config_a);
+    }
+    close(config_a->link_fd);
+    close(config_b->link_fd);
+    return virtual_link_test_wait_for_child(pid_a) + virtual_link_test_wait_for_child(pid_b);
+}
+
+int virtual_link_test_run_scenarios(int (*run_scenario)(int scenario), int num_scenarios){
+    int failures = 0;
+    int i;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    for (i=0;i<num_scenarios;i++){
+        failures += (*run_scenario)(i);
+    }
+    printf("%u failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+
+/*
+ *  virtual_link_test.h
+ *
+ *  Test harness: runs device A and B in forked processes, each with its own stack,
+ *  connected by the virtual HCI controller
+ */
+
+#ifndef __VIRTUAL_LINK_TEST_H
+#define __VIRTUAL_LINK_TEST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <btstack/btstack.h>
+#include <btstack/utils.h>
+
+#include "hci_transport.h"
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+extern bd_addr_t virtual_link_test_addr_a;
+extern bd_addr_t virtual_link_test_addr_b;
+
+typedef struct {
+    // receives HCI and L2CAP events, and events of protocols registered with virtual_link_test_packet_handler
+    btstack_packet_handler_t packet_handler;
+    // called in the device process before the stack is set up, optional
+    void (*setup)(void);
+    // 1: no remote device db, link key requests are forwarded to the packet handler
+    int no_remote_device_db;
+} virtual_link_test_device_t;
+
+typedef struct {
+    virtual_link_test_device_t a;
+    virtual_link_test_device_t b;
+    // a device that did not exit after timeout_ms fails
+    uint32_t timeout_ms;
+    // reports progress before a device fails on timeout, optional
+    void (*timeout_handler)(void);
+    // initializes protocols above L2CAP and registers their packet handlers, optional
+    void (*stack_init)(void);
+} virtual_link_test_t;
+
+/**
+ * @brief Forwards events to the packet handler of the device, for rfcomm_register_packet_handler et al.
+ */
+void virtual_link_test_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+/**
+ * @brief Sets up the stack for the device on the given transport and runs it. Does not return,
+ *        the device exits from its packet handler with EXIT_SUCCESS or EXIT_FAILURE.
+ */
+void virtual_link_test_stack_run(const virtual_link_test_t * test, const virtual_link_test_device_t * device,
+                                 hci_transport_t * transport, void * config);
+
+/**
+ * @brief Runs device A and B connected over a virtual link. The bd_addr of the controller configs
+ *        is set to virtual_link_test_addr_a/b. Configs may be NULL for default controllers.
+ * @return number of devices that failed
+ */
+int virtual_link_test_run(const virtual_link_test_t * test, hci_virtual_config_t * config_a, hci_virtual_config_t * config_b);
+
+/**
+ * @brief Waits for a device process
+ * @return 0 if it exited with EXIT_SUCCESS
+ */
+int virtual_link_test_wait_for_child(pid_t pid);
+
+/**
+ * @brief Runs scenarios 0..num_scenarios-1 and prints the number of failures
+ * @return exit code for main
+ */
+int virtual_link_test_run_scenarios(int (*run_scenario)(int scenario), int num_scenarios);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // __VIRTUAL_LINK_TEST_H
@@ -0,0 +1,38 @@
+// Configuration shared by virtual link tests, included at the end of their btstack-config.h
+// Tests define logging, HCI_ACL_PAYLOAD_SIZE and pool sizes that differ from the defaults below first
+
+#define HAVE_INIT_SCRIPT
+#define HAVE_BZERO
+#define HAVE_TIME
+#define HAVE_BLE
+
+#define ENABLE_LOG_ERROR
+#define HAVE_HCI_DUMP
+
+#define USE_POSIX_RUN_LOOP
+
+#ifndef HCI_ACL_PAYLOAD_SIZE
+#define HCI_ACL_PAYLOAD_SIZE 1021
+#endif
+
+#define MAX_SPP_CONNECTIONS 1
+
+#define MAX_NO_HCI_CONNECTIONS MAX_SPP_CONNECTIONS
+#define MAX_NO_L2CAP_SERVICES  2
+#ifndef MAX_NO_L2CAP_CHANNELS
+#define MAX_NO_L2CAP_CHANNELS  (1+MAX_SPP_CONNECTIONS)
+#endif
+#define MAX_NO_RFCOMM_MULTIPLEXERS MAX_SPP_CONNECTIONS
+#ifndef MAX_NO_RFCOMM_SERVICES
+#define MAX_NO_RFCOMM_SERVICES 1
+#endif
+#ifndef MAX_NO_RFCOMM_CHANNELS
+#define MAX_NO_RFCOMM_CHANNELS MAX_SPP_CONNECTIONS
+#endif
+#define MAX_NO_BNEP_SERVICES 1
+#define MAX_NO_BNEP_CHANNELS MAX_SPP_CONNECTIONS
+#define MAX_NO_DB_MEM_DEVICE_LINK_KEYS  2
+#define MAX_NO_DB_MEM_DEVICE_NAMES 2
+#define MAX_NO_DB_MEM_SERVICES 1
+#define MAX_NO_WHITELIST_ENTRIES 1
+#define HAVE_MALLOC
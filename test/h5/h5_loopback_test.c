@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+// *****************************************************************************
+//
+// H5 loopback test: hci_transport_h5 talks over a pty pair to a minimal H5
+// peer emulator running in the same run loop. For each window size, a fixed
+// number of ACL packets is sent and throughput is reported. Optionally,
+// the emulator drops frames to exercise retransmission.
+//
+// *****************************************************************************
+
+#define _XOPEN_SOURCE 600
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "run_loop_private.h"
+
+extern run_loop_t run_loop_posix;
+
+#define NUM_PACKETS          2000
+#define PEER_ACK_DELAY_MS    2
+#define TEST_TIMEOUT_MS      30000
+
+// test config
+static int window_size;
+static int data_integrity;
+static int drop_interval;     // drop every n-th reliable frame received, 0 = never
+static int write_polling;     // run loop without write notifications, transport polls with timer
+
+// host
+static hci_transport_t * transport;
+static uint8_t  acl_packet[HCI_ACL_BUFFER_SIZE];
+static int      packets_sent;
+static int      link_active;
+static struct timeval start_tv;
+
+// peer emulator
+static int      peer_fd;
+static data_source_t peer_ds;
+static timer_source_t peer_ack_timer;
+static int      peer_ack_timer_active;
+static uint8_t  peer_rx_seq;
+static int      peer_frames_received;
+static int      peer_packets_received;
+static int      peer_errors;
+static uint8_t  peer_frame[2 * HCI_PACKET_BUFFER_SIZE];
+static int      peer_frame_len;
+static int      peer_in_frame;
+static int      peer_escape;
+
+static timer_source_t timeout_timer;
+
+static uint16_t crc_ccitt(const uint8_t * data, int size){
+    uint16_t crc = 0xffff;
+    int i, j;
+    for (i = 0; i < size; i++){
+        crc ^= data[i];
+        for (j = 0; j < 8; j++){
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
+        }
+    }
+    uint16_t result = 0;
+    for (j = 0; j < 16; j++){
+        result = (result << 1) | (crc & 1);
+        crc >>= 1;
+    }
+    return result;
+}
+
+static void peer_write_slip(const uint8_t * data, int size){
+    uint8_t buffer[64];
+    int pos = 0;
+    int i;
+    buffer[pos++] = 0xc0;
+    for (i = 0; i < size; i++){
+        switch (data[i]){
+            case 0xc0:
+                buffer[pos++] = 0xdb;
+                buffer[pos++] = 0xdc;
+                break;
+            case 0xdb:
+                buffer[pos++] = 0xdb;
+                buffer[pos++] = 0xdd;
+                break;
+            default:
+                buffer[pos++] = data[i];
+                break;
+        }
+    }
+    buffer[pos++] = 0xc0;
+    if (write(peer_fd, buffer, pos) != pos){
+        printf("peer: write failed\n");
+    }
+}
+
+// unreliable frame with current ack
+static void peer_send_frame(uint8_t packet_type, const uint8_t * payload, int size){
+    uint8_t frame[32];
+    frame[0] = (peer_rx_seq << 3) | (data_integrity ? 0x40 : 0);
+    frame[1] = packet_type | ((size & 0x0f) << 4);
+    frame[2] = size >> 4;
+    frame[3] = ~(frame[0] + frame[1] + frame[2]);
+    memcpy(&frame[4], payload, size);
+    int len = 4 + size;
+    if (data_integrity){
+        uint16_t crc = crc_ccitt(frame, len);
+        net_store_16(frame, len, crc);
+        len += 2;
+    }
+    peer_write_slip(frame, len);
+}
+
+static void peer_send_ack(void){
+    if (peer_ack_timer_active){
+        run_loop_remove_timer(&peer_ack_timer);
+        peer_ack_timer_active = 0;
+    }
+    peer_send_frame(0, NULL, 0);
+}
+
+static void peer_ack_timer_handler(timer_source_t * ts){
+    peer_ack_timer_active = 0;
+    peer_send_ack();
+}
+
+static void peer_handle_frame(uint8_t * frame, int len){
+    if (len < 4) return;
+    if ((uint8_t) ~(frame[0] + frame[1] + frame[2]) != frame[3]){
+        peer_errors++;
+        return;
+    }
+    uint8_t seq      = frame[0] & 0x07;
+    int     crc      = (frame[0] >> 6) & 1;
+    int     reliable = (frame[0] >> 7) & 1;
+    uint8_t type     = frame[1] & 0x0f;
+    int     size     = (frame[1] >> 4) | (frame[2] << 4);
+    if (len != 4 + size + (crc ? 2 : 0)) {
+        peer_errors++;
+        return;
+    }
+    if (crc && crc_ccitt(frame, 4 + size) != READ_NET_16(frame, 4 + size)){
+        peer_errors++;
+        return;
+    }
+    uint8_t * payload = &frame[4];
+
+    if (type == 15){
+        // link control
+        if (size >= 2 && payload[0] == 0x01){
+            uint8_t sync_response[] = { 0x02, 0x7d };
+            peer_send_frame(15, sync_response, sizeof(sync_response));
+        }
+        if (size >= 2 && payload[0] == 0x03){
+            uint8_t config_response[] = { 0x04, 0x7b, 0x07 | (data_integrity ? 0x10 : 0) };
+            peer_send_frame(15, config_response, sizeof(config_response));
+        }
+        return;
+    }
+
+    if (!reliable) return;
+    peer_frames_received++;
+    if (drop_interval && (peer_frames_received % drop_interval) == 0) return;
+    if (seq != peer_rx_seq){
+        peer_send_ack();
+        return;
+    }
+    peer_rx_seq = (peer_rx_seq + 1) & 0x07;
+    if (type == HCI_ACL_DATA_PACKET){
+        // verify payload pattern
+        int i;
+        for (i = 4; i < size; i++){
+            if (payload[i] != (uint8_t) (peer_packets_received + i)) {
+                peer_errors++;
+                break;
+            }
+        }
+        peer_packets_received++;
+    }
+    if (!peer_ack_timer_active){
+        run_loop_set_timer_handler(&peer_ack_timer, peer_ack_timer_handler);
+        run_loop_set_timer(&peer_ack_timer, PEER_ACK_DELAY_MS);
+        run_loop_add_timer(&peer_ack_timer);
+        peer_ack_timer_active = 1;
+    }
+}
+
+static int peer_process(data_source_t * ds){
+    uint8_t buffer[512];
+    int bytes_read = read(peer_fd, buffer, sizeof(buffer));
+    int i;
+    for (i = 0; i < bytes_read; i++){
+        uint8_t data = buffer[i];
+        if (data == 0xc0){
+            if (peer_in_frame && peer_frame_len){
+                peer_handle_frame(peer_frame, peer_frame_len);
+            }
+            peer_in_frame  = 1;
+            peer_frame_len = 0;
+            peer_escape    = 0;
+            continue;
+        }
+        if (!peer_in_frame) continue;
+        if (peer_escape){
+            data = data == 0xdc ? 0xc0 : 0xdb;
+            peer_escape = 0;
+        } else if (data == 0xdb){
+            peer_escape = 1;
+            continue;
+        }
+        if (peer_frame_len < sizeof(peer_frame)){
+            peer_frame[peer_frame_len++] = data;
+        }
+    }
+    return 0;
+}
+
+// host
+
+static void host_report(void){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint32_t ms = (now.tv_sec - start_tv.tv_sec) * 1000 + (now.tv_usec - start_tv.tv_usec) / 1000;
+    if (ms == 0) ms = 1;
+    uint32_t bytes = NUM_PACKETS * sizeof(acl_packet);
+    printf("window %u, crc %u, drop %3u, poll %u: %u packets, %6u bytes in %5u ms, %7u bytes/s, retransmissions %u, errors %u\n",
+        window_size, data_integrity, drop_interval, write_polling, peer_packets_received, bytes, ms,
+        bytes * 1000 / ms, hci_transport_h5_get_retransmissions(), peer_errors);
+    exit(peer_packets_received == NUM_PACKETS && peer_errors == 0 ? 0 : 1);
+}
+
+static void host_send(void){
+    while (packets_sent < NUM_PACKETS && transport->can_send_packet_now(HCI_ACL_DATA_PACKET)){
+        int i;
+        bt_store_16(acl_packet, 0, 0x0001);
+        bt_store_16(acl_packet, 2, sizeof(acl_packet) - 4);
+        for (i = 4; i < sizeof(acl_packet); i++){
+            acl_packet[i] = (uint8_t) (packets_sent + i);
+        }
+        transport->send_packet(HCI_ACL_DATA_PACKET, acl_packet, sizeof(acl_packet));
+        packets_sent++;
+    }
+    if (peer_packets_received == NUM_PACKETS){
+        host_report();
+    }
+}
+
+static void host_packet_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    if (packet[0] != DAEMON_EVENT_HCI_PACKET_SENT) return;
+    if (!link_active){
+        link_active = 1;
+        gettimeofday(&start_tv, NULL);
+    }
+    host_send();
+}
+
+static void timeout_handler(timer_source_t * ts){
+    printf("timeout: ");
+    host_report();
+}
+
+static int run_test(void){
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master)){
+        printf("could not create pty pair\n");
+        return 1;
+    }
+    fcntl(master, F_SETFL, O_NONBLOCK);
+
+    run_loop_init(RUN_LOOP_POSIX);
+    if (write_polling){
+        run_loop_posix.enable_data_source_write = NULL;
+    }
+
+    peer_fd = master;
+    peer_ds.fd = master;
+    run_loop_set_data_source_handler(&peer_ds, &peer_process);
+    run_loop_add_data_source(&peer_ds);
+
+    hci_uart_config_t config = { ptsname(master), 115200, 0, 0 };
+    transport = hci_transport_h5_instance();
+    hci_transport_h5_set_window_size(window_size);
+    hci_transport_h5_enable_data_integrity_check(data_integrity);
+    transport->register_packet_handler(&host_packet_handler);
+    if (transport->open(&config)){
+        printf("could not open %s\n", config.device_name);
+        return 1;
+    }
+
+    run_loop_set_timer_handler(&timeout_timer, &timeout_handler);
+    run_loop_set_timer(&timeout_timer, TEST_TIMEOUT_MS);
+    run_loop_add_timer(&timeout_timer);
+
+    run_loop_execute();
+    return 0;
+}
+
+// run each configuration in a child process as the run loop doesn't return
+static int fork_test(int window, int crc, int drop, int poll){
+    pid_t pid = fork();
+    if (pid == 0){
+        window_size    = window;
+        data_integrity = crc;
+        drop_interval  = drop;
+        write_polling  = poll;
+        exit(run_test());
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, const char * argv[]){
+    int failures = 0;
+    int window;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    for (window = 1; window <= 7; window++){
+        failures += fork_test(window, 0, 0, 0);
+    }
+    failures += fork_test(7, 1, 0, 0);
+    failures += fork_test(4, 0, 97, 0);
+    failures += fork_test(7, 1, 251, 0);
+    failures += fork_test(7, 0, 97, 1);
+    printf("%u failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,7 @@
+// Configuration for L2CAP CID lookup test, up to 256 channels
+
+#define ENABLE_LOG_INFO
+#define L2CAP_CID_TABLE_SIZE 256
+#define MAX_NO_L2CAP_CHANNELS  256
+
+#include "virtual_link_test_config.h"
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// L2CAP CID lookup test: device A opens 1, 16 and 256 channels to device B
+// and sends SDUs on the last one. B reports the receive time per SDU, the
+// cost of l2cap_get_channel_for_local_cid over all open channels and the
+// channels visited by l2cap_run while receiving.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define MAX_CHANNELS        256
+#define NUM_SDUS            5000
+#define SDU_LEN             100
+#define NUM_LOOKUPS         1000000
+
+static const int scenarios[] = { 1, 16, 256 };
+
+static int      num_channels;
+static uint16_t local_cids[MAX_CHANNELS];
+static int      channels_open;
+static uint16_t classic_handle;
+static int      sdus_sent;
+static int      sdus_received;
+static int      data_ok;
+static uint8_t  sdu[SDU_LEN];
+static struct timeval first_rx;
+static struct timeval last_rx;
+static l2cap_run_statistics_t first_rx_runs;
+static l2cap_run_statistics_t last_rx_runs;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("l2cap_cid_lookup_test: %u channels timeout, %u open, %u of %u SDUs received\n", num_channels, channels_open, sdus_received, NUM_SDUS);
+}
+
+static uint32_t time_us(struct timeval * start, struct timeval * end){
+    return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_usec - start->tv_usec);
+}
+
+// Device A: open channels one after the other, then send SDUs on the last one
+
+static void a_send_sdus(void){
+    static int in_send;
+    uint16_t local_cid = local_cids[num_channels - 1];
+    int i;
+    // l2cap_send_internal can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (sdus_sent < NUM_SDUS && l2cap_can_send_packet_now(local_cid)){
+        bt_store_16(sdu, 0, sdus_sent);
+        for (i=2;i<SDU_LEN;i++){
+            sdu[i] = sdus_sent + i;
+        }
+        if (l2cap_send_internal(local_cid, sdu, SDU_LEN)) break;
+        sdus_sent++;
+    }
+    in_send = 0;
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, SDU_LEN);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            local_cids[channels_open++] = READ_BT_16(packet, 13);
+            if (channels_open < num_channels){
+                a_connect(NULL);
+                break;
+            }
+            a_send_sdus();
+            break;
+        case L2CAP_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (channels_open == num_channels && sdus_sent < NUM_SDUS){
+                a_send_sdus();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive SDUs, then measure CID lookup over all open channels
+
+static uint32_t lookup_us;
+static int      lookups_found;
+
+static void b_measure_lookup(void){
+    struct timeval start;
+    struct timeval end;
+    int i;
+    gettimeofday(&start, NULL);
+    for (i=0;i<NUM_LOOKUPS;i++){
+        if (l2cap_get_channel_for_local_cid(local_cids[i % channels_open])) lookups_found++;
+    }
+    gettimeofday(&end, NULL);
+    lookup_us = time_us(&start, &end);
+}
+
+static void b_done(void){
+    int found = lookups_found;
+    uint32_t rx_us = time_us(&first_rx, &last_rx);
+    // idle channels are not visited by l2cap_run
+    uint32_t runs = last_rx_runs.runs - first_rx_runs.runs;
+    uint32_t visited = last_rx_runs.channels_visited - first_rx_runs.channels_visited;
+    int ok = data_ok && sdus_received == NUM_SDUS && channels_open == num_channels && found == NUM_LOOKUPS && visited < runs;
+    printf("l2cap_cid_lookup_test: %3u channels, %5u SDUs, %5u ns per SDU, %4u ns per lookup, %u channels visited in %u runs\n", num_channels,
+        sdus_received, (uint32_t) ((uint64_t) rx_us * 1000 / NUM_SDUS), (uint32_t) ((uint64_t) lookup_us * 1000 / NUM_LOOKUPS), visited, runs);
+    if (!ok){
+        printf("l2cap_cid_lookup_test: %u channels failed, %u open, %u lookups failed, data %s\n", num_channels,
+            channels_open, NUM_LOOKUPS - found, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_handle_sdu(uint8_t *packet, uint16_t size){
+    int i;
+    if (!sdus_received){
+        gettimeofday(&first_rx, NULL);
+        l2cap_get_run_statistics(&first_rx_runs);
+    }
+    gettimeofday(&last_rx, NULL);
+    l2cap_get_run_statistics(&last_rx_runs);
+    uint16_t index = READ_BT_16(packet, 0);
+    if (size != SDU_LEN || index != sdus_received) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    sdus_received++;
+    if (sdus_received == NUM_SDUS){
+        b_measure_lookup();
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == L2CAP_DATA_PACKET){
+        b_handle_sdu(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, SDU_LEN, LEVEL_0);
+            hci_connectable_control(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            local_cids[channels_open++] = READ_BT_16(packet, 13);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+static int run_scenario(int i){
+    num_channels = scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(int));
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// L2CAP credits test: device A sends SDUs to device B over the virtual
+// controller in Basic mode and reports goodput with single credits, with
+// credits for all free ACL buffers, and with l2cap_send_batch.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define BATCH_SIZE          8
+#define SDU_LEN             1000
+
+typedef struct {
+    const char *  name;
+    uint8_t       max_credits;
+    int           batch;
+    uint16_t      num_sdus;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "single credit",  1, 0, 5000 },
+    { "multi credit",   8, 0, 5000 },
+    { "batch",          8, 1, 5000 },
+};
+
+static const test_scenario_t * scenario;
+static uint8_t  sdus[BATCH_SIZE][SDU_LEN];
+
+static uint16_t local_cid;
+static uint16_t classic_handle;
+static int      sdus_sent;
+static int      sdus_received;
+static int      credit_events;
+static int      data_ok;
+static struct timeval first_rx;
+static struct timeval last_rx;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("l2cap_credits_test: %s timeout, %u of %u SDUs sent, %u received\n", scenario->name, sdus_sent, scenario->num_sdus, sdus_received);
+}
+
+// Device A: connect to B and send SDUs
+
+static uint8_t * a_prepare_sdu(int index){
+    int i;
+    uint8_t * sdu = sdus[index % BATCH_SIZE];
+    bt_store_16(sdu, 0, index);
+    for (i=2;i<SDU_LEN;i++){
+        sdu[i] = index + i;
+    }
+    return sdu;
+}
+
+static void a_send_sdus(void){
+    static int in_send;
+    uint8_t * data[BATCH_SIZE];
+    uint16_t  len[BATCH_SIZE];
+    int i;
+    // l2cap_send_internal can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    if (scenario->batch){
+        while (sdus_sent < scenario->num_sdus && l2cap_can_send_packet_now(local_cid)){
+            int num_sdus = scenario->num_sdus - sdus_sent;
+            if (num_sdus > BATCH_SIZE) num_sdus = BATCH_SIZE;
+            for (i=0;i<num_sdus;i++){
+                data[i] = a_prepare_sdu(sdus_sent + i);
+                len[i]  = SDU_LEN;
+            }
+            int sent = l2cap_send_batch(local_cid, data, len, num_sdus);
+            sdus_sent += sent;
+            if (sent < num_sdus) break;
+        }
+    } else {
+        while (sdus_sent < scenario->num_sdus && l2cap_can_send_packet_now(local_cid)){
+            if (l2cap_send_internal(local_cid, a_prepare_sdu(sdus_sent), SDU_LEN)) break;
+            sdus_sent++;
+        }
+    }
+    in_send = 0;
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, SDU_LEN);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            local_cid = READ_BT_16(packet, 13);
+            a_send_sdus();
+            break;
+        case L2CAP_EVENT_CREDITS:
+            credit_events++;
+            /* fall through */
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (local_cid && sdus_sent < scenario->num_sdus){
+                a_send_sdus();
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            gap_disconnect(classic_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            printf("l2cap_credits_test: %-14s %5u credit events\n", scenario->name, credit_events);
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive SDUs and check order and content
+
+static void b_done(void){
+    int ok = data_ok && sdus_received == scenario->num_sdus;
+    uint32_t ms = (last_rx.tv_sec - first_rx.tv_sec) * 1000 + (last_rx.tv_usec - first_rx.tv_usec) / 1000;
+    uint32_t bytes = sdus_received * SDU_LEN;
+    if (!ms) ms = 1;
+    printf("l2cap_credits_test: %-14s %5u of %5u SDUs, %7u bytes in %5u ms, %8u bytes/s\n", scenario->name,
+        sdus_received, scenario->num_sdus, bytes, ms, (uint32_t) ((uint64_t) bytes * 1000 / ms));
+    if (!ok){
+        printf("l2cap_credits_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_handle_sdu(uint8_t *packet, uint16_t size){
+    int i;
+    if (!sdus_received){
+        gettimeofday(&first_rx, NULL);
+    }
+    gettimeofday(&last_rx, NULL);
+    uint16_t index = READ_BT_16(packet, 0);
+    if (size != SDU_LEN) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    if (index != sdus_received){
+        printf("l2cap_credits_test: %s SDU %u received, expected %u\n", scenario->name, index, sdus_received);
+        data_ok = 0;
+    }
+    sdus_received++;
+    if (sdus_received == scenario->num_sdus){
+        l2cap_disconnect_internal(local_cid, 0);
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == L2CAP_DATA_PACKET){
+        b_handle_sdu(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, SDU_LEN, LEVEL_0);
+            hci_connectable_control(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            local_cid = READ_BT_16(packet, 12);
+            l2cap_accept_connection_internal(local_cid);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    l2cap_set_max_credits(scenario->max_credits);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
@@ -0,0 +1,6 @@
+// Configuration for L2CAP ERTM test, max size ACL packets
+
+#define HAVE_L2CAP_ERTM
+#define ENABLE_LOG_INFO
+
+#include "virtual_link_test_config.h"
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// L2CAP ERTM test: device A sends SDUs to device B over the virtual controller
+// in Basic, Enhanced Retransmission and Streaming Mode and reports goodput.
+// With a lossy link, ERTM has to deliver all SDUs in order while Streaming
+// Mode may only drop SDUs. A non-mandatory ERTM channel falls back to Basic
+// mode, a mandatory one is refused by a Basic mode service.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define STREAMING_LINGER_MS 500
+#define BUFFER_SIZE         40000
+
+typedef enum {
+    EXPECT_ALL = 0,     // all SDUs in order
+    EXPECT_INTACT,      // SDUs in order, some may be missing
+    EXPECT_REFUSED,     // channel not opened
+} expectation_t;
+
+typedef struct {
+    const char *  name;
+    uint8_t       a_mode;
+    uint8_t       a_mandatory;
+    uint8_t       b_mode;
+    uint16_t      drop_interval_a;
+    uint16_t      drop_interval_b;
+    uint16_t      num_sdus;
+    uint16_t      sdu_len;
+    uint32_t      a_buffer_size;
+    expectation_t expectation;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "basic goodput",       L2CAP_CHANNEL_MODE_BASIC,                   0, L2CAP_CHANNEL_MODE_BASIC,                   0, 0, 2000, 1000, BUFFER_SIZE, EXPECT_ALL },
+    { "ertm goodput",        L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 1, L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 0, 0, 2000, 1000, BUFFER_SIZE, EXPECT_ALL },
+    { "streaming goodput",   L2CAP_CHANNEL_MODE_STREAMING,               1, L2CAP_CHANNEL_MODE_STREAMING,               0, 0, 2000, 1000, BUFFER_SIZE, EXPECT_ALL },
+    { "ertm segmentation",   L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 1, L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 0, 0,  500,  600, 6000,        EXPECT_ALL },
+    { "ertm lossy",          L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 1, L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 11, 7, 300,  600, 6000,        EXPECT_ALL },
+    { "streaming lossy",     L2CAP_CHANNEL_MODE_STREAMING,               1, L2CAP_CHANNEL_MODE_STREAMING,               7, 0, 1000,  600, 6000,        EXPECT_INTACT },
+    { "ertm fallback",       L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 0, L2CAP_CHANNEL_MODE_BASIC,                   0, 0,  200,  600, BUFFER_SIZE, EXPECT_ALL },
+    { "ertm refused",        L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION, 1, L2CAP_CHANNEL_MODE_BASIC,                   0, 0,  200,  600, BUFFER_SIZE, EXPECT_REFUSED },
+};
+
+static const test_scenario_t * scenario;
+static l2cap_ertm_config_t ertm_config;
+static uint8_t  ertm_buffer[BUFFER_SIZE];
+static uint8_t  sdu[2000];
+
+static uint16_t local_cid;
+static uint16_t classic_handle;
+static int      sdus_sent;
+static int      sdus_received;
+static int      next_index;
+static int      data_ok;
+static int      refused;
+static struct timeval first_rx;
+static struct timeval last_rx;
+
+static timer_source_t retry_timer;
+static timer_source_t linger_timer;
+
+static void timeout_handler(void){
+    printf("l2cap_ertm_test: %s timeout, %u of %u SDUs sent, %u received\n", scenario->name, sdus_sent, scenario->num_sdus, sdus_received);
+}
+
+static void setup_ertm_config(uint8_t mode, uint8_t mandatory){
+    memset(&ertm_config, 0, sizeof(ertm_config));
+    ertm_config.mode = mode;
+    ertm_config.mode_mandatory = mandatory;
+    ertm_config.max_transmit = 0;
+    ertm_config.retransmission_timeout_ms = 300;
+    ertm_config.monitor_timeout_ms = 300;
+    ertm_config.local_mtu = scenario->sdu_len;
+    ertm_config.num_tx_buffers = 16;
+    ertm_config.num_rx_buffers = 16;
+    ertm_config.fcs_option = 1;
+}
+
+// Device A: connect to B and send SDUs
+
+static void a_disconnect(timer_source_t * ts){
+    l2cap_disconnect_internal(local_cid, 0);
+}
+
+static void a_send_sdus(void){
+    static int in_send;
+    int i;
+    // l2cap_send_internal can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (sdus_sent < scenario->num_sdus && l2cap_can_send_packet_now(local_cid)){
+        bt_store_16(sdu, 0, sdus_sent);
+        for (i=2;i<scenario->sdu_len;i++){
+            sdu[i] = sdus_sent + i;
+        }
+        if (l2cap_send_internal(local_cid, sdu, scenario->sdu_len)) break;
+        sdus_sent++;
+    }
+    in_send = 0;
+    if (sdus_sent < scenario->num_sdus) return;
+    if (scenario->expectation != EXPECT_INTACT) return;
+    // B cannot tell when it's done, give Streaming Mode some time to send stored I-frames
+    sdus_sent++;
+    run_loop_set_timer_handler(&linger_timer, a_disconnect);
+    run_loop_set_timer(&linger_timer, STREAMING_LINGER_MS);
+    run_loop_add_timer(&linger_timer);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    if (scenario->a_mode == L2CAP_CHANNEL_MODE_BASIC){
+        l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, scenario->sdu_len);
+        return;
+    }
+    setup_ertm_config(scenario->a_mode, scenario->a_mandatory);
+    l2cap_create_ertm_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, &ertm_config, ertm_buffer, scenario->a_buffer_size);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2] == L2CAP_ERTM_MODE_REFUSED){
+                // channel gets closed by disconnect
+                refused = 1;
+                break;
+            }
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            local_cid = READ_BT_16(packet, 13);
+            a_send_sdus();
+            break;
+        case L2CAP_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (local_cid && sdus_sent < scenario->num_sdus){
+                a_send_sdus();
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            if (!classic_handle){
+                classic_handle = hci_connection_for_bd_addr_and_type(virtual_link_test_addr_b, BD_ADDR_TYPE_CLASSIC)->con_handle;
+            }
+            gap_disconnect(classic_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            if (scenario->expectation == EXPECT_REFUSED){
+                exit(refused ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive SDUs and check order and content
+
+static void b_done(void){
+    int ok = data_ok;
+    switch (scenario->expectation){
+        case EXPECT_ALL:
+            ok = ok && sdus_received == scenario->num_sdus;
+            break;
+        case EXPECT_INTACT:
+            ok = ok && sdus_received > 0 && sdus_received <= scenario->num_sdus;
+            break;
+        case EXPECT_REFUSED:
+            ok = sdus_received == 0;
+            break;
+    }
+    if (sdus_received){
+        uint32_t ms = (last_rx.tv_sec - first_rx.tv_sec) * 1000 + (last_rx.tv_usec - first_rx.tv_usec) / 1000;
+        uint32_t bytes = sdus_received * scenario->sdu_len;
+        if (!ms) ms = 1;
+        printf("l2cap_ertm_test: %-20s %4u of %4u SDUs, %7u bytes in %5u ms, %8u bytes/s\n", scenario->name,
+            sdus_received, scenario->num_sdus, bytes, ms, (uint32_t) ((uint64_t) bytes * 1000 / ms));
+    } else {
+        printf("l2cap_ertm_test: %-20s no SDUs received\n", scenario->name);
+    }
+    if (!ok){
+        printf("l2cap_ertm_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_handle_sdu(uint8_t *packet, uint16_t size){
+    int i;
+    if (!sdus_received){
+        gettimeofday(&first_rx, NULL);
+    }
+    gettimeofday(&last_rx, NULL);
+    uint16_t index = READ_BT_16(packet, 0);
+    if (size != scenario->sdu_len) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    if (scenario->expectation == EXPECT_ALL ? index != next_index : index < next_index){
+        printf("l2cap_ertm_test: %s SDU %u received, expected %u\n", scenario->name, index, next_index);
+        data_ok = 0;
+    }
+    next_index = index + 1;
+    sdus_received++;
+    if (scenario->expectation == EXPECT_ALL && index == scenario->num_sdus - 1){
+        l2cap_disconnect_internal(local_cid, 0);
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == L2CAP_DATA_PACKET){
+        b_handle_sdu(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, scenario->sdu_len, LEVEL_0);
+            hci_connectable_control(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            local_cid = READ_BT_16(packet, 12);
+            if (scenario->b_mode == L2CAP_CHANNEL_MODE_BASIC){
+                l2cap_accept_connection_internal(local_cid);
+                break;
+            }
+            setup_ertm_config(scenario->b_mode, 1);
+            l2cap_accept_ertm_connection_internal(local_cid, &ertm_config, ertm_buffer, sizeof(ertm_buffer));
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+static int run_scenario(int i){
+    hci_virtual_config_t config_a;
+    hci_virtual_config_t config_b;
+    memset(&config_a, 0, sizeof(config_a));
+    memset(&config_b, 0, sizeof(config_b));
+    config_a.acl_drop_interval = scenarios[i].drop_interval_a;
+    config_b.acl_drop_interval = scenarios[i].drop_interval_b;
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, &config_a, &config_b);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
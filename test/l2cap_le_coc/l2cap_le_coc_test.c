@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// L2CAP LE Credit Based Flow Control test: device A connects to device B via
+// LE over the virtual controller and sends SDUs on an LE CoC channel. SDUs are
+// segmented into MPS-sized K-frames, reassembled by B, and credits are returned
+// in batches. Reports goodput for ATT-sized and bulk SDUs. Connections to an
+// unknown LE_PSM, to a service with higher security, or declined by B fail.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "gap_le.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_LE_PSM         0x0080
+#define UNKNOWN_LE_PSM      0x0081
+#define TEST_TIMEOUT_MS     20000
+#define MAX_SDU_LEN         2000
+
+typedef struct {
+    const char *  name;
+    uint16_t      psm;
+    uint16_t      mps_a;
+    uint16_t      mps_b;
+    uint16_t      credits_a;
+    uint16_t      credits_b;
+    uint16_t      le_data_packet_length;
+    uint16_t      num_sdus;
+    uint16_t      sdu_len;
+    gap_security_level_t security_level;
+    int           decline;
+    uint8_t       expected_status;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "att sized goodput",     TEST_LE_PSM,    0,   0,  10, 10, 251, 2000,   20, LEVEL_0, 0, 0 },
+    { "bulk goodput",          TEST_LE_PSM,    0,   0,  10, 10, 251, 2000, 1000, LEVEL_0, 0, 0 },
+    { "segmentation",          TEST_LE_PSM,  100, 100,   4,  4,  27,  200, 2000, LEVEL_0, 0, 0 },
+    { "single credit",         TEST_LE_PSM,   64,  64,   1,  1,  27,  200,  500, LEVEL_0, 0, 0 },
+    { "unknown psm",           UNKNOWN_LE_PSM, 0,   0,  10, 10, 251,  100,  100, LEVEL_0, 0, L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_PSM },
+    { "insufficient security", TEST_LE_PSM,    0,   0,  10, 10, 251,  100,  100, LEVEL_2, 0, L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_SECURITY },
+    { "declined",              TEST_LE_PSM,    0,   0,  10, 10, 251,  100,  100, LEVEL_0, 1, L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_RESOURCES },
+};
+
+static uint8_t adv_data[] = { 0x02, 0x01, 0x06, 0x07, 0x09, 'l', 'e', ' ', 'c', 'o', 'c' };
+
+static const test_scenario_t * scenario;
+static uint8_t  sdu[MAX_SDU_LEN];
+static uint8_t  receive_buffer[MAX_SDU_LEN];
+
+static uint16_t local_cid;
+static uint16_t le_handle;
+static int      scanning;
+static int      sdus_sent;
+static int      sdus_received;
+static int      data_ok;
+static int      status_ok;
+static struct timeval first_rx;
+static struct timeval last_rx;
+
+static void timeout_handler(void){
+    printf("l2cap_le_coc_test: %s timeout, %u of %u SDUs sent, %u received\n", scenario->name, sdus_sent, scenario->num_sdus, sdus_received);
+}
+
+// Device A: scan for B, connect via LE and send SDUs
+
+static void a_send_sdus(void){
+    static int in_send;
+    int i;
+    // l2cap_le_send_data can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (sdus_sent < scenario->num_sdus && l2cap_le_can_send_now(local_cid)){
+        bt_store_16(sdu, 0, sdus_sent);
+        for (i=2;i<scenario->sdu_len;i++){
+            sdu[i] = sdus_sent + i;
+        }
+        sdus_sent++;
+        if (l2cap_le_send_data(local_cid, sdu, scenario->sdu_len)) break;
+    }
+    in_send = 0;
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    bd_addr_t addr;
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            scanning = 1;
+            le_central_set_scan_parameters(1, 0x0030, 0x0030);
+            le_central_start_scan();
+            break;
+        case GAP_LE_ADVERTISING_REPORT:
+            if (!scanning) break;
+            bt_flip_addr(addr, &packet[4]);
+            if (BD_ADDR_CMP(addr, virtual_link_test_addr_b)) break;
+            scanning = 0;
+            le_central_stop_scan();
+            le_central_connect(addr, BD_ADDR_TYPE_LE_PUBLIC);
+            break;
+        case HCI_EVENT_LE_META:
+            if (packet[2] != HCI_SUBEVENT_LE_CONNECTION_COMPLETE || packet[3]) break;
+            le_handle = READ_BT_16(packet, 4);
+            l2cap_le_create_channel_internal(NULL, a_packet_handler, le_handle, scenario->psm, receive_buffer,
+                                             MAX_SDU_LEN, scenario->mps_a, scenario->credits_a);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            status_ok = packet[2] == scenario->expected_status;
+            if (!status_ok){
+                printf("l2cap_le_coc_test: %s channel opened with status 0x%02x, expected 0x%02x\n", scenario->name, packet[2], scenario->expected_status);
+            }
+            if (packet[2]){
+                gap_disconnect(le_handle);
+                break;
+            }
+            local_cid = READ_BT_16(packet, 13);
+            a_send_sdus();
+            break;
+        case L2CAP_EVENT_CREDITS:
+            if (local_cid){
+                a_send_sdus();
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            gap_disconnect(le_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(status_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: advertise, receive SDUs and check order and content
+
+static void b_done(void){
+    int ok = data_ok;
+    if (scenario->expected_status){
+        ok = sdus_received == 0;
+    } else {
+        ok = ok && sdus_received == scenario->num_sdus;
+    }
+    if (sdus_received){
+        uint32_t ms = (last_rx.tv_sec - first_rx.tv_sec) * 1000 + (last_rx.tv_usec - first_rx.tv_usec) / 1000;
+        uint32_t bytes = sdus_received * scenario->sdu_len;
+        if (!ms) ms = 1;
+        printf("l2cap_le_coc_test: %-22s %4u of %4u SDUs, %7u bytes in %5u ms, %8u bytes/s\n", scenario->name,
+            sdus_received, scenario->num_sdus, bytes, ms, (uint32_t) ((uint64_t) bytes * 1000 / ms));
+    } else {
+        printf("l2cap_le_coc_test: %-22s no SDUs received\n", scenario->name);
+    }
+    if (!ok){
+        printf("l2cap_le_coc_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_handle_sdu(uint8_t *packet, uint16_t size){
+    int i;
+    if (!sdus_received){
+        gettimeofday(&first_rx, NULL);
+    }
+    gettimeofday(&last_rx, NULL);
+    uint16_t index = READ_BT_16(packet, 0);
+    if (size != scenario->sdu_len) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    if (index != sdus_received){
+        printf("l2cap_le_coc_test: %s SDU %u received, expected %u\n", scenario->name, index, sdus_received);
+        data_ok = 0;
+    }
+    sdus_received++;
+    if (sdus_received == scenario->num_sdus){
+        l2cap_le_disconnect_internal(local_cid);
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == L2CAP_DATA_PACKET){
+        b_handle_sdu(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_le_register_service_internal(NULL, b_packet_handler, TEST_LE_PSM, scenario->sdu_len, scenario->mps_b,
+                                               scenario->credits_b, scenario->security_level);
+            hci_le_advertisements_set_params(0x0030, 0x0030, 0, 0, 0, virtual_link_test_addr_a, 0x07, 0);
+            gap_advertisements_set_data(sizeof(adv_data), adv_data);
+            gap_advertisements_enable(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            local_cid = READ_BT_16(packet, 12);
+            if (scenario->decline){
+                l2cap_le_decline_connection_internal(local_cid);
+                break;
+            }
+            l2cap_le_accept_connection_internal(local_cid, receive_buffer);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+static int run_scenario(int i){
+    hci_virtual_config_t config_a;
+    hci_virtual_config_t config_b;
+    memset(&config_a, 0, sizeof(config_a));
+    memset(&config_b, 0, sizeof(config_b));
+    config_a.le_data_packet_length = scenarios[i].le_data_packet_length;
+    config_b.le_data_packet_length = scenarios[i].le_data_packet_length;
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, &config_a, &config_b);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
@@ -0,0 +1,7 @@
+// Configuration for L2CAP pending connection response test, short RTX to detect missing responses
+
+#define ENABLE_LOG_INFO
+#define MAX_NO_L2CAP_CHANNELS  1
+#define L2CAP_RTX_TIMEOUT_MS   500
+
+#include "virtual_link_test_config.h"
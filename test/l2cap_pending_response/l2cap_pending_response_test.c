@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+// *****************************************************************************
+//
+// L2CAP pending connection response test: device B requires security level 3
+// for its service and delays the link key reply for longer than the RTX of
+// device A. Device B has to send a pending connection response while the
+// security level update is outstanding, so that device A switches to the
+// ERTX and receives the final connection response instead of timing out.
+// In a second run, device B declines the connection from a timer after the
+// incoming connection event, device A has to receive the refusal before
+// its RTX expires.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define TEST_MTU            100
+#define TEST_TIMEOUT_MS     10000
+#define RETRY_INTERVAL_MS   100
+#define SECURITY_DELAY_MS   (3 * L2CAP_RTX_TIMEOUT_MS)
+#define DECLINE_DELAY_MS    (L2CAP_RTX_TIMEOUT_MS / 5)
+
+typedef struct {
+    const char *         name;
+    gap_security_level_t security_level;    // of the service on device B
+    int                  decline;           // device B declines from a timer instead of accepting
+    uint8_t              expected_status;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "security delayed by 3 RTX", LEVEL_3, 0, L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_SECURITY },
+    { "declined from timer",       LEVEL_0, 1, L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_RESOURCES },
+};
+
+static const test_scenario_t * scenario;
+static uint8_t  open_status;
+static bd_addr_t link_key_request_addr;
+static uint16_t incoming_cid;
+
+static timer_source_t retry_timer;
+static timer_source_t security_timer;
+static timer_source_t decline_timer;
+
+static void timeout_handler(void){
+    printf("l2cap_pending_response_test: timeout\n");
+}
+
+// Device A: request channel, expect refusal by device B instead of RTX timeout
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, TEST_MTU);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            open_status = packet[2];
+            if (open_status != scenario->expected_status
+             && open_status != L2CAP_CONNECTION_RESPONSE_RESULT_RTX_TIMEOUT){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            gap_disconnect(READ_BT_16(packet, 9));
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE: {
+            int ok = open_status == scenario->expected_status;
+            printf("l2cap_pending_response_test: %s, RTX %u ms, channel status 0x%02x%s\n",
+                scenario->name, L2CAP_RTX_TIMEOUT_MS, open_status, ok ? "" : ", failed");
+            exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        default:
+            break;
+    }
+}
+
+// Device B: answer link key request late, without stored link keys, or decline late
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void b_link_key_reply(timer_source_t * ts){
+    hci_send_cmd(&hci_link_key_request_negative_reply, link_key_request_addr);
+}
+
+static void b_decline(timer_source_t * ts){
+    // 0x0004 No resources available
+    l2cap_decline_connection_internal(incoming_cid, 0x0004);
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, TEST_MTU, scenario->security_level);
+            hci_connectable_control(1);
+            break;
+        case HCI_EVENT_LINK_KEY_REQUEST:
+            bt_flip_addr(link_key_request_addr, &packet[2]);
+            run_loop_set_timer_handler(&security_timer, b_link_key_reply);
+            run_loop_set_timer(&security_timer, SECURITY_DELAY_MS);
+            run_loop_add_timer(&security_timer);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            incoming_cid = READ_BT_16(packet, 12);
+            if (!scenario->decline){
+                l2cap_accept_connection_internal(incoming_cid);
+                break;
+            }
+            run_loop_set_timer_handler(&decline_timer, b_decline);
+            run_loop_set_timer(&decline_timer, DECLINE_DELAY_MS);
+            run_loop_add_timer(&decline_timer);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    // no remote device db: link key requests are forwarded to the application
+    /* .b               = */ { b_packet_handler, NULL, 1 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
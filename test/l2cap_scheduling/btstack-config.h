@@ -0,0 +1,5 @@
+// Configuration for L2CAP scheduling test, max size ACL packets
+
+#define ENABLE_LOG_INFO
+
+#include "virtual_link_test_config.h"
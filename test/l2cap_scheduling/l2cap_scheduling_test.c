@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// L2CAP scheduling test: device A opens two channels to device B, which
+// registered both services with a scheduling class and weight. B streams
+// SDUs on both channels over one ACL link. When the first channel has
+// delivered all SDUs, the share of the other channel must match the
+// configured priorities and weights.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM_1          0x1001
+#define TEST_PSM_2          0x1003
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define NUM_SDUS            2000
+#define SDU_LEN             200
+
+typedef struct {
+    const char *  name;
+    uint8_t       priority[2];
+    uint8_t       weight[2];
+    int           min_share;    // SDUs of channel 2 in percent of NUM_SDUS when channel 1 is done
+    int           max_share;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "equal",      { L2CAP_PRIORITY_NORMAL, L2CAP_PRIORITY_NORMAL }, { 1, 1 }, 80, 100 },
+    { "weighted",   { L2CAP_PRIORITY_NORMAL, L2CAP_PRIORITY_NORMAL }, { 3, 1 }, 20,  50 },
+    // low class gets about one credit per L2CAP_PRIORITY_MIN_SHARE_CREDITS of the high class
+    { "priority",   { L2CAP_PRIORITY_HIGH,   L2CAP_PRIORITY_LOW    }, { 1, 1 },  3,  15 },
+};
+
+static const uint16_t psms[2] = { TEST_PSM_1, TEST_PSM_2 };
+
+static const test_scenario_t * scenario;
+static uint8_t  sdu[SDU_LEN];
+
+static uint16_t local_cids[2];
+static uint16_t classic_handle;
+static int      channels_open;
+static int      sdus_sent[2];
+static int      sdus_received[2];
+static int      winner = -1;    // channel that delivered all SDUs first
+static int      data_ok;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("l2cap_scheduling_test: %s timeout, %u/%u SDUs received\n", scenario->name, sdus_received[0], sdus_received[1]);
+}
+
+static int channel_index(uint16_t local_cid){
+    return local_cid == local_cids[1] ? 1 : 0;
+}
+
+// Device A: open both channels and count received SDUs
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, psms[channels_open], SDU_LEN);
+}
+
+static void a_done(void){
+    // with equal settings, either channel may finish first
+    int other = winner == 0 ? 1 : 0;
+    int share = sdus_received[other] * 100 / NUM_SDUS;
+    int ok = data_ok && winner >= 0 && share >= scenario->min_share && share <= scenario->max_share;
+    if (scenario->priority[0] != scenario->priority[1] || scenario->weight[0] != scenario->weight[1]){
+        ok = ok && winner == 0;
+    }
+    printf("l2cap_scheduling_test: %-9s channel %u got %4u SDUs (%3u%%) when channel %u was done\n", scenario->name,
+        other + 1, sdus_received[other], share, winner + 1);
+    if (!ok){
+        printf("l2cap_scheduling_test: %s failed, expected %u..%u%%, data %s\n", scenario->name,
+            scenario->min_share, scenario->max_share, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void a_handle_sdu(uint16_t local_cid, uint8_t *packet, uint16_t size){
+    int index = channel_index(local_cid);
+    int i;
+    if (winner >= 0) return;
+    uint16_t seq = READ_BT_16(packet, 0);
+    if (size != SDU_LEN || seq != sdus_received[index]) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(seq + i)) data_ok = 0;
+    }
+    sdus_received[index]++;
+    if (sdus_received[index] == NUM_SDUS){
+        winner = index;
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == L2CAP_DATA_PACKET){
+        a_handle_sdu(channel, packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            local_cids[channels_open++] = READ_BT_16(packet, 13);
+            if (channels_open < 2){
+                a_connect(NULL);
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            a_done();
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: stream SDUs on both channels as soon as both are open
+
+static void b_send_sdus(void){
+    static int in_send;
+    int i;
+    int index;
+    // l2cap_send_internal can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    for (index=0;index<2;index++){
+        while (sdus_sent[index] < NUM_SDUS && l2cap_can_send_packet_now(local_cids[index])){
+            bt_store_16(sdu, 0, sdus_sent[index]);
+            for (i=2;i<SDU_LEN;i++){
+                sdu[i] = sdus_sent[index] + i;
+            }
+            if (l2cap_send_internal(local_cids[index], sdu, SDU_LEN)) break;
+            sdus_sent[index]++;
+        }
+    }
+    in_send = 0;
+}
+
+static void b_report(uint16_t local_cid){
+    l2cap_channel_statistics_t statistics;
+    int index = channel_index(local_cid);
+    if (l2cap_get_channel_statistics(local_cid, &statistics)) return;
+    printf("l2cap_scheduling_test: %-9s channel %u sent %6u bytes, %4u credit waits, %3u ms queueing delay, max %3u ms\n",
+            scenario->name, index + 1, statistics.bytes_sent, statistics.credit_waits,
+            statistics.queueing_delay_ms, statistics.queueing_delay_max_ms);
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    int index;
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            for (index=0;index<2;index++){
+                l2cap_register_service_with_priority_internal(NULL, b_packet_handler, psms[index], SDU_LEN, LEVEL_0,
+                    scenario->priority[index], scenario->weight[index]);
+            }
+            hci_connectable_control(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]) break;
+            index = READ_BT_16(packet, 11) == TEST_PSM_2 ? 1 : 0;
+            local_cids[index] = READ_BT_16(packet, 13);
+            channels_open++;
+            if (channels_open == 2){
+                b_send_sdus();
+            }
+            break;
+        case L2CAP_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (channels_open == 2){
+                b_send_sdus();
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            b_report(READ_BT_16(packet, 2));
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
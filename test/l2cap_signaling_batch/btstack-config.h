@@ -0,0 +1,6 @@
+// Configuration for L2CAP signaling batch test, up to 16 channels
+
+#define ENABLE_LOG_INFO
+#define MAX_NO_L2CAP_CHANNELS  16
+
+#include "virtual_link_test_config.h"
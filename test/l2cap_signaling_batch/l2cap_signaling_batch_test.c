@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// L2CAP signaling batch test: device A requests 1, 4 and 16 channels to
+// device B at once. The connection and configuration commands for all
+// channels are exchanged in shared C-frames. Both devices report the number
+// of signaling commands and C-frames sent.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define TEST_MTU            100
+#define TEST_TIMEOUT_MS     10000
+#define RETRY_INTERVAL_MS   100
+
+static const int scenarios[] = { 1, 4, 16 };
+
+static int      num_channels;
+static int      channels_open;
+static int      channels_failed;
+static uint16_t classic_handle;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("l2cap_signaling_batch_test: %u channels timeout, %u open\n", num_channels, channels_open);
+}
+
+// report signaling statistics, requires fewer C-frames than commands for multiple channels
+static void done(const char * name){
+    l2cap_signaling_statistics_t stats;
+    l2cap_get_signaling_statistics(&stats);
+    int ok = channels_open == num_channels;
+    if (num_channels > 1 && stats.c_frames_sent >= stats.commands_sent) ok = 0;
+    printf("l2cap_signaling_batch_test: %2u channels, %s sent %3u commands in %3u C-frames%s\n", num_channels, name,
+        stats.commands_sent, stats.c_frames_sent, ok ? "" : ", failed");
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Device A: request all channels at once, disconnect when all are open
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    int i;
+    int channels = num_channels - channels_open;
+    channels_failed = 0;
+    for (i=0;i<channels;i++){
+        l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, TEST_MTU);
+    }
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]){
+                // device B not connectable yet, retry when all requests failed
+                channels_failed++;
+                if (channels_open + channels_failed < num_channels) break;
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            channels_open++;
+            if (channels_open < num_channels) break;
+            gap_disconnect(classic_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            done("A");
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: accept all channels
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, TEST_MTU, LEVEL_0);
+            hci_connectable_control(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]) break;
+            channels_open++;
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            done("B");
+            break;
+        default:
+            break;
+    }
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+static int run_scenario(int i){
+    num_channels = scenarios[i];
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(int));
+}
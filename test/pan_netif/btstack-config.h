@@ -0,0 +1,10 @@
+// Configuration for PAN network interface test
+
+// BNEP requires an L2CAP MTU of at least 1691
+#define HCI_ACL_PAYLOAD_SIZE (1691 + 4)
+
+// room to restore the ethernet header in front of received frames
+#define HCI_INCOMING_PRE_BUFFER_SIZE 14
+#define MAX_NO_L2CAP_CHANNELS  2
+
+#include "virtual_link_test_config.h"
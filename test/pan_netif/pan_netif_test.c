@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// PAN network interface test: a socket pair stands in for the TAP device on
+// both devices. Ethernet frames written to A's interface are read by
+// pan_netif into the outgoing buffer and sent with bnep_send_prepared, B's
+// pan_netif writes them to its interface. The frames use all four BNEP header
+// formats in blocks, so the payload only has to be moved when the format
+// changes. B must receive all frames in order.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/sdp_util.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "bnep.h"
+#include "pan_netif.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define FEED_INTERVAL_MS    1
+#define NUM_FORMATS         4
+#define PAYLOAD_LEN_MIN     46
+#define PAYLOAD_LEN_MAX     1500
+#define TX_QUEUE_SIZE       16384
+
+typedef struct {
+    const char *  name;
+    int           use_queue;
+    uint32_t      num_frames;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "direct", 0, 2000 },
+    { "queued", 1, 2000 },
+};
+
+static bd_addr_t addr_other = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+static const test_scenario_t * scenario;
+static int      netif_fds[2];    // [0] used by pan_netif, [1] by the test
+static uint16_t bnep_cid;
+static uint16_t classic_handle;
+static uint32_t frames_written;
+static uint32_t frames_received;
+static int      data_ok;
+static int      stats_ok;
+static uint8_t  frame[ETHER_HEADER_LEN + PAYLOAD_LEN_MAX];
+static uint8_t  tx_queue_buffer[TX_QUEUE_SIZE];
+static bnep_channel_statistics_t stats;
+
+static timer_source_t retry_timer;
+static timer_source_t feed_timer;
+static data_source_t  netif_ds;
+
+static void timeout_handler(void){
+    printf("pan_netif_test: %s timeout, %u frames written, %u received\n", scenario->name, frames_written, frames_received);
+}
+
+// pan_netif gets L2CAP and BNEP events next to the test
+static void stack_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    virtual_link_test_packet_handler(connection, packet_type, channel, packet, size);
+    pan_netif_packet_handler(packet_type, channel, packet, size);
+}
+
+// Frames: block n of the frames uses header format n
+
+static uint16_t frame_payload_len(uint32_t index){
+    return PAYLOAD_LEN_MIN + (index * 37) % (PAYLOAD_LEN_MAX - PAYLOAD_LEN_MIN + 1);
+}
+
+static uint16_t build_frame(uint32_t index){
+    int i;
+    int format = index / (scenario->num_frames / NUM_FORMATS);
+    uint16_t payload_len = frame_payload_len(index);
+    // compressed, destination only, source only, general ethernet
+    BD_ADDR_COPY(&frame[0], (format & 1) ? addr_other : virtual_link_test_addr_b);
+    BD_ADDR_COPY(&frame[6], (format & 2) ? addr_other : virtual_link_test_addr_a);
+    net_store_16(frame, 12, ETHERTYPE_IP);
+    uint8_t * payload = &frame[ETHER_HEADER_LEN];
+    memset(payload, 0, 20);
+    payload[0] = 0x45;  // IPv4, 20 byte header
+    payload[9] = 6;     // TCP
+    bt_store_32(payload, 20, index);
+    for (i=24;i<payload_len;i++){
+        payload[i] = index + i;
+    }
+    return ETHER_HEADER_LEN + payload_len;
+}
+
+// Device A: write frames into the network interface
+
+static void a_feed_frames(timer_source_t * ts){
+    while (frames_written < scenario->num_frames){
+        uint16_t len = build_frame(frames_written);
+        if (send(netif_fds[1], frame, len, MSG_DONTWAIT) < 0) break;
+        frames_written++;
+    }
+    if (frames_written == scenario->num_frames) return;
+    run_loop_set_timer(&feed_timer, FEED_INTERVAL_MS);
+    run_loop_add_timer(&feed_timer);
+}
+
+static void a_connect(timer_source_t * ts){
+    bnep_connect(NULL, virtual_link_test_addr_b, PSM_BNEP, SDP_PANU, SDP_NAP);
+}
+
+static void a_done(void){
+    int ok = stats_ok && stats.frames_sent + stats.frames_queued >= scenario->num_frames;
+    // payload moved once per change of the header format
+    ok = ok && stats.prepared_frames_moved <= NUM_FORMATS - 1;
+    if (!scenario->use_queue){
+        ok = ok && stats.prepared_frames_sent == scenario->num_frames && stats.prepared_frames_moved == 2;
+    }
+    printf("pan_netif_test: %-6s %5u frames sent, %5u prepared, %u moved, %4u queued\n", scenario->name,
+        stats.frames_sent, stats.prepared_frames_sent, stats.prepared_frames_moved, stats.frames_queued);
+    if (!ok){
+        printf("pan_netif_test: %s failed on sender\n", scenario->name);
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case BNEP_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            bnep_cid = channel;
+            if (scenario->use_queue){
+                bnep_enable_tx_queue(bnep_cid, tx_queue_buffer, sizeof(tx_queue_buffer), 8);
+            }
+            pan_netif_open(netif_fds[0], bnep_cid);
+            run_loop_set_timer_handler(&feed_timer, a_feed_frames);
+            a_feed_frames(&feed_timer);
+            break;
+        case BNEP_EVENT_CHANNEL_CLOSED:
+            // channel is freed afterwards
+            stats_ok = bnep_get_channel_statistics(bnep_cid, &stats) == 0;
+            a_done();
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: read frames from the network interface
+
+static void b_done(void){
+    int ok = data_ok && frames_received == scenario->num_frames;
+    printf("pan_netif_test: %-6s %5u frames received\n", scenario->name, frames_received);
+    if (!ok){
+        printf("pan_netif_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static int b_read_frame(data_source_t * ds){
+    uint8_t buffer[ETHER_HEADER_LEN + PAYLOAD_LEN_MAX];
+    ssize_t len = recv(ds->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (len < 0) return 0;
+    uint16_t expected_len = build_frame(frames_received);
+    if (len != expected_len || memcmp(buffer, frame, len)) data_ok = 0;
+    frames_received++;
+    if (frames_received == scenario->num_frames){
+        run_loop_remove_data_source(&netif_ds);
+        gap_disconnect(classic_handle);
+    }
+    return 0;
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            bnep_register_service(NULL, SDP_NAP, l2cap_max_mtu() - 15);
+            hci_connectable_control(1);
+            break;
+        case HCI_EVENT_CONNECTION_COMPLETE:
+            classic_handle = READ_BT_16(packet, 3);
+            break;
+        case BNEP_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            pan_netif_open(netif_fds[0], channel);
+            netif_ds.fd = netif_fds[1];
+            netif_ds.process = b_read_frame;
+            run_loop_add_data_source(&netif_ds);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, netif_fds)) exit(EXIT_FAILURE);
+    bnep_init();
+    l2cap_register_packet_handler(stack_packet_handler);
+    bnep_register_packet_handler(stack_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    hci_virtual_config_t config_a;
+    hci_virtual_config_t config_b;
+    memset(&config_a, 0, sizeof(config_a));
+    memset(&config_b, 0, sizeof(config_b));
+    config_a.acl_num_packets = 2;
+    config_b.acl_num_packets = 2;
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, &config_a, &config_b);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
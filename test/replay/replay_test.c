@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+// *****************************************************************************
+//
+// Replay test: records a session of device B receiving an L2CAP data stream
+// from device A over the virtual controller, once as PacketLogger and once
+// as BlueZ hcidump file. Then, a fresh stack replays each log as fast as
+// possible and must receive all data without any host packet mismatch.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_dump.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define NUM_PACKETS         1000
+#define PACKET_LEN          40
+#define TEST_TIMEOUT_MS     10000
+#define RETRY_INTERVAL_MS   100
+
+typedef struct {
+    const char *      path;
+    hci_dump_format_t format;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "replay_test.pklg", HCI_DUMP_PACKETLOGGER },
+    { "replay_test.dump", HCI_DUMP_BLUEZ },
+};
+
+static const test_scenario_t * scenario;
+
+static uint16_t local_cid;
+static uint16_t classic_handle;
+static int      packets_sent;
+static int      packets_received;
+static int      data_ok;
+static uint8_t  packet[PACKET_LEN];
+static int      is_replay;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("replay_test: timeout\n");
+}
+
+// Device A: connect to B and stream data
+
+static void a_send_packets(void){
+    static int in_send;
+    int i;
+    // l2cap_send_internal can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (packets_sent < NUM_PACKETS && l2cap_can_send_packet_now(local_cid)){
+        for (i=0;i<PACKET_LEN;i++){
+            packet[i] = packets_sent + i;
+        }
+        l2cap_send_internal(local_cid, packet, PACKET_LEN);
+        packets_sent++;
+    }
+    in_send = 0;
+    if (packets_sent < NUM_PACKETS) return;
+    packets_sent++;
+    l2cap_disconnect_internal(local_cid, 0);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static void a_connect(timer_source_t * ts){
+    l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, 100);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            local_cid = READ_BT_16(packet, 13);
+            a_send_packets();
+            break;
+        case L2CAP_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (local_cid && packets_sent <= NUM_PACKETS){
+                a_send_packets();
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            gap_disconnect(classic_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive data, recorded and replayed
+
+static void b_done(void){
+    hci_replay_statistics_t stats;
+    int ok = packets_received == NUM_PACKETS && data_ok;
+    if (is_replay){
+        hci_transport_replay_get_statistics(&stats);
+        uint32_t ms = stats.duration_ms ? stats.duration_ms : 1;
+        printf("replay_test: %u events, %u ACL packets, %u ACL bytes, %u host packets in %u ms, %u events/s, %u bytes/s, %u mismatches, %u missing\n",
+            stats.events, stats.acl_packets, stats.acl_bytes, stats.host_packets, stats.duration_ms,
+            stats.events * 1000 / ms, stats.acl_bytes * 1000 / ms, stats.host_mismatches, stats.host_missing);
+        ok = ok && stats.host_mismatches == 0 && stats.host_missing == 0;
+    }
+    if (!ok){
+        printf("replay_test: %s received %u of %u packets, data %s\n", is_replay ? "replay" : "recording",
+            packets_received, NUM_PACKETS, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    int i;
+    if (packet_type == L2CAP_DATA_PACKET){
+        if (size != PACKET_LEN) data_ok = 0;
+        for (i=0;i<size;i++){
+            if (packet[i] != (uint8_t)(packets_received + i)) data_ok = 0;
+        }
+        packets_received++;
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, 100, LEVEL_0);
+            hci_connectable_control(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            if (!is_replay){
+                b_done();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void b_setup(void){
+    data_ok = 1;
+    if (is_replay){
+        hci_transport_replay_register_done_handler(&b_done);
+        return;
+    }
+    unlink(scenario->path);
+    hci_dump_open(scenario->path, scenario->format);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, b_setup, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+// device B replays its recording as fast as possible, without device A
+static int replay(void){
+    pid_t pid = fork();
+    if (pid == 0){
+        static hci_replay_config_t config;
+        config.path   = scenario->path;
+        config.format = scenario->format;
+        config.speed  = 0;
+        is_replay = 1;
+        virtual_link_test_stack_run(&test, &test.b, hci_transport_replay_instance(), &config);
+    }
+    return virtual_link_test_wait_for_child(pid);
+}
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    int failures = virtual_link_test_run(&test, NULL, NULL);
+    return failures + replay();
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
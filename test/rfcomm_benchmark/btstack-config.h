@@ -0,0 +1,7 @@
+// Configuration for RFCOMM benchmark
+
+#define MAX_NO_L2CAP_CHANNELS  2
+#define MAX_NO_RFCOMM_SERVICES 8
+#define MAX_NO_RFCOMM_CHANNELS 8
+
+#include "virtual_link_test_config.h"
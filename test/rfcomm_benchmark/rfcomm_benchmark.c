@@ -0,0 +1,548 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// RFCOMM benchmark: device A opens N RFCOMM channels to device B over the
+// virtual controller and streams frames on all of them. Each run reports
+// goodput, per-frame latency percentiles, credit frames returned by B and
+// CPU time per MB on both sides as one CSV row, for each combination of
+// credit policy, controller ACL buffers, channel count and frame size.
+//
+// usage: rfcomm_benchmark [-p policies] [-a acl packets] [-c channels] [-f frame sizes] [-b bytes]
+//
+// Lists are comma separated, e.g. -c 1,2,4 -f 64,1000 -p auto,release.
+// Credit policies:
+//   auto       incoming credit window sized by RFCOMM
+//   per-frame  B grants a single credit for each frame received
+//   release    B releases each frame after processing, credits returned in batches
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define RUN_TIMEOUT_MS      60000
+#define RETRY_INTERVAL_MS   100
+#define MAX_CHANNELS        MAX_NO_RFCOMM_CHANNELS
+#define MAX_FRAME_LEN       1000
+#define MIN_FRAME_LEN       8       // sequence nr and send timestamp
+#define MAX_VALUES          8       // per option list
+#define MAX_LATENCY_SAMPLES 65536   // frames received after that are not part of the percentiles
+#define PER_FRAME_CREDITS   10      // initial credits for per-frame policy
+#define RELEASE_BATCH       5
+
+typedef enum {
+    POLICY_AUTO,
+    POLICY_PER_FRAME,
+    POLICY_RELEASE,
+} credit_policy_t;
+
+static const char * policy_names[] = { "auto", "per-frame", "release" };
+
+typedef struct {
+    credit_policy_t policy;
+    uint8_t         acl_packets;    // controller ACL buffers and L2CAP max credits
+    int             num_channels;
+    uint16_t        frame_len;
+    uint32_t        num_frames;     // per channel
+} benchmark_config_t;
+
+// written by each device to the parent at the end of a run
+typedef struct {
+    int      ok;
+    uint32_t bytes;
+    uint32_t duration_us;           // first to last frame received
+    uint32_t latency_us[4];         // p50, p90, p99, max
+    uint32_t credit_frames;         // frames with credits sent by receiver
+    uint32_t credit_stalls;         // receiver ran out of incoming credits
+    uint32_t packet_grants;         // RFCOMM_EVENT_CREDITS on sender
+    uint32_t cpu_us;                // user and system time from first frame
+} benchmark_report_t;
+
+
+static const benchmark_config_t * config;
+static int      pipe_a[2];
+static int      pipe_b[2];
+static int      report_fd;
+static benchmark_report_t report;
+static uint8_t  frame[MAX_FRAME_LEN];
+
+static uint16_t rfcomm_cids[MAX_CHANNELS];
+static uint32_t frames_sent[MAX_CHANNELS];
+static uint32_t frames_received[MAX_CHANNELS];
+static int      channels_open;
+static int      channels_done;
+static uint16_t classic_handle;
+static int      data_ok;
+static uint32_t first_rx_us;
+static uint32_t last_rx_us;
+static uint32_t cpu_start_us;
+static uint32_t latency_samples[MAX_LATENCY_SAMPLES];
+static uint32_t num_latency_samples;
+
+static timer_source_t retry_timer;
+
+static uint32_t time_us(void){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint32_t) (tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static uint32_t cpu_time_us(void){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint32_t) ((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static void send_report(void){
+    report.cpu_us = cpu_time_us() - cpu_start_us;
+    if (write(report_fd, &report, sizeof(report)) != sizeof(report)) exit(EXIT_FAILURE);
+}
+
+static void timeout_handler(void){
+    fprintf(stderr, "rfcomm_benchmark: %s, %u channels, %u bytes frames: timeout, %u channels open, %u frames received on first channel\n",
+        policy_names[config->policy], config->num_channels, config->frame_len, channels_open, frames_received[0]);
+}
+
+static void stack_init(void){
+    l2cap_set_max_credits(config->acl_packets);
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static int channel_index(uint16_t rfcomm_cid){
+    int i;
+    for (i=0;i<config->num_channels;i++){
+        if (rfcomm_cids[i] == rfcomm_cid) return i;
+    }
+    return -1;
+}
+
+// Device A: open channels to B and stream frames on all of them
+
+static void a_send_frames(void){
+    static int in_send;
+    int i, j;
+    // rfcomm_send_internal can emit RFCOMM_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    for (i=0;i<channels_open;i++){
+        while (frames_sent[i] < config->num_frames && rfcomm_can_send_packet_now(rfcomm_cids[i])){
+            bt_store_32(frame, 0, frames_sent[i]);
+            bt_store_32(frame, 4, time_us());
+            for (j=MIN_FRAME_LEN;j<config->frame_len;j++){
+                frame[j] = frames_sent[i] + j;
+            }
+            if (rfcomm_send_internal(rfcomm_cids[i], frame, config->frame_len)) break;
+            frames_sent[i]++;
+        }
+    }
+    in_send = 0;
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, channels_open + 1);
+}
+
+static void a_done(void){
+    int i;
+    report.ok = 1;
+    for (i=0;i<config->num_channels;i++){
+        report.bytes += frames_sent[i] * config->frame_len;
+        if (frames_sent[i] < config->num_frames) report.ok = 0;
+    }
+    send_report();
+    exit(report.ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            rfcomm_cids[channels_open++] = READ_BT_16(packet, 12);
+            if (channels_open < config->num_channels){
+                a_connect(NULL);
+                break;
+            }
+            cpu_start_us = cpu_time_us();
+            a_send_frames();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+            report.packet_grants++;
+            /* fall through */
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (channels_open == config->num_channels){
+                a_send_frames();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            a_done();
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive frames, check order and content, collect latency and credit counters
+
+static int compare_uint32(const void * a, const void * b){
+    uint32_t value_a = *(const uint32_t *) a;
+    uint32_t value_b = *(const uint32_t *) b;
+    if (value_a < value_b) return -1;
+    return value_a > value_b;
+}
+
+static void b_done(void){
+    static const int percentiles[] = { 50, 90, 99, 100 };
+    rfcomm_channel_statistics_t stats;
+    int i;
+    report.ok = data_ok;
+    report.duration_us = last_rx_us - first_rx_us;
+    for (i=0;i<config->num_channels;i++){
+        report.bytes += frames_received[i] * config->frame_len;
+        // channels are gone after disconnect
+        if (rfcomm_get_channel_statistics(rfcomm_cids[i], &stats)){
+            report.ok = 0;
+            continue;
+        }
+        report.credit_frames += stats.credit_frames_sent;
+        report.credit_stalls += stats.incoming_stalls;
+    }
+    qsort(latency_samples, num_latency_samples, sizeof(uint32_t), compare_uint32);
+    for (i=0;i<4;i++){
+        report.latency_us[i] = latency_samples[(num_latency_samples - 1) * percentiles[i] / 100];
+    }
+    send_report();
+    gap_disconnect(classic_handle);
+}
+
+static void b_handle_frame(uint16_t rfcomm_cid, uint8_t *packet, uint16_t size){
+    int i;
+    uint32_t now = time_us();
+    int index = channel_index(rfcomm_cid);
+    if (index < 0 || size != config->frame_len){
+        data_ok = 0;
+        return;
+    }
+    if (!channels_done && !num_latency_samples){
+        first_rx_us  = now;
+        cpu_start_us = cpu_time_us();
+    }
+    last_rx_us = now;
+    if (num_latency_samples < MAX_LATENCY_SAMPLES){
+        latency_samples[num_latency_samples++] = now - READ_BT_32(packet, 4);
+    }
+    uint32_t nr = READ_BT_32(packet, 0);
+    for (i=MIN_FRAME_LEN;i<size;i++){
+        if (packet[i] != (uint8_t)(nr + i)) data_ok = 0;
+    }
+    if (nr != frames_received[index]) data_ok = 0;
+    frames_received[index]++;
+
+    switch (config->policy){
+        case POLICY_PER_FRAME:
+            rfcomm_grant_credits(rfcomm_cid, 1);
+            break;
+        case POLICY_RELEASE:
+            rfcomm_release_frames(rfcomm_cid, 1);
+            break;
+        default:
+            break;
+    }
+
+    if (frames_received[index] < config->num_frames) return;
+    channels_done++;
+    if (channels_done < config->num_channels) return;
+    b_done();
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    int i;
+    uint16_t rfcomm_cid;
+    if (packet_type == RFCOMM_DATA_PACKET){
+        b_handle_frame(channel, packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            for (i=0;i<config->num_channels;i++){
+                if (config->policy == POLICY_PER_FRAME){
+                    rfcomm_register_service_with_initial_credits_internal(NULL, i + 1, config->frame_len, PER_FRAME_CREDITS);
+                } else {
+                    rfcomm_register_service_internal(NULL, i + 1, config->frame_len);
+                }
+            }
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_cid = READ_BT_16(packet, 9);
+            rfcomm_cids[packet[8] - 1] = rfcomm_cid;
+            if (config->policy == POLICY_RELEASE){
+                rfcomm_enable_frame_release(rfcomm_cid, RELEASE_BATCH);
+            }
+            rfcomm_accept_connection_internal(rfcomm_cid);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(report.ok ? EXIT_SUCCESS : EXIT_FAILURE);
+            break;
+        default:
+            break;
+    }
+}
+
+static void a_setup(void){
+    close(pipe_a[0]);
+    close(pipe_b[0]);
+    close(pipe_b[1]);
+    report_fd = pipe_a[1];
+}
+
+static void b_setup(void){
+    close(pipe_b[0]);
+    close(pipe_a[0]);
+    close(pipe_a[1]);
+    report_fd = pipe_b[1];
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, a_setup, 0 },
+    /* .b               = */ { b_packet_handler, b_setup, 0 },
+    /* .timeout_ms      = */ RUN_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+// Parent: run each configuration with fresh stacks, collect reports
+
+static void read_report(int fd, benchmark_report_t * child_report){
+    if (read(fd, child_report, sizeof(benchmark_report_t)) == sizeof(benchmark_report_t)) return;
+    memset(child_report, 0, sizeof(benchmark_report_t));
+}
+
+static int run_benchmark(const benchmark_config_t * benchmark_config, benchmark_report_t * report_a, benchmark_report_t * report_b){
+    hci_virtual_config_t config_a;
+    hci_virtual_config_t config_b;
+    memset(&config_a, 0, sizeof(config_a));
+    memset(&config_b, 0, sizeof(config_b));
+    config_a.acl_num_packets = benchmark_config->acl_packets;
+    config_b.acl_num_packets = benchmark_config->acl_packets;
+    if (pipe(pipe_a) || pipe(pipe_b)) return 1;
+
+    config  = benchmark_config;
+    data_ok = 1;
+    int failures = virtual_link_test_run(&test, &config_a, &config_b);
+    close(pipe_a[1]);
+    close(pipe_b[1]);
+    read_report(pipe_a[0], report_a);
+    read_report(pipe_b[0], report_b);
+    close(pipe_a[0]);
+    close(pipe_b[0]);
+    return failures || !report_a->ok || !report_b->ok;
+}
+
+static uint32_t per_mb(uint32_t value, uint32_t bytes){
+    if (!bytes) return 0;
+    return (uint32_t) ((uint64_t) value * 1000000 / bytes);
+}
+
+static void print_header(void){
+    printf("policy,acl_packets,channels,frame_len,bytes,duration_us,goodput_bytes_per_s,"
+        "latency_p50_us,latency_p90_us,latency_p99_us,latency_max_us,"
+        "credit_frames,credit_stalls,packet_grants,tx_cpu_us_per_mb,rx_cpu_us_per_mb,result\n");
+}
+
+static void print_result(const benchmark_config_t * benchmark_config, const benchmark_report_t * report_a, const benchmark_report_t * report_b, int failed){
+    uint32_t duration_us = report_b->duration_us ? report_b->duration_us : 1;
+    printf("%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%s\n",
+        policy_names[benchmark_config->policy], benchmark_config->acl_packets, benchmark_config->num_channels,
+        benchmark_config->frame_len, report_b->bytes, report_b->duration_us,
+        (uint32_t) ((uint64_t) report_b->bytes * 1000000 / duration_us),
+        report_b->latency_us[0], report_b->latency_us[1], report_b->latency_us[2], report_b->latency_us[3],
+        report_b->credit_frames, report_b->credit_stalls, report_a->packet_grants,
+        per_mb(report_a->cpu_us, report_a->bytes), per_mb(report_b->cpu_us, report_b->bytes),
+        failed ? "failed" : "ok");
+}
+
+static int parse_list(const char * arg, int * values, int min, int max){
+    char buffer[80];
+    int count = 0;
+    strncpy(buffer, arg, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+    char * token;
+    for (token = strtok(buffer, ","); token && count < MAX_VALUES; token = strtok(NULL, ",")){
+        int value = atoi(token);
+        if (value < min || value > max) return 0;
+        values[count++] = value;
+    }
+    return count;
+}
+
+static int parse_policies(const char * arg, int * values){
+    char buffer[80];
+    int count = 0;
+    unsigned int i;
+    strncpy(buffer, arg, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+    char * token;
+    for (token = strtok(buffer, ","); token && count < MAX_VALUES; token = strtok(NULL, ",")){
+        for (i=0;i<sizeof(policy_names)/sizeof(char *);i++){
+            if (strcmp(token, policy_names[i]) == 0) break;
+        }
+        if (i == sizeof(policy_names)/sizeof(char *)) return 0;
+        values[count++] = i;
+    }
+    return count;
+}
+
+static void usage(const char * name){
+    fprintf(stderr, "usage: %s [-p policies] [-a acl packets] [-c channels] [-f frame sizes] [-b bytes]\n", name);
+    fprintf(stderr, "  -p  credit policies: auto, per-frame, release (default auto)\n");
+    fprintf(stderr, "  -a  controller ACL buffers (default 8)\n");
+    fprintf(stderr, "  -c  RFCOMM channels, 1-%u (default 1,2,4)\n", MAX_CHANNELS);
+    fprintf(stderr, "  -f  frame sizes, %u-%u (default 64,1000)\n", MIN_FRAME_LEN, MAX_FRAME_LEN);
+    fprintf(stderr, "  -b  bytes per run, split across channels (default 1000000)\n");
+}
+
+int main(int argc, char * const argv[]){
+    int policies[MAX_VALUES]    = { POLICY_AUTO };
+    int acl_packets[MAX_VALUES] = { 8 };
+    int channels[MAX_VALUES]    = { 1, 2, 4 };
+    int frame_lens[MAX_VALUES]  = { 64, 1000 };
+    int num_policies    = 1;
+    int num_acl_packets = 1;
+    int num_channels    = 3;
+    int num_frame_lens  = 2;
+    uint32_t bytes      = 1000000;
+    int option;
+    while ((option = getopt(argc, argv, "p:a:c:f:b:h")) != -1){
+        switch (option){
+            case 'p':
+                num_policies = parse_policies(optarg, policies);
+                break;
+            case 'a':
+                num_acl_packets = parse_list(optarg, acl_packets, 1, 255);
+                break;
+            case 'c':
+                num_channels = parse_list(optarg, channels, 1, MAX_CHANNELS);
+                break;
+            case 'f':
+                num_frame_lens = parse_list(optarg, frame_lens, MIN_FRAME_LEN, MAX_FRAME_LEN);
+                break;
+            case 'b':
+                bytes = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+        if (!num_policies || !num_acl_packets || !num_channels || !num_frame_lens || !bytes){
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int runs = 0;
+    int failures = 0;
+    int p, a, c, f;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    print_header();
+    for (p=0;p<num_policies;p++){
+        for (a=0;a<num_acl_packets;a++){
+            for (c=0;c<num_channels;c++){
+                for (f=0;f<num_frame_lens;f++){
+                    benchmark_config_t benchmark_config;
+                    benchmark_report_t report_a;
+                    benchmark_report_t report_b;
+                    benchmark_config.policy       = (credit_policy_t) policies[p];
+                    benchmark_config.acl_packets  = acl_packets[a];
+                    benchmark_config.num_channels = channels[c];
+                    benchmark_config.frame_len    = frame_lens[f];
+                    benchmark_config.num_frames   = bytes / (frame_lens[f] * channels[c]);
+                    if (!benchmark_config.num_frames) {
+                        benchmark_config.num_frames = 1;
+                    }
+                    int failed = run_benchmark(&benchmark_config, &report_a, &report_b);
+                    print_result(&benchmark_config, &report_a, &report_b, failed);
+                    runs++;
+                    failures += failed;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "rfcomm_benchmark: %u runs, %u failures\n", runs, failures);
+    return failures ? 1 : 0;
+}
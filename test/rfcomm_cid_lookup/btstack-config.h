@@ -0,0 +1,9 @@
+// Configuration for RFCOMM CID lookup test, CIDs of 8 channels exceed the CID table
+
+#define ENABLE_LOG_INFO
+#define RFCOMM_CID_TABLE_SIZE 4
+#define MAX_NO_L2CAP_CHANNELS  2
+#define MAX_NO_RFCOMM_SERVICES 8
+#define MAX_NO_RFCOMM_CHANNELS 8
+
+#include "virtual_link_test_config.h"
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+// *****************************************************************************
+//
+// RFCOMM CID lookup test: device A opens 1, 4 and 8 channels to device B
+// over a single multiplexer and sends frames on the first one, which holds
+// the packets granted by RFCOMM. CIDs above the CID table are found in the
+// channel list when the other channels are accepted. B reports the receive
+// time per frame and the channels visited by rfcomm_run while receiving,
+// idle channels must not be visited.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define MAX_CHANNELS        8
+#define NUM_FRAMES          5000
+#define FRAME_LEN           100
+
+static const int scenarios[] = { 1, 4, 8 };
+
+static int      num_channels;
+static uint16_t rfcomm_cids[MAX_CHANNELS];
+static int      channels_open;
+static uint16_t classic_handle;
+static int      frames_sent;
+static int      frames_received;
+static int      data_ok;
+static uint8_t  frame[FRAME_LEN];
+static struct timeval first_rx;
+static struct timeval last_rx;
+static rfcomm_run_statistics_t first_rx_runs;
+static rfcomm_run_statistics_t last_rx_runs;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("rfcomm_cid_lookup_test: %u channels timeout, %u open, %u of %u frames received\n", num_channels, channels_open, frames_received, NUM_FRAMES);
+}
+
+static uint32_t time_us(struct timeval * start, struct timeval * end){
+    return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_usec - start->tv_usec);
+}
+
+// Device A: open channels one after the other, then send frames on the first one
+
+static void a_send_frames(void){
+    static int in_send;
+    uint16_t rfcomm_cid = rfcomm_cids[0];
+    int i;
+    // rfcomm_send_internal can emit RFCOMM_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (frames_sent < NUM_FRAMES && rfcomm_can_send_packet_now(rfcomm_cid)){
+        bt_store_16(frame, 0, frames_sent);
+        for (i=2;i<FRAME_LEN;i++){
+            frame[i] = frames_sent + i;
+        }
+        if (rfcomm_send_internal(rfcomm_cid, frame, FRAME_LEN)) break;
+        frames_sent++;
+    }
+    in_send = 0;
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, channels_open + 1);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            rfcomm_cids[channels_open++] = READ_BT_16(packet, 12);
+            if (channels_open < num_channels){
+                a_connect(NULL);
+                break;
+            }
+            a_send_frames();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (channels_open == num_channels && frames_sent < NUM_FRAMES){
+                a_send_frames();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive frames on first channel
+
+static void b_done(void){
+    uint32_t rx_us = time_us(&first_rx, &last_rx);
+    // idle channels are not visited by rfcomm_run, receiving channel only for new credits
+    uint32_t runs = last_rx_runs.runs - first_rx_runs.runs;
+    uint32_t visited = last_rx_runs.channels_visited - first_rx_runs.channels_visited;
+    int ok = data_ok && frames_received == NUM_FRAMES && channels_open == num_channels && visited < runs;
+    printf("rfcomm_cid_lookup_test: %u channels, %5u frames, %5u ns per frame, %u channels visited in %u runs, max %u per run\n", num_channels,
+        frames_received, (uint32_t) ((uint64_t) rx_us * 1000 / NUM_FRAMES), visited, runs, last_rx_runs.channels_visited_max);
+    if (!ok){
+        printf("rfcomm_cid_lookup_test: %u channels failed, %u open, data %s\n", num_channels,
+            channels_open, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_handle_frame(uint16_t rfcomm_cid, uint8_t *packet, uint16_t size){
+    int i;
+    if (!frames_received){
+        gettimeofday(&first_rx, NULL);
+        rfcomm_get_run_statistics(&first_rx_runs);
+    }
+    gettimeofday(&last_rx, NULL);
+    rfcomm_get_run_statistics(&last_rx_runs);
+    uint16_t index = READ_BT_16(packet, 0);
+    if (rfcomm_cid != rfcomm_cids[0]) data_ok = 0;
+    if (size != FRAME_LEN || index != frames_received) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    frames_received++;
+    if (frames_received == NUM_FRAMES){
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    int i;
+    if (packet_type == RFCOMM_DATA_PACKET){
+        b_handle_frame(channel, packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            for (i=1;i<=MAX_CHANNELS;i++){
+                rfcomm_register_service_internal(NULL, i, FRAME_LEN);
+            }
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_accept_connection_internal(READ_BT_16(packet, 9));
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            rfcomm_cids[channels_open++] = READ_BT_16(packet, 12);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    num_channels = scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(int));
+}
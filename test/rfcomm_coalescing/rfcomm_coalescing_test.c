@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// RFCOMM write coalescing test: device A writes a byte stream in small chunks
+// to device B over the virtual controller, without coalescing, with frames
+// sent when full, and with frames sent by the delay timer while A trickles.
+// B checks the stream and counts the UIH frames received.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define SERVER_CHANNEL      1
+#define MAX_FRAME_LEN       1000
+#define MAX_WRITE_LEN       100
+
+typedef struct {
+    const char *  name;
+    int           coalescing;
+    uint16_t      delay_ms;         // timer for coalesced writes, 0 = only full frames and rfcomm_flush
+    uint16_t      write_len;
+    uint32_t      num_bytes;
+    uint16_t      write_interval_ms;// 0 = write as fast as possible
+    uint16_t      min_frame_fill;   // average bytes per frame received
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "no coalescing",  0,  0, 10, 50000,  0,  10 },
+    { "full frames",    1,  0, 10, 50000,  0, 900 },
+    { "mixed writes",   1,  5, 73, 50000,  0, 900 },
+    { "timer",          1, 20, 10,  2000,  1,  50 },
+};
+
+static const test_scenario_t * scenario;
+static uint8_t  tx_buffer[MAX_FRAME_LEN];
+
+static uint16_t rfcomm_cid;
+static uint16_t classic_handle;
+static uint32_t bytes_written;
+static uint32_t bytes_received;
+static uint32_t frames_received;
+static int      flushed;
+static int      data_ok;
+static int      result;
+
+static timer_source_t retry_timer;
+static timer_source_t write_timer;
+
+static void timeout_handler(void){
+    printf("rfcomm_coalescing_test: %s timeout, %u bytes written, %u received\n", scenario->name, bytes_written, bytes_received);
+}
+
+static uint8_t stream_byte(uint32_t pos){
+    return (uint8_t) (pos + (pos >> 8));
+}
+
+// Device A: write stream in small chunks
+
+static int a_write_chunk(void){
+    uint8_t chunk[MAX_WRITE_LEN];
+    uint16_t len = scenario->write_len;
+    int i;
+    if (len > scenario->num_bytes - bytes_written){
+        len = scenario->num_bytes - bytes_written;
+    }
+    for (i=0;i<len;i++){
+        chunk[i] = stream_byte(bytes_written + i);
+    }
+    int err = rfcomm_send_internal(rfcomm_cid, chunk, len);
+    if (err) return err;
+    bytes_written += len;
+    return 0;
+}
+
+static void a_write(void){
+    static int in_write;
+    // rfcomm_send_internal can emit RFCOMM_EVENT_CREDITS synchronously
+    if (in_write) return;
+    in_write = 1;
+    while (bytes_written < scenario->num_bytes && rfcomm_can_send_packet_now(rfcomm_cid)){
+        if (a_write_chunk()) break;
+    }
+    // without timer, last frame is sent explicitly
+    if (bytes_written == scenario->num_bytes && scenario->coalescing && !scenario->delay_ms && !flushed){
+        flushed = rfcomm_flush(rfcomm_cid) == 0;
+    }
+    in_write = 0;
+}
+
+static void a_write_timer_handler(timer_source_t * ts){
+    if (bytes_written >= scenario->num_bytes) return;
+    if (rfcomm_can_send_packet_now(rfcomm_cid)){
+        a_write_chunk();
+    }
+    run_loop_set_timer(&write_timer, scenario->write_interval_ms);
+    run_loop_add_timer(&write_timer);
+}
+
+// B received the complete stream
+static void a_done(void){
+    rfcomm_channel_statistics_t stats;
+    int ok = 1;
+    if (scenario->coalescing){
+        ok = rfcomm_get_channel_statistics(rfcomm_cid, &stats) == 0 && stats.coalesced_bytes == scenario->num_bytes;
+        if (ok){
+            printf("rfcomm_coalescing_test: %-14s %5u writes in %4u frames, average fill %u bytes\n", scenario->name,
+                stats.coalesced_writes, stats.coalesced_frames, stats.coalesced_bytes / stats.coalesced_frames);
+        }
+    }
+    result = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    gap_disconnect(classic_handle);
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, SERVER_CHANNEL);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        a_done();
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            rfcomm_cid = READ_BT_16(packet, 12);
+            if (scenario->coalescing){
+                rfcomm_enable_write_coalescing(rfcomm_cid, tx_buffer, sizeof(tx_buffer), scenario->delay_ms);
+            }
+            if (scenario->write_interval_ms){
+                run_loop_set_timer_handler(&write_timer, a_write_timer_handler);
+                a_write_timer_handler(&write_timer);
+                break;
+            }
+            a_write();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (rfcomm_cid && !scenario->write_interval_ms){
+                a_write();
+            }
+            break;
+        case RFCOMM_EVENT_CHANNEL_CLOSED:
+            rfcomm_cid = 0;
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(result);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: check stream and count frames, acknowledge complete stream
+
+static void b_done(void){
+    uint8_t ack = 0;
+    int ok = data_ok && bytes_received == scenario->num_bytes;
+    uint32_t fill = bytes_received / frames_received;
+    printf("rfcomm_coalescing_test: %-14s %5u bytes in %5u frames received, average %u bytes\n", scenario->name,
+        bytes_received, frames_received, fill);
+    if (fill < scenario->min_frame_fill) ok = 0;
+    if (!ok){
+        printf("rfcomm_coalescing_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    result = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (rfcomm_send_internal(rfcomm_cid, &ack, 1)){
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void b_handle_frame(uint8_t *packet, uint16_t size){
+    int i;
+    for (i=0;i<size;i++){
+        if (packet[i] != stream_byte(bytes_received + i)) data_ok = 0;
+    }
+    bytes_received += size;
+    frames_received++;
+    if (bytes_received >= scenario->num_bytes){
+        b_done();
+    }
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        b_handle_frame(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            rfcomm_register_service_internal(NULL, SERVER_CHANNEL, MAX_FRAME_LEN);
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_accept_connection_internal(READ_BT_16(packet, 9));
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            rfcomm_cid = READ_BT_16(packet, 12);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(result);
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    data_ok = 1;
+    result = EXIT_FAILURE;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
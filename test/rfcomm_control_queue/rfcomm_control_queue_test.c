@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+// *****************************************************************************
+//
+// RFCOMM control queue test: devices A and B stream frames over a single
+// channel while also sending modem status commands. Credits, modem status
+// commands and responses are queued while the ACL buffers are busy and must
+// all be delivered, and data must not overtake them.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define SERVER_CHANNEL      1
+#define MAX_FRAME_LEN       1000
+#define FRAME_LEN           200
+#define MSC_INTERVAL        50      // frames between modem status commands
+
+// modem status: ea, rtc, rtr, dv - with IC set for the done marker
+#define MODEM_STATUS_TICK   0x8d
+#define MODEM_STATUS_DONE   0xcd
+
+typedef struct {
+    const char *  name;
+    uint32_t      frames_a;     // sent by A
+    uint32_t      frames_b;     // sent by B
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "one-way",   5000,    0 },
+    { "both-ways", 3000, 3000 },
+};
+
+static const test_scenario_t * scenario;
+static const char * device_name;
+static uint16_t rfcomm_cid;
+static uint16_t classic_handle;
+static uint32_t frames_to_send;
+static uint32_t frames_to_receive;
+static uint32_t frames_sent;
+static uint32_t frames_received;
+static uint32_t msc_sent;
+static uint32_t msc_received;
+static int      msc_pending;
+static int      done_received;
+static int      done_sent;
+static int      data_ok;
+static int      stats_ok;
+static rfcomm_multiplexer_statistics_t stats;
+static uint8_t  frame[FRAME_LEN];
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("rfcomm_control_queue_test: %s %s timeout, %u frames sent, %u received, %u status sent, %u received\n",
+        scenario->name, device_name, frames_sent, frames_received, msc_sent, msc_received);
+}
+
+// Common: frames with modem status commands in between, checked in order
+
+static int transfer_complete(void){
+    return frames_sent == frames_to_send && !msc_pending && frames_received == frames_to_receive
+        && msc_received == frames_to_receive / MSC_INTERVAL;
+}
+
+static void send_frames(void){
+    static int in_send;
+    int i;
+    // rfcomm_send_internal can emit RFCOMM_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (frames_sent < frames_to_send || msc_pending){
+        if (msc_pending){
+            // accepted while ACL buffers are busy unless control queue is full
+            if (rfcomm_send_modem_status(rfcomm_cid, MODEM_STATUS_TICK)) break;
+            msc_pending = 0;
+            msc_sent++;
+            continue;
+        }
+        if (!rfcomm_can_send_packet_now(rfcomm_cid)) break;
+        bt_store_32(frame, 0, frames_sent);
+        for (i=4;i<FRAME_LEN;i++){
+            frame[i] = frames_sent + i;
+        }
+        if (rfcomm_send_internal(rfcomm_cid, frame, FRAME_LEN)) break;
+        frames_sent++;
+        if (frames_sent % MSC_INTERVAL == 0){
+            msc_pending = 1;
+        }
+    }
+    in_send = 0;
+}
+
+static void handle_frame(uint8_t *packet, uint16_t size){
+    int i;
+    uint32_t index = READ_BT_32(packet, 0);
+    if (size != FRAME_LEN || index != frames_received) data_ok = 0;
+    for (i=4;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    frames_received++;
+}
+
+static void handle_modem_status(uint8_t modem_status){
+    switch (modem_status){
+        case MODEM_STATUS_TICK:
+            // initial status sent during channel setup is not counted
+            if (!frames_received) break;
+            // status must not be overtaken by the frame after it
+            if (frames_received % MSC_INTERVAL) data_ok = 0;
+            msc_received++;
+            break;
+        case MODEM_STATUS_DONE:
+            done_received = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+static void read_statistics(void){
+    // channel and multiplexer are gone after disconnect
+    stats_ok = rfcomm_get_multiplexer_statistics(rfcomm_cid, &stats) == 0;
+    printf("rfcomm_control_queue_test: %-9s %s %5u frames sent, %5u received, %3u status sent, %3u received, %4u control frames queued, max %u, %4u data frames deferred\n",
+        scenario->name, device_name, frames_sent, frames_received, msc_sent, msc_received,
+        stats.control_frames_queued, stats.control_queue_max, stats.data_frames_deferred);
+}
+
+static int check_done(void){
+    int ok = data_ok && stats_ok && transfer_complete();
+    ok = ok && stats.control_queue_max <= RFCOMM_CONTROL_QUEUE_SIZE;
+    if (!ok){
+        printf("rfcomm_control_queue_test: %s %s failed, data %s\n", scenario->name, device_name, data_ok ? "ok" : "corrupted");
+    }
+    return ok;
+}
+
+// Device A: connect to B, tell B when all data has been exchanged
+
+static void a_check_done(void){
+    if (done_sent || !transfer_complete()) return;
+    // sending can emit events that lead back here
+    done_sent = 1;
+    read_statistics();
+    if (rfcomm_send_modem_status(rfcomm_cid, MODEM_STATUS_DONE) == 0) return;
+    printf("rfcomm_control_queue_test: %s %s done status refused\n", scenario->name, device_name);
+    exit(EXIT_FAILURE);
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, SERVER_CHANNEL);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        handle_frame(packet, size);
+        a_check_done();
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            rfcomm_cid = READ_BT_16(packet, 12);
+            send_frames();
+            a_check_done();
+            break;
+        case RFCOMM_EVENT_REMOTE_MODEM_STATUS:
+            handle_modem_status(packet[2]);
+            a_check_done();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (!rfcomm_cid) break;
+            send_frames();
+            a_check_done();
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(check_done() ? EXIT_SUCCESS : EXIT_FAILURE);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: accept connection, disconnect after A is done
+
+static void b_check_done(void){
+    static int disconnecting;
+    if (disconnecting || !done_received || !transfer_complete()) return;
+    disconnecting = 1;
+    read_statistics();
+    gap_disconnect(classic_handle);
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        handle_frame(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            rfcomm_register_service_internal(NULL, SERVER_CHANNEL, MAX_FRAME_LEN);
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_cid = READ_BT_16(packet, 9);
+            rfcomm_accept_connection_internal(rfcomm_cid);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            send_frames();
+            break;
+        case RFCOMM_EVENT_REMOTE_MODEM_STATUS:
+            handle_modem_status(packet[2]);
+            b_check_done();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (!rfcomm_cid) break;
+            send_frames();
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(check_done() ? EXIT_SUCCESS : EXIT_FAILURE);
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static void a_setup(void){
+    device_name       = "A";
+    frames_to_send    = scenario->frames_a;
+    frames_to_receive = scenario->frames_b;
+}
+
+static void b_setup(void){
+    device_name       = "B";
+    frames_to_send    = scenario->frames_b;
+    frames_to_receive = scenario->frames_a;
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, a_setup, 0 },
+    /* .b               = */ { b_packet_handler, b_setup, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
@@ -0,0 +1,8 @@
+// Configuration for RFCOMM credits test
+
+#define ENABLE_LOG_INFO
+#define MAX_NO_L2CAP_CHANNELS  2
+#define MAX_NO_RFCOMM_SERVICES 4
+#define MAX_NO_RFCOMM_CHANNELS 4
+
+#include "virtual_link_test_config.h"
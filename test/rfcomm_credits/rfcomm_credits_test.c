@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+ 
+// *****************************************************************************
+//
+// RFCOMM credits test: device A streams frames to device B over the virtual
+// controller on one or more RFCOMM channels sharing a multiplexer. A must be
+// granted several packets per RFCOMM_EVENT_CREDITS, and B must grow the
+// incoming credit window for the fast stream, limited by the frame size.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define MAX_CHANNELS        MAX_NO_RFCOMM_CHANNELS
+#define MAX_FRAME_LEN       1000
+#define DEFAULT_CREDITS     10
+
+typedef struct {
+    const char *  name;
+    int           num_channels;
+    uint16_t      frame_len;
+    uint16_t      num_frames;       // per channel
+    uint8_t       acl_packets;      // controller ACL buffers and L2CAP max credits
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "1 channel",      1, 1000, 5000,  8 },
+    { "2 channels",     2, 1000, 2500,  8 },
+    { "small frames",   1,  100, 5000,  8 },
+    { "deep buffers",   1, 1000, 5000, 32 },
+};
+
+static const test_scenario_t * scenario;
+static uint8_t  frame[MAX_FRAME_LEN];
+
+static uint16_t rfcomm_cids[MAX_CHANNELS];
+static int      frames_sent[MAX_CHANNELS];
+static int      frames_received[MAX_CHANNELS];
+static int      channels_open;
+static int      channels_done;
+static uint16_t classic_handle;
+static int      credit_events;
+static int      credits_max;
+static int      data_ok;
+static int      result;
+static struct timeval first_rx;
+static struct timeval last_rx;
+
+static timer_source_t retry_timer;
+
+static void timeout_handler(void){
+    printf("rfcomm_credits_test: %s timeout, %u channels open, %u frames received on first channel\n",
+        scenario->name, channels_open, frames_received[0]);
+}
+
+static int channel_index(uint16_t rfcomm_cid){
+    int i;
+    for (i=0;i<scenario->num_channels;i++){
+        if (rfcomm_cids[i] == rfcomm_cid) return i;
+    }
+    return -1;
+}
+
+// Device A: open channels to B and stream frames on all of them
+
+static void a_send_frames(void){
+    static int in_send;
+    int i, j;
+    // rfcomm_send_internal can emit RFCOMM_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    for (i=0;i<channels_open;i++){
+        while (frames_sent[i] < scenario->num_frames && rfcomm_can_send_packet_now(rfcomm_cids[i])){
+            bt_store_16(frame, 0, frames_sent[i]);
+            for (j=2;j<scenario->frame_len;j++){
+                frame[j] = frames_sent[i] + j;
+            }
+            if (rfcomm_send_internal(rfcomm_cids[i], frame, scenario->frame_len)) break;
+            frames_sent[i]++;
+        }
+    }
+    in_send = 0;
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, channels_open + 1);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            rfcomm_cids[channels_open++] = READ_BT_16(packet, 12);
+            if (channels_open < scenario->num_channels){
+                a_connect(NULL);
+                break;
+            }
+            a_send_frames();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+            credit_events++;
+            if (packet[4] > credits_max){
+                credits_max = packet[4];
+            }
+            /* fall through */
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (channels_open == scenario->num_channels){
+                a_send_frames();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            printf("rfcomm_credits_test: %-14s %5u credit events, max %u credits\n", scenario->name, credit_events, credits_max);
+            if (credits_max < 2){
+                printf("rfcomm_credits_test: %s failed, single credits only\n", scenario->name);
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: receive frames, check order and content, report incoming window
+
+static void b_done(void){
+    int ok = data_ok && channels_done == scenario->num_channels;
+    rfcomm_channel_statistics_t stats;
+    int i;
+    uint32_t ms = (last_rx.tv_sec - first_rx.tv_sec) * 1000 + (last_rx.tv_usec - first_rx.tv_usec) / 1000;
+    uint32_t bytes = channels_done * scenario->num_frames * scenario->frame_len;
+    if (!ms) ms = 1;
+    printf("rfcomm_credits_test: %-14s %7u bytes in %5u ms, %8u bytes/s\n", scenario->name,
+        bytes, ms, (uint32_t) ((uint64_t) bytes * 1000 / ms));
+    for (i=0;i<scenario->num_channels;i++){
+        if (rfcomm_get_channel_statistics(rfcomm_cids[i], &stats)){
+            ok = 0;
+            continue;
+        }
+        printf("rfcomm_credits_test: %-14s channel %u: %5u stalls, incoming window %u, max %u\n", scenario->name,
+            i, stats.incoming_stalls, stats.incoming_window, stats.incoming_window_max);
+        if (stats.incoming_window_max <= DEFAULT_CREDITS) ok = 0;
+    }
+    if (!ok){
+        printf("rfcomm_credits_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    result = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    gap_disconnect(classic_handle);
+}
+
+static void b_handle_frame(uint16_t rfcomm_cid, uint8_t *packet, uint16_t size){
+    int i;
+    int index = channel_index(rfcomm_cid);
+    if (index < 0){
+        data_ok = 0;
+        return;
+    }
+    if (!frames_received[0] && !frames_received[index]){
+        gettimeofday(&first_rx, NULL);
+    }
+    gettimeofday(&last_rx, NULL);
+    uint16_t nr = READ_BT_16(packet, 0);
+    if (size != scenario->frame_len) data_ok = 0;
+    for (i=2;i<size;i++){
+        if (packet[i] != (uint8_t)(nr + i)) data_ok = 0;
+    }
+    if (nr != frames_received[index]){
+        printf("rfcomm_credits_test: %s frame %u received on channel %u, expected %u\n", scenario->name, nr, index, frames_received[index]);
+        data_ok = 0;
+    }
+    frames_received[index]++;
+    if (frames_received[index] < scenario->num_frames) return;
+    channels_done++;
+    if (channels_done < scenario->num_channels) return;
+    b_done();
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    int i;
+    if (packet_type == RFCOMM_DATA_PACKET){
+        b_handle_frame(channel, packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            for (i=0;i<scenario->num_channels;i++){
+                rfcomm_register_service_internal(NULL, i + 1, scenario->frame_len);
+            }
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_cids[packet[8] - 1] = READ_BT_16(packet, 9);
+            rfcomm_accept_connection_internal(READ_BT_16(packet, 9));
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(result);
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    l2cap_set_max_credits(scenario->acl_packets);
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    hci_virtual_config_t config_a;
+    hci_virtual_config_t config_b;
+    memset(&config_a, 0, sizeof(config_a));
+    memset(&config_b, 0, sizeof(config_b));
+    config_a.acl_num_packets = scenarios[i].acl_packets;
+    config_b.acl_num_packets = scenarios[i].acl_packets;
+    scenario = &scenarios[i];
+    data_ok = 1;
+    result = EXIT_FAILURE;
+    return virtual_link_test_run(&test, &config_a, &config_b);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
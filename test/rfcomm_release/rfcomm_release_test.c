@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+// *****************************************************************************
+//
+// RFCOMM frame release test: device A sends frames as fast as credits allow,
+// B processes each frame in place and releases it either right away or later
+// from a timer. Credits must only be returned for released frames, in
+// batches, and A must still be able to send all frames.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define SERVER_CHANNEL      1
+#define MAX_FRAME_LEN       1000
+#define FRAME_LEN           200
+
+typedef struct {
+    const char *  name;
+    uint8_t       release_batch;
+    uint16_t      release_interval_ms;  // 0 = release in packet handler
+    uint32_t      num_frames;
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "single",   1, 0, 5000 },
+    { "batch",    5, 0, 5000 },
+    { "deferred", 5, 1, 2000 },
+};
+
+static const test_scenario_t * scenario;
+static uint16_t rfcomm_cid;
+static uint16_t classic_handle;
+static uint32_t frames_sent;
+static uint32_t frames_received;
+static uint32_t frames_held;
+static uint8_t  frame[FRAME_LEN];
+static int      data_ok;
+static int      stats_ok;
+static rfcomm_channel_statistics_t stats;
+
+static timer_source_t retry_timer;
+static timer_source_t release_timer;
+
+static void timeout_handler(void){
+    printf("rfcomm_release_test: %s timeout, %u frames sent, %u received\n", scenario->name, frames_sent, frames_received);
+}
+
+// Device A: send frames while credits are available
+
+static void a_send_frames(void){
+    static int in_send;
+    int i;
+    // rfcomm_send_internal can emit RFCOMM_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (frames_sent < scenario->num_frames && rfcomm_can_send_packet_now(rfcomm_cid)){
+        bt_store_32(frame, 0, frames_sent);
+        for (i=4;i<FRAME_LEN;i++){
+            frame[i] = frames_sent + i;
+        }
+        if (rfcomm_send_internal(rfcomm_cid, frame, FRAME_LEN)) break;
+        frames_sent++;
+    }
+    in_send = 0;
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, SERVER_CHANNEL);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            rfcomm_cid = READ_BT_16(packet, 12);
+            a_send_frames();
+            break;
+        case RFCOMM_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (rfcomm_cid && frames_sent < scenario->num_frames){
+                a_send_frames();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: check frames in place, release them now or from timer
+
+static void b_done(void){
+    int ok = data_ok && frames_received == scenario->num_frames && stats_ok;
+    ok = ok && stats.frames_released == scenario->num_frames;
+    // one more for the initial credits
+    ok = ok && stats.credit_frames_sent <= scenario->num_frames / scenario->release_batch + 1;
+    printf("rfcomm_release_test: %-8s %5u frames received, %5u released, %5u credit frames, %3u stalls\n", scenario->name,
+        frames_received, stats.frames_released, stats.credit_frames_sent, stats.incoming_stalls);
+    if (!ok){
+        printf("rfcomm_release_test: %s failed, data %s\n", scenario->name, data_ok ? "ok" : "corrupted");
+    }
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void b_release(void){
+    rfcomm_release_frames(rfcomm_cid, frames_held);
+    frames_held = 0;
+    if (frames_received == scenario->num_frames){
+        // channel is gone after disconnect
+        stats_ok = rfcomm_get_channel_statistics(rfcomm_cid, &stats) == 0;
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void b_release_timer_handler(timer_source_t * ts){
+    b_release();
+    if (frames_received == scenario->num_frames) return;
+    run_loop_set_timer(&release_timer, scenario->release_interval_ms);
+    run_loop_add_timer(&release_timer);
+}
+
+static void b_handle_frame(uint8_t *packet, uint16_t size){
+    int i;
+    uint32_t index = READ_BT_32(packet, 0);
+    if (size != FRAME_LEN || index != frames_received) data_ok = 0;
+    for (i=4;i<size;i++){
+        if (packet[i] != (uint8_t)(index + i)) data_ok = 0;
+    }
+    frames_received++;
+    frames_held++;
+    if (scenario->release_interval_ms) return;
+    b_release();
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        b_handle_frame(packet, size);
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            rfcomm_register_service_internal(NULL, SERVER_CHANNEL, MAX_FRAME_LEN);
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_cid = READ_BT_16(packet, 9);
+            rfcomm_enable_frame_release(rfcomm_cid, scenario->release_batch);
+            rfcomm_accept_connection_internal(rfcomm_cid);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            if (scenario->release_interval_ms){
+                run_loop_set_timer_handler(&release_timer, b_release_timer_handler);
+                run_loop_set_timer(&release_timer, scenario->release_interval_ms);
+                run_loop_add_timer(&release_timer);
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            b_done();
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    data_ok = 1;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
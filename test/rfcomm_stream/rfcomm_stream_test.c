@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+// *****************************************************************************
+//
+// RFCOMM stream test: device A writes a byte stream into the TX ring of a
+// stream channel, B stores it in a small RX ring and reads it either right
+// away or slowly from a timer. B must receive the complete stream without
+// RX ring overflow, as credits are only provided for free ring space. B
+// acknowledges the stream, or A disconnects right after the last write.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "virtual_link_test.h"
+
+#define TEST_TIMEOUT_MS     20000
+#define RETRY_INTERVAL_MS   100
+#define SERVER_CHANNEL      1
+#define MAX_FRAME_LEN       1000
+#define MAX_RING_LEN        4096
+#define MAX_CHUNK_LEN       500
+
+typedef struct {
+    const char *  name;
+    uint16_t      tx_size;
+    uint16_t      rx_size;
+    uint16_t      write_len;
+    uint16_t      read_len;
+    uint16_t      read_interval_ms; // 0 = read on RFCOMM_EVENT_STREAM_DATA_AVAILABLE
+    uint32_t      num_bytes;
+    int           disconnect;       // A disconnects after last write instead of waiting for ack
+} test_scenario_t;
+
+static const test_scenario_t scenarios[] = {
+    { "fast reader",  4096, 4000, 100, 500,  0, 200000, 0 },
+    { "slow reader",  2048, 2000, 333, 100,  1,  50000, 0 },
+    { "single frame",  100, 1000,  64,  64,  0,  50000, 0 },
+    { "disconnect",   4096, 2000, 100, 100,  0,  20000, 1 },
+};
+
+static const test_scenario_t * scenario;
+static uint8_t  tx_ring[MAX_RING_LEN];
+static uint8_t  rx_ring[MAX_RING_LEN];
+
+static uint16_t rfcomm_cid;
+static uint16_t classic_handle;
+static uint32_t bytes_written;
+static uint32_t bytes_received;
+static uint32_t short_writes;
+static uint32_t start_ms;
+static int      data_ok;
+static int      result;
+
+static timer_source_t retry_timer;
+static timer_source_t read_timer;
+
+static void timeout_handler(void){
+    printf("rfcomm_stream_test: %s timeout, %u bytes written, %u received\n", scenario->name, bytes_written, bytes_received);
+}
+
+static uint8_t stream_byte(uint32_t pos){
+    return (uint8_t) (pos + (pos >> 8));
+}
+
+// Device A: write stream until TX ring is full, continue on RFCOMM_EVENT_STREAM_CAN_WRITE
+
+static void a_write(void){
+    uint8_t chunk[MAX_CHUNK_LEN];
+    int i;
+    while (bytes_written < scenario->num_bytes){
+        uint16_t len = scenario->write_len;
+        if (len > scenario->num_bytes - bytes_written){
+            len = scenario->num_bytes - bytes_written;
+        }
+        for (i=0;i<len;i++){
+            chunk[i] = stream_byte(bytes_written + i);
+        }
+        uint16_t written = rfcomm_stream_write(rfcomm_cid, chunk, len);
+        bytes_written += written;
+        if (written < len) {
+            short_writes++;
+            return;
+        }
+    }
+    // remaining data in tx ring is sent before DISC
+    if (scenario->disconnect && rfcomm_cid){
+        rfcomm_disconnect_internal(rfcomm_cid);
+        rfcomm_cid = 0;
+    }
+}
+
+// B received the complete stream
+static void a_done(void){
+    rfcomm_channel_statistics_t stats;
+    int ok = rfcomm_get_channel_statistics(rfcomm_cid, &stats) == 0 && stats.stream_bytes_sent == scenario->num_bytes;
+    if (ok){
+        printf("rfcomm_stream_test: %-12s %6u bytes in %4u frames, %5u short writes\n", scenario->name,
+            stats.stream_bytes_sent, stats.stream_frames_sent, short_writes);
+    }
+    result = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    gap_disconnect(classic_handle);
+}
+
+static void a_connect(timer_source_t * ts){
+    rfcomm_create_channel_internal(NULL, virtual_link_test_addr_b, SERVER_CHANNEL);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        a_done();
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            a_connect(NULL);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]){
+                // device B not connectable yet
+                run_loop_set_timer_handler(&retry_timer, a_connect);
+                run_loop_set_timer(&retry_timer, RETRY_INTERVAL_MS);
+                run_loop_add_timer(&retry_timer);
+                break;
+            }
+            classic_handle = READ_BT_16(packet, 9);
+            rfcomm_cid = READ_BT_16(packet, 12);
+            // stream out, acknowledge as packet
+            rfcomm_stream_enable(rfcomm_cid, tx_ring, scenario->tx_size, NULL, 0);
+            a_write();
+            break;
+        case RFCOMM_EVENT_STREAM_CAN_WRITE:
+            a_write();
+            break;
+        case RFCOMM_EVENT_CHANNEL_CLOSED:
+            if (!scenario->disconnect) break;
+            printf("rfcomm_stream_test: %-12s %6u bytes written, %5u short writes\n", scenario->name, bytes_written, short_writes);
+            result = bytes_written == scenario->num_bytes ? EXIT_SUCCESS : EXIT_FAILURE;
+            gap_disconnect(classic_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(result);
+            break;
+        default:
+            break;
+    }
+}
+
+// Device B: read stream from RX ring, acknowledge complete stream
+
+static void b_done(void){
+    rfcomm_channel_statistics_t stats;
+    uint8_t ack = 0;
+    uint32_t duration_ms = run_loop_get_time_ms() - start_ms;
+    if (!duration_ms) duration_ms = 1;
+    int ok = data_ok && bytes_received == scenario->num_bytes;
+    ok = ok && rfcomm_get_channel_statistics(rfcomm_cid, &stats) == 0 && stats.stream_rx_overflows == 0;
+    printf("rfcomm_stream_test: %-12s %6u bytes received in %4u ms, %u bytes/s, %u stalls\n", scenario->name,
+        bytes_received, duration_ms, (uint32_t) (bytes_received * 1000ULL / duration_ms), stats.incoming_stalls);
+    if (!ok){
+        printf("rfcomm_stream_test: %s failed, data %s, %u overflows\n", scenario->name, data_ok ? "ok" : "corrupted", stats.stream_rx_overflows);
+    }
+    result = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (scenario->disconnect) return;
+    if (rfcomm_send_internal(rfcomm_cid, &ack, 1)){
+        gap_disconnect(classic_handle);
+    }
+}
+
+static void b_read(void){
+    uint8_t chunk[MAX_CHUNK_LEN];
+    int i;
+    uint16_t len = rfcomm_stream_read(rfcomm_cid, chunk, scenario->read_len);
+    for (i=0;i<len;i++){
+        if (chunk[i] != stream_byte(bytes_received + i)) data_ok = 0;
+    }
+    bytes_received += len;
+    if (len && bytes_received >= scenario->num_bytes){
+        b_done();
+    }
+}
+
+static void b_read_timer_handler(timer_source_t * ts){
+    b_read();
+    if (bytes_received >= scenario->num_bytes) return;
+    run_loop_set_timer(&read_timer, scenario->read_interval_ms);
+    run_loop_add_timer(&read_timer);
+}
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type == RFCOMM_DATA_PACKET){
+        // stream channel doesn't deliver packets
+        data_ok = 0;
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            rfcomm_register_service_internal(NULL, SERVER_CHANNEL, MAX_FRAME_LEN);
+            hci_connectable_control(1);
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            // before channel setup, initial credits fit into rx ring
+            rfcomm_cid = READ_BT_16(packet, 9);
+            rfcomm_stream_enable(rfcomm_cid, NULL, 0, rx_ring, scenario->rx_size);
+            rfcomm_accept_connection_internal(rfcomm_cid);
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            classic_handle = READ_BT_16(packet, 9);
+            start_ms = run_loop_get_time_ms();
+            if (scenario->read_interval_ms){
+                run_loop_set_timer_handler(&read_timer, b_read_timer_handler);
+                b_read_timer_handler(&read_timer);
+            }
+            break;
+        case RFCOMM_EVENT_STREAM_DATA_AVAILABLE:
+            if (scenario->read_interval_ms) break;
+            while (rfcomm_stream_available(rfcomm_cid) && bytes_received < scenario->num_bytes){
+                b_read();
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            exit(result);
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_init(void){
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(virtual_link_test_packet_handler);
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, NULL, 0 },
+    /* .b               = */ { b_packet_handler, NULL, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ stack_init,
+};
+
+static int run_scenario(int i){
+    scenario = &scenarios[i];
+    data_ok = 1;
+    result = EXIT_FAILURE;
+    return virtual_link_test_run(&test, NULL, NULL);
+}
+
+int main(int argc, const char * argv[]){
+    return virtual_link_test_run_scenarios(run_scenario, sizeof(scenarios)/sizeof(test_scenario_t));
+}
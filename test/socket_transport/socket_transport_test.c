@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+// *****************************************************************************
+//
+// Socket transport test: hci_transport_socket connects to a minimal
+// controller emulator running in the same run loop, once via a UNIX domain
+// socket and once via TCP. The emulator answers HCI Reset and echoes ACL
+// packets in small writes that don't match packet boundaries. Finally, the
+// emulator closes the connection and the host expects a Hardware Error event.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "hci_transport.h"
+
+#define NUM_PACKETS          5000
+#define ACL_PAYLOAD_LEN      48
+#define WINDOW_SIZE          8
+#define PEER_WRITE_SIZE      37
+#define TEST_TIMEOUT_MS      10000
+
+#define OPCODE_PEER_CLOSE    0xfc00
+
+// host
+static hci_transport_t * transport;
+static uint8_t  acl_packet[HCI_ACL_HEADER_SIZE + ACL_PAYLOAD_LEN];
+static int      packets_sent;
+static int      packets_received;
+static int      reset_complete;
+static int      errors;
+static struct timeval start_tv;
+
+// peer emulator
+static int      peer_listen_fd;
+static int      peer_fd = -1;
+static data_source_t peer_listen_ds;
+static data_source_t peer_ds;
+static uint8_t  peer_rx_buffer[4096];
+static int      peer_rx_len;
+
+static timer_source_t timeout_timer;
+
+static void peer_write(const uint8_t * data, int size){
+    // small writes to split packets
+    while (size){
+        int len = size < PEER_WRITE_SIZE ? size : PEER_WRITE_SIZE;
+        if (write(peer_fd, data, len) != len){
+            printf("peer: write failed\n");
+            errors++;
+            return;
+        }
+        data += len;
+        size -= len;
+    }
+}
+
+static void peer_handle_packet(uint8_t * packet, int size){
+    uint8_t command_complete[] = { HCI_EVENT_PACKET, HCI_EVENT_COMMAND_COMPLETE, 4, 1, 0, 0, 0};
+    uint8_t empty_acl[] = { HCI_ACL_DATA_PACKET, 0x01, 0x20, 0x00, 0x00 };
+    switch (packet[0]){
+        case HCI_COMMAND_DATA_PACKET:
+            if (READ_BT_16(packet, 1) == OPCODE_PEER_CLOSE){
+                run_loop_remove_data_source(&peer_ds);
+                close(peer_fd);
+                peer_fd = -1;
+                return;
+            }
+            // command complete followed by an ACL packet without payload
+            bt_store_16(command_complete, 4, READ_BT_16(packet, 1));
+            peer_write(command_complete, sizeof(command_complete));
+            peer_write(empty_acl, sizeof(empty_acl));
+            break;
+        case HCI_ACL_DATA_PACKET:
+            // echo
+            peer_write(packet, size);
+            break;
+        default:
+            errors++;
+            break;
+    }
+}
+
+static int peer_process(data_source_t * ds){
+    int bytes_read = read(peer_fd, &peer_rx_buffer[peer_rx_len], sizeof(peer_rx_buffer) - peer_rx_len);
+    if (bytes_read <= 0) return 0;
+    peer_rx_len += bytes_read;
+    int pos = 0;
+    while (peer_fd >= 0 && pos < peer_rx_len){
+        int header_len;
+        int size;
+        switch (peer_rx_buffer[pos]){
+            case HCI_COMMAND_DATA_PACKET:
+                header_len = 1 + HCI_CMD_HEADER_SIZE;
+                break;
+            case HCI_ACL_DATA_PACKET:
+                header_len = 1 + HCI_ACL_HEADER_SIZE;
+                break;
+            default:
+                printf("peer: invalid packet type %u\n", peer_rx_buffer[pos]);
+                exit(1);
+        }
+        if (pos + header_len > peer_rx_len) break;
+        if (peer_rx_buffer[pos] == HCI_COMMAND_DATA_PACKET){
+            size = header_len + peer_rx_buffer[pos + 3];
+        } else {
+            size = header_len + READ_BT_16(peer_rx_buffer, pos + 3);
+        }
+        if (pos + size > peer_rx_len) break;
+        peer_handle_packet(&peer_rx_buffer[pos], size);
+        pos += size;
+    }
+    memmove(peer_rx_buffer, &peer_rx_buffer[pos], peer_rx_len - pos);
+    peer_rx_len -= pos;
+    return 0;
+}
+
+static int peer_accept(data_source_t * ds){
+    peer_fd = accept(peer_listen_fd, NULL, NULL);
+    if (peer_fd < 0) return 0;
+    run_loop_remove_data_source(&peer_listen_ds);
+    close(peer_listen_fd);
+    // fails without effect for UNIX domain sockets
+    int on = 1;
+    setsockopt(peer_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    peer_ds.fd = peer_fd;
+    run_loop_set_data_source_handler(&peer_ds, &peer_process);
+    run_loop_add_data_source(&peer_ds);
+    return 0;
+}
+
+// host
+
+static void host_report(const char * mode){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint32_t ms = (now.tv_sec - start_tv.tv_sec) * 1000 + (now.tv_usec - start_tv.tv_usec) / 1000;
+    if (ms == 0) ms = 1;
+    uint32_t bytes = packets_received * sizeof(acl_packet);
+    printf("%-4s: %u packets echoed, %7u bytes in %5u ms, %8u bytes/s, errors %u\n",
+        mode, packets_received, bytes, ms, bytes * 1000 / ms, errors);
+    exit(packets_received == NUM_PACKETS && errors == 0 ? 0 : 1);
+}
+
+static const char * mode_name;
+
+static void host_send(void){
+    while (packets_sent < NUM_PACKETS && packets_sent - packets_received < WINDOW_SIZE
+        && transport->can_send_packet_now(HCI_ACL_DATA_PACKET)){
+        int i;
+        bt_store_16(acl_packet, 0, 0x2001);
+        bt_store_16(acl_packet, 2, ACL_PAYLOAD_LEN);
+        for (i = 4; i < sizeof(acl_packet); i++){
+            acl_packet[i] = (uint8_t) (packets_sent + i);
+        }
+        transport->send_packet(HCI_ACL_DATA_PACKET, acl_packet, sizeof(acl_packet));
+        packets_sent++;
+    }
+}
+
+static void host_packet_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+    int i;
+    uint8_t close_command[] = { 0x00, 0xfc, 0x00 };
+    if (packet_type == HCI_EVENT_PACKET){
+        switch (packet[0]){
+            case HCI_EVENT_COMMAND_COMPLETE:
+                if (READ_BT_16(packet, 3) != 0x0c03) errors++;
+                break;
+            case HCI_EVENT_HARDWARE_ERROR:
+                host_report(mode_name);
+                break;
+            case DAEMON_EVENT_HCI_PACKET_SENT:
+                break;
+            default:
+                errors++;
+                break;
+        }
+    }
+    if (packet_type == HCI_ACL_DATA_PACKET){
+        if (!reset_complete){
+            // empty packet after command complete
+            if (size != HCI_ACL_HEADER_SIZE) errors++;
+            reset_complete = 1;
+            gettimeofday(&start_tv, NULL);
+        } else {
+            if (size != sizeof(acl_packet)) errors++;
+            for (i = 4; i < size; i++){
+                if (packet[i] != (uint8_t) (packets_received + i)) {
+                    errors++;
+                    break;
+                }
+            }
+            packets_received++;
+            if (packets_received == NUM_PACKETS){
+                transport->send_packet(HCI_COMMAND_DATA_PACKET, close_command, sizeof(close_command));
+                return;
+            }
+        }
+    }
+    if (reset_complete){
+        host_send();
+    }
+}
+
+static void timeout_handler(timer_source_t * ts){
+    printf("timeout: ");
+    host_report(mode_name);
+}
+
+static int peer_listen(int use_tcp, hci_socket_config_t * config){
+    static char path[64];
+    if (use_tcp){
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        peer_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(peer_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+        if (getsockname(peer_listen_fd, (struct sockaddr *) &addr, &addr_len) < 0) return -1;
+        config->path = NULL;
+        config->host = "127.0.0.1";
+        config->port = ntohs(addr.sin_port);
+    } else {
+        struct sockaddr_un addr;
+        snprintf(path, sizeof(path), "/tmp/btstack_socket_test_%u", getpid());
+        unlink(path);
+        peer_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if (bind(peer_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+        config->path = path;
+    }
+    if (listen(peer_listen_fd, 1) < 0) return -1;
+    peer_listen_ds.fd = peer_listen_fd;
+    run_loop_set_data_source_handler(&peer_listen_ds, &peer_accept);
+    run_loop_add_data_source(&peer_listen_ds);
+    return 0;
+}
+
+static int run_test(int use_tcp){
+    hci_socket_config_t config;
+    uint8_t reset_command[] = { 0x03, 0x0c, 0x00 };
+
+    mode_name = use_tcp ? "TCP" : "UNIX";
+    run_loop_init(RUN_LOOP_POSIX);
+
+    if (peer_listen(use_tcp, &config)){
+        printf("could not create %s socket\n", mode_name);
+        return 1;
+    }
+
+    transport = hci_transport_socket_instance();
+    transport->register_packet_handler(&host_packet_handler);
+    if (transport->open(&config)){
+        printf("could not connect via %s\n", mode_name);
+        return 1;
+    }
+    if (config.path){
+        unlink(config.path);
+    }
+    transport->send_packet(HCI_COMMAND_DATA_PACKET, reset_command, sizeof(reset_command));
+
+    run_loop_set_timer_handler(&timeout_timer, &timeout_handler);
+    run_loop_set_timer(&timeout_timer, TEST_TIMEOUT_MS);
+    run_loop_add_timer(&timeout_timer);
+
+    run_loop_execute();
+    return 0;
+}
+
+// run each configuration in a child process as the run loop doesn't return
+static int fork_test(int use_tcp){
+    pid_t pid = fork();
+    if (pid == 0){
+        exit(run_test(use_tcp));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, const char * argv[]){
+    int failures = 0;
+    setvbuf(stdout, NULL, _IONBF, 0);
+    failures += fork_test(0);
+    failures += fork_test(1);
+    printf("%u failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2014 BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY BLUEKITCHEN GMBH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at 
+ * contact@bluekitchen-gmbh.com
+ *
+ */
+ 
+ 
+// *****************************************************************************
+//
+// Virtual controller test: two complete BTstack stacks, each in its own
+// process, are linked via hci_transport_virtual_link(). Device A checks
+// LE Rand/LE Encrypt, discovers device B via inquiry, opens an L2CAP channel
+// (incl. Just Works pairing), streams data to B, and finally connects to
+// B via LE after scanning for its advertisements.
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "gap_le.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "virtual_link_test.h"
+
+#define TEST_PSM            0x1001
+#define NUM_PACKETS         2000
+#define PACKET_LEN          40
+#define TEST_TIMEOUT_MS     10000
+#define INQUIRY_ROUNDS_MAX  5
+
+// FIPS-197, Appendix C.1
+static const uint8_t aes_key[16]        = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const uint8_t aes_plaintext[16]  = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+static const uint8_t aes_ciphertext[16] = { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+
+static uint8_t adv_data[] = { 0x02, 0x01, 0x06, 0x08, 0x09, 'v', 'i', 'r', 't', 'u', 'a', 'l' };
+
+typedef enum {
+    A_W4_WORKING,
+    A_W4_RAND,
+    A_W4_ENCRYPT,
+    A_W4_INQUIRY_COMPLETE,
+    A_W4_CHANNEL_OPENED,
+    A_SENDING,
+    A_W4_CHANNEL_CLOSED,
+    A_W4_CLASSIC_DISCONNECTED,
+    A_W4_ADVERTISEMENT,
+    A_W4_LE_CONNECTED,
+    A_W4_LE_DISCONNECTED,
+} state_a_t;
+
+static state_a_t state_a;
+static int      inquiry_found_b;
+static int      inquiry_rounds;
+static uint16_t local_cid;
+static uint16_t classic_handle;
+static uint16_t le_handle;
+static int      packets_sent;
+static int      packets_received;
+static int      data_ok = 1;
+static uint8_t  packet[PACKET_LEN];
+static struct timeval stream_start;
+
+static void fail(const char * reason){
+    printf("virtual_controller: FAILED - %s\n", reason);
+    exit(EXIT_FAILURE);
+}
+
+static void timeout_handler(void){
+    fail("timeout");
+}
+
+//
+// Device B: discoverable, connectable, L2CAP service, advertising
+//
+
+static void b_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    int i;
+    if (packet_type == L2CAP_DATA_PACKET){
+        if (size != PACKET_LEN) data_ok = 0;
+        for (i=0;i<size;i++){
+            if (packet[i] != (uint8_t)(packets_received + i)) data_ok = 0;
+        }
+        packets_received++;
+        return;
+    }
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            l2cap_register_service_internal(NULL, b_packet_handler, TEST_PSM, 100, LEVEL_0);
+            hci_discoverable_control(1);
+            hci_connectable_control(1);
+            hci_le_advertisements_set_params(0x0030, 0x0030, 0, 0, 0, virtual_link_test_addr_a, 0x07, 0);
+            gap_advertisements_set_data(sizeof(adv_data), adv_data);
+            gap_advertisements_enable(1);
+            break;
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            if (packets_received != NUM_PACKETS || !data_ok){
+                printf("device B: received %u of %u packets, data %s\n", packets_received, NUM_PACKETS, data_ok ? "ok" : "corrupted");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            if (READ_BT_16(packet, 3) != le_handle) break;
+            exit(packets_received == NUM_PACKETS && data_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+            break;
+        case HCI_EVENT_LE_META:
+            if (packet[2] != HCI_SUBEVENT_LE_CONNECTION_COMPLETE) break;
+            if (packet[3]) break;
+            le_handle = READ_BT_16(packet, 4);
+            break;
+        default:
+            break;
+    }
+}
+
+static void b_setup(void){
+    le_handle = 0xffff;
+}
+
+//
+// Device A: test driver
+//
+
+static void a_send_packets(void){
+    static int in_send;
+    int i;
+    // l2cap_send_internal can emit L2CAP_EVENT_CREDITS synchronously
+    if (in_send) return;
+    in_send = 1;
+    while (packets_sent < NUM_PACKETS && l2cap_can_send_packet_now(local_cid)){
+        for (i=0;i<PACKET_LEN;i++){
+            packet[i] = packets_sent + i;
+        }
+        if (l2cap_send_internal(local_cid, packet, PACKET_LEN)) fail("l2cap_send_internal");
+        packets_sent++;
+    }
+    in_send = 0;
+    if (packets_sent < NUM_PACKETS) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long ms = (now.tv_sec - stream_start.tv_sec) * 1000 + (now.tv_usec - stream_start.tv_usec) / 1000;
+    printf("virtual_controller: %u bytes sent in %ld ms\n", NUM_PACKETS * PACKET_LEN, ms);
+    state_a = A_W4_CHANNEL_CLOSED;
+    l2cap_disconnect_internal(local_cid, 0);
+}
+
+static void a_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    bd_addr_t addr;
+    uint8_t data[16];
+    uint8_t key[16];
+    uint8_t plaintext[16];
+
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (state_a != A_W4_WORKING || packet[2] != HCI_STATE_WORKING) break;
+            state_a = A_W4_RAND;
+            hci_send_cmd(&hci_le_rand);
+            break;
+        case HCI_EVENT_COMMAND_COMPLETE:
+            if (state_a == A_W4_RAND && COMMAND_COMPLETE_EVENT(packet, hci_le_rand)){
+                if (packet[5]) fail("LE Rand");
+                state_a = A_W4_ENCRYPT;
+                swap128((uint8_t *) aes_key, key);
+                swap128((uint8_t *) aes_plaintext, plaintext);
+                hci_send_cmd(&hci_le_encrypt, key, plaintext);
+                break;
+            }
+            if (state_a == A_W4_ENCRYPT && COMMAND_COMPLETE_EVENT(packet, hci_le_encrypt)){
+                swap128(&packet[6], data);
+                if (packet[5] || memcmp(data, aes_ciphertext, 16)) fail("LE Encrypt");
+                state_a = A_W4_INQUIRY_COMPLETE;
+                hci_send_cmd(&hci_inquiry, HCI_INQUIRY_LAP, 1, 1);
+            }
+            break;
+        case HCI_EVENT_INQUIRY_RESULT:
+            bt_flip_addr(addr, &packet[3]);
+            if (BD_ADDR_CMP(addr, virtual_link_test_addr_b) == 0){
+                inquiry_found_b = 1;
+            }
+            break;
+        case HCI_EVENT_INQUIRY_COMPLETE:
+            if (!inquiry_found_b){
+                // device B might not be discoverable yet
+                if (++inquiry_rounds == INQUIRY_ROUNDS_MAX) fail("inquiry");
+                hci_send_cmd(&hci_inquiry, HCI_INQUIRY_LAP, 1, 1);
+                break;
+            }
+            state_a = A_W4_CHANNEL_OPENED;
+            l2cap_create_channel_internal(NULL, a_packet_handler, virtual_link_test_addr_b, TEST_PSM, 100);
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]) fail("L2CAP channel open");
+            classic_handle = READ_BT_16(packet, 9);
+            local_cid = READ_BT_16(packet, 13);
+            state_a = A_SENDING;
+            gettimeofday(&stream_start, NULL);
+            a_send_packets();
+            break;
+        case L2CAP_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            if (state_a == A_SENDING){
+                a_send_packets();
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_CLOSED:
+            if (state_a != A_W4_CHANNEL_CLOSED) fail("L2CAP channel closed");
+            state_a = A_W4_CLASSIC_DISCONNECTED;
+            gap_disconnect(classic_handle);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            if (state_a == A_W4_CLASSIC_DISCONNECTED && READ_BT_16(packet, 3) == classic_handle){
+                state_a = A_W4_ADVERTISEMENT;
+                le_central_set_scan_parameters(1, 0x0030, 0x0030);
+                le_central_start_scan();
+                break;
+            }
+            if (state_a == A_W4_LE_DISCONNECTED && READ_BT_16(packet, 3) == le_handle){
+                exit(EXIT_SUCCESS);
+                break;
+            }
+            fail("unexpected disconnect");
+            break;
+        case GAP_LE_ADVERTISING_REPORT:
+            if (state_a != A_W4_ADVERTISEMENT) break;
+            bt_flip_addr(addr, &packet[4]);
+            if (BD_ADDR_CMP(addr, virtual_link_test_addr_b)) break;
+            state_a = A_W4_LE_CONNECTED;
+            le_central_stop_scan();
+            le_central_connect(addr, BD_ADDR_TYPE_LE_PUBLIC);
+            break;
+        case HCI_EVENT_LE_META:
+            if (packet[2] != HCI_SUBEVENT_LE_CONNECTION_COMPLETE || state_a != A_W4_LE_CONNECTED) break;
+            if (packet[3] || packet[6] != 0) fail("LE connection");
+            le_handle = READ_BT_16(packet, 4);
+            state_a = A_W4_LE_DISCONNECTED;
+            gap_disconnect(le_handle);
+            break;
+        default:
+            break;
+    }
+}
+
+static void a_setup(void){
+    state_a = A_W4_WORKING;
+}
+
+static const virtual_link_test_t test = {
+    /* .a               = */ { a_packet_handler, a_setup, 0 },
+    /* .b               = */ { b_packet_handler, b_setup, 0 },
+    /* .timeout_ms      = */ TEST_TIMEOUT_MS,
+    /* .timeout_handler = */ timeout_handler,
+    /* .stack_init      = */ NULL,
+};
+
+int main(int argc, const char * argv[]){
+    if (virtual_link_test_run(&test, NULL, NULL)) fail("device A or B");
+    printf("virtual_controller: OK\n");
+    return EXIT_SUCCESS;
+}